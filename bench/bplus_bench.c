@@ -0,0 +1,298 @@
+/*
+ * Microbenchmarks of the core tree operations.
+ *
+ * For every (order, key count, distribution) the tree is loaded with
+ * insert, probed with search and range scans and half emptied with
+ * delete. Each combination runs in a child process so its peak RSS is
+ * its own. One line per operation is printed, as JSON or CSV.
+ *
+ * Distributions:
+ *   seq      keys inserted, looked up and deleted in ascending order
+ *   uniform  keys inserted and deleted in random order, looked up uniformly
+ *   zipfian  like uniform, but lookups and scans pick keys by a scrambled
+ *            zipfian (theta 0.99), so a few keys take most of the traffic
+ *
+ * usage: bplus_bench [-o orders] [-n key counts] [-d dists] [-q lookups]
+ *                    [-r scan length] [-s seed] [-c]
+ *   lists are comma separated, key counts may be written as 1e6
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "bplus_tree.h"
+#include "workload.h"
+
+#define BENCH_MAX_LIST	32
+
+enum {
+  DIST_SEQ = 0,
+  DIST_UNIFORM,
+  DIST_ZIPFIAN,
+  DIST_NUM
+};
+
+static const char *dist_name[DIST_NUM] = { "seq", "uniform", "zipfian" };
+
+typedef struct bench_config_t_ {
+  int 		order;
+  long 		keys;
+  int 		dist;
+  long 		lookups;			/* searches, 0 for as many as keys */
+  int 		scan_len;			/* keys per range scan */
+  uint64_t 	seed;
+  bool 		csv;
+} bench_config_t;
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static long
+peak_rss_kb (void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_maxrss);
+}
+
+static void
+report (const bench_config_t *cfg,
+        const char *name,
+        long ops,
+        double ns)
+{
+  double ns_per_op = ops ? ns / ops : 0;
+  double mops 	   = ns > 0 ? ops * 1e3 / ns : 0;
+
+  if (cfg->csv)
+    printf("%s,%d,%ld,%s,%ld,%.1f,%.3f,%ld\n", name, cfg->order, cfg->keys,
+           dist_name[cfg->dist], ops, ns_per_op, mops, peak_rss_kb());
+  else
+    printf("{\"op\":\"%s\",\"order\":%d,\"keys\":%ld,\"dist\":\"%s\",\"ops\":%ld,"
+           "\"ns_per_op\":%.1f,\"mops\":%.3f,\"peak_rss_kb\":%ld}\n",
+           name, cfg->order, cfg->keys, dist_name[cfg->dist], ops, ns_per_op,
+           mops, peak_rss_kb());
+  fflush(stdout);
+}
+
+/*
+ * range scan callback; the sum keeps the compiler honest
+ */
+static bool
+scan_visit (bplus_key_t key,
+            const bplus_value_t *value,
+            uint8_t flags,
+            void *arg)
+{
+  (void)key;
+  (void)flags;
+  *(double *)arg += value->num;
+  return (true);
+}
+
+/*
+ * key of the i'th operation of a pass over all keys
+ */
+static inline bplus_key_t
+pass_key (const bench_config_t *cfg,
+          long i)
+{
+  if (cfg->dist == DIST_SEQ)
+    return ((bplus_key_t)i);
+
+  /* a permutation of [0, keys): odd multiplier modulo a power of two, folded */
+  return ((bplus_key_t)wl_scramble_perm(i, cfg->keys, cfg->seed));
+}
+
+/*
+ * key of the i'th lookup
+ */
+static inline bplus_key_t
+lookup_key (const bench_config_t *cfg,
+            wl_rng_t *rng,
+            wl_zipf_t *zipf,
+            long i)
+{
+  switch (cfg->dist) {
+  case DIST_SEQ:
+    return ((bplus_key_t)(i % cfg->keys));
+  case DIST_UNIFORM:
+    return ((bplus_key_t)wl_rng_below(rng, cfg->keys));
+  default:
+    return ((bplus_key_t)wl_scramble(wl_zipf_next(zipf, rng), cfg->keys));
+  }
+}
+
+static void
+bench_run (const bench_config_t *cfg)
+{
+  long i 		= 0;
+  long lookups 		= cfg->lookups ? cfg->lookups : cfg->keys;
+  long scans 		= 0;
+  long found 		= 0;
+  double t 		= 0;
+  double sum 		= 0;
+  double value 		= 0;
+  bplus_key_t key 	= 0;
+  wl_rng_t rng 		= { cfg->seed };
+  wl_zipf_t zipf 	= { 0 };
+  bplus_tree_t *tree 	= NULL;
+
+  if (cfg->dist == DIST_ZIPFIAN)
+    wl_zipf_init(&zipf, cfg->keys, WL_ZIPF_THETA);
+
+  tree = bplus_tree_create(cfg->order);
+  if (!tree)
+    exit(1);
+
+  t = now_ns();
+  for (i = 0; i < cfg->keys; i++)
+    bplus_tree_insert(tree, pass_key(cfg, i), (double)i);
+  report(cfg, "insert", cfg->keys, now_ns() - t);
+
+  t = now_ns();
+  for (i = 0; i < lookups; i++)
+    found += bplus_tree_search_key(tree, lookup_key(cfg, &rng, &zipf, i), &value);
+  report(cfg, "search", lookups, now_ns() - t);
+  if (found != lookups)
+    fprintf(stderr, "bplus_bench: %ld of %ld lookups missed\n", lookups - found, lookups);
+
+  scans = lookups / cfg->scan_len;
+  if (scans < 1)
+    scans = 1;
+  t = now_ns();
+  for (i = 0; i < scans; i++) {
+    key = lookup_key(cfg, &rng, &zipf, i * cfg->scan_len);
+    bplus_tree_range_scan(tree, key, key + cfg->scan_len - 1, scan_visit, &sum);
+  }
+  report(cfg, "scan", scans, now_ns() - t);
+
+  t = now_ns();
+  for (i = 0; i < cfg->keys / 2; i++)
+    bplus_tree_delete_key(tree, pass_key(cfg, i));
+  report(cfg, "delete", cfg->keys / 2, now_ns() - t);
+
+  if (sum < 0)
+    printf("%f\n", sum);
+}
+
+/*
+ * parse a comma separated list of numbers (1e6 allowed)
+ * @return number of entries
+ */
+static int
+parse_list (char *str,
+            long *out)
+{
+  int num 	= 0;
+  char *tok 	= NULL;
+  char *save 	= NULL;
+
+  for (tok = strtok_r(str, ",", &save); tok && num < BENCH_MAX_LIST;
+       tok = strtok_r(NULL, ",", &save))
+    out[num++] = (long)strtod(tok, NULL);
+
+  return (num);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i = 0, j = 0, k = 0;
+  int opt 			= 0;
+  int num_orders 		= 5;
+  int num_keys 			= 4;
+  int num_dists 		= DIST_NUM;
+  long orders[BENCH_MAX_LIST] 	= { 4, 16, 64, 256, 512 };
+  long keys[BENCH_MAX_LIST] 	= { 1000, 10000, 100000, 1000000 };
+  int dists[DIST_NUM] 		= { DIST_SEQ, DIST_UNIFORM, DIST_ZIPFIAN };
+  char *tok 			= NULL;
+  pid_t pid;
+  bench_config_t cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.scan_len 	= 100;
+  cfg.seed 	= 1;
+
+  while ((opt = getopt(argc, argv, "o:n:d:q:r:s:c")) != -1) {
+    switch (opt) {
+    case 'o':
+      num_orders = parse_list(optarg, orders);
+      break;
+    case 'n':
+      num_keys = parse_list(optarg, keys);
+      break;
+    case 'd':
+      num_dists = 0;
+      for (tok = strtok(optarg, ","); tok && num_dists < DIST_NUM; tok = strtok(NULL, ",")) {
+        for (k = 0; k < DIST_NUM && strcmp(tok, dist_name[k]); k++)
+          ;
+        if (k == DIST_NUM) {
+          fprintf(stderr, "bplus_bench: unknown distribution %s\n", tok);
+          return (1);
+        }
+        dists[num_dists++] = k;
+      }
+      break;
+    case 'q':
+      cfg.lookups = (long)strtod(optarg, NULL);
+      break;
+    case 'r':
+      cfg.scan_len = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    case 's':
+      cfg.seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'c':
+      cfg.csv = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-o orders] [-n keys] [-d seq,uniform,zipfian] "
+                      "[-q lookups] [-r scan length] [-s seed] [-c]\n", argv[0]);
+      return (1);
+    }
+  }
+
+  if (cfg.csv)
+    printf("op,order,keys,dist,ops,ns_per_op,mops,peak_rss_kb\n");
+  fflush(stdout);
+
+  for (i = 0; i < num_orders; i++) {
+    for (j = 0; j < num_keys; j++) {
+      for (k = 0; k < num_dists; k++) {
+
+        if (orders[i] < 3 || keys[j] < 1) {
+          fprintf(stderr, "bplus_bench: skipping order %ld keys %ld\n", orders[i], keys[j]);
+          continue;
+        }
+
+        cfg.order 	= orders[i];
+        cfg.keys 	= keys[j];
+        cfg.dist 	= dists[k];
+
+        /* a child per run, so peak RSS is not inherited from the last one */
+        pid = fork();
+        if (pid == 0) {
+          bench_run(&cfg);
+          exit(0);
+        }
+        if (pid < 0 || waitpid(pid, NULL, 0) < 0) {
+          perror("bplus_bench");
+          return (1);
+        }
+      }
+    }
+  }
+
+  return (0);
+}
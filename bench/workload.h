@@ -0,0 +1,145 @@
+#ifndef BPLUS_WORKLOAD_H_
+#define BPLUS_WORKLOAD_H_
+
+#include <stdint.h>
+#include <math.h>
+
+/*
+ * Key choosers shared by the benchmark and the workload generator.
+ * Everything is seeded explicitly so a run can be reproduced.
+ */
+
+/*
+ * splitmix64: small, fast and good enough for picking keys
+ */
+typedef struct wl_rng_t_ {
+  uint64_t 	state;
+} wl_rng_t;
+
+static inline uint64_t
+wl_rng_next (wl_rng_t *rng)
+{
+  uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return (z ^ (z >> 31));
+}
+
+/*
+ * uniform in [0, 1)
+ */
+static inline double
+wl_rng_double (wl_rng_t *rng)
+{
+  return ((wl_rng_next(rng) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/*
+ * uniform in [0, n)
+ */
+static inline uint64_t
+wl_rng_below (wl_rng_t *rng,
+              uint64_t n)
+{
+  return (n ? wl_rng_next(rng) % n : 0);
+}
+
+/*
+ * spread item i of [0, n) over [0, n) (FNV-1a of its bytes), so the
+ * popular items of a skewed chooser are not neighbours in key order
+ */
+static inline uint64_t
+wl_scramble (uint64_t i,
+             uint64_t n)
+{
+  int b 	= 0;
+  uint64_t h 	= 0xCBF29CE484222325ULL;
+
+  for (b = 0; b < 8; b++) {
+    h ^= (i >> (b * 8)) & 0xFF;
+    h *= 0x100000001B3ULL;
+  }
+  return (n ? h % n : 0);
+}
+
+/*
+ * i'th element of a seeded permutation of [0, n): a bijection on the
+ * next power of two (odd multiplies and xorshifts), walked until it
+ * lands below n
+ */
+static inline uint64_t
+wl_scramble_perm (uint64_t i,
+                  uint64_t n,
+                  uint64_t seed)
+{
+  int bits 	= 1;
+  uint64_t mask = 0;
+
+  while (bits < 64 && (1ULL << bits) < n)
+    bits++;
+  mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+
+  do {
+    i = (i * 0x9E3779B97F4A7C15ULL + seed) & mask;
+    i ^= i >> (bits / 2 + 1);
+    i = (i * 0xBF58476D1CE4E5B9ULL) & mask;
+    i ^= i >> (bits / 2 + 1);
+  } while (i >= n);
+
+  return (i);
+}
+
+/*
+ * Zipfian ranks over [0, n) as in YCSB (Gray et al., "Quickly generating
+ * billion-record synthetic databases"); rank 0 is the most popular.
+ * Set up is O(n), each draw O(1)
+ */
+#define WL_ZIPF_THETA	0.99
+
+typedef struct wl_zipf_t_ {
+  uint64_t 	n;
+  double 	theta;
+  double 	alpha;
+  double 	zetan;
+  double 	eta;
+  double 	half_pow_theta;			/* 1 + 0.5^theta */
+} wl_zipf_t;
+
+static inline void
+wl_zipf_init (wl_zipf_t *z,
+              uint64_t n,
+              double theta)
+{
+  uint64_t i 	= 0;
+  double zeta2 	= 1.0 + pow(0.5, theta);
+
+  z->n 		= n ? n : 1;
+  z->theta 	= theta;
+  z->zetan 	= 0;
+  for (i = 1; i <= z->n; i++)
+    z->zetan += 1.0 / pow((double)i, theta);
+
+  z->alpha 		= 1.0 / (1.0 - theta);
+  z->eta 		= (1.0 - pow(2.0 / z->n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+  z->half_pow_theta 	= zeta2;
+}
+
+static inline uint64_t
+wl_zipf_next (wl_zipf_t *z,
+              wl_rng_t *rng)
+{
+  uint64_t rank = 0;
+  double u 	= wl_rng_double(rng);
+  double uz 	= u * z->zetan;
+
+  if (uz < 1.0)
+    return (0);
+  if (uz < z->half_pow_theta)
+    return (z->n > 1 ? 1 : 0);
+
+  rank = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+  return (rank < z->n ? rank : z->n - 1);
+}
+
+#endif /* BPLUS_WORKLOAD_H_ */
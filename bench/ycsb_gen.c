@@ -0,0 +1,226 @@
+/*
+ * YCSB style workload generator.
+ *
+ * Writes a trace in the format parser() and ycsb_run read: Initialize,
+ * a load phase of Insert records, Run(), then the operations of the run
+ * phase. The core workloads of YCSB are built in:
+ *
+ *   a  50% read, 50% update                    zipfian
+ *   b  95% read,  5% update                    zipfian
+ *   c 100% read                                zipfian
+ *   d  95% read,  5% insert                    latest
+ *   e  95% scan,  5% insert                    zipfian, scans of 1 - 100
+ *   f  50% read, 50% read-modify-write         zipfian
+ *
+ * and any of the mix can be overridden. Records are numbered in insert
+ * order and keyed by a seeded permutation of the int range, so inserts
+ * land all over the tree as with YCSB's hashed insert order.
+ *
+ * usage: ycsb_gen [-w a-f] [-n records] [-o operations] [-k order]
+ *                 [-r read%] [-u update%] [-i insert%] [-s scan%] [-m rmw%]
+ *                 [-d zipfian|uniform|latest] [-l max scan length] [-S seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "workload.h"
+
+#define YCSB_KEY_SPACE	(1ULL << 31)		/* keys are non negative ints */
+
+enum {
+  OP_READ = 0,
+  OP_UPDATE,
+  OP_INSERT,
+  OP_SCAN,
+  OP_RMW,
+  OP_NUM
+};
+
+enum {
+  CHOOSE_ZIPFIAN = 0,
+  CHOOSE_UNIFORM,
+  CHOOSE_LATEST
+};
+
+typedef struct ycsb_mix_t_ {
+  int 		pct[OP_NUM];			/* percent of each operation */
+  int 		chooser;			/* CHOOSE_* */
+} ycsb_mix_t;
+
+static const ycsb_mix_t ycsb_core[] = {
+  ['a' - 'a'] = { { 50, 50,  0,  0,  0 }, CHOOSE_ZIPFIAN },
+  ['b' - 'a'] = { { 95,  5,  0,  0,  0 }, CHOOSE_ZIPFIAN },
+  ['c' - 'a'] = { {100,  0,  0,  0,  0 }, CHOOSE_ZIPFIAN },
+  ['d' - 'a'] = { { 95,  0,  5,  0,  0 }, CHOOSE_LATEST },
+  ['e' - 'a'] = { {  0,  0,  5, 95,  0 }, CHOOSE_ZIPFIAN },
+  ['f' - 'a'] = { { 50,  0,  0,  0, 50 }, CHOOSE_ZIPFIAN },
+};
+
+static uint64_t seed = 1;
+
+/*
+ * key of record number i
+ */
+static inline uint64_t
+record_key (uint64_t i)
+{
+  return (wl_scramble_perm(i, YCSB_KEY_SPACE, seed));
+}
+
+static inline double
+random_value (wl_rng_t *rng)
+{
+  return ((double)wl_rng_below(rng, 100000) / 100);
+}
+
+/*
+ * pick an existing record; records holds how many there are now.
+ * The zipfian is sized for the records the run is expected to have
+ * at its end, draws past the current end are drawn again
+ */
+static uint64_t
+choose_record (int chooser,
+               wl_zipf_t *zipf,
+               wl_rng_t *rng,
+               uint64_t records)
+{
+  uint64_t i = 0;
+
+  switch (chooser) {
+  case CHOOSE_UNIFORM:
+    return (wl_rng_below(rng, records));
+  case CHOOSE_LATEST:
+    i = wl_zipf_next(zipf, rng);
+    return (i < records ? records - 1 - i : 0);
+  default:
+    do {
+      i = wl_scramble(wl_zipf_next(zipf, rng), zipf->n);
+    } while (i >= records);
+    return (i);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  int c 		= 0;
+  int op 		= 0;
+  int order 		= 64;
+  int max_scan 		= 100;
+  int total 		= 0;
+  uint64_t i 		= 0;
+  uint64_t records 	= 1000;
+  uint64_t ops 		= 1000;
+  uint64_t pick 	= 0;
+  ycsb_mix_t mix 	= ycsb_core[0];
+  wl_rng_t rng;
+  wl_zipf_t zipf;
+
+  while ((c = getopt(argc, argv, "w:n:o:k:r:u:i:s:m:d:l:S:")) != -1) {
+    switch (c) {
+    case 'w':
+      if (optarg[0] < 'a' || optarg[0] > 'f') {
+        fprintf(stderr, "ycsb_gen: workloads are a - f\n");
+        return (1);
+      }
+      mix = ycsb_core[optarg[0] - 'a'];
+      break;
+    case 'n':
+      records = (uint64_t)strtod(optarg, NULL);
+      break;
+    case 'o':
+      ops = (uint64_t)strtod(optarg, NULL);
+      break;
+    case 'k':
+      order = atoi(optarg);
+      break;
+    case 'r':
+      mix.pct[OP_READ] = atoi(optarg);
+      break;
+    case 'u':
+      mix.pct[OP_UPDATE] = atoi(optarg);
+      break;
+    case 'i':
+      mix.pct[OP_INSERT] = atoi(optarg);
+      break;
+    case 's':
+      mix.pct[OP_SCAN] = atoi(optarg);
+      break;
+    case 'm':
+      mix.pct[OP_RMW] = atoi(optarg);
+      break;
+    case 'd':
+      if (!strcmp(optarg, "uniform"))
+        mix.chooser = CHOOSE_UNIFORM;
+      else if (!strcmp(optarg, "latest"))
+        mix.chooser = CHOOSE_LATEST;
+      else
+        mix.chooser = CHOOSE_ZIPFIAN;
+      break;
+    case 'l':
+      max_scan = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    case 'S':
+      seed = strtoull(optarg, NULL, 0);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-w a-f] [-n records] [-o operations] [-k order] "
+                      "[-r read%%] [-u update%%] [-i insert%%] [-s scan%%] [-m rmw%%] "
+                      "[-d zipfian|uniform|latest] [-l max scan length] [-S seed]\n", argv[0]);
+      return (1);
+    }
+  }
+
+  for (op = 0; op < OP_NUM; op++)
+    total += mix.pct[op];
+  if (total <= 0 || records == 0 || records > YCSB_KEY_SPACE) {
+    fprintf(stderr, "ycsb_gen: need some operations and 1 - 2^31 records\n");
+    return (1);
+  }
+
+  rng.state = seed;
+
+  /* size for the records the inserts are expected to add */
+  wl_zipf_init(&zipf, records + ops * mix.pct[OP_INSERT] / total, WL_ZIPF_THETA);
+
+  printf("Initialize(%d)\n", order);
+  for (i = 0; i < records; i++)
+    printf("Insert(%llu, %.2f)\n", (unsigned long long)record_key(i), random_value(&rng));
+  printf("Run()\n");
+
+  for (i = 0; i < ops; i++) {
+
+    pick = wl_rng_below(&rng, total);
+    for (op = 0; pick >= (uint64_t)mix.pct[op]; op++)
+      pick -= mix.pct[op];
+
+    switch (op) {
+    case OP_READ:
+      printf("Search(%llu)\n",
+             (unsigned long long)record_key(choose_record(mix.chooser, &zipf, &rng, records)));
+      break;
+    case OP_UPDATE:
+      printf("Update(%llu, %.2f)\n",
+             (unsigned long long)record_key(choose_record(mix.chooser, &zipf, &rng, records)),
+             random_value(&rng));
+      break;
+    case OP_INSERT:
+      printf("Insert(%llu, %.2f)\n", (unsigned long long)record_key(records++),
+             random_value(&rng));
+      break;
+    case OP_SCAN:
+      printf("Scan(%llu, %llu)\n",
+             (unsigned long long)record_key(choose_record(mix.chooser, &zipf, &rng, records)),
+             (unsigned long long)(1 + wl_rng_below(&rng, max_scan)));
+      break;
+    default:
+      printf("ReadModifyWrite(%llu, %.2f)\n",
+             (unsigned long long)record_key(choose_record(mix.chooser, &zipf, &rng, records)),
+             random_value(&rng));
+      break;
+    }
+  }
+
+  return (0);
+}
@@ -0,0 +1,426 @@
+/*
+ * Replay driver for traces written by ycsb_gen (or by hand).
+ *
+ * The trace, text or binary, is read into memory first. Everything up to Run() is the
+ * load phase and is executed by one thread; the run phase is dealt out
+ * round robin to the client threads, so each thread issues its share in
+ * trace order. Readers (Search, Scan) share a rwlock, writers (Insert,
+ * Update, Delete, ReadModifyWrite and the tree settings Buffer,
+ * LazyDelete and Compact) hold it exclusively, as the tree takes one
+ * writer at a time.
+ *
+ * Throughput of both phases and the latency distribution of every
+ * operation type are printed as JSON lines.
+ *
+ * usage: ycsb_run [-t threads] [-a] [-f bits] trace
+ *   -a  allocate nodes from the huge page arenas
+ *   -f  filter point lookups with bits per key (bplus_tree_set_filter())
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bplus_tree.h"
+
+#define YCSB_MAX_THREADS	EPOCH_MAX_READERS
+#define HIST_SUB_BITS		4			/* 16 buckets per power of two, ~6% wide */
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_SIZE		(64 * HIST_SUB)
+
+static const char *cmd_name[BPLUS_CMD_NUM] = {
+  [BPLUS_CMD_INSERT] = "insert", [BPLUS_CMD_UPDATE] = "update", [BPLUS_CMD_DELETE] = "delete",
+  [BPLUS_CMD_SEARCH] = "read", [BPLUS_CMD_RANGE] = "range", [BPLUS_CMD_SCAN] = "scan",
+  [BPLUS_CMD_RMW] = "rmw", [BPLUS_CMD_BUFFER] = "buffer", [BPLUS_CMD_LAZY] = "lazy_delete",
+  [BPLUS_CMD_COMPACT] = "compact", [BPLUS_CMD_FILL] = "fill_factor"
+};
+
+typedef struct hist_t_ {
+  uint64_t 	count;
+  uint64_t 	sum_ns;
+  uint64_t 	max_ns;
+  uint64_t 	bucket[HIST_SIZE];
+} hist_t;
+
+typedef struct client_t_ {
+  pthread_t 	thread;
+  int 		id;
+  int 		num_threads;
+  hist_t 	hist[BPLUS_CMD_NUM];
+} client_t;
+
+static bplus_trace_t 		trace;		/* string keys point into it */
+static bplus_tree_t 		*shared_tree;	/* the clients' tree */
+static bplus_cmd_t 		*cmds;
+static long 			num_cmds;
+static long 			run_start;		/* first command of the run phase */
+static pthread_rwlock_t 	tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int 			filter_bits;		/* -f, 0 for no filter */
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * log-linear bucket of a latency: exact below HIST_SUB ns,
+ * then HIST_SUB buckets per power of two
+ */
+static inline int
+hist_bucket (uint64_t ns)
+{
+  int b = 0;
+
+  if (ns < HIST_SUB)
+    return ((int)ns);
+
+  b = 63 - __builtin_clzll(ns);
+  return ((b - HIST_SUB_BITS + 1) * HIST_SUB +
+          (int)((ns >> (b - HIST_SUB_BITS)) & (HIST_SUB - 1)));
+}
+
+/*
+ * largest latency which falls in bucket i
+ */
+static uint64_t
+hist_bucket_max (int i)
+{
+  int b = 0;
+
+  if (i < HIST_SUB)
+    return (i);
+
+  b = i / HIST_SUB + HIST_SUB_BITS - 1;
+  return ((((uint64_t)HIST_SUB + i % HIST_SUB + 1) << (b - HIST_SUB_BITS)) - 1);
+}
+
+static inline void
+hist_add (hist_t *h,
+          uint64_t ns)
+{
+  h->count++;
+  h->sum_ns += ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+  h->bucket[hist_bucket(ns)]++;
+}
+
+static void
+hist_merge (hist_t *dst,
+            const hist_t *src)
+{
+  int i = 0;
+
+  dst->count 	+= src->count;
+  dst->sum_ns 	+= src->sum_ns;
+  if (src->max_ns > dst->max_ns)
+    dst->max_ns = src->max_ns;
+  for (i = 0; i < HIST_SIZE; i++)
+    dst->bucket[i] += src->bucket[i];
+}
+
+static double
+hist_percentile_us (const hist_t *h,
+                    double pct)
+{
+  int i 		= 0;
+  uint64_t seen 	= 0;
+  uint64_t want 	= (uint64_t)(h->count * pct / 100);
+
+  /* nearest rank */
+  if (want < h->count * pct / 100 || want == 0)
+    want++;
+  for (i = 0; i < HIST_SIZE; i++) {
+    seen += h->bucket[i];
+    if (seen >= want)
+      break;
+  }
+
+  i = (i < HIST_SIZE) ? i : HIST_SIZE - 1;
+  return ((hist_bucket_max(i) < h->max_ns ? hist_bucket_max(i) : h->max_ns) / 1e3);
+}
+
+/*
+ * bplus_tree_scan() callback; arg counts down the records wanted
+ */
+static bool
+scan_visit (bplus_key_t key,
+            const bplus_value_t *value,
+            uint8_t flags,
+            void *arg)
+{
+  (void)key;
+  (void)value;
+  (void)flags;
+  return (--*(long *)arg > 0);
+}
+
+static bool
+range_visit (bplus_key_t key,
+             const bplus_value_t *value,
+             uint8_t flags,
+             void *arg)
+{
+  (void)key;
+  (void)value;
+  (void)flags;
+  (void)arg;
+  return (true);
+}
+
+/*
+ * run one command against the tree
+ */
+static void
+cmd_execute (const bplus_cmd_t *cmd)
+{
+  long left 	= 0;
+  double data 	= 0;
+
+  switch (cmd->op) {
+  case BPLUS_CMD_INIT:
+    shared_tree = bplus_tree_create(cmd->arg);
+    if (filter_bits)
+      bplus_tree_set_filter(shared_tree, filter_bits);
+    break;
+  case BPLUS_CMD_INSERT:
+  case BPLUS_CMD_UPDATE:
+    pthread_rwlock_wrlock(&tree_lock);
+    bplus_tree_insert(shared_tree, cmd->key, cmd->value);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_DELETE:
+    pthread_rwlock_wrlock(&tree_lock);
+    bplus_tree_delete_key(shared_tree, cmd->key);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_SEARCH:
+    pthread_rwlock_rdlock(&tree_lock);
+    bplus_tree_search_key(shared_tree, cmd->key, &data);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_RANGE:
+    pthread_rwlock_rdlock(&tree_lock);
+    bplus_tree_range_scan(shared_tree, cmd->key, cmd->high_key, range_visit, NULL);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_SCAN:
+    left = cmd->arg;
+    pthread_rwlock_rdlock(&tree_lock);
+    if (left > 0)
+      bplus_tree_scan(shared_tree, cmd->key, scan_visit, &left);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_RMW:
+    pthread_rwlock_wrlock(&tree_lock);
+    bplus_tree_search_key(shared_tree, cmd->key, &data);
+    bplus_tree_insert(shared_tree, cmd->key, cmd->value);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_BUFFER:
+    pthread_rwlock_wrlock(&tree_lock);
+    bplus_tree_set_buffer_size(shared_tree, cmd->arg);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_LAZY:
+    pthread_rwlock_wrlock(&tree_lock);
+    if (shared_tree)
+      shared_tree->lazy_delete = (cmd->arg != 0);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_COMPACT:
+    pthread_rwlock_wrlock(&tree_lock);
+    bplus_tree_compact_step(shared_tree, cmd->arg);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  case BPLUS_CMD_FILL:
+    pthread_rwlock_wrlock(&tree_lock);
+    bplus_tree_set_fill_factor(shared_tree, cmd->arg);
+    pthread_rwlock_unlock(&tree_lock);
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * read the trace into cmds
+ */
+static bool
+trace_load (const char *path)
+{
+  long cap 	= 0;
+  FILE *fp 	= NULL;
+  bplus_cmd_t cmd;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    perror(path);
+    return (false);
+  }
+  if (!bplus_trace_open(&trace, fp)) {
+    fclose(fp);
+    return (false);
+  }
+  fclose(fp);
+
+  run_start = -1;
+  while (bplus_trace_next(&trace, &cmd)) {
+
+    if (cmd.op == BPLUS_CMD_NONE || cmd.op == BPLUS_CMD_INVALID)
+      continue;
+
+    if (num_cmds == cap) {
+      cap 	= cap ? cap * 2 : 4096;
+      cmds 	= realloc(cmds, cap * sizeof(bplus_cmd_t));
+      if (!cmds) {
+        fprintf(stderr, "ycsb_run: out of memory\n");
+        return (false);
+      }
+    }
+
+    if (cmd.op == BPLUS_CMD_RUN && run_start < 0)
+      run_start = num_cmds + 1;
+    cmds[num_cmds++] = cmd;
+  }
+
+  /* no Run(): only Initialize is load */
+  if (run_start < 0)
+    run_start = (num_cmds && cmds[0].op == BPLUS_CMD_INIT) ? 1 : 0;
+
+  return (true);
+}
+
+static void *
+client_main (void *arg)
+{
+  long i 		= 0;
+  uint64_t t 		= 0;
+  client_t *client 	= arg;
+
+  for (i = run_start + client->id; i < num_cmds; i += client->num_threads) {
+
+    if (cmds[i].op == BPLUS_CMD_RUN || cmds[i].op == BPLUS_CMD_INIT)
+      continue;
+
+    t = now_ns();
+    cmd_execute(&cmds[i]);
+    hist_add(&client->hist[cmds[i].op], now_ns() - t);
+  }
+
+  bplus_tree_reader_unregister();
+  return (NULL);
+}
+
+static void
+report_phase (const char *phase,
+              int threads,
+              long ops,
+              uint64_t ns)
+{
+  printf("{\"phase\":\"%s\",\"threads\":%d,\"ops\":%ld,\"seconds\":%.3f,\"ops_per_sec\":%.0f}\n",
+         phase, threads, ops, ns / 1e9, ns ? ops * 1e9 / ns : 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int c 		= 0;
+  int t 		= 0;
+  int type 		= 0;
+  int threads 		= 1;
+  long i 		= 0;
+  long ops 		= 0;
+  uint64_t start 	= 0;
+  client_t *clients 	= NULL;
+  hist_t total;
+
+  while ((c = getopt(argc, argv, "t:af:")) != -1) {
+    switch (c) {
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'a':
+      if (!bplus_arena_enable())
+        return (1);
+      break;
+    case 'f':
+      filter_bits = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t threads] [-a] [-f bits] trace\n", argv[0]);
+      return (1);
+    }
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-t threads] [-a] [-f bits] trace\n", argv[0]);
+    return (1);
+  }
+  if (threads < 1 || threads > YCSB_MAX_THREADS) {
+    fprintf(stderr, "ycsb_run: 1 - %d threads\n", YCSB_MAX_THREADS);
+    return (1);
+  }
+
+  if (!trace_load(argv[optind]))
+    return (1);
+
+  start = now_ns();
+  for (i = 0; i < run_start; i++) {
+    cmd_execute(&cmds[i]);
+    ops += (cmds[i].op != BPLUS_CMD_INIT && cmds[i].op != BPLUS_CMD_RUN);
+  }
+  report_phase("load", 1, ops, now_ns() - start);
+
+  if (!shared_tree) {
+    fprintf(stderr, "ycsb_run: the trace does not Initialize a tree\n");
+    return (1);
+  }
+
+  clients 	= calloc(threads, sizeof(client_t));
+  if (!clients)
+    return (1);
+
+  start = now_ns();
+  for (t = 0; t < threads; t++) {
+    clients[t].id 		= t;
+    clients[t].num_threads 	= threads;
+    if (pthread_create(&clients[t].thread, NULL, client_main, &clients[t])) {
+      perror("ycsb_run");
+      return (1);
+    }
+  }
+  for (t = 0; t < threads; t++)
+    pthread_join(clients[t].thread, NULL);
+
+  ops = 0;
+  for (t = 0; t < threads; t++) {
+    for (type = 0; type < BPLUS_CMD_NUM; type++)
+      ops += clients[t].hist[type].count;
+  }
+  report_phase("run", threads, ops, now_ns() - start);
+
+  for (type = 0; type < BPLUS_CMD_NUM; type++) {
+
+    memset(&total, 0, sizeof(total));
+    for (t = 0; t < threads; t++)
+      hist_merge(&total, &clients[t].hist[type]);
+    if (!total.count)
+      continue;
+
+    printf("{\"op\":\"%s\",\"count\":%llu,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p95_us\":%.3f,"
+           "\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+           cmd_name[type], (unsigned long long)total.count,
+           total.sum_ns / 1e3 / total.count,
+           hist_percentile_us(&total, 50), hist_percentile_us(&total, 95),
+           hist_percentile_us(&total, 99), hist_percentile_us(&total, 99.9),
+           total.max_ns / 1e3);
+  }
+
+  return (0);
+}
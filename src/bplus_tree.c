@@ -1,36 +1,94 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "bplus_tree.h"
 
 #define MAX				100				// Buffer size of strtok
 #define MAX_FILE_NAME	256				// Maximum input file name
+#define PACK_ALIGN	16				// packed deltas are padded to a SIMD register
+#define DEFRAG_RUN	8				// leaves back to back which defrag leaves alone
+#define OUT_BUF_SIZE	(1 << 20)			// parser output written at a time
+#define CMD_RING_SLOTS	4096				// parsed commands in flight (bplustree -p)
+#define RES_RING_SLOTS	16384				// results in flight (bplustree -p)
+#define PART_MAX_WORKERS	64				// trees of the partitioned replay (bplustree -w)
+#define PART_SAMPLE	65536				// keys sampled for its key ranges
+#define SERVER_MAX_EVENTS	64				// epoll events taken at a time (bplustree -s)
+#define SERVER_READ_SIZE	(64 << 10)			// bytes read from a connection at a time
+#define SERVER_OUT_LIMIT	(16 << 20)			// answers queued before a client is not read
 
 /*
  * forward declarations
  */
 bplus_tree_node_t *
-adjust_parent (bplus_tree_node_t *root,
+adjust_parent (bplus_tree_t *tree,
+               bplus_tree_node_t *root,
+             bplus_path_t *path,
              bplus_tree_node_t *leaf,
              bplus_tree_node_t *new_leaf,
-             int parent_key);
+             bplus_key_t parent_key);
 
 static bplus_tree_node_t *
-delete_key_from_node (bplus_tree_node_t *root,
+delete_key_from_node (bplus_tree_t *tree,
+                      bplus_tree_node_t *root,
+                      bplus_path_t *path,
                       bplus_tree_node_t *node,
-                      bplus_tree_node_t *child,
-                      int key);
+                      int index,
+                      bplus_key_t key);
+
+static void
+bplus_tree_buffer_message (bplus_tree_t *tree,
+                           const pair_t *msg);
+
+static void
+replica_retire (bplus_tree_node_t *node,
+                int height);
+
+struct server_conn_t_;
+
+static void
+server_queue (struct server_conn_t_ *conn,
+              const char *data,
+              size_t len);
+
+void
+bplus_tree_flush_all (bplus_tree_t *tree);
 
 /********************
  * global variables *
  ********************/
-bplus_tree_t    *tree;
 FILE 			*ip;			// File pointer for the input file
 FILE 			*op;			// File pointer for the output file
+epoch_t 		bplus_epoch;		// reclamation domain shared by all trees
+static __thread int 	epoch_slot = -1;	// reader slot of the calling thread
+arena_t 		bplus_arena[ARENA_NUM] = {	// node arenas shared by all trees
+  [0 ... ARENA_NUM - 1] = { .numa = BPLUS_NUMA_ANY }
+};
+static bool 		arena_on;		// nodes come from bplus_arena
+static atomic_bool 	arena_sealed;		// a node was allocated; the mode is fixed
+static __thread int 	numa_node = -1;		// NUMA node the calling thread last ran on
+static __thread unsigned numa_calls;		// lookups since numa_node was read
 
 /************************
  * Queue data structure *
@@ -131,2311 +189,7937 @@ dequeue (queue_t *q)
   return (data);
 }
 
-/*****************************
- * Print tree in level order *
- *****************************/
+/*********************************
+ * Epoch based reclamation (EBR) *
+ *********************************/
+
+static inline void
+epoch_lock (epoch_t *e)
+{
+  while (atomic_flag_test_and_set_explicit(&e->lock, memory_order_acquire))
+    ;
+}
+
+static inline void
+epoch_unlock (epoch_t *e)
+{
+  atomic_flag_clear_explicit(&e->lock, memory_order_release);
+}
 
 /*
- * helper to print an index node
+ * claim a reader slot for the calling thread
+ * @return slot index or -1 if all the slots are taken
  */
-void
-print_index_node (bplus_tree_node_t *node)
+int
+epoch_register (epoch_t *e)
 {
-  int num 	= 0;
   int i 	= 0;
-  int *keys = NULL;
-
-  if (!node)
-    return;
-
-  keys = node->u.index->keys;
-  num = node->u.index->num;
+  bool expected = false;
 
-  //printf("<< (%p : %p : %d) (", node->parent, node, num);
-  printf("<<");
-  for (i = 0; i < num ; i++) {
+  for (i = 0; i < EPOCH_MAX_READERS; i++) {
 
-    printf("%d ", keys[i]);
+    expected = false;
+    if (atomic_compare_exchange_strong(&e->readers[i].in_use, &expected, true)) {
+      atomic_store(&e->readers[i].state, 0);
+      return (i);
+    }
   }
-  printf(">> ");
 
-  return;
+  printf("%s: Error: no free reader slot\n", __FUNCTION__);
+  return (-1);
 }
 
 /*
- * helper to print a leaf node
+ * give the reader slot back
  */
 void
-print_leaf_node (bplus_tree_node_t *node)
+epoch_unregister (epoch_t *e, int slot)
 {
-  int i 		= 0;
-  int num 		= 0;
-  pair_t *pairs = NULL;
-
-  if (!node)
+  if (slot < 0 || slot >= EPOCH_MAX_READERS)
     return;
 
-  num = node->u.leaf->num;
-  pairs = node->u.leaf->pairs;
-  
-  //printf("< (%p : %p : %d) ", node->parent, node, num);
-  printf("<");
-  for (i = 0 ; i < num; i++) {
+  atomic_store(&e->readers[slot].state, 0);
+  atomic_store(&e->readers[slot].in_use, false);
+}
 
-    //printf("(%d : %f) ", pairs[i].key, pairs[i].data);
-    printf("%d ", pairs[i].key);
-  }
-  printf(">");
+/*
+ * start a read side critical section;
+ * nothing retired from now on is freed until epoch_exit()
+ */
+void
+epoch_enter (epoch_t *e, int slot)
+{
+  unsigned long epoch = 0;
 
-  return;
+  epoch = atomic_load(&e->global_epoch);
+
+  /*
+   * seq_cst store: the announcement must be visible
+   * before we start dereferencing tree pointers
+   */
+  atomic_store(&e->readers[slot].state, (epoch << 1) | 1);
 }
 
 /*
- * helper to print a node in b+ tree
+ * end a read side critical section
  */
 void
-print_node (bplus_tree_node_t *node)
+epoch_exit (epoch_t *e, int slot)
 {
-  if (node->is_leaf)
-    print_leaf_node(node);
-  else
-    print_index_node(node);
+  atomic_store_explicit(&e->readers[slot].state, 0, memory_order_release);
 }
 
 /*
- * driver function for printing the b+ tree
+ * retire an object which is no longer reachable from the tree.
+ * free_fn(ptr) is called once no reader can still be holding it
  */
 void
-print_tree_util (bplus_tree_node_t *root)
+epoch_retire (epoch_t *e, void *ptr, void (*free_fn)(void *))
 {
-  queue_t *q = NULL;
+  unsigned long epoch 	= 0;
+  epoch_entry_t *entry 	= NULL;
 
-  if (!root)
+  if (!ptr)
     return;
 
-  q = create_queue();
-  if (!q) {
-    printf("%s: Error creating queue\n", __FUNCTION__);
+  entry = malloc(sizeof(epoch_entry_t));
+  if (!entry) {
+
+    /*
+     * we cannot defer the free, and freeing now is unsafe;
+     * leaking the object is the lesser evil
+     */
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
     return;
   }
-  
-  enqueue(q, (void *)root);
-  while (!q->is_empty) {
-    
-    int count = q->size;
 
-    while (count > 0) {
-      
-      bplus_tree_node_t *node = NULL;
+  entry->ptr 		= ptr;
+  entry->free_fn 	= free_fn;
 
-      node = dequeue(q);
-      if (node->is_leaf) {
-        print_leaf_node(node);
-      } else {
-       
-        int i 	= 0;
-        int num = node->u.index->num;
-        
-        print_index_node(node);
+  epoch_lock(e);
+  epoch 		= atomic_load(&e->global_epoch);
+  entry->next 		= e->limbo[epoch % EPOCH_NUM_LISTS];
+  e->limbo[epoch % EPOCH_NUM_LISTS] = entry;
+  e->num_retired++;
+  epoch_unlock(e);
+}
 
-        /* index node has num + 1 child pointers */
-        for (i = 0 ; i <= num; i++) {
-          enqueue(q, (node->u.index->child[i]));
-        }
-      }
+/*
+ * free all the objects in a limbo list
+ * @return number of objects freed
+ */
+static int
+epoch_free_list (epoch_entry_t *entry)
+{
+  int count 		= 0;
+  epoch_entry_t *next 	= NULL;
 
-      count--;
-    }
-    
-    printf("\n");
+  while (entry) {
+
+    next = entry->next;
+    entry->free_fn(entry->ptr);
+    free(entry);
+    entry = next;
+    count++;
   }
 
-  free(q);
+  return (count);
 }
 
 /*
- * Function to print the b+ tree in level order
+ * advance the global epoch if every active reader has observed it.
+ * The list two epochs behind the new epoch can no longer be
+ * referenced by anyone; free it.
+ * Must be called with the epoch lock held.
  */
-void
-print_tree (bplus_tree_t *tree)
+static bool
+epoch_try_advance (epoch_t *e)
 {
-  if (!tree) {
-    return;
-  }
+  int i 		= 0;
+  int index 		= 0;
+  unsigned long epoch 	= 0;
+  unsigned long state 	= 0;
+  epoch_entry_t *list 	= NULL;
 
-  print_tree_util (tree->root);
-  printf("\n");
+  epoch = atomic_load(&e->global_epoch);
+  for (i = 0; i < EPOCH_MAX_READERS; i++) {
 
-  return;
-}
+    if (!atomic_load(&e->readers[i].in_use))
+      continue;
+
+    state = atomic_load(&e->readers[i].state);
+    if ((state & 1) && ((state >> 1) != epoch))
+      return (false);
+  }
 
+  atomic_store(&e->global_epoch, epoch + 1);
 
-/************************************
- * create/delete b plus tree node   *
- ************************************/
+  /* (epoch + 1) - 2 == epoch + 2 (mod 3) */
+  index 		= (epoch + 2) % EPOCH_NUM_LISTS;
+  list 			= e->limbo[index];
+  e->limbo[index] 	= NULL;
+  e->num_retired 	-= epoch_free_list(list);
+
+  return (true);
+}
 
 /*
- * free a leaf node
+ * try to make progress on freeing retired objects;
+ * called by the writer after operations which retire nodes
  */
-static void
-bplus_tree_delete_leaf_node (leaf_node_t *lnode)
+void
+epoch_reclaim (epoch_t *e)
 {
-    bplus_tree_node_t *next = NULL;
-    bplus_tree_node_t *prev = NULL;
-    
-    if (!lnode)
-        return;
+  epoch_lock(e);
+  if (e->num_retired)
+    epoch_try_advance(e);
+  epoch_unlock(e);
+}
 
-    /* preserver the doubly link list */
-    next = lnode->next;
-    if (next != NULL)  
-        next->u.leaf->prev = lnode->prev;  
-  
-    prev = lnode->prev;
-    if (prev != NULL)  
-        prev->u.leaf->next = lnode->next;   
+/*
+ * free everything that is retired;
+ * only safe once there are no active readers left
+ * @return number of objects still waiting in limbo
+ */
+int
+epoch_drain (epoch_t *e)
+{
+  int i 	= 0;
+  int left 	= 0;
 
-    if (lnode->pairs)
-        free(lnode->pairs);
+  epoch_lock(e);
+  for (i = 0; i < EPOCH_NUM_LISTS && e->num_retired; i++) {
+    if (!epoch_try_advance(e))
+      break;
+  }
+  left = e->num_retired;
+  epoch_unlock(e);
 
-    free(lnode);
-    lnode = NULL;
-    return;
+  return (left);
 }
 
 /*
- * create a leaf node
+ * enter/exit read side critical section on behalf of the calling thread;
+ * the reader slot is claimed on first use
  */
-static leaf_node_t *
-bplus_tree_create_leaf_node ()
+static inline bool
+bplus_tree_reader_enter (void)
 {
-    leaf_node_t *new_lnode;
+  if (epoch_slot == -1)
+    epoch_slot = epoch_register(&bplus_epoch);
 
-    new_lnode = malloc(sizeof(leaf_node_t));
-    if (!new_lnode) {
-        printf("%s>Error: could not create index node", __FUNCTION__);
-        return (NULL);
-    }
+  if (epoch_slot == -1)
+    return (false);
 
-    memset(new_lnode, 0, sizeof(leaf_node_t));
-    new_lnode->prev = NULL;
-    new_lnode->next = NULL;
-    new_lnode->num 	= 0;
+  epoch_enter(&bplus_epoch, epoch_slot);
+  return (true);
+}
 
-    /*
-     * allocate an array for the <kev, value> pair
-     */
-    new_lnode->pairs = malloc(tree->order * sizeof(pair_t));
-    if (!new_lnode->pairs) {
-        printf("%s>Error: Could not create pairs\n", __FUNCTION__);
-        free(new_lnode);
-        return (NULL);
-    }
-    
-    return (new_lnode);
+static inline void
+bplus_tree_reader_exit (void)
+{
+  epoch_exit(&bplus_epoch, epoch_slot);
 }
 
 /*
- * free index node
+ * release the reader slot of the calling thread (on thread exit)
  */
-static void
-bplus_tree_delete_index_node (index_node_t *inode)
+void
+bplus_tree_reader_unregister (void)
 {
-    if (!inode)
-        return;
+  epoch_unregister(&bplus_epoch, epoch_slot);
+  epoch_slot = -1;
+}
 
-    if (inode->keys)
-        free(inode->keys);
+/***************
+ * Node arenas *
+ ***************/
 
-    if (inode->child)
-        free(inode->child);
+/*
+ * header in front of every arena object
+ */
+typedef struct arena_obj_t_ {
 
-    free(inode);
-    inode = NULL;
-    return;
-}
+  uint32_t 	cls;				/* size class, 0 for malloc */
+  uint32_t 	kind;				/* ARENA_INDEX / ARENA_LEAF */
+  uint64_t 	pad;				/* keep objects 16 byte aligned */
+} arena_obj_t;
 
 /*
- * create an index node
+ * number of NUMA nodes in the system (at most BPLUS_MAX_NUMA)
  */
-static index_node_t *
-bplus_tree_create_index_node ()
+static int
+numa_num_nodes (void)
 {
-    index_node_t *new_inode = NULL;
-
-    new_inode = malloc(sizeof(index_node_t));
-    if (!new_inode) {
-        printf("%s>Error: could not create index node", __FUNCTION__);
-        return (NULL);
-    }
+  int n = 0;
+  char path[64];
 
-    memset(new_inode, 0, sizeof(index_node_t));
-    new_inode->num = 0;
+  for (n = 0; n < BPLUS_MAX_NUMA; n++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+    if (access(path, F_OK))
+      break;
+  }
 
-    /*
-     * allocate arrays for keys
-     */
-    new_inode->keys = malloc(tree->order * sizeof(int));
-    if (!new_inode->keys) {
-        printf("%s>Error: Could not allocate keys\n", __FUNCTION__);
-        free(new_inode);
-        return (NULL);
-    }
-    memset(new_inode->keys, 0, tree->order * sizeof(int));
+  return (n ? n : 1);
+}
 
-    
-    /*
-     * allocate child pointers
-     */
-    new_inode->child = malloc(tree->order * sizeof(void *));
-    if (!new_inode->child) {
-        printf("%s> Error: Could not allocate child pointers\n", __FUNCTION__);
-        free(new_inode->keys);
-        free(new_inode);
-        return (NULL);
-    }
-    memset(new_inode->child, 0, tree->order * sizeof(void *));
+/*
+ * NUMA node of the calling thread; re-read now and then
+ * since the scheduler may move us
+ */
+static int
+numa_current_node (void)
+{
+  unsigned cpu 	= 0;
+  unsigned node = 0;
+
+  if (numa_node < 0 || (++numa_calls & 1023) == 0) {
+    numa_node = 0;
+#ifdef SYS_getcpu
+    if (!syscall(SYS_getcpu, &cpu, &node, NULL))
+      numa_node = node;
+#endif
+  }
 
-    return (new_inode);
+  return (numa_node);
 }
 
 /*
- * free a bplus tree node
+ * apply the NUMA policy of the arena to a fresh region,
+ * before anything touches it
  */
 static void
-bplus_tree_delete_node (bplus_tree_node_t *node)
+arena_place (arena_t *arena,
+             void *base)
 {
-    if (!node)
-        return;
+#ifdef SYS_mbind
+  int n 		= 0;
+  int mode 		= 0;
+  unsigned long mask 	= 0;
 
-    if (node->is_leaf) {
-        
-        bplus_tree_delete_leaf_node(node->u.leaf);
-    } else {
-        bplus_tree_delete_index_node(node->u.index);
-    }
+  if (arena->numa == BPLUS_NUMA_ANY)
+    return;
+
+  if (arena->numa == BPLUS_NUMA_INTERLEAVE) {
+    mode = 3;					/* MPOL_INTERLEAVE */
+    for (n = 0; n < numa_num_nodes(); n++)
+      mask |= 1UL << n;
+  } else {
+    mode = 1;					/* MPOL_PREFERRED */
+    mask = 1UL << arena->numa;
+  }
 
-    free(node);
+  if (syscall(SYS_mbind, base, ARENA_REGION_SIZE, mode, &mask,
+              sizeof(mask) * 8, 0))
+    printf("%s: Error: mbind failed, region left to first touch\n", __FUNCTION__);
+#endif
 }
 
 /*
- * create a bplus tree node
+ * map a new 2 MiB region: hugetlbfs pages if there are any reserved,
+ * else a 2 MiB aligned range which THP can back with a huge page
  */
-static bplus_tree_node_t *
-bplus_tree_create_node (bool is_leaf)
+static bool
+arena_grow (arena_t *arena)
 {
-    bplus_tree_node_t *new_node = NULL;
+  uint8_t *p 		= NULL;
+  uint8_t *base 	= NULL;
+
+#ifdef MAP_HUGETLB
+  p = mmap(NULL, ARENA_REGION_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    arena->num_huge++;
+    base = p;
+    goto done;
+  }
+#endif
 
-    new_node = malloc(sizeof(bplus_tree_node_t));
-    if (!new_node) {
-        printf("%s>Error: could not allocate memory for new node\n", __FUNCTION__);
-        return (NULL);
-    }
+  /* map twice the size and trim it down to an aligned region */
+  p = mmap(NULL, 2 * ARENA_REGION_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("%s: Error: Could not map arena region\n", __FUNCTION__);
+    return (false);
+  }
 
-    memset(new_node, 0, sizeof(bplus_tree_node_t));
-    new_node->is_leaf = is_leaf;
-    new_node->parent = NULL;
+  base = (uint8_t *)(((uintptr_t)p + ARENA_REGION_SIZE - 1) & ~(ARENA_REGION_SIZE - 1));
+  if (base > p)
+    munmap(p, base - p);
+  munmap(base + ARENA_REGION_SIZE, p + ARENA_REGION_SIZE - base);
 
-    if (is_leaf) {
+#ifdef MADV_HUGEPAGE
+  madvise(base, ARENA_REGION_SIZE, MADV_HUGEPAGE);
+#endif
 
-        /*
-         * this is a leaf node,
-         * allocate memory for the same
-         */
-        new_node->u.leaf = bplus_tree_create_leaf_node();
-        if (!new_node->u.leaf) {
-            
-            printf("%s>Error: could not create leaf node\n", __FUNCTION__);
-            free(new_node);
-            return (NULL);
-        }
-    } else {
-
-        /*
-         * this is a index node,
-         * allocate memory for the same
-         */
-        new_node->u.index = bplus_tree_create_index_node();
-        if (!new_node->u.index) {
-            
-            printf("%s>Error: could not create leaf node\n", __FUNCTION__);
-            free(new_node);
-            return (NULL);
-        }
-    }
-   
-    return (new_node);
+done:
+  arena_place(arena, base);
+  arena->cur 	= base;
+  arena->end 	= base + ARENA_REGION_SIZE;
+  arena->mapped += ARENA_REGION_SIZE;
+  return (true);
 }
 
 /*
- * free the memory of the allocated b tree
+ * allocate an object of size bytes from arena kind;
+ * with reuse false it is always carved off the end of the region,
+ * right after the previous such object
  */
-void
-bplus_tree_delete(bplus_tree_t **tree)
+static void *
+arena_alloc (int kind,
+             size_t size,
+             bool reuse)
 {
-    if (!*tree)
-        return;
+  int cls 		= 0;
+  size_t bytes 		= 0;
+  arena_t *arena 	= &bplus_arena[kind];
+  arena_obj_t *obj 	= NULL;
+
+  /* set once; trees on other threads allocate too */
+  if (!atomic_load_explicit(&arena_sealed, memory_order_relaxed))
+    atomic_store_explicit(&arena_sealed, true, memory_order_relaxed);
+  if (!arena_on)
+    return (malloc(size));
+
+  cls = (size + ARENA_GRAIN - 1) / ARENA_GRAIN;
+  if (cls == 0)
+    cls = 1;
+
+  /* too large for a size class */
+  if (cls >= ARENA_NUM_CLASSES) {
+    obj = malloc(sizeof(arena_obj_t) + size);
+    if (!obj)
+      return (NULL);
+    obj->cls 	= 0;
+    obj->kind 	= kind;
+    return (obj + 1);
+  }
 
-    if (!is_tree_empty(*tree)) {
-        printf("%sError: trying to free a non-empty tree\n", __FUNCTION__);
-        return;
-    }
-    
-    free(*tree);
-    *tree = NULL;
-}
+  bytes = sizeof(arena_obj_t) + cls * ARENA_GRAIN;
 
-/*
- * create a b plus tree
- * @param order     order of the tree (m in m-way tree)
- * @return pointer to the newly created b plus tree
- */
-bplus_tree_t *
-bplus_tree_create (int order)
-{
-    bplus_tree_t *new_tree = NULL;
+  while (atomic_flag_test_and_set_explicit(&arena->lock, memory_order_acquire))
+    ;
 
-    new_tree = malloc(sizeof(bplus_tree_t));
-    if (!new_tree) {
-        printf("%s>Error: Could not allocate memory for b-plus tree\n", __FUNCTION__);
-        return (NULL);
+  if (reuse && arena->free[cls]) {
+    obj = arena->free[cls];
+    arena->free[cls] = *(void **)(obj + 1);
+  } else {
+    if (arena->end - arena->cur < (ptrdiff_t)bytes && !arena_grow(arena)) {
+      atomic_flag_clear_explicit(&arena->lock, memory_order_release);
+      return (NULL);
     }
+    obj 	= (arena_obj_t *)arena->cur;
+    arena->cur += bytes;
+  }
 
-    memset(new_tree, 0, sizeof(bplus_tree_t));
-    new_tree->order = order;
-    new_tree->root 	= NULL;
+  atomic_flag_clear_explicit(&arena->lock, memory_order_release);
 
-    return (new_tree);
+  obj->cls 	= cls;
+  obj->kind 	= kind;
+  return (obj + 1);
 }
 
-/********************************
- * Search a key from bplus tree *
- ********************************/
-
 /*
- * utility function to get the correct child pointer
+ * allocate a node object of size bytes from arena kind
  */
-static int
-get_child_index_util (int *a,
-		      int key,
-                      int start, int end)
+static void *
+node_alloc (int kind,
+            size_t size)
 {
-    int mid = 0;
-
-    while (start != end) {
-	mid = (start + end) / 2;
-	if (a[mid] <= key) {
-	    start = mid + 1;
-	} else {
-	    end = mid;
-	}
-    }
-    
-    if (a[start] <= key) {
-      return (++start);
-    }
-    return (start);
+  return (arena_alloc(kind, size, true));
 }
 
 /*
- * helper to get the child pointer for a key
+ * first byte past the arena object at ptr, NULL for malloc'ed ones
  */
-static int
-get_child_index (bplus_tree_node_t *node, int key)
+static uint8_t *
+arena_obj_end (void *ptr)
 {
-    if (node->is_leaf) {
-        printf("%s>Error: Invalid node type\n", __FUNCTION__);
-    }
-    
-    return (get_child_index_util(node->u.index->keys, key,
-                                 0, node->u.index->num - 1));
+  arena_obj_t *obj = (arena_obj_t *)ptr - 1;
+
+  if (!arena_on || !ptr || obj->cls == 0)
+    return (NULL);
+
+  return ((uint8_t *)ptr + obj->cls * ARENA_GRAIN);
 }
 
 /*
- * Binary Serach for searching within a leaf node
+ * free a node object; EBR may call this from any thread
  */
-static int
-binary_search (pair_t *pairs,
-               int key,
-               float *data,
-               int start, int end)
+static void
+node_free (void *ptr)
 {
-    int mid = 0;
+  arena_t *arena 	= NULL;
+  arena_obj_t *obj 	= NULL;
 
-    if (start > end)
-        return (-1);
-    
-    mid = (start + end)/2;
-    if (pairs[mid].key == key) {
-        *data = pairs[mid].data;
-        return (mid);
-    }
+  if (!ptr)
+    return;
 
-    if (key < pairs[mid].key) {
-        return (binary_search(pairs, key, data, start, mid - 1));
-    } else {
-        return (binary_search(pairs, key, data, mid + 1, end));
-    }
+  if (!arena_on) {
+    free(ptr);
+    return;
+  }
 
-    return (-1);
+  obj = (arena_obj_t *)ptr - 1;
+  if (obj->cls == 0) {
+    free(obj);
+    return;
+  }
+
+  arena = &bplus_arena[obj->kind];
+  while (atomic_flag_test_and_set_explicit(&arena->lock, memory_order_acquire))
+    ;
+  *(void **)ptr 		= arena->free[obj->cls];
+  arena->free[obj->cls] 	= obj;
+  atomic_flag_clear_explicit(&arena->lock, memory_order_release);
 }
 
 /*
- * utility function to search a key within a leaf node
+ * allocate tree nodes from the huge page arenas.
+ * Must be called before the first node of any tree is created
+ * @return false if nodes were already allocated with malloc
  */
-static int
-bplus_tree_search_in_leaf (bplus_tree_node_t *node,
-                           int key,
-                           float *data)
+bool
+bplus_arena_enable (void)
 {
-    int i = 0;
+  if (arena_on)
+    return (true);
 
-    if (!node->is_leaf) {
-        printf("%s> Error: node is not a leaf\n", __FUNCTION__);
-        return (-1);
-    }
+  if (arena_sealed) {
+    printf("%s: Error: nodes were already allocated\n", __FUNCTION__);
+    return (false);
+  }
 
-    return binary_search(node->u.leaf->pairs,
-                         key, data, 0,
-                         node->u.leaf->num - 1);
+  arena_on = true;
+  return (true);
 }
 
 /*
- * utility function to search a key in the giveb b+ tree.
- * first get to the root in which the key might reside.
- * Then search for the key in that root
+ * place the future regions of an arena
+ * @param kind  ARENA_INDEX or ARENA_LEAF
+ * @param numa  NUMA node, BPLUS_NUMA_ANY or BPLUS_NUMA_INTERLEAVE
  */
-static bool
-bplus_tree_search_key_internal(bplus_tree_node_t *root,
-                               int key,
-                               float *data)
+void
+bplus_arena_bind (int kind,
+                  int numa)
 {
-    int index = 0; /* index of child pointer where the key will  */
-
-    if (!root) {
-        return (false);
-    }
+  if (kind < 0 || kind >= ARENA_REPLICA ||
+      numa < BPLUS_NUMA_INTERLEAVE || numa >= BPLUS_MAX_NUMA) {
+    printf("%s: Error: invalid arguments\n", __FUNCTION__);
+    return;
+  }
 
-    //print_node(root);
+  bplus_arena[kind].numa = numa;
+}
 
-    if (root->is_leaf) {
-        index = bplus_tree_search_in_leaf(root, key, data);
-        if (index == -1) {
-          return (false);
-        } else {
-          return (true);
-        }
-    }
+/*******************
+ * Instrumentation *
+ *******************/
 
-    index = get_child_index(root, key);
-    return (bplus_tree_search_key_internal(root->u.index->child[index],
-                                           key, data));
-}
+#ifdef BPLUS_INSTRUMENT
+static __thread bplus_instrument_t 	*instr;		// counters of the calling thread
+static _Atomic(bplus_instrument_t *) 	instr_all;	// counters of every thread that ran
 
 /*
- *  search a key in b plus tree
- *  @param tree bplus tree
- *  @paramm key key to search
- *  @param data data to be filled
- *  @return true - if key is present in the tree
- *  @return false - if key is not present in the tree
+ * give the calling thread its counters; they outlive the thread
+ * so that its counts stay in the totals
  */
-bool
-bplus_tree_search_key (bplus_tree_t *tree,
-                       int key,
-                       float *data)
+static bplus_instrument_t *
+instr_register (void)
 {
-    if (!tree) {
-        printf("%s> Error: Invalid tree\n", __FUNCTION__);
-        return -1;
-    }
+  bplus_instrument_t *local 		= NULL;
+  static bplus_instrument_t overflow;	/* shared by threads calloc failed for */
 
-    if (!data) {
-        printf("%s>Error: Invalid data ", __FUNCTION__);
-    }
+  local = calloc(1, sizeof(bplus_instrument_t));
+  if (!local)
+    return (&overflow);
 
-    *data = -1;
-    return (bplus_tree_search_key_internal(tree->root, key, data));
+  local->next = atomic_load_explicit(&instr_all, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&instr_all, &local->next, local,
+                                                memory_order_release,
+                                                memory_order_relaxed))
+    ;
+
+  instr = local;
+  return (local);
 }
 
-/******************
- * Range Serach   *
- ******************/
+static inline bplus_instrument_t *
+instr_local (void)
+{
+  if (__builtin_expect(!instr, 0))
+    return (instr_register());
+  return (instr);
+}
 
-/*
- * find the index of the key if found or
- * get the index of next largest element
- */
-int
-bplus_tree_range_search_find_index_in_leaf (pair_t *a,
-                                            int low_key,
-                                            int start, int end)
+static inline uint64_t
+instr_ticks (void)
 {
-    int mid = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  return (__builtin_ia32_rdtsc());
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
 
-    while (start != end) {
-	
-	mid = (start + end) / 2;
+static inline void
+instr_record (bplus_op_t op,
+              uint64_t start)
+{
+  int bucket 			= 0;
+  uint64_t ticks 		= instr_ticks() - start;
+  bplus_instrument_t *local 	= instr_local();
 
-        if (a[mid].key == low_key) {
-          return (mid);
-        }
-	
-        if (a[mid].key <= low_key) {
-	    start = mid + 1;
-	} else {
-	    end = mid;
-	}
-    }
-    
-    if (a[start].key < low_key) {
-      return (++start);
-    }
-    
-    return (start);
+  bucket = 63 - __builtin_clzll(ticks | 1);
+  if (bucket >= BPLUS_HIST_BUCKETS)
+    bucket = BPLUS_HIST_BUCKETS - 1;
+
+  local->ops[op]++;
+  local->hist[op][bucket]++;
 }
 
+#define INSTR_ADD(field, n)	(instr_local()->field += (n))
+#define INSTR_START(t)		uint64_t t = instr_ticks()
+#define INSTR_END(op, t)	instr_record(op, t)
+#else
+#define INSTR_ADD(field, n)	((void)0)
+#define INSTR_START(t)		((void)0)
+#define INSTR_END(op, t)	((void)0)
+#endif /* BPLUS_INSTRUMENT */
+
 /*
- * traverse the leaf and search for low_key,
- * one a match is found (low_key or the next higher key)
- * traverse the doubly linked list until high_key(including)
+ * add up the counters of all threads. The counts of threads which
+ * are running are read without synchronisation, so they may lag a bit
+ * @return false if the library was built without BPLUS_INSTRUMENT
  */
-void
-bplus_tree_range_search_in_leaf (bplus_tree_node_t *root,
-                                 int low_key,
-                                 int high_key)
+bool
+bplus_instrument_snapshot (bplus_instrument_t *out)
 {
-  
-  bplus_tree_node_t *head 	= NULL;
-  int lowest_key_in_leaf 	= -1;
-  int highest_key_in_leaf 	= -1;
-  int i 					= 0;
-  int num 					= 0;
-  int index 				= 0;
-  bool found 				= false;
-  pair_t *pairs;
-
-  if (!root->is_leaf) {
-    
-    printf("Error: Non leaf node encountered\n");
-    return;
-  }
-
-  num = root->u.leaf->num;
-  lowest_key_in_leaf = root->u.leaf->pairs[0].key;
-  highest_key_in_leaf = root->u.leaf->pairs[num - 1].key;
+#ifdef BPLUS_INSTRUMENT
+  int i 			= 0;
+  int op 			= 0;
+  uint64_t r0 			= 0;
+  bplus_instrument_t *local 	= NULL;
+  static double ticks_per_ns;
+  struct timespec t0, t1, wait;
 
-  /*
-   * print <key, values> in this leaf
-   */
-  pairs = root->u.leaf->pairs;
-  index = bplus_tree_range_search_find_index_in_leaf(pairs, low_key, 0, num - 1);
-  for (i = index; i < num; i++) {
+  if (!out)
+    return (false);
 
-    if (pairs[i].key > high_key) {
-      goto done;
+  memset(out, 0, sizeof(*out));
+  for (local = atomic_load_explicit(&instr_all, memory_order_acquire);
+       local; local = local->next) {
+
+    out->descents 	+= local->descents;
+    out->node_visits 	+= local->node_visits;
+    out->compares 	+= local->compares;
+    out->leaf_splits 	+= local->leaf_splits;
+    out->index_splits 	+= local->index_splits;
+    out->borrows 	+= local->borrows;
+    out->merges 	+= local->merges;
+    out->root_changes 	+= local->root_changes;
+    out->filter_rejects += local->filter_rejects;
+    for (op = 0; op < BPLUS_OP_NUM; op++) {
+      out->ops[op] += local->ops[op];
+      for (i = 0; i < BPLUS_HIST_BUCKETS; i++)
+        out->hist[op][i] += local->hist[op][i];
     }
-    
-    if (!false)
-      found = true;
-    fprintf(op, "%0.2f,", pairs[i].data);
-   // printf("<Key: %d, value: %f>\n", pairs[i]. key, pairs[i].data);
   }
 
-  /*
-   * traverse the list from this leaf
-   * and see if they have keys in the range above
-   */
-  head = root->u.leaf->next;
-  while (head) {
-    
-    pairs = head->u.leaf->pairs;
-    num = head->u.leaf->num;
-    for (i = 0; i < num; i++) {
-
-      if (pairs[i].key > high_key) {
-        goto done;
-      }
-      
-      if (!found)
-        found = true;
-      fprintf(op, "%0.2f,", pairs[i].data);
-      //printf("<Key: %d, value: %f>\n", pairs[i]. key, pairs[i].data);
-    }
-    head = head->u.leaf->next;
+  /* measure the tick rate once, against the monotonic clock */
+  if (ticks_per_ns == 0) {
+    wait.tv_sec 	= 0;
+    wait.tv_nsec 	= 10000000;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r0 = instr_ticks();
+    nanosleep(&wait, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ticks_per_ns = (double)(instr_ticks() - r0) /
+                   ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec));
   }
- 
-done:
-  if (!found)
-    fprintf(op, "Null\n");
-  return;
+  out->ticks_per_ns = ticks_per_ns;
+
+  return (true);
+#else
+  if (out)
+    memset(out, 0, sizeof(*out));
+  return (false);
+#endif
 }
 
 /*
- * utility function to do a range search
- * First get the leaf node in which the low_key should reside
- * get all the keys starting from low_key til high_key(both including)
- * by traversing the doubly link list
+ * latency of operation op under which pct percent of them completed,
+ * rounded up to the end of a histogram bucket
+ * @return nanoseconds, 0 if there were no such operations
  */
-void
-bplus_tree_range_search_internal (bplus_tree_node_t *root,
-                                  int low_key,
-                                  int high_key)
+double
+bplus_instrument_percentile (const bplus_instrument_t *stats,
+                             bplus_op_t op,
+                             double pct)
 {
-  int index = 0;
+  int i 		= 0;
+  uint64_t seen 	= 0;
+  uint64_t want 	= 0;
 
-  if (!root) {
-    return;
-  }
+  if (!stats || op >= BPLUS_OP_NUM || !stats->ops[op] || stats->ticks_per_ns <= 0)
+    return (0);
 
-  if (root->is_leaf) {
-    return (bplus_tree_range_search_in_leaf (root, low_key, high_key));
+  want = (uint64_t)ceil(stats->ops[op] * pct / 100);
+  for (i = 0; i < BPLUS_HIST_BUCKETS - 1; i++) {
+    seen += stats->hist[op][i];
+    if (seen >= want)
+      break;
   }
 
-  index = get_child_index(root, low_key);
-  return (bplus_tree_range_search_internal(root->u.index->child[index], low_key, high_key));
+  return ((double)(2ULL << i) / stats->ticks_per_ns);
 }
 
+/***************
+ * Key helpers *
+ ***************/
+
+#ifdef BPLUS_KEY_STRING
 /*
- * return all keys such that
- * low_key <= key <= high_key
+ * three way compare of string keys;
+ * the inline prefix decides unless both keys share it
  */
-void
-bplus_tree_range_search (bplus_tree_t *tree,
-                         int low_key,
-                         int high_key)
+static inline int
+bplus_str_key_cmp (bplus_key_t a, bplus_key_t b)
 {
-  if (!tree) {
-    return;
-  }
+  int ret 	= 0;
+  uint32_t len 	= 0;
 
-  if (high_key < low_key) {
-    printf("Please enter a valid range\n");
-    return;
+  if (a.prefix != b.prefix)
+    return ((a.prefix < b.prefix) ? -1 : 1);
+
+  if (a.len > 8 && b.len > 8) {
+
+    len = (a.len < b.len) ? a.len : b.len;
+    ret = memcmp(a.ext + 8, b.ext + 8, len - 8);
+    if (ret)
+      return (ret);
   }
 
-  bplus_tree_range_search_internal (tree->root, low_key, high_key);
-  
-  return;
-}
+  if (a.len == b.len)
+    return (0);
 
-/*******************************
- *  B+ tree insert             *
- *******************************/
+  return ((a.len < b.len) ? -1 : 1);
+}
 
 /*
- * utility function to add a key in index node
+ * build a key over caller owned bytes;
+ * the bytes must stay around while the key is used for lookups
  */
-static void
-index_node_add_key (index_node_t *node, int key)
+static bplus_key_t
+bplus_str_key_make (const char *str, int len)
 {
-  int num = 0;
+  int i 		= 0;
+  bplus_key_t key 	= {0};
 
-  num 				= node->num;
-  node->keys[num++] = key;
-  node->num 		= num;
+  for (i = 0; i < 8; i++)
+    key.prefix = (key.prefix << 8) | ((i < len) ? (uint8_t)str[i] : 0);
+
+  key.len = len;
+  key.ref = 0;
+  key.ext = (len > 8) ? (const uint8_t *)str : NULL;
+
+  return (key);
 }
 
 /*
- * utility function add a (k, v) pair in leaf node
+ * Slots whose last user went away, waiting to be handed to EBR
+ * together; a slot is reused only once no reader can be comparing
+ * against its bytes
  */
-static void
-leaf_node_add_pair (leaf_node_t *node, int key, float value)
+#define KEY_RETIRE_BATCH	64
+
+typedef struct key_retired_t_ {
+  key_store_t 	*store;
+  int 		num;
+  uint32_t 	refs[KEY_RETIRE_BATCH];
+} key_retired_t;
+
+static inline void
+key_store_lock (key_store_t *store)
 {
-  int num = 0;
+  while (atomic_flag_test_and_set_explicit(&store->lock, memory_order_acquire))
+    ;
+}
 
-  num 					= node->num;
-  node->pairs[num].key = key;
-  node->pairs[num].data = value;
-  node->num++;
+static inline void
+key_store_unlock (key_store_t *store)
+{
+  atomic_flag_clear_explicit(&store->lock, memory_order_release);
+}
+
+static inline key_page_t *
+key_store_page (key_store_t *store, uint32_t ref)
+{
+  return (store->pages[ref >> KEY_PAGE_SLOT_BITS]);
+}
+
+static inline key_slot_t *
+key_store_slot (key_store_t *store, uint32_t ref)
+{
+  return (&key_store_page(store, ref)->slots[ref & ((1 << KEY_PAGE_SLOT_BITS) - 1)]);
 }
 
 /*
- * utility function to check if index node has room to add a new key
+ * grab a new key page and make it the current one
  */
-static bool
-index_has_room (bplus_tree_t *tree,
-                bplus_tree_node_t *node)
+static key_page_t *
+key_store_add_page (key_store_t *store)
 {
-  if (!tree) {
-    printf("%s: Invalid tree\n", __FUNCTION__);
-    return (false);
+  int max 		= 0;
+  key_page_t *page 	= NULL;
+  key_page_t **pages 	= NULL;
+
+  if (store->num_pages + 1 >= KEY_MAX_PAGES) {
+    printf("%s: Error: key store is full\n", __FUNCTION__);
+    return (NULL);
   }
 
-  if (!node) {
-    printf("%s: Invalid node\n", __FUNCTION__);
-    return (false);
+  if (store->num_pages + 1 >= store->max_pages) {
+
+    max 	= store->max_pages ? store->max_pages * 2 : 16;
+    pages 	= realloc(store->pages, max * sizeof(key_page_t *));
+    if (!pages) {
+      printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+      return (NULL);
+    }
+    store->pages 	= pages;
+    store->max_pages 	= max;
   }
-  
-  if (node->is_leaf) {
-    printf("%s: Non-leaf node\n", __FUNCTION__);
-    return (false);
+
+  page = malloc(KEY_PAGE_SIZE);
+  if (!page) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    return (NULL);
   }
 
-  return (node->u.index->num < (tree->order - 1));
+  page->nslots 	= 0;
+  page->heap 	= KEY_PAGE_SIZE;
+  store->pages[++store->num_pages] = page;
+
+  return (page);
 }
 
 /*
- * utility function to check if leaf node has roomm to add a new pair
+ * EBR callback: put the slots of a batch on their free lists.
+ * A free slot keeps the ref of the next one in its first bytes
  */
-static bool
-leaf_has_room (bplus_tree_t *tree,
-               bplus_tree_node_t *node)
+static void
+key_store_reclaim (void *arg)
 {
-  if (!tree) {
-    printf("%s: Invalid tree\n", __FUNCTION__);
-    return (false);
-  }
-
-  if (!node) {
-    printf("%s: Invalid node\n", __FUNCTION__);
-    return (false);
-  }
-  
-  if (!node->is_leaf) {
-    printf("%s: Non-leaf node\n", __FUNCTION__);
-    return (false);
+  int i 			= 0;
+  int size_class 		= 0;
+  key_page_t *page 		= NULL;
+  key_slot_t *slot 		= NULL;
+  key_retired_t *batch 		= arg;
+  key_store_t *store 		= batch->store;
+
+  key_store_lock(store);
+  for (i = 0; i < batch->num; i++) {
+
+    page 	= key_store_page(store, batch->refs[i]);
+    slot 	= key_store_slot(store, batch->refs[i]);
+    size_class 	= slot->len / KEY_SLOT_ALIGN;
+    memcpy((uint8_t *)page + slot->off, &store->free_list[size_class], sizeof(uint32_t));
+    store->free_list[size_class] = batch->refs[i];
   }
+  key_store_unlock(store);
 
-  return (node->u.leaf->num < (tree->order - 1));
+  free(batch);
 }
 
 /*
- * get the leaf in which the key should reside
+ * hand the slots released so far over to EBR
  */
-static bplus_tree_node_t *
-find_leaf_for_key (bplus_tree_node_t *root,
-                   int key)
+static void
+bplus_key_retire (bplus_tree_t *tree)
 {
-  int index = 0;
+  key_store_t *store = &tree->key_store;
 
-  if (!root) {
-    return (NULL);
-  }
+  if (!store->retired)
+    return;
 
-  if (root->is_leaf) {
-    return (root);
-  }
+  epoch_retire(&bplus_epoch, store->retired, key_store_reclaim);
+  store->retired = NULL;
+}
 
-  index = get_child_index(root, key);
-  return (find_leaf_for_key(root->u.index->child[index], key));
+/*
+ * one more key in the tree uses the slot of key
+ */
+static inline void
+bplus_key_hold (bplus_tree_t *tree, bplus_key_t key)
+{
+  if (key.ref)
+    key_store_slot(&tree->key_store, key.ref)->refs++;
 }
 
 /*
- * utility function to insert a new (k, v) pair in
- * non-full leaf node
- *
- * Simply, do a sorted add of the new pair in the pairs array
+ * a key stored in the tree goes away;
+ * its slot is freed once nothing else in the tree uses it
  */
 static void
-insert_into_non_full_leaf (bplus_tree_node_t *node,
-                           int key,
-                           float value)
+bplus_key_release (bplus_tree_t *tree, bplus_key_t key)
 {
-  int i 		= 0;
-  int num 		= 0;
-  pair_t *pairs = NULL;
+  key_store_t *store = &tree->key_store;
 
-  if (!node) {
-    printf("%s: Error: invalid node\n", __FUNCTION__);
-    return;
-  }
-  
-  if (!node->is_leaf) {
-    printf("%s: Error: non leaf node\n", __FUNCTION__);
+  if (!key.ref || --key_store_slot(store, key.ref)->refs)
     return;
-  }
- 
-  pairs = node->u.leaf->pairs;
-  num = node->u.leaf->num;
-  for (i = num - 1; (i >= 0 && (pairs[i].key > key)); i--) {
 
-    pairs[i + 1].key 	= pairs[i].key;
-    pairs[i + 1].data 	= pairs[i].data;
-  }
+  if (!store->retired) {
+    store->retired = malloc(sizeof(key_retired_t));
+    if (!store->retired) {
 
-  pairs[i + 1].key 	= key;
-  pairs[i + 1].data = value;
-  node->u.leaf->num++;
+      /* the slot is lost, which is all that can go wrong here */
+      printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+      return;
+    }
+    store->retired->store 	= store;
+    store->retired->num 	= 0;
+  }
 
-  return;
+  store->retired->refs[store->retired->num++] = key.ref;
+  if (store->retired->num == KEY_RETIRE_BATCH)
+    bplus_key_retire(tree);
 }
 
 /*
- * insert a new key in non-full parent node(index node)
- *
- * do a sorted insert of the new key in keys array of the index node
- * rearragnge child pointers accordingly
+ * copy the bytes of a key which is about to be stored in the tree
+ * into a slot of its key pages, reusing a free slot of the same size
+ * class if there is one. A key which has a slot already keeps it
+ * @return false if the key cannot be stored
  */
-static void
-insert_key_into_non_full_parent (bplus_tree_node_t *parent,
-                                 bplus_tree_node_t *leaf,
-                                 bplus_tree_node_t *new_leaf,
-                                 int key)
+static bool
+bplus_key_intern (bplus_tree_t *tree, bplus_key_t *key)
 {
-  int i 		= 0;
-  int j 		= 0;
-  int num 		= 0;
-  int *keys 	= NULL;
-  void **child 	= NULL;
+  int size 		= 0;
+  int free_bytes 	= 0;
+  uint32_t ref 		= 0;
+  key_page_t *page 	= NULL;
+  key_slot_t *slot 	= NULL;
+  key_store_t *store 	= &tree->key_store;
+
+  if (!key->ext || key->ref)
+    return (true);
 
-  if (!parent || !leaf || !new_leaf) {
-    printf("%s: Error: Invalid args\n", __FUNCTION__);
-    return;
+  if (key->len > BPLUS_STR_KEY_MAX) {
+    printf("%s: Error: key longer than %d bytes\n", __FUNCTION__, BPLUS_STR_KEY_MAX);
+    return (false);
   }
+  size = (key->len + KEY_SLOT_ALIGN - 1) & ~(KEY_SLOT_ALIGN - 1);
 
-  if (parent->is_leaf) {
-    printf("%s: Error: non index node\n", __FUNCTION__);
-    return;
-  }
+  key_store_lock(store);
 
-  keys = parent->u.index->keys;
-  child = parent->u.index->child;
-  num = parent->u.index->num;
+  ref = store->free_list[size / KEY_SLOT_ALIGN];
+  if (ref) {
 
-  /*
-   * move all the keys which are greater than this key by 1
-   */
-  for (i = num - 1; (i >= 0 && (keys[i] > key)); i--) {
+    page = key_store_page(store, ref);
+    slot = key_store_slot(store, ref);
+    memcpy(&store->free_list[size / KEY_SLOT_ALIGN], (uint8_t *)page + slot->off,
+           sizeof(uint32_t));
+  } else {
 
-    keys[i + 1] = keys[i];
-  }
+    page = store->num_pages ? store->pages[store->num_pages] : NULL;
+    if (page)
+      free_bytes = page->heap - sizeof(key_page_t) -
+                   ((page->nslots + 1) * sizeof(key_slot_t));
 
-  /*
-   * we are going to add the new key at i;
-   * which means we want to shift all child pointers starting at i + 1 by 1
-   */
-  for (j = num; j > i + 1; j--) {
-    child[j + 1] = child[j];
+    if (!page || free_bytes < size ||
+        page->nslots == (1 << KEY_PAGE_SLOT_BITS)) {
+
+      page = key_store_add_page(store);
+      if (!page) {
+        key_store_unlock(store);
+        return (false);
+      }
+    }
+
+    page->heap 	-= size;
+    slot 	= &page->slots[page->nslots];
+    slot->off 	= page->heap;
+    slot->len 	= size;
+    ref 	= (store->num_pages << KEY_PAGE_SLOT_BITS) | page->nslots;
+    page->nslots++;
   }
 
-  keys[i + 1] 	= key;
-  child[j + 1] 	= new_leaf;
-  parent->u.index->num++;
+  slot->refs = 1;
+  memcpy((uint8_t *)page + slot->off, key->ext, key->len);
+  key_store_unlock(store);
 
-  return;
+  key->ref = ref;
+  key->ext = (const uint8_t *)page + slot->off;
+  return (true);
+}
+#else
+static inline bool
+bplus_key_intern (bplus_tree_t *tree, bplus_key_t *key)
+{
+  (void)tree;
+  (void)key;
+  return (true);
+}
+
+static inline void
+bplus_key_hold (bplus_tree_t *tree, bplus_key_t key)
+{
+  (void)tree;
+  (void)key;
+}
+
+static inline void
+bplus_key_release (bplus_tree_t *tree, bplus_key_t key)
+{
+  (void)tree;
+  (void)key;
 }
 
+static inline void
+bplus_key_retire (bplus_tree_t *tree)
+{
+  (void)tree;
+}
+#endif
+
 /*
- * insert a new key in a full parent
- * split the node in two and adjust parent
+ * parse a key from the input trace;
+ * a string key points at str, which must outlive it
  */
-static bplus_tree_node_t *
-insert_key_into_full_parent (bplus_tree_node_t *root,
-                             bplus_tree_node_t *parent,
-                             bplus_tree_node_t *leaf,
-                             bplus_tree_node_t *new_leaf,
-                             int key)
+bplus_key_t
+bplus_key_parse (const char *str)
 {
-  int i = 0, j = 0, k = 0, l = 0;
-  int num_tmp_keys 	= 0;
-  int num 			= 0;
-  int promote_key 	= 0; 				//key which will be promoted
-  int *keys 		= NULL; 			//keys in parent
-  void **child 		= NULL; 			//child pointers in parent
-  int *new_keys 	= NULL; 			//keys in new_node
-  void **new_child 	= NULL; 			//child pointers in new_node
-  int tmp_keys[tree->order]; 			//hold all keys in parent + new key
-  void *tmp_child[tree->order + 1]; 	//hold all children in parent + new_leaf
-  bplus_tree_node_t *new_node = NULL;
+#if defined(BPLUS_KEY_TYPE)
+  return (BPLUS_KEY_PARSE(str));
+#elif defined(BPLUS_KEY_STRING)
+  return (bplus_str_key_make(str, strlen(str)));
+#elif defined(BPLUS_KEY_INT64)
+  return (strtoll(str, NULL, 10));
+#elif defined(BPLUS_KEY_UINT128)
+  bplus_key_t key = 0;
+
+  while (*str == ' ')
+    str++;
+
+  while (*str >= '0' && *str <= '9')
+    key = (key * 10) + (*str++ - '0');
+
+  return (key);
+#else
+  return (atoi(str));
+#endif
+}
 
-  if (!root || !parent || !leaf || !new_leaf) {
-    printf("%s: Error: invalid arguments\n", __FUNCTION__);
-    return (root);
-  }
+/*
+ * format a key in decimal
+ * @return buf
+ */
+static char *
+bplus_key_format (bplus_key_t key, char *buf, int len)
+{
+#if defined(BPLUS_KEY_TYPE)
+  BPLUS_KEY_FORMAT(key, buf, len);
+#elif defined(BPLUS_KEY_STRING)
+  int n = (key.len < (uint32_t)len - 1) ? (int)key.len : len - 1;
 
-  if (parent->is_leaf) {
-    printf("%s: Error: parent cannot be leaf here\n", __FUNCTION__);
-    return (root);
-  }
+  if (key.len > 8) {
+    memcpy(buf, key.ext, n);
+  } else {
+    int i;
 
-  new_node = bplus_tree_create_node(false);
-  if (!new_node) {
-    printf("%s: Error: cannot create new node\n", __FUNCTION__);
-    return (root);
+    for (i = 0; i < n; i++)
+      buf[i] = (key.prefix >> (8 * (7 - i))) & 0xFF;
   }
-  new_node->parent = parent->parent;
+  buf[n] = '\0';
+#elif defined(BPLUS_KEY_INT64)
+  snprintf(buf, len, "%lld", (long long)key);
+#elif defined(BPLUS_KEY_UINT128)
+  char tmp[BPLUS_KEY_STR_LEN];
+  int i = 0;
+  int j = 0;
+
+  /* printf has no 128 bit conversion; emit the digits backwards */
+  do {
+    tmp[i++] = '0' + (int)(key % 10);
+    key /= 10;
+  } while (key && i < (int)sizeof(tmp));
+
+  while (i > 0 && j < len - 1)
+    buf[j++] = tmp[--i];
+  buf[j] = '\0';
+#else
+  snprintf(buf, len, "%d", key);
+#endif
+
+  return (buf);
+}
 
-  memset(tmp_keys, 0, sizeof(tmp_keys));
-  memset(tmp_child, 0, sizeof(tmp_child));
+/******************************
+ * Packed (compressed) leaves *
+ ******************************/
 
-  keys 			= parent->u.index->keys;
-  child 		= parent->u.index->child;
-  num 			= parent->u.index->num;
-  num_tmp_keys 	= num + 1;
+/*
+ * key/data of the i-th record of a leaf, packed or not
+ */
+static inline bplus_key_t
+leaf_key_at (leaf_node_t *leaf, int i)
+{
+#ifdef BPLUS_KEY_INTEGRAL
+  if (leaf->packed == 1)
+    return (leaf->base + ((uint8_t *)leaf->deltas)[i]);
 
-  /*
-   * copy all the keys from parent  which are less than key in tmp_keys
-   */
-  i = 0;
-  j = 0;
-  while (keys[j] < key && j < num) {
-    tmp_keys[i++] = keys[j++];
-  }
-  
-  /*
-   * at this point new_leaf will be inserted at loc i in tmp_child
-   */
-  k = 0;
-  l = 0;
-  while (k <= i) {
-    tmp_child[k++] = child[l++];
-  }
+  if (leaf->packed == 2)
+    return (leaf->base + ((uint16_t *)leaf->deltas)[i]);
+#endif
 
-  /*
-   * we now have the right location for key
-   */
-  tmp_keys[i++] = key;
+  return (leaf->pairs[i].key);
+}
 
-  /*
-   * insert the new leaf into child pointers
-   */
-  tmp_child[k++] = new_leaf;
+static inline const bplus_value_t *
+leaf_value_at (leaf_node_t *leaf, int i)
+{
+  if (!leaf->packed)
+    return (&leaf->pairs[i].data);
 
-  /*
-   * copy rest of the keys
-   */
-  while (j < num) {
-    tmp_keys[i++] = keys[j++];
-  }
+  return (&leaf->values[i]);
+}
 
-  /*
-   * copy rest of the pointers
-   */
-  while (l <= num) {
-    tmp_child[k++] = child[l++];
-  }
+/*
+ * is the i-th record a tombstone; packed leaves never hold one
+ */
+static inline bool
+leaf_pair_dead (leaf_node_t *leaf, int i)
+{
+  if (leaf->packed)
+    return (false);
 
-  /*
-   * now tmp_keys and tmp_child should have
-   * keys and child in correct order (if things worked :-))
-   */
+  return (leaf->pairs[i].flags & BPLUS_PAIR_DEAD);
+}
 
-  /*
-   * copy half the content in parent node
-   */
-  parent->u.index->num = 0;
-  for (i = 0; i < (tree->order/2); i++) {
-    
-    keys[i] = tmp_keys[i];
-    parent->u.index->num++;
-  }
+/*
+ * index of the first record in a packed leaf whose key is >= key.
+ *
+ * The deltas are sorted, so the answer is the number of deltas
+ * smaller than (key - base); count them a SIMD register at a time.
+ * Padding lanes hold the largest delta and never compare smaller
+ */
+static int
+packed_leaf_lower_bound (leaf_node_t *leaf, bplus_key_t key)
+{
+#ifdef BPLUS_KEY_INTEGRAL
+  bplus_ukey_t delta 	= 0;
+  int count 		= 0;
+  int i 		= 0;
+  int nbytes 		= 0;
+  int mask 		= 0;
+  uint8_t *deltas 	= NULL;
 
-  for (j = 0; j <= i; j++) {
-    
-    child[j] = tmp_child[j];
-  }
-
-  /*
-   * promote the middle key as this is an index node
-   */
-  promote_key = tmp_keys[i];
+  if (BPLUS_KEY_LE(key, leaf->base))
+    return (0);
 
-  /*
-   * copy rest of the half in new node
-   */
-  new_keys 	= new_node->u.index->keys;
-  new_child = new_node->u.index->child;
-  for (i = (tree->order/2 + 1), j = 0; i < num_tmp_keys; i++, j++) {
-    
-    new_keys[j] = tmp_keys[i];
-    new_node->u.index->num++;
-  }
-  
-  for (i = (tree->order/2 + 1), j = 0; i < num_tmp_keys + 1; i++, j++) {
-    
-    bplus_tree_node_t *tmp = NULL;
+  delta = (bplus_ukey_t)key - (bplus_ukey_t)leaf->base;
+  if (delta > ((leaf->packed == 1) ? 0xFF : 0xFFFF))
+    return (leaf->num);
 
-    new_child[j] = tmp_child[i];
+  deltas = leaf->deltas;
+  nbytes = leaf->num * leaf->packed;
 
-    /* we have a new parent for this child pointers */
-    tmp 		= new_child[j];
-    tmp->parent = new_node;
-  }
+#ifdef __SSE2__
+  if (leaf->packed == 1) {
 
-  return adjust_parent(root, parent, new_node, promote_key);
-}
+    /* SSE2 only has signed compares; flip the sign bit of both sides */
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i k 	 = _mm_xor_si128(_mm_set1_epi8((char)delta), bias);
 
-/*
- * adjust the parent after we have promoted a key from a lower level
- */
-bplus_tree_node_t *
-adjust_parent (bplus_tree_node_t *root,
-             bplus_tree_node_t *leaf,
-             bplus_tree_node_t *new_leaf,
-             int parent_key)
-{
-  bplus_tree_node_t *new_node 	= NULL;
-  bplus_tree_node_t *parent 	= NULL;
+    for (i = 0; i < nbytes; i += PACK_ALIGN) {
 
-  parent = leaf->parent;
+      __m128i v = _mm_xor_si128(_mm_loadu_si128((__m128i *)(deltas + i)), bias);
 
-  /*
-   * If we don't have a parent
-   */
-  if (!parent) {
-    
-    /*
-     * create a new index node;
-     * put the parent_key in the newly created node;
-     * adjust child pointers for this node;
-     * return the new node (which is the new root of the tree)
-     */
-    new_node = bplus_tree_create_node(false);
-    if (!new_node) {
-      printf("%s: Error: could not create new index node\n", __FUNCTION__);
-      return root;
+      mask = _mm_movemask_epi8(_mm_cmplt_epi8(v, k));
+      count += __builtin_popcount(mask);
+      if (mask != 0xFFFF)
+        break;
     }
-    
-    /* new nodes parent is going to be NULL */
+  } else {
 
-    /* add the parent key which was promoted to index node */
-    index_node_add_key(new_node->u.index, parent_key);
+    __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i k 	 = _mm_xor_si128(_mm_set1_epi16((short)delta), bias);
 
-    /* adjust the child pointers accordingly */
-    new_node->u.index->child[0] = leaf;
-    new_node->u.index->child[1] = new_leaf;
-    
-    /* we have a new parent for leaf and new leaf */
-    leaf->parent 		= new_node;
-    new_leaf->parent 	= new_node;
-    return (new_node);
-  }
+    for (i = 0; i < nbytes; i += PACK_ALIGN) {
 
-  /*
-   * if we have a parent which is not full
-   */
-  if (index_has_room(tree, parent)) {
-    insert_key_into_non_full_parent(parent, leaf, new_leaf, parent_key);
-    return (root);
-  }
+      __m128i v = _mm_xor_si128(_mm_loadu_si128((__m128i *)(deltas + i)), bias);
 
-  /*
-   * Parent doesnt have room;
-   * spilt the node accordingly
-   */
-  return (insert_key_into_full_parent(root, parent, leaf, new_leaf, parent_key));
+      /* two mask bits per 16 bit lane */
+      mask = _mm_movemask_epi8(_mm_cmplt_epi16(v, k));
+      count += __builtin_popcount(mask) / 2;
+      if (mask != 0xFFFF)
+        break;
+    }
+  }
+#else
+  {
+    int start = 0;
+    int end   = leaf->num;
+
+    while (start < end) {
+
+      i = (start + end) / 2;
+      if (BPLUS_KEY_LT(leaf_key_at(leaf, i), key))
+        start = i + 1;
+      else
+        end = i;
+    }
+    count = start;
+  }
+#endif
+
+  return (count);
+#else
+  /* only integral keys are ever packed */
+  (void)leaf;
+  (void)key;
+  return (0);
+#endif
 }
 
 /*
- * Insert a new <key, value> in full leaf
- * split the node in two leafs and promote a key to parent node
+ * convert a leaf to the packed format if its key span
+ * fits in 2 byte deltas
+ * @return true if the leaf got packed
  */
-bplus_tree_node_t *
-insert_into_full_leaf (bplus_tree_node_t *root,
-                       bplus_tree_node_t *node,
-                       int key,
-                       float value)
+static bool
+leaf_pack (bplus_tree_node_t *node)
 {
-  int i 			= 0 ;
-  int j 			= 0;
-  int num 			= 0;
-  int promote_key 	= 0;
-  pair_t tmp_pairs[tree->order];
-  bplus_tree_node_t *new_leaf 	= NULL;
-  pair_t *pairs 				= NULL;
-  pair_t *new_pairs 			= NULL;
+#ifdef BPLUS_KEY_INTEGRAL
+  int i 		= 0;
+  int num 		= 0;
+  int width 		= 0;
+  int size 		= 0;
+  bplus_ukey_t span 	= 0;
+  void *deltas 		= NULL;
+  bplus_value_t *values = NULL;
+  leaf_node_t *leaf 	= NULL;
+
+  if (!node || !node->is_leaf)
+    return (false);
 
-  if (!node) {
-    printf("%s: Error: invalid node\n", __FUNCTION__);
-    return(NULL);
-  }
+  leaf = node->u.leaf;
+  if (leaf->packed || leaf->num == 0)
+    return (false);
 
-  if (!node->is_leaf) {
-    printf("%s: Error: non leaf node\n", __FUNCTION__);
-    return(NULL);
+  /* packed leaves have no room for per pair flags */
+  for (i = 0; i < leaf->num; i++) {
+    if (leaf->pairs[i].flags)
+      return (false);
   }
 
-  memset(tmp_pairs, 0, tree->order * sizeof(pair_t));
+  num 	= leaf->num;
+  span 	= (bplus_ukey_t)leaf->pairs[num - 1].key - (bplus_ukey_t)leaf->pairs[0].key;
+  if (span <= 0xFF)
+    width = 1;
+  else if (span <= 0xFFFF)
+    width = 2;
+  else
+    return (false);
 
-  /*
-   * create a new leaf;
-   * parent for this leaf is the same as the parent for leaf
-   */
-  new_leaf = bplus_tree_create_node(true);
-  if (!new_leaf) {
-    printf("%s: Error: Could not create new leaf\n", __FUNCTION__);
-    return (root);
+  /* round up to whole SIMD registers and pad with the largest delta */
+  size 		= ((num * width + PACK_ALIGN - 1) / PACK_ALIGN) * PACK_ALIGN;
+  deltas 	= node_alloc(ARENA_LEAF, size);
+  values 	= node_alloc(ARENA_LEAF, num * sizeof(bplus_value_t));
+  if (!deltas || !values) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    node_free(deltas);
+    node_free(values);
+    return (false);
   }
-  new_leaf->parent = node->parent;
+  memset(deltas, 0xFF, size);
 
-  /*
-   * change the doubly link list
-   */
-  new_leaf->u.leaf->next 	= node->u.leaf->next;
-  node->u.leaf->next 		= new_leaf;
-  new_leaf->u.leaf->prev 	= node;
-  if (new_leaf->u.leaf->next) {
-    bplus_tree_node_t *tmp = NULL;
+  for (i = 0; i < num; i++) {
 
-    tmp 				= new_leaf->u.leaf->next;
-    tmp->u.leaf->prev 	= new_leaf;
+    span = (bplus_ukey_t)leaf->pairs[i].key - (bplus_ukey_t)leaf->pairs[0].key;
+    if (width == 1)
+      ((uint8_t *)deltas)[i] = span;
+    else
+      ((uint16_t *)deltas)[i] = span;
+    values[i] = leaf->pairs[i].data;
   }
 
-  /*
-   * transfer half of the pairs to new leaf
-   */
-  num 	= node->u.leaf->num;
-  pairs = node->u.leaf->pairs;
-  i = 0; //index in tmp_pairs
-  j = 0; //index in original leaf
+  leaf->base 	= leaf->pairs[0].key;
+  leaf->deltas 	= deltas;
+  leaf->values 	= values;
+  leaf->packed 	= width;
 
-  /* copy everything less than key to tmp pairs */
-  while (pairs[j].key < key && j < num) {
-    tmp_pairs[i++] = pairs[j++];
-  }
+  /* a reader may still be in the pairs */
+  epoch_retire(&bplus_epoch, leaf->pairs, node_free);
+  leaf->pairs 	= NULL;
 
-  /* copy the new <key, value> in right location */
-  tmp_pairs[i].key 	= key;
-  tmp_pairs[i].data = value;
-  i++;
+  return (true);
+#else
+  (void)node;
+  return (false);
+#endif
+}
 
-  /* copy the rest of pairs to tmp_pairs */
-  while (j < num) {
-    tmp_pairs[i++] = pairs[j++];
-  }
+/*
+ * convert a packed leaf back to an array of pairs;
+ * every path which modifies a leaf does this first
+ * @return false if we ran out of memory
+ */
+static bool
+leaf_unpack (bplus_tree_t *tree,
+             bplus_tree_node_t *node)
+{
+  int i 		= 0;
+  pair_t *pairs 	= NULL;
+  leaf_node_t *leaf 	= NULL;
 
-  /* copy half the pairs in original leaf */
-  node->u.leaf->num = 0;
-  for (i = 0; i < (tree->order)/2; i++) {
-    pairs[i] = tmp_pairs[i];
-    node->u.leaf->num++;
+  if (!node || !node->is_leaf)
+    return (true);
+
+  leaf = node->u.leaf;
+  if (!leaf->packed)
+    return (true);
+
+  pairs = node_alloc(ARENA_LEAF, tree->order * sizeof(pair_t));
+  if (!pairs) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    return (false);
   }
 
-  /* copy the rest of the half in new leaf */
-  new_pairs = new_leaf->u.leaf->pairs;
-  for (i = (tree->order/2), j = 0; i < tree->order; i++, j++) {
-    new_pairs[j] = tmp_pairs[i];
-    new_leaf->u.leaf->num++;
+  for (i = 0; i < leaf->num; i++) {
+    pairs[i].key 	= leaf_key_at(leaf, i);
+    pairs[i].flags 	= 0;
+    pairs[i].data 	= leaf->values[i];
   }
 
-  promote_key = new_pairs[0].key;
+  /* a reader may still be in the packed arrays */
+  epoch_retire(&bplus_epoch, leaf->deltas, node_free);
+  epoch_retire(&bplus_epoch, leaf->values, node_free);
+  leaf->deltas 	= NULL;
+  leaf->values 	= NULL;
+  leaf->packed 	= 0;
+  leaf->pairs 	= pairs;
 
-  return adjust_parent(root, node, new_leaf, promote_key);
+  return (true);
 }
 
 /*
- * Create the root node for tree
- * (1st insertion)
+ * pack every leaf of the tree whose keys are dense enough
+ * @return number of leaves packed
  */
-bplus_tree_node_t *
-bplus_tree_create_root (int key,
-                        float value)
+int
+bplus_tree_pack_leaves (bplus_tree_t *tree)
 {
-  bplus_tree_node_t *root = NULL;
+  int count 			= 0;
+  bplus_tree_node_t *node 	= NULL;
 
-  /*
-   * create a new leaf node
-   * and mark it as root
-   */
-  root = bplus_tree_create_node(true);
-  if (!root) {
-    printf("%s: Error: could not create root node\n", __FUNCTION__);
-    return (NULL);
+  if (!tree || !tree->root)
+    return (0);
+
+  /* leftmost leaf */
+  node = tree->root;
+  while (!node->is_leaf)
+    node = node->u.index->child[0];
+
+  while (node) {
+
+    if (leaf_pack(node))
+      count++;
+    node = node->u.leaf->next;
   }
 
-  leaf_node_add_pair(root->u.leaf, key, value);
-  return (root);
+  return (count);
 }
 
+/*****************************
+ * Print tree in level order *
+ *****************************/
+
 /*
- * utility function to add a key to the B+ tree
+ * helper to print an index node
  */
 void
-bplus_tree_insert_internal (bplus_tree_node_t **root,
-                            int key,
-                            float value)
+print_index_node (bplus_tree_node_t *node)
 {
-  int index 				= 0;
-  float data 				= 0;
-  bplus_tree_node_t *leaf 	= NULL;
-
-  /*
-   * empty tree:
-   * create a root and insert in the root
-   */
-  if (!*root) {
+  int num 	= 0;
+  int i 	= 0;
+  bplus_key_t *keys = NULL;
+  char str[BPLUS_KEY_STR_LEN];
 
-    *root = bplus_tree_create_root(key, value);
+  if (!node)
     return;
-  }
 
-  /*
-   * tree is non empty
-   */
-  leaf = find_leaf_for_key (*root, key);
-  if (!leaf) {
-    
-    /*
-     * Cannot happen ?
-     */
-    printf("%s: Error: could not find leaf for key %d\n", __FUNCTION__, key);
-    return;
-  }
+  keys = node->u.index->keys;
+  num = node->u.index->num;
 
-  /*
-   * if the key is already present modify the contents
-   */
-  index = bplus_tree_search_in_leaf(leaf, key, &data);
-  if (index != -1) {
-    
-    leaf->u.leaf->pairs[index].data = value;
-    return;
-  }
+  //printf("<< (%p : %d) (", node, num);
+  printf("<<");
+  for (i = 0; i < num ; i++) {
 
-  /*
-   * leaf has room;
-   * insert into right location in leaf and return
-   * there is no change to the tree in this case
-   */
-  if (leaf_has_room(tree, leaf)) {
-   
-    insert_into_non_full_leaf(leaf, key, value);
-    return;
+    printf("%s ", bplus_key_format(keys[i], str, sizeof(str)));
   }
+  printf(">> ");
 
-  /*
-   * leaf is full;
-   * create a new leaf and adjust accordingly
-   */
-  *root = insert_into_full_leaf(*root, leaf, key, value);
   return;
-
 }
 
 /*
- * insert a (key, value) pair in b+ tree
+ * helper to print a leaf node
  */
 void
-bplus_tree_insert (bplus_tree_t *tree,
-                   int key,
-                   float value)
+print_leaf_node (bplus_tree_node_t *node)
 {
-  if (!tree)
+  int i 		= 0;
+  int num 		= 0;
+  char str[BPLUS_KEY_STR_LEN];
+
+  if (!node)
     return;
 
-  bplus_tree_insert_internal(&tree->root, key, value);
+  num = node->u.leaf->num;
+  
+  //printf("< (%p : %d) ", node, num);
+  printf("<");
+  for (i = 0 ; i < num; i++) {
+
+    printf("%s ", bplus_key_format(leaf_key_at(node->u.leaf, i), str, sizeof(str)));
+  }
+  printf(">");
 
   return;
 }
 
-/***********************************
- *   Delete                        *
- ***********************************/
-static int ceil2 (int x, int y)
+/*
+ * helper to print a node in b+ tree
+ */
+void
+print_node (bplus_tree_node_t *node)
 {
-  if (x == 0)
-    return -1;
-
-  return (1 + ((x - 1) / y)); // if x != 0);
+  if (node->is_leaf)
+    print_leaf_node(node);
+  else
+    print_index_node(node);
 }
 
-static bool
-node_is_valid (bplus_tree_node_t *root,
-               bplus_tree_node_t *node)
-{
-  
-  int num = 0;
+/*
+ * driver function for printing the b+ tree
+ */
+void
+print_tree_util (bplus_tree_node_t *root)
+{
+  queue_t *q = NULL;
 
-  if (node->is_leaf)
-    num = node->u.leaf->num;
-  else
-    num = node->u.index->num;
+  if (!root)
+    return;
 
-  if (node == root) {
-    if (num == 0)
-      return (false);
-    return (true);
+  q = create_queue();
+  if (!q) {
+    printf("%s: Error creating queue\n", __FUNCTION__);
+    return;
   }
+  
+  enqueue(q, (void *)root);
+  while (!q->is_empty) {
+    
+    int count = q->size;
 
-  /*
-   * each index/leaf node must have atleast ceil(m/2) children
-   * i.e: ceil(m/2) - 1 keys for valid b+ tree
-   */
-  if (num < (ceil2(tree->order, 2) - 1))
-    return (false);
-
-  return (true);
-}
+    while (count > 0) {
+      
+      bplus_tree_node_t *node = NULL;
 
-static int
-search_key_index_in_keys (int *keys,
-                          int key,
-                          int start, int end)
-{
-    int mid = 0;
+      node = dequeue(q);
+      if (node->is_leaf) {
+        print_leaf_node(node);
+      } else {
+       
+        int i 	= 0;
+        int num = node->u.index->num;
+        
+        print_index_node(node);
 
-    if (start > end)
-        return (-1);
-    
-    mid = (start + end)/2;
-    if (keys[mid] == key) {
-        return (mid);
-    }
+        /* index node has num + 1 child pointers */
+        for (i = 0 ; i <= num; i++) {
+          enqueue(q, (node->u.index->child[i]));
+        }
+      }
 
-    if (key < keys[mid]) {
-        return (search_key_index_in_keys(keys, key, start, mid - 1));
-    } else {
-        return (search_key_index_in_keys(keys, key, mid + 1, end));
+      count--;
     }
+    
+    printf("\n");
+  }
 
-    return (-1);
+  free(q);
 }
 
-static int
-search_key_index_in_pairs (pair_t *pairs,
-                      int key,
-                      int start, int end)
+/*
+ * Function to print the b+ tree in level order
+ */
+void
+print_tree (bplus_tree_t *tree)
 {
-    int mid = 0;
-
-    if (start > end)
-        return (-1);
-    
-    mid = (start + end)/2;
-    if (pairs[mid].key == key) {
-        return (mid);
-    }
+  if (!tree) {
+    return;
+  }
 
-    if (key < pairs[mid].key) {
-        return (search_key_index_in_pairs(pairs, key, start, mid - 1));
-    } else {
-        return (search_key_index_in_pairs(pairs, key, mid + 1, end));
-    }
+  print_tree_util (tree->root);
+  printf("\n");
 
-    return (-1);
+  return;
 }
 
-static int
-search_child_index_in_children (void **child,
-                                void *key,
-                                int start, int end)
-{
-    int i = 0;
-
-    while (child[i] != key)
-      i++;
 
-    return (i);
-}
+/************************************
+ * create/delete b plus tree node   *
+ ************************************/
 
-static bool
-node_has_keys (bplus_tree_node_t *node)
+/*
+ * take a leaf out of the doubly link list.
+ * The leaf keeps its own prev/next so that a reader
+ * which is still standing on it can move on
+ */
+static void
+bplus_tree_unlink_leaf_node (leaf_node_t *lnode)
 {
-  if (node->is_leaf)
-    return (node->u.leaf->num);
-  else
-    return (node->u.index->num);
-}
+    bplus_tree_node_t *next = NULL;
+    bplus_tree_node_t *prev = NULL;
 
-bplus_tree_node_t *
-get_first_child (bplus_tree_node_t *node)
-{
-  if (node->is_leaf)
-    return (NULL);
+    if (!lnode)
+        return;
 
-  return (node->u.index->child[0]);
+    /* preserver the doubly link list */
+    next = lnode->next;
+    if (next != NULL)  
+        next->u.leaf->prev = lnode->prev;  
+  
+    prev = lnode->prev;
+    if (prev != NULL)  
+        prev->u.leaf->next = lnode->next;   
 }
 
+/*
+ * free a leaf node
+ */
 static void
-adjust_leaf_node (bplus_tree_node_t *node,
-                  int key)
+bplus_tree_delete_leaf_node (leaf_node_t *lnode)
 {
-  int i 		= 0;
-  int index 	= 0;
-  int num 		= 0;
-  pair_t *pairs = NULL;
+    if (!lnode)
+        return;
 
-  if (!node->is_leaf) {
-    printf("%s: Error: non leaf node", __FUNCTION__);
-    return;
-  }
+    if (lnode->pairs)
+        node_free(lnode->pairs);
 
-  /*
-   * delete the key, value pair
-   * and adjust the rest of the pairs accordingly
-   */
+    if (lnode->packed) {
+        node_free(lnode->deltas);
+        node_free(lnode->values);
+    }
 
-  /* adjust the keys */
-  num = node->u.leaf->num;
-  pairs = node->u.leaf->pairs;
-  index = search_key_index_in_pairs(pairs, key, 0, num - 1);
-  if (index == -1)
+    node_free(lnode);
+    lnode = NULL;
     return;
+}
 
-  for (i = index; i < num; i++) {
-    pairs[i] = pairs[i + 1];
-  }
+/*
+ * create a leaf node
+ */
+static leaf_node_t *
+bplus_tree_create_leaf_node (bplus_tree_t *tree)
+{
+    leaf_node_t *new_lnode;
 
-  /* node has one less key */
-  node->u.leaf->num--;
+    new_lnode = node_alloc(ARENA_LEAF, sizeof(leaf_node_t));
+    if (!new_lnode) {
+        printf("%s>Error: could not create index node", __FUNCTION__);
+        return (NULL);
+    }
 
-  return;
+    memset(new_lnode, 0, sizeof(leaf_node_t));
+    new_lnode->prev = NULL;
+    new_lnode->next = NULL;
+    new_lnode->num 	= 0;
+
+    /*
+     * allocate an array for the <kev, value> pair
+     */
+    new_lnode->pairs = node_alloc(ARENA_LEAF, tree->order * sizeof(pair_t));
+    if (!new_lnode->pairs) {
+        printf("%s>Error: Could not create pairs\n", __FUNCTION__);
+        node_free(new_lnode);
+        return (NULL);
+    }
+    
+    return (new_lnode);
 }
 
+/*
+ * free index node
+ */
 static void
-adjust_index_node (bplus_tree_node_t *node,
-                   bplus_tree_node_t *child,
-                   int key)
+bplus_tree_delete_index_node (index_node_t *inode)
 {
-  int i 			= 0;
-  int index 		= 0;
-  int num 			= 0;
-  int *keys 		= NULL;
-  void **children 	= NULL;
+    if (!inode)
+        return;
 
-  if (node->is_leaf) {
-    printf("%s: Error: leaf node\n", __FUNCTION__);
-    return;
-  }
+    if (inode->keys)
+        node_free(inode->keys);
 
-  /* adjust the keys */
-  num 	= node->u.index->num;
-  keys 	= node->u.index->keys;
-  index = search_key_index_in_keys(keys, key, 0, num - 1);
-  if (index == -1)
-    return;
+    if (inode->child)
+        node_free(inode->child);
 
-  for (i = index; i < num; i++) {
-    keys[i] = keys[i + 1];
-  }
-  
-  /* adjust the child pointers */
-  num 		= node->u.index->num + 1; //one more child then keys
-  children 	= node->u.index->child;
-  index 	= search_child_index_in_children(children, child, 0, num -1);
-  if (index == -1) {
-    return;
-  }
-  
-  for (i = index; i < num; i++) {
-    children[i] = children[i + 1];
-  }
+    if (inode->buf.msgs)
+        free(inode->buf.msgs);
 
-  /* node has one less key */
-  node->u.index->num--;
-  return;
+    node_free(inode);
+    inode = NULL;
+    return;
 }
 
-static void
-adjust_node (bplus_tree_node_t *node,
-             bplus_tree_node_t *child,
-             int key)
+/*
+ * create an index node
+ */
+static index_node_t *
+bplus_tree_create_index_node (bplus_tree_t *tree)
 {
-  if (node->is_leaf)
-    adjust_leaf_node(node, key);
-  else
-    adjust_index_node(node, child, key);
-}
+    index_node_t *new_inode = NULL;
 
-static bplus_tree_node_t *
-modify_root (bplus_tree_node_t *root)
-{
-  bplus_tree_node_t *new_root = NULL;
+    new_inode = node_alloc(ARENA_INDEX, sizeof(index_node_t));
+    if (!new_inode) {
+        printf("%s>Error: could not create index node", __FUNCTION__);
+        return (NULL);
+    }
 
-  if (!root)
-    return (NULL);
+    memset(new_inode, 0, sizeof(index_node_t));
+    new_inode->num = 0;
 
-  /*
-   * if there are keys;
-   * return root as is
-   */
-  if (node_has_keys(root))
-    return (root);
+    /*
+     * allocate arrays for keys
+     */
+    new_inode->keys = node_alloc(ARENA_INDEX, tree->order * sizeof(bplus_key_t));
+    if (!new_inode->keys) {
+        printf("%s>Error: Could not allocate keys\n", __FUNCTION__);
+        node_free(new_inode);
+        return (NULL);
+    }
+    memset(new_inode->keys, 0, tree->order * sizeof(bplus_key_t));
+
+    
+    /*
+     * allocate child pointers
+     */
+    new_inode->child = node_alloc(ARENA_INDEX, tree->order * sizeof(void *));
+    if (!new_inode->child) {
+        printf("%s> Error: Could not allocate child pointers\n", __FUNCTION__);
+        node_free(new_inode->keys);
+        node_free(new_inode);
+        return (NULL);
+    }
+    memset(new_inode->child, 0, tree->order * sizeof(void *));
+
+    return (new_inode);
+}
+
+/*
+ * free a bplus tree node
+ */
+static void
+bplus_tree_delete_node (bplus_tree_node_t *node)
+{
+    if (!node)
+        return;
+
+    if (node->is_leaf) {
+        
+        bplus_tree_delete_leaf_node(node->u.leaf);
+    } else {
+        bplus_tree_delete_index_node(node->u.index);
+    }
+
+    node_free(node);
+}
+
+/*
+ * epoch_retire() destructor for tree nodes
+ */
+static void
+bplus_tree_free_node (void *node)
+{
+    bplus_tree_delete_node((bplus_tree_node_t *)node);
+}
+
+/*
+ * a node has been removed from the tree;
+ * unlink it and hand it over to EBR.
+ * It is freed once all the readers have moved on
+ */
+static void
+bplus_tree_retire_node (bplus_tree_t *tree,
+                        bplus_tree_node_t *node)
+{
+    if (!node)
+        return;
+
+    if (node->is_leaf) {
+        bplus_tree_unlink_leaf_node(node->u.leaf);
+        tree->num_leafs--;
+    } else {
+        tree->num_index--;
+    }
+
+    epoch_retire(&bplus_epoch, node, bplus_tree_free_node);
+}
+
+/*
+ * a pair is being overwritten or deleted;
+ * hand its out of line value (if any) over to EBR
+ */
+static void
+bplus_pair_release_value (pair_t *pair)
+{
+    if (!(pair->flags & BPLUS_PAIR_BLOB))
+        return;
+
+    epoch_retire(&bplus_epoch, (void *)(uintptr_t)pair->data.blob, free);
+    pair->flags &= ~BPLUS_PAIR_BLOB;
+}
+
+/*
+ * create a bplus tree node
+ */
+static bplus_tree_node_t *
+bplus_tree_create_node (bplus_tree_t *tree,
+                        bool is_leaf)
+{
+    bplus_tree_node_t *new_node = NULL;
+
+    new_node = node_alloc(is_leaf ? ARENA_LEAF : ARENA_INDEX, sizeof(bplus_tree_node_t));
+    if (!new_node) {
+        printf("%s>Error: could not allocate memory for new node\n", __FUNCTION__);
+        return (NULL);
+    }
+
+    memset(new_node, 0, sizeof(bplus_tree_node_t));
+    new_node->is_leaf = is_leaf;
+
+    if (is_leaf) {
+
+        /*
+         * this is a leaf node,
+         * allocate memory for the same
+         */
+        new_node->u.leaf = bplus_tree_create_leaf_node(tree);
+        if (!new_node->u.leaf) {
+            
+            printf("%s>Error: could not create leaf node\n", __FUNCTION__);
+            node_free(new_node);
+            return (NULL);
+        }
+    } else {
+
+        /*
+         * this is a index node,
+         * allocate memory for the same
+         */
+        new_node->u.index = bplus_tree_create_index_node(tree);
+        if (!new_node->u.index) {
+            
+            printf("%s>Error: could not create leaf node\n", __FUNCTION__);
+            node_free(new_node);
+            return (NULL);
+        }
+    }
+
+    if (is_leaf)
+        tree->num_leafs++;
+    else
+        tree->num_index++;
+   
+    return (new_node);
+}
+
+/*
+ * free the memory of the allocated b tree
+ */
+void
+bplus_tree_delete(bplus_tree_t **tree)
+{
+    if (!*tree)
+        return;
+
+    if (!is_tree_empty(*tree)) {
+        printf("%sError: trying to free a non-empty tree\n", __FUNCTION__);
+        return;
+    }
+    
+    free(*tree);
+    *tree = NULL;
+}
+
+/*
+ * create a b plus tree
+ * @param order     order of the tree (m in m-way tree)
+ * @return pointer to the newly created b plus tree
+ */
+bplus_tree_t *
+bplus_tree_create (int order)
+{
+    bplus_tree_t *new_tree = NULL;
+
+    new_tree = malloc(sizeof(bplus_tree_t));
+    if (!new_tree) {
+        printf("%s>Error: Could not allocate memory for b-plus tree\n", __FUNCTION__);
+        return (NULL);
+    }
+
+    memset(new_tree, 0, sizeof(bplus_tree_t));
+    new_tree->order 		= order;
+    new_tree->fill_factor 	= BPLUS_FILL_FACTOR;
+    new_tree->root 		= NULL;
+
+    return (new_tree);
+}
+
+/*
+ * set the fill factor used by append splits
+ * @param fill_factor   percent of the node kept on the left (50 - 100)
+ */
+void
+bplus_tree_set_fill_factor (bplus_tree_t *tree,
+                            int fill_factor)
+{
+    if (!tree)
+        return;
+
+    if (fill_factor < 50 || fill_factor > 100) {
+        printf("%s: Error: fill factor %d is not in 50 - 100\n", __FUNCTION__, fill_factor);
+        return;
+    }
+
+    tree->fill_factor = fill_factor;
+}
+
+/*
+ * number of entries to keep in the left node when a full node splits
+ * @param max       entries the left node may keep at most
+ * @param append    the split is caused by an insert at the right end of the tree
+ */
+static int
+split_point (bplus_tree_t *tree,
+             int max,
+             bool append)
+{
+    int split = tree->order / 2;
+    int fill = 0;
+
+    if (!append)
+        return (split);
+
+    fill = ((tree->order - 1) * tree->fill_factor) / 100;
+    if (fill > max)
+        fill = max;
+    if (fill > split)
+        split = fill;
+
+    return (split);
+}
+
+/*
+ * is every node on the path in its rightmost slot,
+ * i.e. the path leads to the right edge of the tree
+ */
+static bool
+path_is_rightmost (bplus_path_t *path)
+{
+    int i = 0;
+
+    for (i = 0; i < path->depth; i++) {
+        if (path->slot[i] != path->node[i]->u.index->num)
+            return (false);
+    }
+
+    return (true);
+}
+
+/*******************
+ * Message buffers *
+ *******************/
+
+/*
+ * make room for num messages in buf
+ */
+static bool
+msg_buffer_reserve (bplus_tree_t *tree,
+                    bplus_msg_buffer_t *buf,
+                    int num)
+{
+    int cap 	= 0;
+    pair_t *msgs = NULL;
+
+    if (num <= buf->cap)
+        return (true);
+
+    cap = buf->cap ? buf->cap : (tree->buffer_size ? tree->buffer_size : 8);
+    while (cap < num)
+        cap *= 2;
+
+    msgs = realloc(buf->msgs, cap * sizeof(pair_t));
+    if (!msgs) {
+        printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+        return (false);
+    }
+
+    buf->msgs 	= msgs;
+    buf->cap 	= cap;
+    return (true);
+}
+
+/*
+ * merge the appended messages into the sorted part;
+ * of several messages for one key the newest survives
+ */
+static void
+msg_buffer_sort (bplus_tree_t *tree,
+                 bplus_msg_buffer_t *buf)
+{
+    int i 		= 0;
+    int j 		= 0;
+    int n 		= 0;
+    int w 		= 0;
+    pair_t log[BPLUS_MSG_LOG];
+
+    while (buf->sorted < buf->num) {
+
+        /*
+         * take out the next BPLUS_MSG_LOG messages of the log and
+         * insertion sort them; it is stable so newer stays after older
+         */
+        n = 0;
+        for (i = buf->sorted; i < buf->num && n < BPLUS_MSG_LOG; i++) {
+
+            for (j = n; j > 0 && BPLUS_KEY_LT(buf->msgs[i].key, log[j - 1].key); j--)
+                log[j] = log[j - 1];
+            log[j] = buf->msgs[i];
+            n++;
+
+            /* an older message for the same key is dropped */
+            if (j > 0 && BPLUS_KEY_EQ(log[j - 1].key, log[j].key)) {
+                bplus_pair_release_value(&log[j - 1]);
+                bplus_key_release(tree, log[j - 1].key);
+                memmove(&log[j - 1], &log[j], (n - j) * sizeof(pair_t));
+                n--;
+            }
+        }
+        memmove(&buf->msgs[buf->sorted + n], &buf->msgs[i], (buf->num - i) * sizeof(pair_t));
+        buf->num -= i - buf->sorted - n;
+
+        /*
+         * merge from the back into msgs[0, sorted + n);
+         * on equal keys the log entry is the newer one
+         */
+        i = buf->sorted - 1;
+        j = n - 1;
+        w = buf->sorted + n - 1;
+        while (j >= 0) {
+
+            if (i >= 0 && BPLUS_KEY_LT(log[j].key, buf->msgs[i].key)) {
+                buf->msgs[w--] = buf->msgs[i--];
+                continue;
+            }
+
+            if (i >= 0 && BPLUS_KEY_EQ(log[j].key, buf->msgs[i].key)) {
+                bplus_pair_release_value(&buf->msgs[i]);
+                bplus_key_release(tree, buf->msgs[i--].key);
+            }
+            buf->msgs[w--] = log[j--];
+        }
+
+        /* dropped duplicates leave a gap between msgs[i] and msgs[w + 1] */
+        n = (i + 1) + (buf->sorted + n - 1 - w);
+        if (w > i) {
+            memmove(&buf->msgs[i + 1], &buf->msgs[w + 1],
+                    (buf->num - w - 1) * sizeof(pair_t));
+            buf->num -= w - i;
+        }
+        buf->sorted = n;
+    }
+}
+
+/*
+ * index of the first message in the sorted part whose key is >= key
+ */
+static int
+msg_buffer_lower_bound (bplus_msg_buffer_t *buf,
+                        bplus_key_t key)
+{
+    int start 	= 0;
+    int end 	= buf->sorted;
+    int mid 	= 0;
+
+    while (start < end) {
+        mid = (start + end) / 2;
+        if (BPLUS_KEY_LT(buf->msgs[mid].key, key))
+            start = mid + 1;
+        else
+            end = mid;
+    }
+
+    return (start);
+}
+
+/*
+ * the pending message for key, NULL if there is none
+ */
+static pair_t *
+msg_buffer_find (bplus_msg_buffer_t *buf,
+                 bplus_key_t key)
+{
+    int i = 0;
+
+    if (!buf->num)
+        return (NULL);
+
+    /* the log is newer than the sorted part */
+    for (i = buf->num - 1; i >= buf->sorted; i--) {
+        if (BPLUS_KEY_EQ(buf->msgs[i].key, key))
+            return (&buf->msgs[i]);
+    }
+
+    i = msg_buffer_lower_bound(buf, key);
+    if (i == buf->sorted || !BPLUS_KEY_EQ(buf->msgs[i].key, key))
+        return (NULL);
+
+    return (&buf->msgs[i]);
+}
+
+/*
+ * add a message; it replaces an older message for the same key
+ */
+static bool
+msg_buffer_put (bplus_tree_t *tree,
+                bplus_msg_buffer_t *buf,
+                const pair_t *msg)
+{
+    if (!msg_buffer_reserve(tree, buf, buf->num + 1))
+        return (false);
+
+    buf->msgs[buf->num++] = *msg;
+    if (buf->num - buf->sorted >= BPLUS_MSG_LOG)
+        msg_buffer_sort(tree, buf);
+
+    return (true);
+}
+
+/*
+ * move messages [start, end) of src into dst.
+ * They are newer than anything already in dst.
+ * Unless the whole buffer moves src must be sorted
+ */
+static void
+msg_buffer_move (bplus_tree_t *tree,
+                 bplus_msg_buffer_t *src,
+                 bplus_msg_buffer_t *dst,
+                 int start, int end)
+{
+    int i = 0;
+
+    if (start >= end)
+        return;
+
+    for (i = start; i < end; i++) {
+        if (!msg_buffer_put(tree, dst, &src->msgs[i]))
+            printf("%s: Error: message dropped\n", __FUNCTION__);
+    }
+
+    memmove(&src->msgs[start], &src->msgs[end], (src->num - end) * sizeof(pair_t));
+    src->num 	-= end - start;
+    src->sorted = src->num;
+}
+
+/*
+ * move the messages of src with key >= key into dst
+ */
+static void
+msg_buffer_move_from (bplus_tree_t *tree,
+                      bplus_msg_buffer_t *src,
+                      bplus_msg_buffer_t *dst,
+                      bplus_key_t key)
+{
+    msg_buffer_sort(tree, src);
+    msg_buffer_move(tree, src, dst, msg_buffer_lower_bound(src, key), src->num);
+}
+
+/*
+ * move the messages of src with key < key into dst
+ */
+static void
+msg_buffer_move_below (bplus_tree_t *tree,
+                       bplus_msg_buffer_t *src,
+                       bplus_msg_buffer_t *dst,
+                       bplus_key_t key)
+{
+    msg_buffer_sort(tree, src);
+    msg_buffer_move(tree, src, dst, 0, msg_buffer_lower_bound(src, key));
+}
+
+/***************************
+ * Negative lookup filter  *
+ ***************************/
+static void
+bplus_filter_free (void *ptr)
+{
+  bplus_filter_t *filter = ptr;
+
+  free((void *)filter->words);
+  free(filter);
+}
+
+#if !defined(BPLUS_KEY_TYPE) || defined(BPLUS_KEY_HASH)
+
+static inline uint64_t
+filter_mix (uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return (x);
+}
+
+/*
+ * 64 bit hash of a key; keys which compare equal hash equal
+ */
+static inline uint64_t
+bplus_key_hash (bplus_key_t key)
+{
+#if defined(BPLUS_KEY_TYPE)
+  return ((uint64_t)BPLUS_KEY_HASH(key));
+#elif defined(BPLUS_KEY_STRING)
+  uint32_t i 		= 0;
+  uint64_t h 		= key.prefix ^ ((uint64_t)key.len << 56);
+  uint64_t word 	= 0;
+  const uint8_t *bytes 	= NULL;
+
+  /* the prefix holds the first 8 bytes, fold in the rest 8 at a time */
+  if (key.len > 8) {
+    bytes = key.ext;
+    for (i = 8; i < key.len; i += 8) {
+      word = 0;
+      memcpy(&word, bytes + i, (key.len - i < 8) ? key.len - i : 8);
+      h = filter_mix(h) ^ word;
+    }
+  }
+  return (filter_mix(h));
+#elif defined(BPLUS_KEY_UINT128)
+  return (filter_mix((uint64_t)key ^ filter_mix((uint64_t)(key >> 64))));
+#else
+  return (filter_mix((uint64_t)key));
+#endif
+}
+
+/*
+ * block of a key, picked by the high bits of its hash
+ */
+static inline _Atomic uint64_t *
+filter_block (const bplus_filter_t *filter,
+              uint64_t h)
+{
+  uint64_t block = (uint64_t)(((unsigned __int128)h * filter->num_blocks) >> 64);
+
+  return (&filter->words[block * BPLUS_FILTER_BLOCK_WORDS]);
+}
+
+/*
+ * each probe takes 9 bits of a second hash: a word of the block and a bit in it.
+ * Readers probe the words while we set bits
+ */
+static inline void
+bplus_filter_add (bplus_filter_t *filter,
+                  bplus_key_t key)
+{
+  int i 			= 0;
+  uint64_t h 			= bplus_key_hash(key);
+  uint64_t bits 		= filter_mix(h + 0x9e3779b97f4a7c15ULL);
+  _Atomic uint64_t *block 	= filter_block(filter, h);
+
+  for (i = 0; i < filter->probes; i++, bits >>= 9)
+    atomic_fetch_or_explicit(&block[(bits >> 6) & 7], 1ULL << (bits & 63),
+                             memory_order_relaxed);
+}
+
+/*
+ * @return false if the key is certainly not in the tree
+ */
+static inline bool
+bplus_filter_may_contain (const bplus_filter_t *filter,
+                          bplus_key_t key)
+{
+  int i 			= 0;
+  uint64_t h 			= bplus_key_hash(key);
+  uint64_t bits 		= filter_mix(h + 0x9e3779b97f4a7c15ULL);
+  _Atomic uint64_t *block 	= filter_block(filter, h);
+
+  for (i = 0; i < filter->probes; i++, bits >>= 9) {
+    if (!(atomic_load_explicit(&block[(bits >> 6) & 7], memory_order_relaxed) &
+          (1ULL << (bits & 63))))
+      return (false);
+  }
+
+  return (true);
+}
+
+/*
+ * empty filter for capacity keys
+ */
+static bplus_filter_t *
+bplus_filter_create (long capacity,
+                     int bits_per_key)
+{
+  size_t bytes 			= 0;
+  bplus_filter_t *filter 	= NULL;
+
+  filter = calloc(1, sizeof(bplus_filter_t));
+  if (!filter) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    return (NULL);
+  }
+
+  if (capacity < BPLUS_FILTER_MIN_KEYS)
+    capacity = BPLUS_FILTER_MIN_KEYS;
+
+  /* k = ln 2 * bits per key is best; 7 probes use 63 bits of the hash */
+  filter->bits_per_key 	= bits_per_key;
+  filter->probes 	= (bits_per_key * 69 + 50) / 100;
+  filter->probes 	= (filter->probes < 1) ? 1 : (filter->probes > 7) ? 7 : filter->probes;
+  filter->capacity 	= capacity;
+  filter->num_blocks 	= ((uint64_t)capacity * bits_per_key + 511) / 512;
+
+  bytes 		= filter->num_blocks * BPLUS_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+  filter->words 	= aligned_alloc(64, bytes);
+  if (!filter->words) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    free(filter);
+    return (NULL);
+  }
+
+  /* no reader sees it before it is swapped in */
+  memset((void *)filter->words, 0, bytes);
+
+  return (filter);
+}
+
+/*
+ * keys in and below node, buffered messages and tombstones included
+ */
+static long
+filter_count_node (bplus_tree_node_t *node)
+{
+  int i 	= 0;
+  long count 	= 0;
+
+  if (node->is_leaf)
+    return (node->u.leaf->num);
+
+  count = node->u.index->buf.num;
+  for (i = 0; i <= node->u.index->num; i++)
+    count += filter_count_node(node->u.index->child[i]);
+
+  return (count);
+}
+
+/*
+ * add the live keys in and below node; an insert still buffered
+ * on the way down is as much in the tree as one in a leaf
+ */
+static void
+filter_add_node (bplus_filter_t *filter,
+                 bplus_tree_node_t *node)
+{
+  int i 		= 0;
+  leaf_node_t *leaf 	= NULL;
+  index_node_t *index 	= NULL;
+
+  if (node->is_leaf) {
+    leaf = node->u.leaf;
+    for (i = 0; i < leaf->num; i++) {
+      if (!leaf_pair_dead(leaf, i))
+        bplus_filter_add(filter, leaf_key_at(leaf, i));
+    }
+    return;
+  }
+
+  index = node->u.index;
+  for (i = 0; i < index->buf.num; i++) {
+    if (!(index->buf.msgs[i].flags & BPLUS_PAIR_DEAD))
+      bplus_filter_add(filter, index->buf.msgs[i].key);
+  }
+  for (i = 0; i <= index->num; i++)
+    filter_add_node(filter, index->child[i]);
+}
+
+/*
+ * build a filter from the keys of the tree, sized for twice as many,
+ * and swap it in; readers may still be probing the old one
+ */
+static bool
+bplus_filter_rebuild (bplus_tree_t *tree,
+                      int bits_per_key)
+{
+  int i 		= 0;
+  long count 		= tree->orphans.num;
+  bplus_filter_t *old 	= tree->filter;
+  bplus_filter_t *filter = NULL;
+
+  if (tree->root)
+    count += filter_count_node(tree->root);
+
+  filter = bplus_filter_create(2 * count, bits_per_key);
+  if (!filter)
+    return (false);
+
+  if (tree->root)
+    filter_add_node(filter, tree->root);
+  for (i = 0; i < tree->orphans.num; i++) {
+    if (!(tree->orphans.msgs[i].flags & BPLUS_PAIR_DEAD))
+      bplus_filter_add(filter, tree->orphans.msgs[i].key);
+  }
+  filter->num_added = count;
+
+  tree->filter = filter;
+  if (old)
+    epoch_retire(&bplus_epoch, old, bplus_filter_free);
+
+  return (true);
+}
+
+/*
+ * account an insert (or update) of key; the filter is rebuilt
+ * bigger once more keys went in than it was sized for
+ */
+static inline void
+bplus_filter_insert (bplus_tree_t *tree,
+                     bplus_key_t key)
+{
+  bplus_filter_t *filter = tree->filter;
+
+  if (!filter)
+    return;
+
+  bplus_filter_add(filter, key);
+  if (++filter->num_added > filter->capacity &&
+      !bplus_filter_rebuild(tree, filter->bits_per_key)) {
+
+    /* keep the full filter, it only gets less selective */
+    filter->capacity *= 2;
+  }
+}
+
+/*
+ * account a key removed from the leaves; its bits stay set
+ */
+static inline void
+bplus_filter_removed (bplus_tree_t *tree)
+{
+  if (tree->filter)
+    tree->filter->num_deleted++;
+}
+
+/*
+ * after a delete: rebuild once the bits of removed keys pile up.
+ * Not while a flush holds messages outside the buffers
+ */
+static inline void
+bplus_filter_delete (bplus_tree_t *tree)
+{
+  bplus_filter_t *filter = tree->filter;
+
+  if (filter && filter->num_deleted > filter->capacity / 4 &&
+      !bplus_filter_rebuild(tree, filter->bits_per_key))
+    filter->num_deleted = 0;
+}
+
+#else
+static inline bool
+bplus_filter_may_contain (const bplus_filter_t *filter,
+                          bplus_key_t key)
+{
+  (void)filter;
+  (void)key;
+  return (true);
+}
+
+static inline void
+bplus_filter_insert (bplus_tree_t *tree,
+                     bplus_key_t key)
+{
+  (void)tree;
+  (void)key;
+}
+
+static inline void
+bplus_filter_removed (bplus_tree_t *tree)
+{
+  (void)tree;
+}
+
+static inline void
+bplus_filter_delete (bplus_tree_t *tree)
+{
+  (void)tree;
+}
+#endif
+
+/*
+ * put a Bloom filter in front of the point lookups of the tree,
+ * so most searches for absent keys skip the descent
+ * @param bits_per_key  filter bits per key, about 1% false positives
+ *                      at 10; 0 drops the filter
+ */
+void
+bplus_tree_set_filter (bplus_tree_t *tree,
+                       int bits_per_key)
+{
+  if (!tree)
+    return;
+
+  if (bits_per_key < 0 || bits_per_key > 64) {
+    printf("%s: Error: %d bits per key is not in 0 - 64\n", __FUNCTION__, bits_per_key);
+    return;
+  }
+
+  if (!bits_per_key) {
+    epoch_retire(&bplus_epoch, tree->filter, bplus_filter_free);
+    tree->filter = NULL;
+    return;
+  }
+
+#if defined(BPLUS_KEY_TYPE) && !defined(BPLUS_KEY_HASH)
+  printf("%s: Error: define BPLUS_KEY_HASH to filter custom keys\n", __FUNCTION__);
+#else
+  bplus_filter_rebuild(tree, bits_per_key);
+#endif
+}
+
+/********************************
+ * Search a key from bplus tree *
+ ********************************/
+
+/*
+ * utility function to get the correct child pointer
+ */
+static int
+get_child_index_util (bplus_key_t *a,
+		      bplus_key_t key,
+                      int start, int end)
+{
+    int mid = 0;
+
+    INSTR_ADD(compares, 1 + (end > start ? 32 - __builtin_clz(end - start) : 0));
+
+    /* a lock-free reader may see a node emptied by a merge, end < start */
+    while (start < end) {
+	mid = (start + end) / 2;
+	if (BPLUS_KEY_LE(a[mid], key)) {
+	    start = mid + 1;
+	} else {
+	    end = mid;
+	}
+    }
+    
+    if (BPLUS_KEY_LE(a[start], key)) {
+      return (++start);
+    }
+    return (start);
+}
+
+/*
+ * helper to get the child pointer for a key
+ */
+static int
+get_child_index (bplus_tree_node_t *node, bplus_key_t key)
+{
+    if (node->is_leaf) {
+        printf("%s>Error: Invalid node type\n", __FUNCTION__);
+    }
+
+    INSTR_ADD(node_visits, 1);
+    return (get_child_index_util(node->u.index->keys, key,
+                                 0, node->u.index->num - 1));
+}
+
+/*
+ * Binary Serach for searching within a leaf node
+ */
+static int
+binary_search (pair_t *pairs,
+               bplus_key_t key,
+               pair_t *pair,
+               int start, int end)
+{
+    int mid = 0;
+
+    if (start > end)
+        return (-1);
+    
+    INSTR_ADD(compares, 1);
+    mid = (start + end)/2;
+    if (BPLUS_KEY_EQ(pairs[mid].key, key)) {
+        if (pair)
+            *pair = pairs[mid];
+        return (mid);
+    }
+
+    if (BPLUS_KEY_LT(key, pairs[mid].key)) {
+        return (binary_search(pairs, key, pair, start, mid - 1));
+    } else {
+        return (binary_search(pairs, key, pair, mid + 1, end));
+    }
+
+    return (-1);
+}
+
+/*
+ * utility function to search a key within a leaf node;
+ * the matching pair is copied to pair (if not NULL)
+ */
+static int
+bplus_tree_search_in_leaf (bplus_tree_node_t *node,
+                           bplus_key_t key,
+                           pair_t *pair)
+{
+    int i = 0;
+
+    if (!node->is_leaf) {
+        printf("%s> Error: node is not a leaf\n", __FUNCTION__);
+        return (-1);
+    }
+
+    INSTR_ADD(node_visits, 1);
+    if (node->u.leaf->packed) {
+        i = packed_leaf_lower_bound(node->u.leaf, key);
+        if (i == node->u.leaf->num || !BPLUS_KEY_EQ(leaf_key_at(node->u.leaf, i), key))
+            return (-1);
+
+        if (pair) {
+            pair->key 	= key;
+            pair->flags = 0;
+            pair->data 	= node->u.leaf->values[i];
+        }
+        return (i);
+    }
+
+    return binary_search(node->u.leaf->pairs,
+                         key, pair, 0,
+                         node->u.leaf->num - 1);
+}
+
+/*
+ * utility function to search a key in the giveb b+ tree.
+ * first get to the root in which the key might reside.
+ * Then search for the key in that root
+ */
+static bool
+bplus_tree_search_key_internal(bplus_tree_node_t *root,
+                               bplus_key_t key,
+                               pair_t *pair)
+{
+    int index = 0; /* index of child pointer where the key will  */
+    pair_t *msg = NULL;
+
+    if (!root) {
+        return (false);
+    }
+
+    //print_node(root);
+
+    if (root->is_leaf) {
+        index = bplus_tree_search_in_leaf(root, key, pair);
+        if (index == -1 || leaf_pair_dead(root->u.leaf, index)) {
+          return (false);
+        } else {
+          return (true);
+        }
+    }
+
+    /* a pending message is newer than anything below it */
+    msg = msg_buffer_find(&root->u.index->buf, key);
+    if (msg) {
+        if (msg->flags & BPLUS_PAIR_DEAD)
+          return (false);
+        if (pair)
+          *pair = *msg;
+        return (true);
+    }
+
+    index = get_child_index(root, key);
+    return (bplus_tree_search_key_internal(root->u.index->child[index],
+                                           key, pair));
+}
+
+/*
+ * root to descend from: the index levels replicated on our
+ * NUMA node if they are current, else the tree itself.
+ * Buffered trees keep messages in the index nodes and are not replicated
+ */
+static bplus_tree_node_t *
+bplus_tree_search_root (bplus_tree_t *tree)
+{
+    if (!tree->num_replicas || tree->replica_gen != tree->index_gen ||
+        tree->buffer_size)
+        return (tree->root);
+
+    return (tree->replica[numa_current_node() % tree->num_replicas]);
+}
+
+/*
+ * search a key and copy out its pair
+ */
+static bool
+bplus_tree_search_pair (bplus_tree_t *tree,
+                        bplus_key_t key,
+                        pair_t *pair)
+{
+    bool found 			= false;
+    const bplus_filter_t *filter 	= NULL;
+    INSTR_START(start);
+
+    /*
+     * nodes merged away while we descend stay valid
+     * until we leave the read side critical section
+     */
+    if (!bplus_tree_reader_enter())
+        return (false);
+
+    filter = tree->filter;
+    if (filter && !bplus_filter_may_contain(filter, key)) {
+        bplus_tree_reader_exit();
+        INSTR_ADD(filter_rejects, 1);
+        INSTR_END(BPLUS_OP_SEARCH, start);
+        return (false);
+    }
+
+    INSTR_ADD(descents, 1);
+    found = bplus_tree_search_key_internal(bplus_tree_search_root(tree), key, pair);
+    bplus_tree_reader_exit();
+    INSTR_END(BPLUS_OP_SEARCH, start);
+
+    return (found);
+}
+
+/*
+ *  search a key in b plus tree
+ *  @param tree bplus tree
+ *  @paramm key key to search
+ *  @param data data to be filled
+ *  @return true - if key is present in the tree
+ *  @return false - if key is not present in the tree
+ */
+bool
+bplus_tree_search_key (bplus_tree_t *tree,
+                       bplus_key_t key,
+                       double *data)
+{
+    pair_t pair;
+
+    if (!tree) {
+        printf("%s> Error: Invalid tree\n", __FUNCTION__);
+        return -1;
+    }
+
+    if (!data) {
+        printf("%s>Error: Invalid data ", __FUNCTION__);
+        return (false);
+    }
+
+    *data = -1;
+    if (!bplus_tree_search_pair(tree, key, &pair))
+        return (false);
+
+    *data = pair.data.num;
+    return (true);
+}
+
+/*
+ *  search a key and copy its inline value
+ *  @param value BPLUS_VALUE_SIZE bytes to be filled
+ *  @return true - if key is present in the tree
+ */
+bool
+bplus_tree_search_value (bplus_tree_t *tree,
+                         bplus_key_t key,
+                         bplus_value_t *value)
+{
+    pair_t pair;
+
+    if (!tree || !value) {
+        printf("%s> Error: Invalid args\n", __FUNCTION__);
+        return (false);
+    }
+
+    if (!bplus_tree_search_pair(tree, key, &pair))
+        return (false);
+
+    *value = pair.data;
+    return (true);
+}
+
+/*
+ *  search a key stored with bplus_tree_insert_blob()
+ *  @param len filled with the length of the value
+ *  @return the value in place (no copy); it stays valid
+ *          until the key is updated or deleted, so a caller
+ *          racing with writers must hold off the writers
+ *          (e.g. a read lock) for as long as it uses the value.
+ *          NULL if the key is absent or has an inline value
+ */
+const void *
+bplus_tree_search_blob (bplus_tree_t *tree,
+                        bplus_key_t key,
+                        size_t *len)
+{
+    pair_t pair;
+    bplus_blob_t *blob = NULL;
+
+    if (!tree || !len) {
+        printf("%s> Error: Invalid args\n", __FUNCTION__);
+        return (NULL);
+    }
+
+    if (!bplus_tree_search_pair(tree, key, &pair) ||
+        !(pair.flags & BPLUS_PAIR_BLOB))
+        return (NULL);
+
+    blob = (bplus_blob_t *)(uintptr_t)pair.data.blob;
+    *len = blob->len;
+    return (blob->data);
+}
+
+/******************
+ * Range Serach   *
+ ******************/
+
+/*
+ * find the index of the key if found or
+ * get the index of next largest element
+ */
+int
+bplus_tree_range_search_find_index_in_leaf (pair_t *a,
+                                            bplus_key_t low_key,
+                                            int start, int end)
+{
+    int mid = 0;
+
+    while (start != end) {
+	
+	mid = (start + end) / 2;
+
+        if (BPLUS_KEY_EQ(a[mid].key, low_key)) {
+          return (mid);
+        }
+	
+        if (BPLUS_KEY_LE(a[mid].key, low_key)) {
+	    start = mid + 1;
+	} else {
+	    end = mid;
+	}
+    }
+    
+    if (BPLUS_KEY_LT(a[start].key, low_key)) {
+      return (++start);
+    }
+    
+    return (start);
+}
+
+/*
+ * state of a scan while it walks the tree
+ */
+typedef struct bplus_scan_t_ {
+  bplus_key_t 		low_key;
+  bplus_key_t 		high_key;
+  bool 			bounded;		/* high_key is valid */
+  bool 			stop;			/* fn said stop or we went past high_key */
+  long 			count;			/* pairs passed to fn */
+  bplus_scan_fn_t 	fn;
+  void 			*arg;
+} bplus_scan_t;
+
+/*
+ * hand one pair to the callback of the scan
+ */
+static void
+scan_emit (bplus_scan_t *scan,
+           bplus_key_t key,
+           const bplus_value_t *value,
+           uint8_t flags)
+{
+  if (scan->bounded && BPLUS_KEY_GT(key, scan->high_key)) {
+    scan->stop = true;
+    return;
+  }
+
+  scan->count++;
+  if (!scan->fn(key, value, flags, scan->arg))
+    scan->stop = true;
+}
+
+/*
+ * qsort order of pending messages: by key, the newer first.
+ * Later entries of a buffer are newer
+ */
+static int
+scan_msg_cmp (const void *a, const void *b)
+{
+  const pair_t *m1 = *(pair_t * const *)a;
+  const pair_t *m2 = *(pair_t * const *)b;
+
+  if (BPLUS_KEY_LT(m1->key, m2->key))
+    return (-1);
+  if (BPLUS_KEY_LT(m2->key, m1->key))
+    return (1);
+
+  return ((m1 < m2) ? 1 : (m1 > m2) ? -1 : 0);
+}
+
+/*
+ * merge the messages of node in the scanned range into the messages
+ * of its ancestors, which are newer; one message per key survives
+ * @return number of messages in *out, -1 if out of memory
+ */
+static int
+scan_merge_messages (bplus_scan_t *scan,
+                     bplus_tree_node_t *node,
+                     pair_t **up,
+                     int num_up,
+                     pair_t ***out)
+{
+  int i 		= 0;
+  int j 		= 0;
+  int n 		= 0;
+  int num 		= 0;
+  pair_t **own 		= NULL;
+  pair_t **merged 	= NULL;
+  bplus_msg_buffer_t *buf = &node->u.index->buf;
+
+  *out = up;
+  if (!buf->num)
+    return (num_up);
+
+  own 		= malloc(buf->num * sizeof(pair_t *));
+  merged 	= malloc((num_up + buf->num) * sizeof(pair_t *));
+  if (!own || !merged) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    free(own);
+    free(merged);
+    return (-1);
+  }
+
+  for (i = 0; i < buf->num; i++) {
+
+    if (BPLUS_KEY_LT(buf->msgs[i].key, scan->low_key) ||
+        (scan->bounded && BPLUS_KEY_GT(buf->msgs[i].key, scan->high_key)))
+      continue;
+    own[num++] = &buf->msgs[i];
+  }
+  qsort(own, num, sizeof(pair_t *), scan_msg_cmp);
+
+  /* on equal keys the ancestors' message wins, then the newest of ours */
+  i = j = 0;
+  while (i < num_up || j < num) {
+
+    if (j == num || (i < num_up && !BPLUS_KEY_GT(up[i]->key, own[j]->key))) {
+      while (j < num && BPLUS_KEY_EQ(own[j]->key, up[i]->key))
+        j++;
+      merged[n++] = up[i++];
+    } else {
+      merged[n++] = own[j++];
+      while (j < num && BPLUS_KEY_EQ(own[j]->key, merged[n - 1]->key))
+        j++;
+    }
+  }
+
+  free(own);
+  *out = merged;
+  return (n);
+}
+
+/*
+ * scan the pairs under node, merging the pending messages of its
+ * ancestors (msgs, sorted, one per key) into the pairs of the leaves
+ * as point search does
+ */
+static void
+scan_node (bplus_scan_t *scan,
+           bplus_tree_node_t *node,
+           pair_t **msgs,
+           int num_msgs)
+{
+  int i 		= 0;
+  int j 		= 0;
+  int c 		= 0;
+  int last 		= 0;
+  int num 		= 0;
+  pair_t **merged 	= NULL;
+  leaf_node_t *leaf 	= NULL;
+  index_node_t *index 	= NULL;
+
+  if (node->is_leaf) {
+
+    leaf = node->u.leaf;
+    if (leaf->num && leaf->packed)
+      i = packed_leaf_lower_bound(leaf, scan->low_key);
+    else if (leaf->num)
+      i = bplus_tree_range_search_find_index_in_leaf(leaf->pairs, scan->low_key,
+                                                     0, leaf->num - 1);
+
+    while (!scan->stop && (i < leaf->num || j < num_msgs)) {
+
+      /* a message is newer than the pair it shares the key with */
+      if (j < num_msgs &&
+          (i == leaf->num || !BPLUS_KEY_GT(msgs[j]->key, leaf_key_at(leaf, i)))) {
+        if (i < leaf->num && BPLUS_KEY_EQ(msgs[j]->key, leaf_key_at(leaf, i)))
+          i++;
+        if (!(msgs[j]->flags & BPLUS_PAIR_DEAD))
+          scan_emit(scan, msgs[j]->key, &msgs[j]->data, msgs[j]->flags);
+        j++;
+        continue;
+      }
+
+      if (!leaf_pair_dead(leaf, i))
+        scan_emit(scan, leaf_key_at(leaf, i), leaf_value_at(leaf, i),
+                  leaf->packed ? 0 : leaf->pairs[i].flags);
+      i++;
+    }
+    return;
+  }
+
+  num = scan_merge_messages(scan, node, msgs, num_msgs, &merged);
+  if (num < 0) {
+    scan->stop = true;
+    return;
+  }
+
+  /* the messages of child c are those below keys[c] */
+  index = node->u.index;
+  last 	= scan->bounded ? get_child_index(node, scan->high_key) : index->num;
+  for (c = get_child_index(node, scan->low_key), j = 0; c <= last && !scan->stop; c++) {
+
+    for (i = j; j < num && (c == index->num || BPLUS_KEY_LT(merged[j]->key, index->keys[c])); j++)
+      ;
+    scan_node(scan, index->child[c], &merged[i], j - i);
+  }
+
+  if (merged != msgs)
+    free(merged);
+}
+
+/*
+ * call fn on every live pair with low_key <= key (<= high_key if
+ * bounded), in key order, until fn returns false.
+ * Pending messages are merged in, the buffers are left alone
+ * @return number of pairs passed to fn
+ */
+static long
+bplus_tree_scan_util (bplus_tree_t *tree,
+                      bplus_key_t low_key,
+                      bplus_key_t high_key,
+                      bool bounded,
+                      bplus_scan_fn_t fn,
+                      void *arg)
+{
+  bplus_tree_node_t *root 	= NULL;
+  bplus_scan_t scan;
+  INSTR_START(start);
+
+  if (!tree || !fn || (bounded && BPLUS_KEY_LT(high_key, low_key)))
+    return (0);
+
+  if (!bplus_tree_reader_enter())
+    return (0);
+  INSTR_ADD(descents, 1);
+
+  memset(&scan, 0, sizeof(scan));
+  scan.low_key 	= low_key;
+  scan.high_key = high_key;
+  scan.bounded 	= bounded;
+  scan.fn 	= fn;
+  scan.arg 	= arg;
+
+  root = bplus_tree_search_root(tree);
+  if (root)
+    scan_node(&scan, root, NULL, 0);
+
+  bplus_tree_reader_exit();
+  INSTR_END(BPLUS_OP_RANGE, start);
+  return (scan.count);
+}
+
+/*
+ * call fn on every live pair with low_key <= key <= high_key,
+ * in key order, until fn returns false
+ * @return number of pairs passed to fn
+ */
+long
+bplus_tree_range_scan (bplus_tree_t *tree,
+                       bplus_key_t low_key,
+                       bplus_key_t high_key,
+                       bplus_scan_fn_t fn,
+                       void *arg)
+{
+  return (bplus_tree_scan_util(tree, low_key, high_key, true, fn, arg));
+}
+
+/*
+ * call fn on the live pairs from low_key on, in key order,
+ * until fn returns false or the keys run out
+ * @return number of pairs passed to fn
+ */
+long
+bplus_tree_scan (bplus_tree_t *tree,
+                 bplus_key_t low_key,
+                 bplus_scan_fn_t fn,
+                 void *arg)
+{
+  return (bplus_tree_scan_util(tree, low_key, low_key, false, fn, arg));
+}
+
+/*******************************
+ *  B+ tree insert             *
+ *******************************/
+
+/*
+ * utility function to add a key in index node
+ */
+static void
+index_node_add_key (index_node_t *node, bplus_key_t key)
+{
+  int num = 0;
+
+  num 				= node->num;
+  node->keys[num++] = key;
+  node->num 		= num;
+}
+
+/*
+ * utility function add a (k, v) pair in leaf node
+ */
+static void
+leaf_node_add_pair (leaf_node_t *node, bplus_key_t key,
+                    const bplus_value_t *value, uint8_t flags)
+{
+  int num = 0;
+
+  num 					= node->num;
+  node->pairs[num].key = key;
+  node->pairs[num].flags = flags;
+  node->pairs[num].data = *value;
+  node->num++;
+}
+
+/*
+ * utility function to check if index node has room to add a new key
+ */
+static bool
+index_has_room (bplus_tree_t *tree,
+                bplus_tree_node_t *node)
+{
+  if (!tree) {
+    printf("%s: Invalid tree\n", __FUNCTION__);
+    return (false);
+  }
+
+  if (!node) {
+    printf("%s: Invalid node\n", __FUNCTION__);
+    return (false);
+  }
+  
+  if (node->is_leaf) {
+    printf("%s: Non-leaf node\n", __FUNCTION__);
+    return (false);
+  }
+
+  return (node->u.index->num < (tree->order - 1));
+}
+
+/*
+ * utility function to check if leaf node has roomm to add a new pair
+ */
+static bool
+leaf_has_room (bplus_tree_t *tree,
+               bplus_tree_node_t *node)
+{
+  if (!tree) {
+    printf("%s: Invalid tree\n", __FUNCTION__);
+    return (false);
+  }
+
+  if (!node) {
+    printf("%s: Invalid node\n", __FUNCTION__);
+    return (false);
+  }
+  
+  if (!node->is_leaf) {
+    printf("%s: Non-leaf node\n", __FUNCTION__);
+    return (false);
+  }
+
+  return (node->u.leaf->num < (tree->order - 1));
+}
+
+/*
+ * get the leaf in which the key should reside;
+ * the index nodes passed on the way down are pushed on path
+ */
+static bplus_tree_node_t *
+find_leaf_for_key (bplus_tree_node_t *root,
+                   bplus_key_t key,
+                   bplus_path_t *path)
+{
+  int index = 0;
+
+  if (!root) {
+    return (NULL);
+  }
+
+  if (path->depth == 0)
+    INSTR_ADD(descents, 1);
+
+  if (root->is_leaf) {
+    INSTR_ADD(node_visits, 1);
+    return (root);
+  }
+
+  if (path->depth == BPLUS_MAX_HEIGHT) {
+    printf("%s: Error: tree is too deep\n", __FUNCTION__);
+    return (NULL);
+  }
+
+  index = get_child_index(root, key);
+  path->node[path->depth] = root;
+  path->slot[path->depth] = index;
+  path->depth++;
+
+  return (find_leaf_for_key(root->u.index->child[index], key, path));
+}
+
+/*
+ * remember leaf as the insert hint;
+ * the fences are the nearest separators around it on the path
+ */
+static void
+leaf_hint_set (bplus_tree_t *tree,
+               bplus_path_t *path,
+               bplus_tree_node_t *leaf)
+{
+  int i 			= 0;
+  int slot 			= 0;
+  bplus_leaf_hint_t *hint 	= &tree->hint;
+
+  hint->leaf 		= leaf;
+  hint->has_low 	= false;
+  hint->has_high 	= false;
+
+  for (i = path->depth - 1; i >= 0; i--) {
+
+    slot = path->slot[i];
+    if (!hint->has_low && slot > 0) {
+      hint->low 	= path->node[i]->u.index->keys[slot - 1];
+      hint->has_low 	= true;
+    }
+    if (!hint->has_high && slot < path->node[i]->u.index->num) {
+      hint->high 	= path->node[i]->u.index->keys[slot];
+      hint->has_high 	= true;
+    }
+  }
+}
+
+/*
+ * the hinted leaf if key falls within its fences, else NULL
+ */
+static bplus_tree_node_t *
+leaf_hint_lookup (bplus_tree_t *tree,
+                  bplus_key_t key)
+{
+  bplus_leaf_hint_t *hint = &tree->hint;
+
+  if (!hint->leaf)
+    return (NULL);
+
+  if (hint->has_low && BPLUS_KEY_LT(key, hint->low))
+    return (NULL);
+
+  if (hint->has_high && !BPLUS_KEY_LT(key, hint->high))
+    return (NULL);
+
+  return (hint->leaf);
+}
+
+/*
+ * utility function to insert a new (k, v) pair in
+ * non-full leaf node
+ *
+ * Simply, do a sorted add of the new pair in the pairs array
+ */
+static void
+insert_into_non_full_leaf (bplus_tree_node_t *node,
+                           bplus_key_t key,
+                           const bplus_value_t *value,
+                           uint8_t flags)
+{
+  int i 		= 0;
+  int num 		= 0;
+  pair_t *pairs = NULL;
+
+  if (!node) {
+    printf("%s: Error: invalid node\n", __FUNCTION__);
+    return;
+  }
+  
+  if (!node->is_leaf) {
+    printf("%s: Error: non leaf node\n", __FUNCTION__);
+    return;
+  }
+ 
+  pairs = node->u.leaf->pairs;
+  num = node->u.leaf->num;
+  for (i = num - 1; (i >= 0 && BPLUS_KEY_GT(pairs[i].key, key)); i--) {
+
+    pairs[i + 1] 	= pairs[i];
+  }
+
+  pairs[i + 1].key 	= key;
+  pairs[i + 1].flags 	= flags;
+  pairs[i + 1].data 	= *value;
+  node->u.leaf->num++;
+
+  return;
+}
+
+/*
+ * insert a new key in non-full parent node(index node)
+ *
+ * leaf sits at child[slot] of the parent, so the new key goes to
+ * keys[slot] and new_leaf to child[slot + 1];
+ * shift the keys and child pointers after them by 1
+ */
+static void
+insert_key_into_non_full_parent (bplus_tree_node_t *parent,
+                                 int slot,
+                                 bplus_tree_node_t *leaf,
+                                 bplus_tree_node_t *new_leaf,
+                                 bplus_key_t key)
+{
+  int i 		= 0;
+  int num 		= 0;
+  bplus_key_t *keys 	= NULL;
+  void **child 	= NULL;
+
+  if (!parent || !leaf || !new_leaf) {
+    printf("%s: Error: Invalid args\n", __FUNCTION__);
+    return;
+  }
+
+  if (parent->is_leaf) {
+    printf("%s: Error: non index node\n", __FUNCTION__);
+    return;
+  }
+
+  keys = parent->u.index->keys;
+  child = parent->u.index->child;
+  num = parent->u.index->num;
+
+  /*
+   * move all the keys after the slot by 1
+   */
+  for (i = num; i > slot; i--) {
+
+    keys[i] = keys[i - 1];
+  }
+
+  /*
+   * and all the child pointers after leaf
+   */
+  for (i = num + 1; i > slot + 1; i--) {
+    child[i] = child[i - 1];
+  }
+
+  keys[slot] 		= key;
+  child[slot + 1] 	= new_leaf;
+  parent->u.index->num++;
+
+  return;
+}
+
+/*
+ * insert a new key in a full parent
+ * split the node in two and adjust parent
+ */
+static bplus_tree_node_t *
+insert_key_into_full_parent (bplus_tree_t *tree,
+                             bplus_tree_node_t *root,
+                             bplus_path_t *path,
+                             bplus_tree_node_t *parent,
+                             int slot,
+                             bplus_tree_node_t *leaf,
+                             bplus_tree_node_t *new_leaf,
+                             bplus_key_t key)
+{
+  int i = 0, j = 0, k = 0, l = 0;
+  int num_tmp_keys 	= 0;
+  int num 			= 0;
+  bplus_key_t promote_key 	= {0};				//key which will be promoted
+  bplus_key_t *keys 		= NULL; 			//keys in parent
+  void **child 		= NULL; 			//child pointers in parent
+  bplus_key_t *new_keys 	= NULL; 			//keys in new_node
+  void **new_child 	= NULL; 			//child pointers in new_node
+  int split 			= 0; 			//keys kept in parent
+  bplus_key_t tmp_keys[tree->order]; 			//hold all keys in parent + new key
+  void *tmp_child[tree->order + 1]; 	//hold all children in parent + new_leaf
+  bplus_tree_node_t *new_node = NULL;
+
+  if (!root || !parent || !leaf || !new_leaf) {
+    printf("%s: Error: invalid arguments\n", __FUNCTION__);
+    return (root);
+  }
+
+  if (parent->is_leaf) {
+    printf("%s: Error: parent cannot be leaf here\n", __FUNCTION__);
+    return (root);
+  }
+
+  INSTR_ADD(index_splits, 1);
+
+  new_node = bplus_tree_create_node(tree, false);
+  if (!new_node) {
+    printf("%s: Error: cannot create new node\n", __FUNCTION__);
+    return (root);
+  }
+
+  memset(tmp_keys, 0, sizeof(tmp_keys));
+  memset(tmp_child, 0, sizeof(tmp_child));
+
+  keys 			= parent->u.index->keys;
+  child 		= parent->u.index->child;
+  num 			= parent->u.index->num;
+  num_tmp_keys 	= num + 1;
+
+  /*
+   * copy all the keys from parent before the slot in tmp_keys
+   */
+  i = 0;
+  j = 0;
+  while (j < slot) {
+    tmp_keys[i++] = keys[j++];
+  }
+  
+  /*
+   * at this point new_leaf will be inserted at loc i in tmp_child
+   */
+  k = 0;
+  l = 0;
+  while (k <= i) {
+    tmp_child[k++] = child[l++];
+  }
+
+  /*
+   * we now have the right location for key
+   */
+  tmp_keys[i++] = key;
+
+  /*
+   * insert the new leaf into child pointers
+   */
+  tmp_child[k++] = new_leaf;
+
+  /*
+   * copy rest of the keys
+   */
+  while (j < num) {
+    tmp_keys[i++] = keys[j++];
+  }
+
+  /*
+   * copy rest of the pointers
+   */
+  while (l <= num) {
+    tmp_child[k++] = child[l++];
+  }
+
+  /*
+   * now tmp_keys and tmp_child should have
+   * keys and child in correct order (if things worked :-))
+   */
+
+  /*
+   * copy half the content in parent node;
+   * when the new child went to the right edge of the tree keep more,
+   * the new node must still get at least one key
+   */
+  split = split_point(tree, tree->order - 2, slot == num && path_is_rightmost(path));
+  parent->u.index->num = 0;
+  for (i = 0; i < split; i++) {
+    
+    keys[i] = tmp_keys[i];
+    parent->u.index->num++;
+  }
+
+  for (j = 0; j <= i; j++) {
+    
+    child[j] = tmp_child[j];
+  }
+
+  /*
+   * promote the middle key as this is an index node
+   */
+  promote_key = tmp_keys[i];
+
+  /*
+   * copy rest of the half in new node
+   */
+  new_keys 	= new_node->u.index->keys;
+  new_child = new_node->u.index->child;
+  for (i = split + 1, j = 0; i < num_tmp_keys; i++, j++) {
+    
+    new_keys[j] = tmp_keys[i];
+    new_node->u.index->num++;
+  }
+  
+  for (i = split + 1, j = 0; i < num_tmp_keys + 1; i++, j++) {
+    
+    new_child[j] = tmp_child[i];
+  }
+
+  /* pending messages follow their subtree */
+  msg_buffer_move_from(tree, &parent->u.index->buf, &new_node->u.index->buf, promote_key);
+
+  return adjust_parent(tree, root, path, parent, new_node, promote_key);
+}
+
+/*
+ * adjust the parent after we have promoted a key from a lower level.
+ * The parent of leaf is the last node on the path; pop it
+ */
+bplus_tree_node_t *
+adjust_parent (bplus_tree_t *tree,
+               bplus_tree_node_t *root,
+             bplus_path_t *path,
+             bplus_tree_node_t *leaf,
+             bplus_tree_node_t *new_leaf,
+             bplus_key_t parent_key)
+{
+  int slot 			= 0;
+  bplus_tree_node_t *new_node 	= NULL;
+  bplus_tree_node_t *parent 	= NULL;
+
+  /*
+   * If we don't have a parent
+   */
+  if (path->depth == 0) {
+    
+    /*
+     * create a new index node;
+     * put the parent_key in the newly created node;
+     * adjust child pointers for this node;
+     * return the new node (which is the new root of the tree)
+     */
+    new_node = bplus_tree_create_node(tree, false);
+    if (!new_node) {
+      printf("%s: Error: could not create new index node\n", __FUNCTION__);
+      return root;
+    }
+    INSTR_ADD(root_changes, 1);
+    
+    /* new nodes parent is going to be NULL */
+
+    /* add the parent key which was promoted to index node */
+    index_node_add_key(new_node->u.index, parent_key);
+
+    /* adjust the child pointers accordingly */
+    new_node->u.index->child[0] = leaf;
+    new_node->u.index->child[1] = new_leaf;
+    return (new_node);
+  }
+
+  path->depth--;
+  parent 	= path->node[path->depth];
+  slot 		= path->slot[path->depth];
+
+  /*
+   * if we have a parent which is not full
+   */
+  if (index_has_room(tree, parent)) {
+    insert_key_into_non_full_parent(parent, slot, leaf, new_leaf, parent_key);
+    return (root);
+  }
+
+  /*
+   * Parent doesnt have room;
+   * spilt the node accordingly
+   */
+  return (insert_key_into_full_parent(tree, root, path, parent, slot, leaf, new_leaf, parent_key));
+}
+
+/*
+ * Insert a new <key, value> in full leaf
+ * split the node in two leafs and promote a key to parent node
+ */
+bplus_tree_node_t *
+insert_into_full_leaf (bplus_tree_t *tree,
+                       bplus_tree_node_t *root,
+                       bplus_path_t *path,
+                       bplus_tree_node_t *node,
+                       bplus_key_t key,
+                       const bplus_value_t *value,
+                       uint8_t flags)
+{
+  int i 			= 0 ;
+  int j 			= 0;
+  int num 			= 0;
+  int split 			= 0;
+  bool append 			= false;
+  bplus_key_t promote_key 	= {0};
+  pair_t tmp_pairs[tree->order];
+  bplus_tree_node_t *new_leaf 	= NULL;
+  pair_t *pairs 				= NULL;
+  pair_t *new_pairs 			= NULL;
+
+  if (!node) {
+    printf("%s: Error: invalid node\n", __FUNCTION__);
+    return(NULL);
+  }
+
+  if (!node->is_leaf) {
+    printf("%s: Error: non leaf node\n", __FUNCTION__);
+    return(NULL);
+  }
+
+  INSTR_ADD(leaf_splits, 1);
+  memset(tmp_pairs, 0, tree->order * sizeof(pair_t));
+
+  /*
+   * create a new leaf;
+   * parent for this leaf is the same as the parent for leaf
+   */
+  new_leaf = bplus_tree_create_node(tree, true);
+  if (!new_leaf) {
+    printf("%s: Error: Could not create new leaf\n", __FUNCTION__);
+    return (root);
+  }
+
+  /*
+   * change the doubly link list
+   */
+  new_leaf->u.leaf->next 	= node->u.leaf->next;
+  node->u.leaf->next 		= new_leaf;
+  new_leaf->u.leaf->prev 	= node;
+  if (new_leaf->u.leaf->next) {
+    bplus_tree_node_t *tmp = NULL;
+
+    tmp 				= new_leaf->u.leaf->next;
+    tmp->u.leaf->prev 	= new_leaf;
+  }
+
+  /*
+   * transfer half of the pairs to new leaf;
+   * if key goes past the last pair of the rightmost leaf
+   * this is an append and the left leaf is kept fuller
+   */
+  num 	= node->u.leaf->num;
+  pairs = node->u.leaf->pairs;
+  append = !new_leaf->u.leaf->next && BPLUS_KEY_LT(pairs[num - 1].key, key);
+  split = split_point(tree, tree->order - 1, append);
+  i = 0; //index in tmp_pairs
+  j = 0; //index in original leaf
+
+  /* copy everything less than key to tmp pairs */
+  while (BPLUS_KEY_LT(pairs[j].key, key) && j < num) {
+    tmp_pairs[i++] = pairs[j++];
+  }
+
+  /* copy the new <key, value> in right location */
+  tmp_pairs[i].key 	= key;
+  tmp_pairs[i].flags 	= flags;
+  tmp_pairs[i].data 	= *value;
+  i++;
+
+  /* copy the rest of pairs to tmp_pairs */
+  while (j < num) {
+    tmp_pairs[i++] = pairs[j++];
+  }
+
+  /* copy half the pairs in original leaf */
+  node->u.leaf->num = 0;
+  for (i = 0; i < split; i++) {
+    pairs[i] = tmp_pairs[i];
+    node->u.leaf->num++;
+  }
+
+  /* copy the rest of the half in new leaf */
+  new_pairs = new_leaf->u.leaf->pairs;
+  for (i = split, j = 0; i < tree->order; i++, j++) {
+    new_pairs[j] = tmp_pairs[i];
+    new_leaf->u.leaf->num++;
+  }
+
+  /* the separator shares the slot of the key */
+  promote_key = new_pairs[0].key;
+  bplus_key_hold(tree, promote_key);
+
+  /*
+   * appending at the right end of the tree;
+   * the left leaf will not be written to again
+   */
+  if (tree->pack_on_split && append)
+    leaf_pack(node);
+
+  return adjust_parent(tree, root, path, node, new_leaf, promote_key);
+}
+
+/*
+ * Create the root node for tree
+ * (1st insertion)
+ */
+bplus_tree_node_t *
+bplus_tree_create_root (bplus_tree_t *tree,
+                        bplus_key_t key,
+                        const bplus_value_t *value,
+                        uint8_t flags)
+{
+  bplus_tree_node_t *root = NULL;
+
+  /*
+   * create a new leaf node
+   * and mark it as root
+   */
+  root = bplus_tree_create_node(tree, true);
+  if (!root) {
+    printf("%s: Error: could not create root node\n", __FUNCTION__);
+    return (NULL);
+  }
+
+  leaf_node_add_pair(root->u.leaf, key, value, flags);
+  return (root);
+}
+
+/*
+ * add a key to the leaves of the B+ tree
+ * @return false if the pair could not be stored
+ */
+static bool
+bplus_tree_insert_direct (bplus_tree_t *tree,
+                          bplus_key_t key,
+                          const bplus_value_t *value,
+                          uint8_t flags)
+{
+  int index 				= 0;
+  pair_t *pair 				= NULL;
+  bplus_tree_node_t *leaf 	= NULL;
+  bplus_tree_node_t *next 	= NULL;
+  bplus_path_t path;
+  char str[BPLUS_KEY_STR_LEN];
+
+  /*
+   * empty tree:
+   * create a root and insert in the root
+   */
+  if (!tree->root) {
+
+    /* the key is going to be stored; give it its own bytes */
+    if (!bplus_key_intern(tree, &key))
+      return (false);
+
+    tree->root = bplus_tree_create_root(tree, key, value, flags);
+    return (tree->root != NULL);
+  }
+
+  /*
+   * tree is non empty;
+   * try the leaf of the last insert first. A split needs the path
+   * to the leaf, so a full hinted leaf is looked up from the root
+   */
+  path.depth = 0;
+  leaf = leaf_hint_lookup(tree, key);
+  if (leaf && !leaf_has_room(tree, leaf))
+    leaf = NULL;
+
+  if (!leaf) {
+
+    leaf = find_leaf_for_key (tree->root, key, &path);
+    if (!leaf) {
+    
+      /*
+       * Cannot happen ?
+       */
+      printf("%s: Error: could not find leaf for key %s\n", __FUNCTION__,
+             bplus_key_format(key, str, sizeof(str)));
+      return (false);
+    }
+    leaf_hint_set(tree, &path, leaf);
+  }
+
+  /* packed leaves are read only */
+  if (!leaf_unpack(tree, leaf))
+    return (false);
+
+  /*
+   * if the key is already present modify the contents
+   */
+  index = bplus_tree_search_in_leaf(leaf, key, NULL);
+  if (index != -1) {
+    
+    pair = &leaf->u.leaf->pairs[index];
+    bplus_pair_release_value(pair);
+    if (pair->flags & BPLUS_PAIR_DEAD)
+      tree->num_dead--;
+    pair->flags = flags;
+    pair->data 	= *value;
+
+    /* the stored key stays; a buffered message brings its own copy */
+    bplus_key_release(tree, key);
+    return (true);
+  }
+
+  /* the key is going to be stored; give it its own bytes */
+  if (!bplus_key_intern(tree, &key))
+    return (false);
+
+  /*
+   * leaf has room;
+   * insert into right location in leaf and return
+   * there is no change to the tree in this case
+   */
+  if (leaf_has_room(tree, leaf)) {
+   
+    insert_into_non_full_leaf(leaf, key, value, flags);
+    return (true);
+  }
+
+  /*
+   * leaf is full;
+   * create a new leaf and adjust accordingly.
+   * The leaf no longer covers its old key range
+   */
+  tree->hint.leaf = NULL;
+  tree->index_gen++;
+  /* the split leaves the tree as it was if it gets no new leaf */
+  next 	= leaf->u.leaf->next;
+  tree->root = insert_into_full_leaf(tree, tree->root, &path, leaf, key, value, flags);
+  return (leaf->u.leaf->next != next);
+
+}
+
+/*
+ * utility function to add a key to the B+ tree;
+ * in buffered mode it is queued as a message at the root
+ * @return false if the pair could not be stored
+ */
+static bool
+bplus_tree_insert_internal (bplus_tree_t *tree,
+                            bplus_key_t key,
+                            const bplus_value_t *value,
+                            uint8_t flags)
+{
+  bool done 	= false;
+  pair_t msg;
+  INSTR_START(start);
+
+  if (!tree->buffer_size || !tree->root || tree->root->is_leaf) {
+    done = bplus_tree_insert_direct(tree, key, value, flags);
+  } else if (bplus_key_intern(tree, &key)) {
+
+    /* the key is going to be stored; it has its own bytes now */
+    msg.key 	= key;
+    msg.flags 	= flags;
+    msg.data 	= *value;
+    bplus_tree_buffer_message(tree, &msg);
+    done 	= true;
+  }
+  if (done)
+    bplus_filter_insert(tree, key);
+
+  INSTR_END(BPLUS_OP_INSERT, start);
+  return (done);
+}
+
+/*
+ * insert a (key, value) pair in b+ tree
+ */
+void
+bplus_tree_insert (bplus_tree_t *tree,
+                   bplus_key_t key,
+                   double value)
+{
+  bplus_value_t data;
+
+  if (!tree)
+    return;
+
+  memset(&data, 0, sizeof(data));
+  data.num = value;
+  bplus_tree_insert_internal(tree, key, &data, 0);
+
+  return;
+}
+
+/*
+ * insert a key with an inline value of BPLUS_VALUE_SIZE bytes
+ */
+void
+bplus_tree_insert_value (bplus_tree_t *tree,
+                         bplus_key_t key,
+                         const bplus_value_t *value)
+{
+  if (!tree || !value)
+    return;
+
+  bplus_tree_insert_internal(tree, key, value, 0);
+
+  return;
+}
+
+/*
+ * insert a key with an out of line value of len bytes.
+ * The value is copied into the blob before the key goes in,
+ * so readers never see it half written
+ * @return false on failure
+ */
+bool
+bplus_tree_insert_blob (bplus_tree_t *tree,
+                        bplus_key_t key,
+                        const void *value,
+                        size_t len)
+{
+  bplus_blob_t *blob 	= NULL;
+  bplus_value_t data;
+
+  if (!tree || (!value && len)) {
+    printf("%s: Error: Invalid args\n", __FUNCTION__);
+    return (false);
+  }
+
+  blob = malloc(sizeof(bplus_blob_t) + len);
+  if (!blob) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    return (false);
+  }
+  blob->len = len;
+  if (len)
+    memcpy(blob->data, value, len);
+
+  memset(&data, 0, sizeof(data));
+  data.blob = (uint64_t)(uintptr_t)blob;
+  if (!bplus_tree_insert_internal(tree, key, &data, BPLUS_PAIR_BLOB)) {
+    free(blob);
+    return (false);
+  }
+
+  return (true);
+}
+
+/***********************************
+ *   Delete                        *
+ ***********************************/
+static int ceil2 (int x, int y)
+{
+  if (x == 0)
+    return -1;
+
+  return (1 + ((x - 1) / y)); // if x != 0);
+}
+
+static bool
+node_is_valid (bplus_tree_t *tree,
+               bplus_tree_node_t *root,
+               bplus_tree_node_t *node)
+{
+  
+  int num = 0;
+
+  if (node->is_leaf)
+    num = node->u.leaf->num;
+  else
+    num = node->u.index->num;
+
+  if (node == root) {
+    if (num == 0)
+      return (false);
+    return (true);
+  }
+
+  /*
+   * each index/leaf node must have atleast ceil(m/2) children
+   * i.e: ceil(m/2) - 1 keys for valid b+ tree
+   */
+  if (num < (ceil2(tree->order, 2) - 1))
+    return (false);
+
+  return (true);
+}
+
+static int
+search_key_index_in_pairs (pair_t *pairs,
+                      bplus_key_t key,
+                      int start, int end)
+{
+    int mid = 0;
+
+    if (start > end)
+        return (-1);
+    
+    INSTR_ADD(compares, 1);
+    mid = (start + end)/2;
+    if (BPLUS_KEY_EQ(pairs[mid].key, key)) {
+        return (mid);
+    }
+
+    if (BPLUS_KEY_LT(key, pairs[mid].key)) {
+        return (search_key_index_in_pairs(pairs, key, start, mid - 1));
+    } else {
+        return (search_key_index_in_pairs(pairs, key, mid + 1, end));
+    }
+
+    return (-1);
+}
+
+static bool
+node_has_keys (bplus_tree_node_t *node)
+{
+  if (node->is_leaf)
+    return (node->u.leaf->num);
+  else
+    return (node->u.index->num);
+}
+
+bplus_tree_node_t *
+get_first_child (bplus_tree_node_t *node)
+{
+  if (node->is_leaf)
+    return (NULL);
+
+  return (node->u.index->child[0]);
+}
+
+static void
+adjust_leaf_node (bplus_tree_t *tree,
+                  bplus_tree_node_t *node,
+                  bplus_key_t key)
+{
+  int i 		= 0;
+  int index 	= 0;
+  int num 		= 0;
+  pair_t *pairs = NULL;
+
+  if (!node->is_leaf) {
+    printf("%s: Error: non leaf node", __FUNCTION__);
+    return;
+  }
+
+  /*
+   * delete the key, value pair
+   * and adjust the rest of the pairs accordingly
+   */
+
+  /* adjust the keys */
+  num = node->u.leaf->num;
+  pairs = node->u.leaf->pairs;
+  index = search_key_index_in_pairs(pairs, key, 0, num - 1);
+  if (index == -1)
+    return;
+
+  bplus_pair_release_value(&pairs[index]);
+  bplus_key_release(tree, pairs[index].key);
+  if (pairs[index].flags & BPLUS_PAIR_DEAD)
+    tree->num_dead--;
+
+  for (i = index; i < num - 1; i++) {
+    pairs[i] = pairs[i + 1];
+  }
+
+  /* node has one less key */
+  node->u.leaf->num--;
+
+  return;
+}
+
+/*
+ * remove keys[index] and the child to its right;
+ * the caller knows the index from the path, so there is nothing to search
+ */
+static void
+adjust_index_node (bplus_tree_t *tree,
+                   bplus_tree_node_t *node,
+                   int index)
+{
+  int i 			= 0;
+  int num 			= 0;
+  bplus_key_t *keys 		= NULL;
+  void **children 	= NULL;
+
+  if (node->is_leaf) {
+    printf("%s: Error: leaf node\n", __FUNCTION__);
+    return;
+  }
+
+  num 	= node->u.index->num;
+  if (index < 0 || index >= num)
+    return;
+
+  /* adjust the keys */
+  keys 	= node->u.index->keys;
+  bplus_key_release(tree, keys[index]);
+  for (i = index; i < num - 1; i++) {
+    keys[i] = keys[i + 1];
+  }
+  
+  /* adjust the child pointers; there is one more child than keys */
+  children 	= node->u.index->child;
+  for (i = index + 1; i < num; i++) {
+    children[i] = children[i + 1];
+  }
+
+  /* node has one less key */
+  node->u.index->num--;
+  return;
+}
+
+static void
+adjust_node (bplus_tree_t *tree,
+             bplus_tree_node_t *node,
+             int index,
+             bplus_key_t key)
+{
+  if (node->is_leaf)
+    adjust_leaf_node(tree, node, key);
+  else
+    adjust_index_node(tree, node, index);
+}
+
+static bplus_tree_node_t *
+modify_root (bplus_tree_t *tree,
+             bplus_tree_node_t *root)
+{
+  bplus_tree_node_t *new_root = NULL;
+
+  if (!root)
+    return (NULL);
+
+  /*
+   * if there are keys;
+   * return root as is
+   */
+  if (node_has_keys(root))
+    return (root);
+
+  INSTR_ADD(root_changes, 1);
+  /*
+   * root is empty
+   * promote the child if needed
+   * else tree is now empty
+   */
+  if (!root->is_leaf) {
+    new_root = get_first_child(root);
+
+    /*
+     * the pending messages go down with the root;
+     * a leaf has no buffer, so they are handed to the flush in progress
+     */
+    if (!new_root->is_leaf)
+      msg_buffer_move(tree, &root->u.index->buf, &new_root->u.index->buf,
+                      0, root->u.index->buf.num);
+    else
+      msg_buffer_move(tree, &root->u.index->buf, &tree->orphans,
+                      0, root->u.index->buf.num);
+
+    bplus_tree_retire_node(tree, root);
+    return (new_root);
+  }
+
+  bplus_tree_retire_node(tree, root);
+  return(NULL);
+}
+
+static bool
+is_sibling_generous (bplus_tree_t *tree,
+                     bplus_tree_node_t *node)
+{
+  int num = 0;
+
+  if (!node)
+    return (false);
+
+  if (node->is_leaf)
+    num = node->u.leaf->num;
+  else
+    num = node->u.index->num;
+
+  if (num > (tree->order/2))
+    return (true);
+
+  return (false);
+}
+
+/*
+ * the parent of node is the last node on the path
+ * and node sits in the child slot recorded with it
+ */
+static void
+get_sibling_and_parent_key (bplus_path_t *path,
+                            bplus_tree_node_t **sibling,
+                            int *sibling_index,
+                            bplus_key_t *parent_key,
+                            int *parent_key_index)
+{
+  int i 					= 0;
+  bplus_key_t *keys 				= NULL;
+  void **children 			= NULL;
+  bplus_tree_node_t *parent = NULL;
+
+  /*
+   * try to get the left neighbor for this node
+   */
+  if (path->depth == 0) {
+    printf("%s: Error: no parent\n", __FUNCTION__);
+    return;
+  }
+  parent 	= path->node[path->depth - 1];
+  i 		= path->slot[path->depth - 1];
+
+  if (parent->is_leaf) {
+    printf("%s: Error: We shouldn't have hit a leaf node here\n", __FUNCTION__);
+    return;
+  }
+
+  keys = parent->u.index->keys;
+  children = parent->u.index->child;
+
+  *sibling_index = i - 1;
+
+  /*
+   * node is the leftmost leaf
+   */
+  if (*sibling_index == -1) {
+    *parent_key_index = 0;
+    *sibling = children[1];
+  } else {
+    *parent_key_index = *sibling_index;
+    *sibling = children[*sibling_index];
+  }
+
+  *parent_key = keys[*parent_key_index];
+
+  return;
+}
+
+static void
+borrow_and_adjust_leaf_nodes (bplus_tree_t *tree,
+                              bplus_tree_node_t *parent,
+                              bplus_tree_node_t *node,
+                              bplus_tree_node_t *sibling,
+                              int sibling_index,
+                              int parent_key_index)
+{
+  int i 			= 0;
+  int num1 			= 0;
+  int num2 			= 0;
+  pair_t *pairs1 	= NULL;
+  pair_t *pairs2 	= NULL;
+
+  num1 		= node->u.leaf->num;
+  num2 		= sibling->u.leaf->num;
+  pairs1 	= node->u.leaf->pairs;
+  pairs2 	= sibling->u.leaf->pairs;
+  if (sibling_index == -1) {
+  
+    /*
+     * leaf is the left most leaf
+     * we need to borrow leftmost pair from sibling
+     * and place it in the rightmost pair of node.
+     * Also change the parent key at the parent_key_index
+     *
+     * example (for order = 5):
+     *              parent(4)
+     *    node: (2, 3) sibling: (7, 8, 9, 10)
+     *
+     * will become
+     *              parent(8)
+     *    node: (2, 3, 7) sibling: (8, 9, 10)
+     */
+    pairs1[num1] = pairs2[0];
+    for (i = 0; i < num2 - 1; i++) {
+      pairs2[i] = pairs2[i + 1];
+    }
+    bplus_key_hold(tree, pairs2[0].key);
+    bplus_key_release(tree, parent->u.index->keys[parent_key_index]);
+    parent->u.index->keys[parent_key_index] = pairs2[0].key;
+  } else {
+    
+    /*
+     * leaf has a neighbor on the left
+     * we need to borrow rightmost pair from sibling
+     * and place it in the leftmost pair of node
+     * Also change the parent key at the parent_key_index
+     *
+     * example(for order = 5):
+     *              parent(4)
+     *    sibling: (2, 3, 4, 5) node: (7, 8)
+     *
+     * will become
+     *              parent(5)
+     *    sibling: (2, 3, 4) node: (5, 7, 8)
+     */
+    for (i = num1; i > 0; i--) {
+      pairs1[i] = pairs1[i - 1];
+    }
+    pairs1[0] = pairs2[num2 - 1];
+    bplus_key_hold(tree, pairs1[0].key);
+    bplus_key_release(tree, parent->u.index->keys[parent_key_index]);
+    parent->u.index->keys[parent_key_index] = pairs1[0].key;
+  }
+
+  node->u.leaf->num++;
+  sibling->u.leaf->num--;
+  return;
+}
+
+static void
+borrow_and_adjust_index_nodes (bplus_tree_t *tree,
+                               bplus_tree_node_t *parent,
+                               bplus_tree_node_t *node,
+                               bplus_tree_node_t *sibling,
+                               int sibling_index,
+                               int parent_key_index,
+                               bplus_key_t parent_key)
+{
+  int i = 0;
+  bplus_key_t *pkeys 	= NULL;					 //keys in parent node
+  bplus_key_t *nkeys 	= NULL;					 //keys in node
+  bplus_key_t *skeys 	= NULL;					 //keys in sibling
+  void **nchild = NULL;					 //child pointers in node
+  void **schild = NULL;					 //child pointers in sibling
+  int nnum 		= 0; 					 //number of keys in node
+  int snum 		= 0;					 //number of keys in sibling
+
+  nnum 		= node->u.index->num;
+  snum 		= sibling->u.index->num;
+  nkeys 	= node->u.index->keys;
+  skeys 	= sibling->u.index->keys;
+  nchild 	= node->u.index->child;
+  schild 	= sibling->u.index->child;
+  pkeys 	= parent->u.index->keys;
+
+  if (sibling_index == -1) {
+
+    /*
+     * the node is the leftmost node in the tree.
+     * borrow a key from sibling through the neighbor
+     */
+
+    /*
+     * borrow the parent key in the node
+     * also adjust child pointers accordingly
+     */
+    nkeys[nnum] 		= parent_key;
+    nchild[nnum + 1] 	= schild[0];
+
+    /*
+     * parent key at the parent_key_index will change to the leftmost key
+     * in sibling
+     */
+    pkeys[parent_key_index] = skeys[0];
+
+    /* messages for the borrowed child come along */
+    msg_buffer_move_below(tree, &sibling->u.index->buf, &node->u.index->buf, skeys[0]);
+    
+    /*
+     * shift all the keys in sibling
+     */
+    for (i = 0; i < snum - 1; i++ )
+      skeys[i] = skeys[i + 1];
+
+    /*
+     * shift all the children in sibling
+     */
+    for (i = 0; i < snum; i++)
+      schild[i] = schild[i + 1];
+  } else {
+    
+    /*
+     * node has a sibling to its left.
+     * borrow the rightmost key fromm sibling
+     * and place it in leftmost key of node
+     * do the borrow through the parent
+     */
+
+    /*
+     * shift all keys in node
+     */
+    for (i = nnum; i > 0; i--)
+      nkeys[i] = nkeys[i - 1];
+
+    /*
+     * shift all the child pointers
+     */
+    for (i = nnum + 1; i > 0; i--)
+      nchild[i] = nchild[i - 1];
+
+    /*
+     * borrow a key from sibling in node
+     * through parent
+     */
+    nkeys[0] = parent_key;
+    pkeys[parent_key_index] = skeys[snum - 1];
+
+    /* messages for the borrowed child come along */
+    msg_buffer_move_from(tree, &sibling->u.index->buf, &node->u.index->buf, skeys[snum - 1]);
+
+    /*
+     * borrow the child pointer
+     */
+    nchild[0] = schild[snum];
+  }
+  
+  /*
+   * After adjusting:
+   * node has one mmore key;
+   * sibling has one less key
+   */
+  node->u.index->num++;
+  sibling->u.index->num--;
+}
+
+
+static void
+borrow_from_sibling (bplus_tree_t *tree,
+                     bplus_tree_node_t *parent,
+                     bplus_tree_node_t *node,
+                     bplus_tree_node_t *sibling,
+                     int sibling_index,
+                     int parent_key_index,
+                     bplus_key_t parent_key)
+{
+  INSTR_ADD(borrows, 1);
+  if (node->is_leaf)
+    return borrow_and_adjust_leaf_nodes(tree, parent, node, sibling,
+                                        sibling_index, parent_key_index);
+
+  return (borrow_and_adjust_index_nodes(tree, parent, node, sibling,
+                                        sibling_index, parent_key_index,
+                                        parent_key));
+}
+
+static bplus_tree_node_t *
+merge_parent_and_sibling_for_leaf_nodes (bplus_tree_t *tree,
+                                         bplus_tree_node_t *root,
+                                         bplus_path_t *path,
+                                         bplus_tree_node_t *node,
+                                         bplus_tree_node_t *sibling,
+                                         int parent_key_index,
+                                         bplus_key_t parent_key)
+{
+  int i = 0, j = 0;
+  int nnum 					= 0;
+  int snum 					= 0;
+  pair_t *npairs 			= NULL;
+  pair_t *spairs 			= NULL;
+
+  nnum 		= node->u.leaf->num;
+  snum 		= sibling->u.leaf->num;
+  npairs 	= node->u.leaf->pairs;
+  spairs 	= sibling->u.leaf->pairs;
+
+  /*
+   * we will add all the pairs from node to neigh
+   * case1:
+   *  node is the leftmost node
+   *
+   *  example:
+   *          parent (<a> 16 <b>)
+   *
+   *    node (2)        sibling(17, 18)
+   *
+   *    node and neighbors have been swapped
+   *
+   *              ||
+   *              \/
+   *
+   *              parent(<a> 16 <b>)
+   *
+   *    node (17, 18)   sibling (2)
+   *
+   *  final state:
+   *
+   *                  parent(<a> 16(to be deleted) <b>)
+   *
+   *                  sibling(2, 17, 18)
+   *
+   *  case2:
+   *    node has a left neighbor
+   *
+   *  example:
+   *            parent (16)
+   *
+   *    node (2, 3, 5)        sibling(17, 18)
+   *
+   *    final-state:
+   *
+   *                parent (16 (to be deleted))
+   *
+   *                sibling(2, 3, 5, 17)
+   */
+  i = snum;
+  j = 0;
+  while (j < nnum) {
+    spairs[i++] = npairs[j++];
+    sibling->u.leaf->num++;
+  }
+
+  /* pop the parent off the path and remove the separator from it */
+  path->depth--;
+  root = delete_key_from_node(tree, root, path, path->node[path->depth],
+                              parent_key_index, parent_key);
+
+  /* node can now be retired */
+  bplus_tree_retire_node(tree, node);
+  
+  return (root);
+}
+
+static bplus_tree_node_t *
+merge_parent_and_sibling_for_index_nodes (bplus_tree_t *tree,
+                                          bplus_tree_node_t *root,
+                                          bplus_path_t *path,
+                                          bplus_tree_node_t *node,
+                                          bplus_tree_node_t *sibling,
+                                          int parent_key_index,
+                                          bplus_key_t parent_key)
+{
+  int i = 0, j = 0;
+  int nnum 							= 0 ;
+  int snum 							= 0;
+  bplus_key_t *nkeys 						= NULL;
+  bplus_key_t *skeys 						= NULL;
+  void **nchild 					= NULL;
+  void **schild 					= NULL;
+
+  nnum 		= node->u.index->num;
+  snum 		= sibling->u.index->num;
+  nkeys 	= node->u.index->keys;
+  skeys 	= sibling->u.index->keys;
+  nchild 	= node->u.index->child;
+  schild 	= sibling->u.index->child;
+
+  /* the parent's copy of the separator goes with delete_key_from_node below */
+  skeys[snum] = parent_key;
+  bplus_key_hold(tree, parent_key);
+  snum = ++sibling->u.index->num;
+  
+
+  i = snum;
+  j = 0;
+  while (j < nnum) {
+    skeys[i] 	= nkeys[j];
+    schild[i] 	= nchild[j];
+    sibling->u.index->num++;
+    node->u.index->num--;
+    i++;
+    j++;
+  }
+
+  /* onde more child */
+  schild[i] 	= nchild[j];
+
+  /* and all the pending messages */
+  msg_buffer_move(tree, &node->u.index->buf, &sibling->u.index->buf,
+                  0, node->u.index->buf.num);
+
+  /* pop the parent off the path and remove the separator from it */
+  path->depth--;
+  root = delete_key_from_node(tree, root, path, path->node[path->depth],
+                              parent_key_index, parent_key);
+
+  /* node can now be retired */
+  bplus_tree_retire_node(tree, node);
+ 
+  return (root);
+}
+
+static bplus_tree_node_t *
+merge_parent_and_sibling (bplus_tree_t *tree,
+                          bplus_tree_node_t *root,
+                          bplus_path_t *path,
+                          bplus_tree_node_t *node,
+                          bplus_tree_node_t *sibling,
+                          int sibling_index,
+                          int parent_key_index,
+                          bplus_key_t parent_key)
+{
+  bplus_tree_node_t *tmp = NULL;
+
+  INSTR_ADD(merges, 1);
+  if (sibling_index == -1) {
+    tmp 	= node;
+    node 	= sibling;
+    sibling = tmp;
+  }
+  
+  if (node->is_leaf)
+    return (merge_parent_and_sibling_for_leaf_nodes(tree, root, path, node,
+                                                    sibling, parent_key_index,
+                                                    parent_key));
+
+  return (merge_parent_and_sibling_for_index_nodes(tree, root, path, node,
+                                                   sibling, parent_key_index,
+                                                   parent_key));
+}
+
+/*
+ * delete key from node; for an index node the key is keys[index]
+ * and the child to its right goes with it.
+ * path holds the ancestors of node
+ */
+static bplus_tree_node_t *
+delete_key_from_node (bplus_tree_t *tree,
+                      bplus_tree_node_t *root,
+                      bplus_path_t *path,
+                      bplus_tree_node_t *node,
+                      int index,
+                      bplus_key_t key)
+{
+  bplus_key_t parent_key 				= {0};
+  int parent_key_index 			= 0;
+  int sibling_index 			= 0;
+  bplus_tree_node_t *sibling 	= NULL;
+
+  if (!root)
+    return (root);
+
+  if (!node)
+    return (root);
+
+  if (!node->is_leaf && index < 0)
+    return (root);
+
+  /* packed leaves are read only */
+  if (!leaf_unpack(tree, node))
+    return (root);
+
+  /*
+   * delete the key and the child pointer fromm the node
+   * This will simply delete the key/pointer without adjusting the tree
+   */
+  adjust_node(tree, node, index, key);
+
+  /*
+   * if deletion of key didn't violate b+ tree property
+   * nothing more to be done as tree remains unchanged
+   */
+  if (node_is_valid(tree, root, node))
+    return (root);
+
+  /* the tree is going to change shape; the insert hint and replicas may go stale */
+  tree->hint.leaf = NULL;
+  tree->index_gen++;
+  
+  /*
+   * special case of root
+   */
+  if (node == root)
+    return (modify_root(tree, root));
+
+  /*
+   * b+ tree properties are violated;
+   * adjust the tree accordingly
+   */
+
+  get_sibling_and_parent_key(path, &sibling, &sibling_index,
+                             &parent_key, &parent_key_index);
+
+  /* we are going to borrow from or merge with the sibling */
+  if (!leaf_unpack(tree, sibling))
+    return (root);
+
+  /*
+   * see if we can borrow from sibling without
+   * violating the B+ tree properties.
+   * There is no change in the tree in this case;
+   * return root as is
+   */
+  if (is_sibling_generous(tree, sibling)) {
+
+    borrow_from_sibling(tree, path->node[path->depth - 1], node,
+                        sibling, sibling_index,
+                        parent_key_index, parent_key);
+    return (root);
+  }
+
+  return (merge_parent_and_sibling(tree, root, path, node, sibling, sibling_index,
+                                   parent_key_index, parent_key));
+  
+}
+
+/*
+ * lazy delete: turn the pair into a tombstone and leave the tree
+ * shape alone. Its value is released right away
+ * @return true if a live pair was turned into a tombstone
+ */
+static bool
+bplus_tree_mark_dead (bplus_tree_t *tree,
+                      bplus_tree_node_t *root,
+                      bplus_key_t key)
+{
+  int index 			= 0;
+  pair_t *pair 			= NULL;
+  bplus_tree_node_t *leaf 	= NULL;
+  bplus_path_t path;
+
+  if (!root)
+    return (false);
+
+  path.depth = 0;
+  leaf = find_leaf_for_key(root, key, &path);
+  if (!leaf)
+    return (false);
+
+  index = bplus_tree_search_in_leaf(leaf, key, NULL);
+  if (index == -1 || leaf_pair_dead(leaf->u.leaf, index))
+    return (false);
+
+  /* packed leaves have no room for the flag */
+  if (!leaf_unpack(tree, leaf))
+    return (false);
+
+  pair = &leaf->u.leaf->pairs[index];
+  bplus_pair_release_value(pair);
+  memset(&pair->data, 0, sizeof(pair->data));
+  pair->flags = BPLUS_PAIR_DEAD;
+  tree->num_dead++;
+  return (true);
+}
+
+/*
+ * @param removed   if not NULL, set to whether a live pair was removed
+ */
+bplus_tree_node_t *
+bplus_tree_delete_key_util (bplus_tree_t *tree,
+                            bplus_tree_node_t *root,
+                            bplus_key_t key,
+                            bool *removed)
+{
+  int index 			= 0;
+  bplus_tree_node_t *leaf 	= NULL;
+  bplus_path_t path;
+
+  if (removed)
+    *removed = false;
+
+  if (!root)
+    return (NULL);
+
+  path.depth = 0;
+  leaf = find_leaf_for_key(root, key, &path);
+  if (!leaf)
+    return (NULL);
+
+  if (removed) {
+    index 	= bplus_tree_search_in_leaf(leaf, key, NULL);
+    *removed 	= (index != -1 && !leaf_pair_dead(leaf->u.leaf, index));
+  }
+
+  return (delete_key_from_node(tree, root, &path, leaf, -1, key));
+}
+
+/*
+ * delete a key from the leaves of the tree
+ */
+static void
+bplus_tree_delete_direct (bplus_tree_t *tree,
+                          bplus_key_t key)
+{
+  bool removed = false;
+
+  if (tree->lazy_delete)
+    removed 	= bplus_tree_mark_dead(tree, tree->root, key);
+  else
+    tree->root 	= bplus_tree_delete_key_util(tree, tree->root, key,
+                                             tree->filter ? &removed : NULL);
+
+  if (removed)
+    bplus_filter_removed(tree);
+}
+
+void
+bplus_tree_delete_key (bplus_tree_t *tree,
+                   bplus_key_t key)
+{
+  pair_t msg;
+  INSTR_START(start);
+
+  if (!tree)
+    return;
+
+  if (tree->buffer_size && tree->root && !tree->root->is_leaf) {
+
+    /* the key is going to be stored in a buffer */
+    if (!bplus_key_intern(tree, &key))
+      return;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.key 	= key;
+    msg.flags 	= BPLUS_PAIR_DEAD;
+    bplus_tree_buffer_message(tree, &msg);
+  } else {
+    bplus_tree_delete_direct(tree, key);
+  }
+  bplus_filter_delete(tree);
+
+  /* free whatever the readers are done with */
+  epoch_reclaim(&bplus_epoch);
+
+  INSTR_END(BPLUS_OP_DELETE, start);
+  return;
+}
+
+/*
+ * move a cursor of the tree to key, or clear it if key is NULL.
+ * The cursor keeps the slot of its key alive
+ */
+static void
+bplus_cursor_set (bplus_tree_t *tree,
+                  bplus_key_t *cursor,
+                  bool *valid,
+                  const bplus_key_t *key)
+{
+  if (key)
+    bplus_key_hold(tree, *key);
+  if (*valid)
+    bplus_key_release(tree, *cursor);
+
+  *valid = (key != NULL);
+  if (key)
+    *cursor = *key;
+}
+
+/*
+ * find the first tombstone with key >= the compaction cursor,
+ * starting over from the leftmost leaf if there is none past it
+ */
+static bool
+bplus_tree_next_dead (bplus_tree_t *tree,
+                      bplus_key_t *key)
+{
+  int i 			= 0;
+  int pass 			= 0;
+  bplus_tree_node_t *node 	= NULL;
+  bplus_path_t path;
+
+  for (pass = 0; pass < 2; pass++) {
+
+    if (tree->has_compact_cursor) {
+      path.depth = 0;
+      node = find_leaf_for_key(tree->root, tree->compact_cursor, &path);
+    } else {
+      node = tree->root;
+      while (node && !node->is_leaf)
+        node = node->u.index->child[0];
+    }
+
+    for (; node; node = node->u.leaf->next) {
+
+      for (i = 0; i < node->u.leaf->num; i++) {
+
+        if (!leaf_pair_dead(node->u.leaf, i))
+          continue;
+
+        if (tree->has_compact_cursor &&
+            BPLUS_KEY_LT(node->u.leaf->pairs[i].key, tree->compact_cursor))
+          continue;
+
+        *key = node->u.leaf->pairs[i].key;
+        return (true);
+      }
+    }
+
+    /* wrap around */
+    bplus_cursor_set(tree, &tree->compact_cursor, &tree->has_compact_cursor, NULL);
+  }
+
+  return (false);
+}
+
+/*
+ * remove up to budget tombstones, merging and rebalancing as a
+ * synchronous delete would. Meant to be called off the request path
+ * (idle time, off-peak hours); each call resumes where the last one
+ * stopped
+ * @return number of tombstones removed
+ */
+int
+bplus_tree_compact_step (bplus_tree_t *tree,
+                         int budget)
+{
+  int purged 		= 0;
+  bplus_key_t key 	= {0};
+
+  if (!tree)
+    return (0);
+
+  /* tombstones may still be waiting in the message buffers */
+  if (tree->buffer_size)
+    bplus_tree_flush_all(tree);
+
+  while (purged < budget && tree->num_dead > 0 && tree->root) {
+
+    if (!bplus_tree_next_dead(tree, &key))
+      break;
+
+    bplus_cursor_set(tree, &tree->compact_cursor, &tree->has_compact_cursor, &key);
+    tree->root = bplus_tree_delete_key_util(tree, tree->root, key, NULL);
+    purged++;
+  }
+
+  /* free whatever the readers are done with */
+  bplus_key_retire(tree);
+  epoch_reclaim(&bplus_epoch);
+
+  return (purged);
+}
+
+/*******************************
+ *   Buffered (B-epsilon) mode *
+ *******************************/
+
+/*
+ * apply the messages in work to the leaves, oldest first.
+ * A root collapsing onto a leaf meanwhile leaves its messages in
+ * tree->orphans; they are newer than the rest of work and go last
+ */
+static void
+bplus_tree_apply_messages (bplus_tree_t *tree,
+                           bplus_msg_buffer_t *work)
+{
+  int i 	= 0;
+  pair_t *msg 	= NULL;
+
+  for (i = 0; i < work->num; i++) {
+
+    msg = &work->msgs[i];
+    if (msg->flags & BPLUS_PAIR_DEAD) {
+      bplus_tree_delete_direct(tree, msg->key);
+      bplus_key_release(tree, msg->key);
+    } else {
+      bplus_tree_insert_direct(tree, msg->key, &msg->data, msg->flags);
+    }
+
+    if (tree->orphans.num && msg_buffer_reserve(tree, work, work->num + tree->orphans.num)) {
+      memcpy(&work->msgs[work->num], tree->orphans.msgs,
+             tree->orphans.num * sizeof(pair_t));
+      work->num 		+= tree->orphans.num;
+      tree->orphans.num 	= 0;
+      tree->orphans.sorted 	= 0;
+    }
+  }
+
+  free(work->msgs);
+  memset(work, 0, sizeof(*work));
+}
+
+/*
+ * flush a full buffer: hand the messages of the child which has
+ * the most of them down to that child
+ */
+static void
+bplus_tree_flush_node (bplus_tree_t *tree,
+                       bplus_tree_node_t *node)
+{
+  int i 			= 0;
+  int start 			= 0;
+  int end 			= 0;
+  int best 			= 0;
+  int best_start 		= 0;
+  int best_end 			= 0;
+  index_node_t *index 		= node->u.index;
+  bplus_tree_node_t *child 	= NULL;
+  bplus_msg_buffer_t work;
+
+  /* sorted, the messages of child i are a run of the buffer */
+  msg_buffer_sort(tree, &index->buf);
+  for (i = 0; i <= index->num; i++) {
+
+    end = (i < index->num) ? msg_buffer_lower_bound(&index->buf, index->keys[i])
+                           : index->buf.num;
+    if (end - start > best_end - best_start) {
+      best 		= i;
+      best_start 	= start;
+      best_end 		= end;
+    }
+    start = end;
+  }
+
+  child = index->child[best];
+  if (!child->is_leaf) {
+
+    msg_buffer_move(tree, &index->buf, &child->u.index->buf, best_start, best_end);
+    if (child->u.index->buf.num >= tree->buffer_size)
+      bplus_tree_flush_node(tree, child);
+    return;
+  }
+
+  /*
+   * the messages reach a leaf: take them out of the buffer and apply
+   * them from the root, the tree may split or merge under us
+   */
+  memset(&work, 0, sizeof(work));
+  if (!msg_buffer_reserve(tree, &work, best_end - best_start))
+    return;
+  memcpy(work.msgs, &index->buf.msgs[best_start],
+         (best_end - best_start) * sizeof(pair_t));
+  work.num = best_end - best_start;
+  memmove(&index->buf.msgs[best_start], &index->buf.msgs[best_end],
+          (index->buf.num - best_end) * sizeof(pair_t));
+  index->buf.num 	-= work.num;
+  index->buf.sorted 	= index->buf.num;
+
+  bplus_tree_apply_messages(tree, &work);
+}
+
+/*
+ * queue a message at the root and flush if its buffer is full
+ */
+static void
+bplus_tree_buffer_message (bplus_tree_t *tree,
+                           const pair_t *msg)
+{
+  bplus_tree_node_t *root = tree->root;
+
+  if (!msg_buffer_put(tree, &root->u.index->buf, msg))
+    return;
+
+  if (root->u.index->buf.num >= tree->buffer_size)
+    bplus_tree_flush_node(tree, root);
+}
+
+/*
+ * take the messages of node and everything below it out of the buffers,
+ * one list per level of the tree
+ */
+static void
+bplus_tree_collect_messages (bplus_tree_t *tree,
+                             bplus_tree_node_t *node,
+                             int level,
+                             bplus_msg_buffer_t *levels)
+{
+  int i 		= 0;
+  index_node_t *index 	= NULL;
+
+  if (node->is_leaf || level == BPLUS_MAX_HEIGHT)
+    return;
+
+  index = node->u.index;
+  if (index->buf.num && msg_buffer_reserve(tree, &levels[level], levels[level].num + index->buf.num)) {
+    memcpy(&levels[level].msgs[levels[level].num], index->buf.msgs,
+           index->buf.num * sizeof(pair_t));
+    levels[level].num 	+= index->buf.num;
+    index->buf.num 	= 0;
+    index->buf.sorted 	= 0;
+  }
+
+  for (i = 0; i <= index->num; i++)
+    bplus_tree_collect_messages(tree, index->child[i], level + 1, levels);
+}
+
+/*
+ * apply every pending message to the leaves
+ */
+void
+bplus_tree_flush_all (bplus_tree_t *tree)
+{
+  int level 		= 0;
+  bplus_msg_buffer_t levels[BPLUS_MAX_HEIGHT];
+  bplus_msg_buffer_t work;
+
+  if (!tree || !tree->root)
+    return;
+
+  memset(levels, 0, sizeof(levels));
+  memset(&work, 0, sizeof(work));
+  bplus_tree_collect_messages(tree, tree->root, 0, levels);
+
+  /* deeper messages are older; apply them first */
+  for (level = BPLUS_MAX_HEIGHT - 1; level >= 0; level--) {
+
+    if (!levels[level].num)
+      continue;
+
+    if (msg_buffer_reserve(tree, &work, work.num + levels[level].num)) {
+      memcpy(&work.msgs[work.num], levels[level].msgs,
+             levels[level].num * sizeof(pair_t));
+      work.num += levels[level].num;
+    }
+    free(levels[level].msgs);
+  }
+
+  bplus_tree_apply_messages(tree, &work);
+
+  /* free whatever the readers are done with */
+  bplus_key_retire(tree);
+  epoch_reclaim(&bplus_epoch);
+}
+
+/*
+ * switch the write optimized mode
+ * @param size  messages an index node buffers before a flush,
+ *              0 applies everything pending and turns buffering off
+ */
+void
+bplus_tree_set_buffer_size (bplus_tree_t *tree,
+                            int size)
+{
+  if (!tree)
+    return;
+
+  if (size < 0) {
+    printf("%s: Error: invalid buffer size %d\n", __FUNCTION__, size);
+    return;
+  }
+
+  if (!size)
+    bplus_tree_flush_all(tree);
+
+  tree->buffer_size = size;
+}
+
+/*
+ * wait a little for the other side of a ring (or a
+ * shared memory slot being published);
+ * spin first, then give up the cpu
+ */
+static inline void
+ring_wait (int *spins)
+{
+  if (++*spins < 128) {
+#ifdef __SSE2__
+    _mm_pause();
+#endif
+    return;
+  }
+
+  sched_yield();
+}
+
+/********************
+ * Static snapshots *
+ ********************/
+#ifndef BPLUS_KEY_STRING
+
+#define SNAP_ALIGN 		64
+#define SNAP_ROUND(x)		(((x) + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1))
+#define SNAP_ARRAY(s, off, T)	((T *)((uint8_t *)(s) + (s)->off))
+
+/* separators per cache line; the descent prefetches four levels ahead */
+#define SNAP_PREFETCH		(64 / sizeof(bplus_key_t))
+
+/*
+ * lay the separators out in Eytzinger order:
+ * an in-order walk of the implicit tree visits them sorted
+ */
+static void
+snapshot_fill_eytzinger (bplus_snapshot_t *snap,
+                         uint64_t k,
+                         uint64_t *leaf)
+{
+  bplus_key_t *sep 	= SNAP_ARRAY(snap, sep_off, bplus_key_t);
+  uint32_t *rank 	= SNAP_ARRAY(snap, rank_off, uint32_t);
+  bplus_key_t *keys 	= SNAP_ARRAY(snap, key_off, bplus_key_t);
+
+  if (k > snap->num_leaves)
+    return;
+
+  snapshot_fill_eytzinger(snap, 2 * k, leaf);
+  sep[k] 	= keys[*leaf * BPLUS_SNAPSHOT_LEAF];
+  rank[k] 	= *leaf;
+  (*leaf)++;
+  snapshot_fill_eytzinger(snap, 2 * k + 1, leaf);
+}
+
+/*
+ * compile the tree into a static snapshot.
+ * Pending messages are applied and tombstones left out
+ * @return the snapshot (release with free()), NULL on failure
+ */
+bplus_snapshot_t *
+bplus_tree_snapshot (bplus_tree_t *tree)
+{
+  int i 			= 0;
+  uint64_t num 			= 0;
+  uint64_t leaf 		= 0;
+  uint64_t blob_bytes 		= 0;
+  uint64_t size 		= 0;
+  uint8_t *heap 		= NULL;
+  bplus_blob_t *blob 		= NULL;
+  bplus_tree_node_t *first 	= NULL;
+  bplus_tree_node_t *node 	= NULL;
+  bplus_snapshot_t *snap 	= NULL;
+  bplus_key_t *keys 		= NULL;
+  bplus_value_t *values 	= NULL;
+  uint8_t *flags 		= NULL;
+  bplus_snapshot_t hdr;
+
+  if (!tree)
+    return (NULL);
+
+  if (tree->buffer_size)
+    bplus_tree_flush_all(tree);
+
+  if (!bplus_tree_reader_enter())
+    return (NULL);
+
+  /* leftmost leaf */
+  first = tree->root;
+  while (first && !first->is_leaf)
+    first = first->u.index->child[0];
+
+  /* size the snapshot */
+  for (node = first; node; node = node->u.leaf->next) {
+    for (i = 0; i < node->u.leaf->num; i++) {
+
+      if (leaf_pair_dead(node->u.leaf, i))
+        continue;
+
+      num++;
+      if (!node->u.leaf->packed && (node->u.leaf->pairs[i].flags & BPLUS_PAIR_BLOB)) {
+        blob = (bplus_blob_t *)(uintptr_t)node->u.leaf->pairs[i].data.blob;
+        blob_bytes += SNAP_ROUND(sizeof(bplus_blob_t) + blob->len);
+      }
+    }
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic 		= BPLUS_SNAPSHOT_MAGIC;
+  hdr.key_size 		= sizeof(bplus_key_t);
+  hdr.num 		= num;
+  hdr.num_leaves 	= (num + BPLUS_SNAPSHOT_LEAF - 1) / BPLUS_SNAPSHOT_LEAF;
+  hdr.sep_off 		= SNAP_ROUND(sizeof(bplus_snapshot_t));
+  hdr.rank_off 		= SNAP_ROUND(hdr.sep_off + (hdr.num_leaves + 1) * sizeof(bplus_key_t));
+  hdr.key_off 		= SNAP_ROUND(hdr.rank_off + (hdr.num_leaves + 1) * sizeof(uint32_t));
+  hdr.value_off 	= SNAP_ROUND(hdr.key_off + num * sizeof(bplus_key_t));
+  hdr.flag_off 		= SNAP_ROUND(hdr.value_off + num * sizeof(bplus_value_t));
+  hdr.blob_off 		= SNAP_ROUND(hdr.flag_off + num);
+  size 			= hdr.blob_off + blob_bytes;
+  hdr.size 		= size;
+
+  snap = aligned_alloc(SNAP_ALIGN, SNAP_ROUND(size));
+  if (!snap) {
+    printf("%s: Error: Could not allocate memory\n", __FUNCTION__);
+    bplus_tree_reader_exit();
+    return (NULL);
+  }
+  memset(snap, 0, SNAP_ROUND(size));
+  *snap = hdr;
+
+  keys 		= SNAP_ARRAY(snap, key_off, bplus_key_t);
+  values 	= SNAP_ARRAY(snap, value_off, bplus_value_t);
+  flags 	= SNAP_ARRAY(snap, flag_off, uint8_t);
+  heap 		= SNAP_ARRAY(snap, blob_off, uint8_t);
+
+  /* copy the pairs */
+  num = 0;
+  for (node = first; node; node = node->u.leaf->next) {
+    for (i = 0; i < node->u.leaf->num; i++) {
+
+      if (leaf_pair_dead(node->u.leaf, i))
+        continue;
+
+      keys[num] 	= leaf_key_at(node->u.leaf, i);
+      values[num] 	= *leaf_value_at(node->u.leaf, i);
+      if (!node->u.leaf->packed && (node->u.leaf->pairs[i].flags & BPLUS_PAIR_BLOB)) {
+
+        blob = (bplus_blob_t *)(uintptr_t)node->u.leaf->pairs[i].data.blob;
+        memcpy(heap, blob, sizeof(bplus_blob_t) + blob->len);
+        values[num].blob 	= heap - (uint8_t *)snap;
+        flags[num] 		= BPLUS_PAIR_BLOB;
+        heap 			+= SNAP_ROUND(sizeof(bplus_blob_t) + blob->len);
+      }
+      num++;
+    }
+  }
+
+  bplus_tree_reader_exit();
+
+  snapshot_fill_eytzinger(snap, 1, &leaf);
+  return (snap);
+}
+
+/*
+ * index of the pair with key in the snapshot, -1 if absent.
+ * The fields are read from snap and the arrays are at their
+ * offsets from base, which is where snap was copied from
+ */
+static int64_t
+snapshot_find_in (const bplus_snapshot_t *snap,
+                  const void *base,
+                  bplus_key_t key)
+{
+  uint64_t k 			= 1;
+  uint64_t m 			= 0;
+  int64_t leaf 			= 0;
+  uint64_t start 		= 0;
+  uint64_t len 			= 0;
+  uint64_t half 		= 0;
+  const bplus_key_t *sep 	= NULL;
+  const uint32_t *rank 		= NULL;
+  const bplus_key_t *keys 	= NULL;
+
+  if (!snap || snap->magic != BPLUS_SNAPSHOT_MAGIC ||
+      snap->key_size != sizeof(bplus_key_t) || !snap->num)
+    return (-1);
+
+  m 	= snap->num_leaves;
+  sep 	= (const bplus_key_t *)((const uint8_t *)base + snap->sep_off);
+  rank 	= (const uint32_t *)((const uint8_t *)base + snap->rank_off);
+  keys 	= (const bplus_key_t *)((const uint8_t *)base + snap->key_off);
 
   /*
-   * root is empty
-   * promote the child if needed
-   * else tree is now empty
+   * branchless descent to the first separator > key;
+   * prefetching a line of great grand children ahead
    */
-  if (!root->is_leaf) {
-    new_root = get_first_child(root);
-    new_root->parent = NULL;
-    return (new_root);
+  while (k <= m) {
+    if (SNAP_PREFETCH)
+      __builtin_prefetch(sep + k * SNAP_PREFETCH);
+    k = 2 * k + BPLUS_KEY_LE(sep[k], key);
+  }
+  k >>= __builtin_ffsll(~k);
+
+  /* the leaf before it holds key, if anything does */
+  leaf = k ? (int64_t)rank[k] - 1 : (int64_t)m - 1;
+  if (leaf < 0 || leaf >= (int64_t)m)
+    return (-1);
+
+  /* branchless lower bound within the leaf */
+  start = leaf * BPLUS_SNAPSHOT_LEAF;
+  len 	= snap->num - start;
+  if (len > BPLUS_SNAPSHOT_LEAF)
+    len = BPLUS_SNAPSHOT_LEAF;
+
+  while (len > 1) {
+    half 	= len / 2;
+    start 	= BPLUS_KEY_LT(keys[start + half - 1], key) ? start + half : start;
+    len 	-= half;
+  }
+
+  if (!BPLUS_KEY_EQ(keys[start], key))
+    return (-1);
+
+  return (start);
+}
+
+static inline int64_t
+snapshot_find (const bplus_snapshot_t *snap,
+               bplus_key_t key)
+{
+  return (snapshot_find_in(snap, snap, key));
+}
+
+/*
+ *  search a key in a snapshot
+ *  @param value filled with the inline value (blob offset for blobs)
+ *  @return true - if key is present in the snapshot
+ */
+bool
+bplus_snapshot_search (const bplus_snapshot_t *snap,
+                       bplus_key_t key,
+                       bplus_value_t *value)
+{
+  int64_t i = 0;
+
+  i = snapshot_find(snap, key);
+  if (i == -1)
+    return (false);
+
+  if (value)
+    *value = SNAP_ARRAY(snap, value_off, const bplus_value_t)[i];
+  return (true);
+}
+
+/*
+ *  search a key stored as a blob in a snapshot
+ *  @return the value in place, NULL if absent or inline
+ */
+const void *
+bplus_snapshot_search_blob (const bplus_snapshot_t *snap,
+                            bplus_key_t key,
+                            size_t *len)
+{
+  int64_t i 			= 0;
+  const bplus_blob_t *blob 	= NULL;
+
+  i = snapshot_find(snap, key);
+  if (i == -1 || !(SNAP_ARRAY(snap, flag_off, const uint8_t)[i] & BPLUS_PAIR_BLOB))
+    return (NULL);
+
+  blob = (const bplus_blob_t *)((const uint8_t *)snap +
+                                SNAP_ARRAY(snap, value_off, const bplus_value_t)[i].blob);
+  if (len)
+    *len = blob->len;
+  return (blob->data);
+}
+
+/*
+ * Shared memory snapshots.
+ *
+ * A writer process publishes snapshots of its tree to POSIX shared
+ * memory, where reader processes search them in place; a snapshot is
+ * nothing but offsets, so it works at any address. There are two slots,
+ * name.0 and name.1, and a header object, name. A publish goes to the
+ * slot readers are not sent to and then turns them to it. Each slot has
+ * a sequence count, odd while it is written: a reader notes the count of
+ * the slot it is sent to, searches, and searches again if the count has
+ * moved, which only happens if two publishes overlap its search. A torn
+ * snapshot may be read meanwhile, so it is checked against the mapping
+ * before the search and the search stays inside the snapshot
+ */
+
+/*
+ * does the snapshot in len mapped bytes
+ * lie within them
+ */
+static bool
+snapshot_valid (const bplus_snapshot_t *snap,
+                uint64_t len)
+{
+  uint64_t m 	= snap->num_leaves;
+  uint64_t num 	= snap->num;
+
+  /* every offset is checked on its own first, so no sum can wrap */
+  return (len >= sizeof(*snap) && snap->magic == BPLUS_SNAPSHOT_MAGIC &&
+          snap->key_size == sizeof(bplus_key_t) && snap->size <= len && num <= len &&
+          m == (num + BPLUS_SNAPSHOT_LEAF - 1) / BPLUS_SNAPSHOT_LEAF &&
+          snap->sep_off <= len && snap->rank_off <= len && snap->key_off <= len &&
+          snap->value_off <= len && snap->flag_off <= len &&
+          snap->sep_off + (m + 1) * sizeof(bplus_key_t) <= len &&
+          snap->rank_off + (m + 1) * sizeof(uint32_t) <= len &&
+          snap->key_off + num * sizeof(bplus_key_t) <= len &&
+          snap->value_off + num * sizeof(bplus_value_t) <= len &&
+          snap->flag_off + num <= len);
+}
+
+/*
+ * map slot i of shm to hold at least len bytes;
+ * the writer grows the object to fit
+ */
+static bool
+shm_map_slot (bplus_shm_t *shm,
+              int i,
+              uint64_t len)
+{
+  void *map 	= NULL;
+  struct stat st;
+
+  if (fstat(shm->fd[i], &st))
+    return (false);
+
+  if ((uint64_t)st.st_size < len) {
+    if (!shm->writer)
+      return (false);
+
+    len = SNAP_ROUND(len + len / 2);
+    if (ftruncate(shm->fd[i], len))
+      return (false);
+  } else {
+    len = st.st_size;
+  }
+
+  map = mmap(NULL, len, shm->writer ? PROT_READ | PROT_WRITE : PROT_READ,
+             MAP_SHARED, shm->fd[i], 0);
+  if (map == MAP_FAILED)
+    return (false);
+
+  if (shm->slot[i])
+    munmap(shm->slot[i], shm->slot_len[i]);
+  shm->slot[i] 		= map;
+  shm->slot_len[i] 	= len;
+  return (true);
+}
+
+void
+bplus_shm_close (bplus_shm_t *shm)
+{
+  int i = 0;
+
+  if (!shm)
+    return;
+
+  for (i = 0; i < 2; i++) {
+    if (shm->slot[i])
+      munmap(shm->slot[i], shm->slot_len[i]);
+    if (shm->fd[i] >= 0)
+      close(shm->fd[i]);
+  }
+  if (shm->hdr)
+    munmap(shm->hdr, sizeof(bplus_shm_hdr_t));
+  if (shm->fd_hdr >= 0)
+    close(shm->fd_hdr);
+
+  free(shm);
+}
+
+/*
+ * open the objects of name; the writer creates
+ * them, emptied, readers find them
+ * @return NULL on failure
+ */
+static bplus_shm_t *
+shm_attach (const char *name,
+            bool writer)
+{
+  int i 		= 0;
+  int flags 		= writer ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY;
+  char path[BPLUS_SHM_NAME + 4];
+  bplus_shm_t *shm 	= NULL;
+  void *map 		= NULL;
+
+  if (strlen(name) >= BPLUS_SHM_NAME) {
+    printf("%s: Error: Name too long\n", __FUNCTION__);
+    return (NULL);
+  }
+
+  shm = calloc(1, sizeof(*shm));
+  if (!shm) {
+    printf("%s: Error: Unable to allocate memory\n", __FUNCTION__);
+    return (NULL);
+  }
+  shm->writer 	= writer;
+  shm->fd_hdr 	= shm->fd[0] = shm->fd[1] = -1;
+
+  shm->fd_hdr = shm_open(name, flags, 0644);
+  for (i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "%s.%d", name, i);
+    shm->fd[i] = shm_open(path, flags, 0644);
+  }
+  if (shm->fd_hdr < 0 || shm->fd[0] < 0 || shm->fd[1] < 0 ||
+      (writer && ftruncate(shm->fd_hdr, sizeof(bplus_shm_hdr_t)))) {
+    printf("%s: Error: Unable to open shared memory %s\n", __FUNCTION__, name);
+    bplus_shm_close(shm);
+    return (NULL);
+  }
+
+  map = mmap(NULL, sizeof(bplus_shm_hdr_t), writer ? PROT_READ | PROT_WRITE : PROT_READ,
+             MAP_SHARED, shm->fd_hdr, 0);
+  if (map == MAP_FAILED) {
+    printf("%s: Error: Unable to map shared memory %s\n", __FUNCTION__, name);
+    bplus_shm_close(shm);
+    return (NULL);
+  }
+  shm->hdr = map;
+
+  if (!writer && (shm->hdr->magic != BPLUS_SHM_MAGIC || shm->hdr->key_size != sizeof(bplus_key_t))) {
+    printf("%s: Error: %s holds no snapshots of this key type\n", __FUNCTION__, name);
+    bplus_shm_close(shm);
+    return (NULL);
+  }
+
+  return (shm);
+}
+
+/*
+ * create the shared memory objects of name for a writer,
+ * replacing any earlier ones; they hold no snapshot yet
+ */
+bplus_shm_t *
+bplus_shm_create (const char *name)
+{
+  bplus_shm_t *shm = shm_attach(name, true);
+
+  if (!shm)
+    return (NULL);
+
+  shm->hdr->key_size 	= sizeof(bplus_key_t);
+  shm->hdr->magic 	= BPLUS_SHM_MAGIC;
+  return (shm);
+}
+
+/*
+ * open the shared memory objects of name for reading
+ */
+bplus_shm_t *
+bplus_shm_open (const char *name)
+{
+  return (shm_attach(name, false));
+}
+
+/*
+ * remove the objects of name; mappings stay valid
+ */
+void
+bplus_shm_unlink (const char *name)
+{
+  int i = 0;
+  char path[BPLUS_SHM_NAME + 4];
+
+  shm_unlink(name);
+  for (i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "%s.%d", name, i);
+    shm_unlink(path);
+  }
+}
+
+/*
+ * publish a snapshot of tree to the readers of shm
+ * @return false if it could not be built or written
+ */
+bool
+bplus_shm_publish (bplus_shm_t *shm,
+                   bplus_tree_t *tree)
+{
+  int i 			= 0;
+  unsigned long seq 		= 0;
+  bplus_snapshot_t *snap 	= NULL;
+  bplus_shm_hdr_t *hdr 		= NULL;
+
+  if (!shm || !shm->writer)
+    return (false);
+
+  snap = bplus_tree_snapshot(tree);
+  if (!snap)
+    return (false);
+
+  hdr 	= shm->hdr;
+  i 	= !atomic_load_explicit(&hdr->active, memory_order_relaxed);
+  seq 	= atomic_load_explicit(&hdr->seq[i], memory_order_relaxed);
+
+  /* readers of this slot start over from here on */
+  atomic_store_explicit(&hdr->seq[i], seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  if (snap->size > shm->slot_len[i] && !shm_map_slot(shm, i, snap->size)) {
+    printf("%s: Error: Unable to grow shared memory\n", __FUNCTION__);
+    atomic_store_explicit(&hdr->seq[i], seq + 2, memory_order_release);
+    free(snap);
+    return (false);
+  }
+
+  memcpy(shm->slot[i], snap, snap->size);
+  atomic_store_explicit(&hdr->size[i], snap->size, memory_order_relaxed);
+  atomic_store_explicit(&hdr->seq[i], seq + 2, memory_order_release);
+  atomic_store_explicit(&hdr->active, i, memory_order_release);
+
+  free(snap);
+  return (true);
+}
+
+/*
+ *  search a key in the latest snapshot published to shm
+ *  @param value filled with the inline value (a blob is
+ *               left out, value.blob is its offset)
+ *  @return true - if key is present
+ */
+bool
+bplus_shm_search (bplus_shm_t *shm,
+                  bplus_key_t key,
+                  bplus_value_t *value)
+{
+  int i 			= 0;
+  int spins 			= 0;
+  bool found 			= false;
+  int64_t at 			= 0;
+  uint64_t size 		= 0;
+  unsigned long seq 		= 0;
+  bplus_shm_hdr_t *hdr 		= shm->hdr;
+  const uint8_t *base 		= NULL;
+  bplus_snapshot_t snap;
+  bplus_value_t copy;
+
+  memset(&copy, 0, sizeof(copy));
+  for (;;) {
+
+    i 	= atomic_load_explicit(&hdr->active, memory_order_acquire);
+    seq = atomic_load_explicit(&hdr->seq[i], memory_order_acquire);
+    if (seq & 1) {
+      ring_wait(&spins);
+      continue;
+    }
+
+    /* nothing published yet */
+    size = atomic_load_explicit(&hdr->size[i], memory_order_relaxed);
+    if (!size)
+      return (false);
+
+    if (size > shm->slot_len[i] && !shm_map_slot(shm, i, size)) {
+      if (atomic_load_explicit(&hdr->seq[i], memory_order_acquire) != seq)
+        continue;
+      printf("%s: Error: Unable to map shared memory\n", __FUNCTION__);
+      return (false);
+    }
+
+    /*
+     * a publish may rewrite the header under us: check and
+     * search one copy of it, against what we have mapped
+     */
+    base 	= (const uint8_t *)shm->slot[i];
+    memcpy(&snap, base, sizeof(snap));
+    at 		= snapshot_valid(&snap, shm->slot_len[i]) ?
+                  snapshot_find_in(&snap, base, key) : -1;
+    if (at >= 0)
+      memcpy(&copy, base + snap.value_off + at * sizeof(bplus_value_t), sizeof(copy));
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&hdr->seq[i], memory_order_relaxed) == seq)
+      break;
+  }
+
+  found = (at >= 0);
+  if (found && value)
+    *value = copy;
+  return (found);
+}
+#endif /* BPLUS_KEY_STRING */
+
+/*****************************
+ * NUMA replicated index     *
+ *****************************/
+
+/*
+ * number of index levels under node
+ */
+static int
+bplus_tree_height (bplus_tree_node_t *node)
+{
+  int height = 0;
+
+  while (!node->is_leaf) {
+    node = node->u.index->child[0];
+    height++;
+  }
+
+  return (height);
+}
+
+/*
+ * copy the index levels under node into arena kind;
+ * leaves are shared, not copied
+ */
+static bplus_tree_node_t *
+replica_copy (bplus_tree_t *tree,
+              bplus_tree_node_t *node,
+              int kind)
+{
+  int i 			= 0;
+  bplus_tree_node_t *copy 	= NULL;
+  index_node_t *index 		= NULL;
+
+  if (node->is_leaf)
+    return (node);
+
+  copy 	= node_alloc(kind, sizeof(bplus_tree_node_t));
+  index = node_alloc(kind, sizeof(index_node_t));
+  if (!copy || !index) {
+    node_free(copy);
+    node_free(index);
+    return (NULL);
+  }
+  memset(copy, 0, sizeof(bplus_tree_node_t));
+  memset(index, 0, sizeof(index_node_t));
+  copy->u.index = index;
+
+  index->keys 	= node_alloc(kind, tree->order * sizeof(bplus_key_t));
+  index->child 	= node_alloc(kind, tree->order * sizeof(void *));
+  if (!index->keys || !index->child) {
+    bplus_tree_delete_node(copy);
+    return (NULL);
+  }
+
+  index->num = node->u.index->num;
+  memcpy(index->keys, node->u.index->keys, index->num * sizeof(bplus_key_t));
+
+  for (i = 0; i <= index->num; i++) {
+
+    index->child[i] = replica_copy(tree, node->u.index->child[i], kind);
+    if (!index->child[i]) {
+      index->num = i - 1;
+      replica_retire(copy, bplus_tree_height(node));
+      return (NULL);
+    }
+  }
+
+  return (copy);
+}
+
+/*
+ * hand a replica over to EBR, leaving the shared leaves alone.
+ * A stale replica may point at leaves which are long gone,
+ * so they are told apart by height (0 for leaves), not by looking
+ */
+static void
+replica_retire (bplus_tree_node_t *node,
+                int height)
+{
+  int i = 0;
+
+  if (!node || height == 0)
+    return;
+
+  for (i = 0; i <= node->u.index->num; i++)
+    replica_retire(node->u.index->child[i], height - 1);
+
+  epoch_retire(&bplus_epoch, node, bplus_tree_free_node);
+}
+
+/*
+ * (re)build the per NUMA node copies of the index levels.
+ * Call it once the index settles (after a bulk load, periodically);
+ * any split or merge makes searches fall back to the tree until then.
+ * The copies are bound to their node when arenas are enabled
+ * @param num   copies to build, -1 for one per NUMA node, 0 to drop them
+ * @return number of copies built
+ */
+int
+bplus_tree_replicate (bplus_tree_t *tree,
+                      int num)
+{
+  int n 			= 0;
+
+  if (!tree)
+    return (0);
+
+  if (num < 0)
+    num = numa_num_nodes();
+  if (num > BPLUS_MAX_NUMA)
+    num = BPLUS_MAX_NUMA;
+
+  /* readers may still be on the old copies */
+  for (n = 0; n < tree->num_replicas; n++) {
+    replica_retire(tree->replica[n], tree->replica_height);
+    tree->replica[n] = NULL;
+  }
+  tree->num_replicas = 0;
+
+  if (!tree->root || num == 0 || tree->buffer_size)
+    return (0);
+
+  tree->replica_height = bplus_tree_height(tree->root);
+
+  for (n = 0; n < num; n++) {
+
+    bplus_arena[ARENA_REPLICA + n].numa = (n < numa_num_nodes()) ? n : BPLUS_NUMA_ANY;
+    tree->replica[n] = replica_copy(tree, tree->root, ARENA_REPLICA + n);
+    if (!tree->replica[n]) {
+      printf("%s: Error: could not replicate the index on node %d\n", __FUNCTION__, n);
+      break;
+    }
+  }
+
+  tree->num_replicas 	= n;
+  tree->replica_gen 	= tree->index_gen;
+
+  epoch_reclaim(&bplus_epoch);
+  return (n);
+}
+
+/*****************************
+ * Online defragmentation    *
+ *****************************/
+
+/*
+ * the arena objects a leaf is made of, in the order they are laid out
+ * @return number of objects
+ */
+static int
+leaf_objects (bplus_tree_node_t *node,
+              void *obj[4])
+{
+  leaf_node_t *leaf = node->u.leaf;
+
+  obj[0] = node;
+  obj[1] = leaf;
+  if (!leaf->packed) {
+    obj[2] = leaf->pairs;
+    return (3);
+  }
+
+  obj[2] = leaf->deltas;
+  obj[3] = leaf->values;
+  return (4);
+}
+
+/*
+ * first byte past the arena objects of a leaf
+ */
+static uint8_t *
+leaf_end (bplus_tree_node_t *node)
+{
+  void *obj[4];
+
+  return (arena_obj_end(obj[leaf_objects(node, obj) - 1]));
+}
+
+/*
+ * is node laid out right after prev, its objects back to back?
+ */
+static bool
+leaf_follows (bplus_tree_node_t *prev,
+              bplus_tree_node_t *node)
+{
+  int i 	= 0;
+  int num 	= 0;
+  uint8_t *end 	= NULL;
+  void *obj[4];
+
+  if (!prev || !node)
+    return (false);
+
+  end = leaf_end(prev);
+  num = leaf_objects(node, obj);
+  for (i = 0; i < num; i++) {
+
+    if (!end || (uint8_t *)obj[i] != end + sizeof(arena_obj_t))
+      return (false);
+    end = arena_obj_end(obj[i]);
+  }
+
+  return (true);
+}
+
+/*
+ * number of leaves laid out back to back from node on, up to DEFRAG_RUN
+ * @param after set to the first leaf past the run
+ */
+static int
+leaf_run (bplus_tree_node_t *node,
+          bplus_tree_node_t **after)
+{
+  int num = 1;
+
+  while (num < DEFRAG_RUN && leaf_follows(node, node->u.leaf->next)) {
+    node = node->u.leaf->next;
+    num++;
+  }
+
+  if (after)
+    *after = node->u.leaf->next;
+  return (num);
+}
+
+/*
+ * should the leaf go to the end of the arena? Only the head of a short
+ * run, and only if that extends the run its left neighbour ends or the
+ * run after it is short too. Moved leaves follow their left neighbour
+ * and long runs stay where they are, so a laid out tree stays put and
+ * a new leaf does not drag the rest of the chain along
+ */
+static bool
+leaf_should_move (bplus_tree_node_t *node)
+{
+  leaf_node_t *leaf 		= node->u.leaf;
+  bplus_tree_node_t *after 	= NULL;
+
+  if (leaf_follows(leaf->prev, node))
+    return (false);
+
+  if (leaf_run(node, &after) == DEFRAG_RUN)
+    return (false);
+
+  if (leaf->prev && leaf_end(leaf->prev) == bplus_arena[ARENA_LEAF].cur)
+    return (true);
+
+  return (after && leaf_run(after, NULL) < DEFRAG_RUN);
+}
+
+/*
+ * copy a leaf to the end of the arena, its objects back to back.
+ * The copy is not linked into the tree yet
+ */
+static bplus_tree_node_t *
+leaf_relocate (bplus_tree_node_t *node)
+{
+  int i 		= 0;
+  int num 		= 0;
+  arena_obj_t *hdr 	= NULL;
+  leaf_node_t *leaf 	= NULL;
+  void *obj[4];
+  void *copy[4];
+
+  num = leaf_objects(node, obj);
+  for (i = 0; i < num; i++) {
+
+    hdr 	= (arena_obj_t *)obj[i] - 1;
+    copy[i] 	= (hdr->cls == 0) ? NULL
+                                  : arena_alloc(hdr->kind, hdr->cls * ARENA_GRAIN, false);
+    if (!copy[i]) {
+      while (i-- > 0)
+        node_free(copy[i]);
+      return (NULL);
+    }
+    memcpy(copy[i], obj[i], hdr->cls * ARENA_GRAIN);
+  }
+
+  leaf 					= copy[1];
+  ((bplus_tree_node_t *)copy[0])->u.leaf = leaf;
+  if (leaf->packed) {
+    leaf->deltas = copy[2];
+    leaf->values = copy[3];
+  } else {
+    leaf->pairs = copy[2];
+  }
+
+  return (copy[0]);
+}
+
+/*
+ * fold the right sibling of node into it if the two fit in a leaf
+ * filled to the fill factor; path holds the ancestors of node
+ * @return true if they were merged
+ */
+static bool
+leaf_merge_next (bplus_tree_t *tree,
+                 bplus_path_t *path,
+                 bplus_tree_node_t *node)
+{
+  int slot 			= 0;
+  int max 			= 0;
+  bplus_key_t key 		= {0};
+  leaf_node_t *leaf 		= node->u.leaf;
+  bplus_tree_node_t *parent 	= NULL;
+  bplus_tree_node_t *next 	= NULL;
+
+  if (path->depth == 0)
+    return (false);
+
+  parent 	= path->node[path->depth - 1];
+  slot 		= path->slot[path->depth - 1];
+  if (slot >= parent->u.index->num)
+    return (false);
+
+  next 	= parent->u.index->child[slot + 1];
+  max 	= (tree->order - 1) * tree->fill_factor / 100;
+  if (leaf->num + next->u.leaf->num > max)
+    return (false);
+
+  if (!leaf_unpack(tree, node) || !leaf_unpack(tree, next))
+    return (false);
+
+  memcpy(&leaf->pairs[leaf->num], next->u.leaf->pairs,
+         next->u.leaf->num * sizeof(pair_t));
+  leaf->num 		+= next->u.leaf->num;
+  next->u.leaf->num 	= 0;
+
+  tree->hint.leaf = NULL;
+  tree->index_gen++;
+
+  /* pop the parent off the path and remove the separator from it */
+  key = parent->u.index->keys[slot];
+  path->depth--;
+  tree->root = delete_key_from_node(tree, tree->root, path, parent, slot, key);
+
+  bplus_tree_retire_node(tree, next);
+  return (true);
+}
+
+/*
+ * put a relocated leaf in the place of node
+ */
+static void
+leaf_replace (bplus_tree_t *tree,
+              bplus_path_t *path,
+              bplus_tree_node_t *node,
+              bplus_tree_node_t *copy)
+{
+  leaf_node_t *leaf = copy->u.leaf;
+
+  if (leaf->prev)
+    leaf->prev->u.leaf->next = copy;
+  if (leaf->next)
+    leaf->next->u.leaf->prev = copy;
+
+  if (path->depth == 0)
+    tree->root = copy;
+  else
+    path->node[path->depth - 1]->u.index->child[path->slot[path->depth - 1]] = copy;
+
+  if (tree->hint.leaf == node)
+    tree->hint.leaf = copy;
+  tree->index_gen++;
+
+  /* readers may still be on the old copy; its neighbours are left alone */
+  epoch_retire(&bplus_epoch, node, bplus_tree_free_node);
+}
+
+/*
+ * visit up to budget leaves in key order, merging neighbours which
+ * fit in one leaf and moving scattered leaves to the end of the arena,
+ * one after the other. A pass over a fragmented tree lays the leaves
+ * out in key order, so a range scan walks memory sequentially.
+ * Leaves only move when arenas are enabled. Each call resumes where
+ * the last one stopped
+ * @return number of leaves merged or moved
+ */
+int
+bplus_tree_defrag_step (bplus_tree_t *tree,
+                        int budget)
+{
+  int done 			= 0;
+  int visited 			= 0;
+  bplus_tree_node_t *node 	= NULL;
+  bplus_tree_node_t *copy 	= NULL;
+  bplus_tree_node_t *next 	= NULL;
+  bplus_key_t key 		= {0};
+  bplus_path_t path;
+
+  if (!tree)
+    return (0);
+
+  /* merges may leave messages in tree->orphans */
+  if (tree->buffer_size)
+    bplus_tree_flush_all(tree);
+
+  while (visited < budget && tree->root) {
+
+    path.depth = 0;
+    if (tree->has_defrag_cursor) {
+      node = find_leaf_for_key(tree->root, tree->defrag_cursor, &path);
+    } else {
+      for (node = tree->root; !node->is_leaf; node = node->u.index->child[0]) {
+        path.node[path.depth] 	= node;
+        path.slot[path.depth] 	= 0;
+        path.depth++;
+      }
+    }
+    if (!node)
+      break;
+    visited++;
+
+    /* look at the merged leaf again, it may take the next one too */
+    if (leaf_merge_next(tree, &path, node)) {
+      done++;
+      continue;
+    }
+
+    if (arena_on && leaf_should_move(node)) {
+      copy = leaf_relocate(node);
+      if (copy) {
+        leaf_replace(tree, &path, node, copy);
+        node = copy;
+        done++;
+      }
+    }
+
+    next = node->u.leaf->next;
+    if (!next) {
+      bplus_cursor_set(tree, &tree->defrag_cursor, &tree->has_defrag_cursor, NULL);
+      break;
+    }
+    key = leaf_key_at(next->u.leaf, 0);
+    bplus_cursor_set(tree, &tree->defrag_cursor, &tree->has_defrag_cursor, &key);
+  }
+
+  bplus_key_retire(tree);
+  epoch_reclaim(&bplus_epoch);
+  return (done);
+}
+
+/**************
+ * Statistics *
+ **************/
+
+/*
+ * bytes taken by a node object of size bytes
+ */
+static size_t
+node_bytes (void *ptr,
+            size_t size)
+{
+  arena_obj_t *obj = (arena_obj_t *)ptr - 1;
+
+  if (!ptr)
+    return (0);
+
+  if (!arena_on || obj->cls == 0)
+    return (arena_on ? sizeof(arena_obj_t) + size : size);
+
+  return (sizeof(arena_obj_t) + obj->cls * ARENA_GRAIN);
+}
+
+/*
+ * add a leaf to the stats
+ */
+static void
+bplus_tree_stats_leaf (bplus_tree_t *tree,
+                       bplus_tree_node_t *node,
+                       bplus_tree_stats_t *stats)
+{
+  int i 		= 0;
+  int fill 		= 0;
+  size_t size 		= 0;
+  leaf_node_t *leaf 	= node->u.leaf;
+  bplus_blob_t *blob 	= NULL;
+
+  stats->num_leafs++;
+  stats->entries 	+= leaf->num;
+  stats->leaf_bytes 	+= node_bytes(node, sizeof(bplus_tree_node_t)) +
+                           node_bytes(leaf, sizeof(leaf_node_t));
+
+  if (leaf->packed) {
+    size 		= ((leaf->num * leaf->packed + PACK_ALIGN - 1) / PACK_ALIGN) * PACK_ALIGN;
+    stats->num_packed++;
+    stats->leaf_bytes 	+= node_bytes(leaf->deltas, size) +
+                           node_bytes(leaf->values, leaf->num * sizeof(bplus_value_t));
+    stats->leaf_slack 	+= size - leaf->num * leaf->packed;
+  } else {
+    stats->leaf_bytes 	+= node_bytes(leaf->pairs, tree->order * sizeof(pair_t));
+    stats->leaf_slack 	+= (tree->order - leaf->num) * sizeof(pair_t);
+
+    for (i = 0; i < leaf->num; i++) {
+
+      if (leaf->pairs[i].flags & BPLUS_PAIR_DEAD)
+        stats->num_dead++;
+      if (leaf->pairs[i].flags & BPLUS_PAIR_BLOB) {
+        blob = (bplus_blob_t *)(uintptr_t)leaf->pairs[i].data.blob;
+        stats->blob_bytes += sizeof(bplus_blob_t) + blob->len;
+      }
+    }
+  }
+
+  fill = leaf->num * 100 / (tree->order - 1);
+  stats->leaf_fill_avg += fill;
+  if (stats->num_leafs == 1 || fill < stats->leaf_fill_min)
+    stats->leaf_fill_min = fill;
+}
+
+/*
+ * add the subtree under node to the stats
+ */
+static void
+bplus_tree_stats_node (bplus_tree_t *tree,
+                       bplus_tree_node_t *node,
+                       int level,
+                       bplus_tree_stats_t *stats)
+{
+  int i 		= 0;
+  int fill 		= 0;
+  index_node_t *index 	= NULL;
+
+  if (level > stats->height)
+    stats->height = level;
+
+  if (node->is_leaf) {
+    bplus_tree_stats_leaf(tree, node, stats);
+    return;
+  }
+
+  index 		= node->u.index;
+  stats->num_index++;
+  stats->index_keys 	+= index->num;
+  stats->buffered 	+= index->buf.num;
+  stats->index_bytes 	+= node_bytes(node, sizeof(bplus_tree_node_t)) +
+                           node_bytes(index, sizeof(index_node_t)) +
+                           node_bytes(index->keys, tree->order * sizeof(bplus_key_t)) +
+                           node_bytes(index->child, tree->order * sizeof(void *));
+  stats->buffer_bytes 	+= index->buf.cap * sizeof(pair_t);
+  stats->index_slack 	+= (tree->order - index->num) * sizeof(bplus_key_t) +
+                           (tree->order - index->num - 1) * sizeof(void *) +
+                           (index->buf.cap - index->buf.num) * sizeof(pair_t);
+
+  fill = index->num * 100 / (tree->order - 1);
+  stats->index_fill_avg += fill;
+  if (stats->num_index == 1 || fill < stats->index_fill_min)
+    stats->index_fill_min = fill;
+
+  for (i = 0; i <= index->num; i++)
+    bplus_tree_stats_node(tree, index->child[i], level + 1, stats);
+}
+
+/*
+ * walk the tree and report its footprint and occupancy.
+ * Takes time linear in the number of nodes; tree->num_leafs and
+ * tree->num_index are kept up to date for cheaper questions
+ */
+void
+bplus_tree_stats (bplus_tree_t *tree,
+                  bplus_tree_stats_t *stats)
+{
+  if (!stats)
+    return;
+
+  memset(stats, 0, sizeof(*stats));
+  if (!tree)
+    return;
+
+  if (tree->root)
+    bplus_tree_stats_node(tree, tree->root, 1, stats);
+
+  stats->buffered 	+= tree->orphans.num;
+  stats->buffer_bytes 	+= tree->orphans.cap * sizeof(pair_t);
+  if (tree->filter)
+    stats->filter_bytes = tree->filter->num_blocks * BPLUS_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+  stats->total_bytes 	= stats->leaf_bytes + stats->index_bytes +
+                          stats->buffer_bytes + stats->blob_bytes + stats->filter_bytes;
+  stats->arena_mapped 	= bplus_arena[ARENA_LEAF].mapped + bplus_arena[ARENA_INDEX].mapped;
+
+  if (stats->num_leafs)
+    stats->leaf_fill_avg /= stats->num_leafs;
+  if (stats->num_index)
+    stats->index_fill_avg /= stats->num_index;
+}
+
+/*******************
+ * Parser function *
+ *******************/
+/*
+ * This function is used as a parser
+ * for the input file
+ * This function will call the following
+ * functions for each of the following inputs
+ ************************************************************
+ * 1. Initialie(m)	- bplus_tree_create(order)
+ *    Here, order 	= m
+ ************************************************************
+ * 2. Insert(a, b)	- bplus_tree_insert(tree, key, value)
+ *    Here, key		= a
+ *          value	= b
+ ************************************************************
+ * 3. Delete(a)		- bplus_tree_delete(tree, key)
+ *    Here, key		= a
+ ************************************************************
+ * 4. Search(a)		- bplus_tree_search_key(tree, key, 
+ * 						&data)
+ *    Here, key		= a
+ *    	    data	= The value associated with that key
+ ************************************************************
+ * 5. Search(a,b)	- bplus_tree_range_search(tree, 
+ * 					low_key, high_key)
+ *    Here, low_key	= a
+ *          high_key	= b
+ ************************************************************
+ * 6. Update(a, b)	- bplus_tree_insert(tree, key, value)
+ *    of a key which is expected to be present
+ ************************************************************
+ * 7. Scan(a, n)	- the values of the first n keys >= a,
+ *    written like a range search
+ ************************************************************
+ * 8. ReadModifyWrite(a, b) - Search(a) followed by Update(a, b)
+ ************************************************************
+ * 9. Run()		- ends the load phase of a generated
+ *    workload; ignored here
+ ************************************************************
+ * 10. Buffer(n)	- bplus_tree_set_buffer_size(tree, n)
+ ************************************************************
+ * 11. LazyDelete(n)	- deletes leave tombstones unless n is 0
+ ************************************************************
+ * 12. Compact(n)	- bplus_tree_compact_step(tree, n)
+ ************************************************************
+ * 13. FillFactor(n)	- bplus_tree_set_fill_factor(tree, n)
+ ************************************************************
+ * The tree settings (10 - 13) write nothing.
+ * The file is mapped and tokenized in place, a line at a time.
+ * A binary trace (bplus_cmd_file_t) holds the same commands
+ * already parsed; bplustree -b input output writes one.
+ */
+
+static bool
+ring_init (spsc_ring_t *ring,
+           size_t slots,
+           size_t slot_size)
+{
+  memset(ring, 0, sizeof(*ring));
+  ring->slots = malloc(slots * slot_size);
+  if (!ring->slots) {
+    printf("%s: Error: Unable to allocate memory\n", __FUNCTION__);
+    return (false);
+  }
+
+  ring->mask 		= slots - 1;
+  ring->slot_size 	= slot_size;
+  ring->limit 		= slots;
+  return (true);
+}
+
+/*
+ * make the slots written so far visible to the consumer
+ */
+static inline void
+ring_publish (spsc_ring_t *ring)
+{
+  atomic_store_explicit(&ring->head, ring->write, memory_order_release);
+}
+
+/*
+ * next free slot, waiting for the consumer if the ring is full;
+ * fill it and call ring_put_done()
+ */
+static inline void *
+ring_put (spsc_ring_t *ring)
+{
+  int spins = 0;
+
+  while (ring->write == ring->limit) {
+
+    ring_publish(ring);
+    ring->limit = atomic_load_explicit(&ring->tail, memory_order_acquire) + ring->mask + 1;
+    if (ring->write == ring->limit)
+      ring_wait(&spins);
+  }
+
+  return (ring->slots + (ring->write & ring->mask) * ring->slot_size);
+}
+
+static inline void
+ring_put_done (spsc_ring_t *ring)
+{
+  if (!(++ring->write & (RING_BATCH - 1)))
+    ring_publish(ring);
+}
+
+/*
+ * next filled slot, waiting for the producer if the ring is empty;
+ * call ring_get_done() once it has been used
+ */
+static inline void *
+ring_get (spsc_ring_t *ring)
+{
+  int spins = 0;
+
+  while (ring->read == ring->avail) {
+
+    atomic_store_explicit(&ring->tail, ring->read, memory_order_release);
+    ring->avail = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (ring->read == ring->avail)
+      ring_wait(&spins);
+  }
+
+  return (ring->slots + (ring->read & ring->mask) * ring->slot_size);
+}
+
+/*
+ * @return true if ring_get() would not wait
+ */
+static inline bool
+ring_ready (spsc_ring_t *ring)
+{
+  if (ring->read == ring->avail)
+    ring->avail = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  return (ring->read != ring->avail);
+}
+
+static inline void
+ring_get_done (spsc_ring_t *ring)
+{
+  if (!(++ring->read & (RING_BATCH - 1)))
+    atomic_store_explicit(&ring->tail, ring->read, memory_order_release);
+}
+
+/*
+ * The output of the parser is formatted into out_buf
+ * and written to op when it fills up
+ */
+static char 	out_buf[OUT_BUF_SIZE];
+static size_t 	out_len;
+static struct server_conn_t_ *out_conn;	/* when set, the output goes to it instead */
+
+/*
+ * write out_buf to op; what is already in op's
+ * own buffer goes first
+ */
+void
+bplus_cmd_flush (void)
+{
+  size_t off 	= 0;
+  ssize_t ret 	= 0;
+
+  if (!out_len)
+    return;
+
+  if (out_conn) {
+    server_queue(out_conn, out_buf, out_len);
+    out_len = 0;
+    return;
   }
 
-  bplus_tree_delete_node(root);
-  return(NULL);
+  fflush(op);
+  while (off < out_len) {
+    ret = write(fileno(op), out_buf + off, out_len - off);
+    if (ret <= 0) {
+      printf("%s: Error: Unable to write the output file\n", __FUNCTION__);
+      break;
+    }
+    off += ret;
+  }
+  out_len = 0;
+}
+
+/*
+ * room for len more bytes at out_buf + out_len
+ */
+static inline char *
+out_reserve (size_t len)
+{
+  if (out_len + len > OUT_BUF_SIZE)
+    bplus_cmd_flush();
+
+  return (out_buf + out_len);
+}
+
+static inline void
+out_str (const char *str,
+         size_t len)
+{
+  memcpy(out_reserve(len), str, len);
+  out_len += len;
+}
+
+/*
+ * append value as "%0.2f" formats it. value * 100 is rounded to an
+ * integer by hand: fma() gives the rounding error of the product, which
+ * tells an exact half from values just off it, and exact halves go to
+ * even like printf(). Values of 1e13 and up (and NaN) go to snprintf()
+ */
+static void
+out_value (double value)
+{
+  char buf[32];
+  char *p 		= buf + sizeof(buf);
+  double abs 		= fabs(value);
+  double prod 		= 0;
+  double err 		= 0;
+  double whole 		= 0;
+  double half 		= 0;
+  uint64_t cents 	= 0;
+
+  if (!(abs < 1e13)) {
+    out_len += snprintf(out_reserve(DBL_MAX_10_EXP + 8), DBL_MAX_10_EXP + 8, "%0.2f", value);
+    return;
+  }
+
+  prod 	= abs * 100;
+  err 	= fma(abs, 100, -prod);
+  whole = floor(prod);
+  half 	= (prod - whole) - 0.5;		/* exact, as is prod - whole */
+  cents = (uint64_t)whole;
+
+  if (half > 0 || (half == 0 && (err > 0 || (err == 0 && (cents & 1)))))
+    cents++;
+
+  *--p = '0' + cents % 10;
+  cents /= 10;
+  *--p = '0' + cents % 10;
+  cents /= 10;
+  *--p = '.';
+  do {
+    *--p = '0' + cents % 10;
+    cents /= 10;
+  } while (cents);
+
+  if (signbit(value))
+    *--p = '-';
+
+  out_str(p, buf + sizeof(buf) - p);
+}
+
+/*
+ * Results of a command, as bplus_cmd_execute() hands them on:
+ * formatted into out_buf, or when pipelined passed through res_ring
+ * to the writer thread, which formats them
+ */
+enum {
+  RES_VALUE = 0,				/* first value of a line */
+  RES_NEXT_VALUE,				/* a value after a comma */
+  RES_NULL,					/* nothing found */
+  RES_EOL,
+  RES_END					/* no more results */
+};
+
+typedef struct parser_result_t_ {
+  double 	value;
+  int 		kind;				/* RES_* */
+} parser_result_t;
+
+static __thread spsc_ring_t 	*res_ring;
+
+/* tree the trace commands run on; each partitioned worker has its own */
+static __thread bplus_tree_t 	*tree;
+
+static void
+out_result (int kind,
+            double value)
+{
+  switch (kind) {
+  case RES_NEXT_VALUE:
+    out_str(",", 1);
+    /* fall through */
+  case RES_VALUE:
+    out_value(value);
+    break;
+  case RES_NULL:
+    out_str("Null", 4);
+    break;
+  case RES_EOL:
+    out_str("\n", 1);
+    break;
+  }
+}
+
+static void
+parser_result (int kind,
+               double value)
+{
+  parser_result_t *res = NULL;
+
+  if (!res_ring) {
+    out_result(kind, value);
+    return;
+  }
+
+  res 		= ring_put(res_ring);
+  res->kind 	= kind;
+  res->value 	= value;
+  ring_put_done(res_ring);
 }
 
+/*
+ * bplus_tree_scan() callback of Search(a, b) and Scan(a, n):
+ * writes the values separated by commas.
+ * left counts down the values Scan still wants
+ */
+typedef struct parser_scan_t_ {
+  long 		num;			/* values written */
+  long 		left;
+} parser_scan_t;
+
 static bool
-is_sibling_generous (bplus_tree_node_t *node)
+parser_scan_print (bplus_key_t key,
+                   const bplus_value_t *value,
+                   uint8_t flags,
+                   void *arg)
 {
-  int num = 0;
+  parser_scan_t *scan = arg;
 
-  if (!node)
+  (void)key;
+  (void)flags;
+  parser_result(scan->num++ ? RES_NEXT_VALUE : RES_VALUE, value->num);
+  return (--scan->left != 0);
+}
+
+/*
+ * write the values of low_key <= key <= high_key as one
+ * line of output, as Search(a, b) of a trace does
+ */
+void
+bplus_tree_range_search (bplus_tree_t *tree,
+                         bplus_key_t low_key,
+                         bplus_key_t high_key)
+{
+  parser_scan_t scan 	= {0};
+
+  if (BPLUS_KEY_LT(high_key, low_key)) {
+    printf("Please enter a valid range\n");
+    return;
+  }
+
+  scan.left = -1;
+  if (!bplus_tree_range_scan(tree, low_key, high_key, parser_scan_print, &scan))
+    parser_result(RES_NULL, 0);
+  parser_result(RES_EOL, 0);
+}
+
+/*
+ * verbs of the input file, matched without regard to case
+ */
+static const struct {
+  const char 	*name;
+  int 		len;
+  uint8_t 	op;
+} parser_verbs[] = {
+  { "Insert", 		6, 	BPLUS_CMD_INSERT },
+  { "Search", 		6, 	BPLUS_CMD_SEARCH },
+  { "Delete", 		6, 	BPLUS_CMD_DELETE },
+  { "Update", 		6, 	BPLUS_CMD_UPDATE },
+  { "Scan", 		4, 	BPLUS_CMD_SCAN },
+  { "ReadModifyWrite", 	15, 	BPLUS_CMD_RMW },
+  { "Initialize", 	10, 	BPLUS_CMD_INIT },
+  { "Run", 		3, 	BPLUS_CMD_RUN },
+  { "Buffer", 		6, 	BPLUS_CMD_BUFFER },
+  { "LazyDelete", 	10, 	BPLUS_CMD_LAZY },
+  { "Compact", 		7, 	BPLUS_CMD_COMPACT },
+  { "FillFactor", 	10, 	BPLUS_CMD_FILL },
+};
+
+/*
+ * exact powers of ten for parser_value()
+ */
+static const double parser_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool
+parser_is_sep (char c)
+{
+  return (c == ' ' || c == ',' || c == '(' || c == ')' || c == '\t' || c == '\r');
+}
+
+/*
+ * copy [str, end) into buf as a C string for the library parsers
+ */
+static char *
+parser_token (const char *str,
+              const char *end,
+              char *buf)
+{
+  int len = (end - str < MAX) ? end - str : MAX - 1;
+
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  return (buf);
+}
+
+/*
+ * parse the key in [str, end); a string key points at str
+ * @return false if it is not a number of the key type
+ */
+static bool
+parser_key (const char *str,
+            const char *end,
+            bplus_key_t *key)
+{
+#if defined(BPLUS_KEY_STRING)
+  *key = bplus_str_key_make(str, end - str);
+  return (true);
+#elif defined(BPLUS_KEY_TYPE)
+  char buf[MAX];
+
+  *key = bplus_key_parse(parser_token(str, end, buf));
+  return (true);
+#else
+  bool neg 		= false;
+  bplus_ukey_t val 	= 0;
+  bplus_ukey_t limit 	= ~(bplus_ukey_t)0;
+  const char *digits 	= NULL;
+
+  if (str < end && (*str == '-' || *str == '+'))
+    neg = (*str++ == '-');
+
+  /*
+   * magnitude allowed: the type's max, one more when negative.
+   * A negative unsigned key wraps around, as with strtoull()
+   */
+#ifndef BPLUS_KEY_UINT128
+  limit = (limit >> 1) + neg;
+#endif
+
+  for (digits = str; str < end && *str >= '0' && *str <= '9'; str++) {
+    if (val > (limit - (*str - '0')) / 10)
+      return (false);
+    val = (val * 10) + (*str - '0');
+  }
+
+  if (str == digits || str != end)
     return (false);
 
-  if (node->is_leaf)
-    num = node->u.leaf->num;
-  else
-    num = node->u.index->num;
+  *key = neg ? (bplus_key_t)(0 - val) : (bplus_key_t)val;
+  return (true);
+#endif
+}
 
-  if (num > (tree->order/2))
-    return (true);
+static long
+parser_long (const char *str,
+             const char *end)
+{
+  char buf[MAX];
 
-  return (false);
+  return (atol(parser_token(str, end, buf)));
 }
 
-static void
-get_sibling_and_parent_key (bplus_tree_node_t *node,
-                            bplus_tree_node_t **sibling,
-                            int *sibling_index,
-                            int *parent_key,
-                            int *parent_key_index)
+/*
+ * parse the value in [str, end). Up to 15 digits with no exponent fit a
+ * double exactly, as does the power of ten, so the one rounding of the
+ * division gives what atof() would; anything else goes to atof()
+ */
+static double
+parser_value (const char *str,
+              const char *end)
 {
-  int i 					= 0;
-  int num 					= 0;
-  int *keys 				= NULL;
-  void **children 			= NULL;
-  bplus_tree_node_t *parent = NULL;
+  char buf[MAX];
+  const char *p 	= str;
+  bool neg 		= false;
+  int digits 		= 0;
+  int frac 		= 0;
+  uint64_t mant 	= 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = (*p++ == '-');
+
+  for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+    mant = (mant * 10) + (*p - '0');
+
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++, frac++)
+      mant = (mant * 10) + (*p - '0');
+  }
+
+  if (p == end && digits > 0 && digits <= 15)
+    return (neg ? -(mant / parser_pow10[frac]) : mant / parser_pow10[frac]);
+
+  return (atof(parser_token(str, end, buf)));
+}
+
+/*
+ * parse the line at str into cmd in a single pass, without copying it;
+ * the line ends at a newline or at end
+ * @return start of the next line
+ */
+const char *
+bplus_cmd_parse (const char *str,
+                 const char *end,
+                 bplus_cmd_t *cmd)
+{
+  int i 		= 0;
+  int num 		= 0;
+  const char *verb 	= NULL;
+  const char *next 	= NULL;
+  const char *eol 	= memchr(str, '\n', end - str);
+  const char *arg[2];
+  const char *arg_end[2];
+
+  memset(cmd, 0, sizeof(*cmd));
+  next 	= eol ? eol + 1 : end;
+  eol 	= eol ? eol : end;
+
+  while (str < eol && parser_is_sep(*str))
+    str++;
+  verb = str;
+  while (str < eol && !parser_is_sep(*str))
+    str++;
+
+  if (str == verb)
+    return (next);
+
+  cmd->op = BPLUS_CMD_INVALID;
+  for (i = 0; i < (int)(sizeof(parser_verbs) / sizeof(parser_verbs[0])); i++) {
+    if (str - verb == parser_verbs[i].len &&
+        !strncasecmp(verb, parser_verbs[i].name, parser_verbs[i].len)) {
+      cmd->op = parser_verbs[i].op;
+      break;
+    }
+  }
 
   /*
-   * try to get the left neighbor for this node
+   * up to two operands, separated by
+   * any of " ,()"
    */
-  parent = node->parent;
-  if (!parent) {
-    printf("%s: Error: no parent\n", __FUNCTION__);
-    return;
+  while (num < 2) {
+
+    while (str < eol && parser_is_sep(*str))
+      str++;
+    if (str == eol)
+      break;
+
+    arg[num] = str;
+    while (str < eol && !parser_is_sep(*str))
+      str++;
+    arg_end[num++] = str;
   }
 
-  if (parent->is_leaf) {
-    printf("%s: Error: We shouldn't have hit a leaf node here\n", __FUNCTION__);
+  switch (cmd->op) {
+  case BPLUS_CMD_INIT:
+  case BPLUS_CMD_BUFFER:
+  case BPLUS_CMD_LAZY:
+  case BPLUS_CMD_COMPACT:
+  case BPLUS_CMD_FILL:
+    if (num > 0)
+      cmd->arg = parser_long(arg[0], arg_end[0]);
+    return (next);
+  case BPLUS_CMD_INVALID:
+  case BPLUS_CMD_RUN:
+    return (next);
+  default:
+    break;
+  }
+
+  if (num > 0 && !parser_key(arg[0], arg_end[0], &cmd->key)) {
+    cmd->op = BPLUS_CMD_INVALID;
+    return (next);
+  }
+  if (num < 2)
+    return (next);
+
+  switch (cmd->op) {
+  case BPLUS_CMD_SEARCH:
+    cmd->op = parser_key(arg[1], arg_end[1], &cmd->high_key) ? BPLUS_CMD_RANGE
+                                                             : BPLUS_CMD_INVALID;
+    break;
+  case BPLUS_CMD_SCAN:
+    cmd->arg = parser_long(arg[1], arg_end[1]);
+    break;
+  case BPLUS_CMD_DELETE:
+    break;
+  default:
+    cmd->value = parser_value(arg[1], arg_end[1]);
+    break;
+  }
+
+  return (next);
+}
+
+/*
+ * run one command on the driver's tree,
+ * writing its results to op
+ */
+void
+bplus_cmd_execute (const bplus_cmd_t *cmd)
+{
+  double data 		= 0;
+  parser_scan_t scan 	= {0};
+
+  switch (cmd->op) {
+  case BPLUS_CMD_INIT:
+    tree = bplus_tree_create(cmd->arg);
+    break;
+
+  case BPLUS_CMD_INSERT:
+  case BPLUS_CMD_UPDATE:
+    bplus_tree_insert(tree, cmd->key, cmd->value);
+    break;
+
+  case BPLUS_CMD_DELETE:
+    bplus_tree_delete_key(tree, cmd->key);
+    break;
+
+  /*
+   * ReadModifyWrite reads the key like
+   * Search does and then updates it
+   */
+  case BPLUS_CMD_SEARCH:
+  case BPLUS_CMD_RMW:
+    if (bplus_tree_search_key(tree, cmd->key, &data))
+      parser_result(RES_VALUE, data);
+    else
+      parser_result(RES_NULL, 0);
+    parser_result(RES_EOL, 0);
+
+    if (cmd->op == BPLUS_CMD_RMW)
+      bplus_tree_insert(tree, cmd->key, cmd->value);
+    break;
+
+  /* the values of low_key <= key <= high_key */
+  case BPLUS_CMD_RANGE:
+    bplus_tree_range_search(tree, cmd->key, cmd->high_key);
+    break;
+
+  /*
+   * Scan writes the values of the
+   * first n keys starting at key
+   */
+  case BPLUS_CMD_SCAN:
+    scan.left = cmd->arg;
+    if (scan.left <= 0 || !bplus_tree_scan(tree, cmd->key, parser_scan_print, &scan))
+      parser_result(RES_NULL, 0);
+    parser_result(RES_EOL, 0);
+    break;
+
+  /* tree settings */
+  case BPLUS_CMD_BUFFER:
+    bplus_tree_set_buffer_size(tree, cmd->arg);
+    break;
+
+  case BPLUS_CMD_LAZY:
+    if (tree)
+      tree->lazy_delete = (cmd->arg != 0);
+    break;
+
+  case BPLUS_CMD_COMPACT:
+    bplus_tree_compact_step(tree, cmd->arg);
+    break;
+
+  case BPLUS_CMD_FILL:
+    bplus_tree_set_fill_factor(tree, cmd->arg);
+    break;
+
+  case BPLUS_CMD_INVALID:
+    printf("Invalid input. The allowed inputs are- Initialize(), Insert(), Delete(), Search(), "
+           "Update(), Scan(), ReadModifyWrite(), Run(), Buffer(), LazyDelete(), Compact(), "
+           "FillFactor()\n");
+    break;
+
+  /*
+   * Run marks the end of the load phase
+   * of a generated workload
+   */
+  default:
+    break;
+  }
+}
+
+/*
+ * map the file of fp for bplus_trace_next(); a pipe or other
+ * unmappable file is read into memory instead
+ * @return false if it cannot be read or is a binary trace of another build
+ */
+bool
+bplus_trace_open (bplus_trace_t *trace,
+                  FILE *fp)
+{
+  size_t cap 			= 0;
+  size_t got 			= 0;
+  char *buf 			= NULL;
+  void *map 			= MAP_FAILED;
+  const bplus_cmd_file_t *hdr 	= NULL;
+  struct stat st;
+
+  memset(trace, 0, sizeof(*trace));
+
+  if (!fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+
+  if (map != MAP_FAILED) {
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    trace->base 	= map;
+    trace->size 	= st.st_size;
+    trace->mapped 	= true;
+  } else {
+    do {
+      trace->size += got;
+      if (trace->size == cap) {
+        cap = cap ? cap * 2 : (1 << 20);
+        buf = realloc(buf, cap);
+        if (!buf) {
+          printf("%s: Error: Unable to allocate memory\n", __FUNCTION__);
+          return (false);
+        }
+      }
+    } while ((got = fread(buf + trace->size, 1, cap - trace->size, fp)) > 0);
+    trace->base = buf;
+  }
+  trace->cur = trace->base;
+
+  if (trace->size < sizeof(*hdr) || memcmp(trace->base, BPLUS_CMD_MAGIC, sizeof(hdr->magic)))
+    return (true);
+
+  hdr = (const bplus_cmd_file_t *)trace->base;
+#ifdef BPLUS_KEY_STRING
+  printf("%s: Error: Binary traces need fixed size keys\n", __FUNCTION__);
+  bplus_trace_close(trace);
+  return (false);
+#endif
+  if (hdr->version != BPLUS_CMD_VERSION || hdr->cmd_size != sizeof(bplus_cmd_t)) {
+    printf("%s: Error: Binary trace of another version or key type\n", __FUNCTION__);
+    bplus_trace_close(trace);
+    return (false);
+  }
+
+  /* a cut short or padded file has no record boundaries to trust */
+  if ((trace->size - sizeof(*hdr)) % sizeof(bplus_cmd_t)) {
+    printf("%s: Error: Binary trace is not a whole number of commands\n", __FUNCTION__);
+    bplus_trace_close(trace);
+    return (false);
+  }
+
+  trace->binary 	= true;
+  trace->cur 		+= sizeof(*hdr);
+  return (true);
+}
+
+/*
+ * next command of the trace; a binary record
+ * of an unknown op comes back as BPLUS_CMD_INVALID
+ * @return false at the end
+ */
+bool
+bplus_trace_next (bplus_trace_t *trace,
+                  bplus_cmd_t *cmd)
+{
+  const char *end = trace->base + trace->size;
+
+  if (trace->binary) {
+    if ((size_t)(end - trace->cur) < sizeof(*cmd))
+      return (false);
+    memcpy(cmd, trace->cur, sizeof(*cmd));
+    trace->cur += sizeof(*cmd);
+
+    if (cmd->op >= BPLUS_CMD_NUM)
+      cmd->op = BPLUS_CMD_INVALID;
+    return (true);
+  }
+
+  if (trace->cur >= end)
+    return (false);
+
+  trace->cur = bplus_cmd_parse(trace->cur, end, cmd);
+  return (true);
+}
+
+void
+bplus_trace_close (bplus_trace_t *trace)
+{
+  if (trace->mapped)
+    munmap((void *)trace->base, trace->size);
+  else
+    free((void *)trace->base);
+
+  memset(trace, 0, sizeof(*trace));
+}
+
+/*
+ * replay the input file, text or binary
+ */
+void
+parser ()
+{
+  bplus_trace_t trace;
+  bplus_cmd_t cmd;
+
+  if (!bplus_trace_open(&trace, ip))
     return;
+
+  while (bplus_trace_next(&trace, &cmd))
+    bplus_cmd_execute(&cmd);
+
+  bplus_cmd_flush();
+  bplus_trace_close(&trace);
+}
+
+/*
+ * First stage of parser_pipeline(): parses the trace
+ * into the command ring, ending it with BPLUS_CMD_NUM
+ */
+static void *
+pipeline_read (void *arg)
+{
+  bplus_cmd_t *cmd 	= NULL;
+  spsc_ring_t *ring 	= arg;
+  bplus_trace_t trace;
+
+  if (!bplus_trace_open(&trace, ip)) {
+    cmd = ring_put(ring);
+    cmd->op = BPLUS_CMD_NUM;
+    ring_put_done(ring);
+    ring_publish(ring);
+    return (NULL);
   }
 
-  num = parent->u.index->num;
-  keys = parent->u.index->keys;
-  children = parent->u.index->child;
+  /*
+   * parse straight into the ring; the slot of a
+   * blank line is used again for the next one
+   */
+  for (;;) {
 
-  /* node has num + 1 child pointers  */
-  i = 0;
-  while (children[i] != node) {
-    i++;
+    cmd = ring_put(ring);
+    if (!bplus_trace_next(&trace, cmd))
+      break;
+
+    if (cmd->op != BPLUS_CMD_NONE)
+      ring_put_done(ring);
   }
 
-  *sibling_index = i - 1;
+  cmd->op = BPLUS_CMD_NUM;
+  ring_put_done(ring);
+  ring_publish(ring);
 
   /*
-   * node is the leftmost leaf
+   * string keys of commands still in the
+   * ring point into the mapped trace
    */
-  if (*sibling_index == -1) {
-    *parent_key_index = 0;
-    *sibling = children[1];
-  } else {
-    *parent_key_index = *sibling_index;
-    *sibling = children[*sibling_index];
+  while (atomic_load_explicit(&ring->tail, memory_order_acquire) != ring->write)
+    sched_yield();
+
+  bplus_trace_close(&trace);
+  return (NULL);
+}
+
+/*
+ * Last stage of parser_pipeline(): formats
+ * the results and writes them to op
+ */
+static void *
+pipeline_write (void *arg)
+{
+  parser_result_t *res 	= NULL;
+  spsc_ring_t *ring 	= arg;
+
+  for (;;) {
+
+    res = ring_get(ring);
+    if (res->kind == RES_END)
+      break;
+
+    out_result(res->kind, res->value);
+    ring_get_done(ring);
+  }
+
+  ring_get_done(ring);
+  atomic_store_explicit(&ring->tail, ring->read, memory_order_release);
+  bplus_cmd_flush();
+  return (NULL);
+}
+
+/*
+ * replay the input file like parser(), in three stages on their own
+ * threads: reading and parsing, running the commands on the tree (this
+ * thread), and formatting and writing the results. Commands and results
+ * pass in order through spsc rings, so the output is that of parser()
+ */
+void
+parser_pipeline ()
+{
+  bplus_cmd_t *cmd 	= NULL;
+  pthread_t reader;
+  pthread_t writer;
+  spsc_ring_t cmds;
+  spsc_ring_t results;
+
+  if (!ring_init(&cmds, CMD_RING_SLOTS, sizeof(bplus_cmd_t)))
+    return;
+  if (!ring_init(&results, RES_RING_SLOTS, sizeof(parser_result_t))) {
+    free(cmds.slots);
+    return;
+  }
+
+  if (pthread_create(&reader, NULL, pipeline_read, &cmds)) {
+    printf("%s: Error: Unable to start the reader\n", __FUNCTION__);
+    free(cmds.slots);
+    free(results.slots);
+    parser();
+    return;
+  }
+
+  /* without a writer this thread formats the results */
+  res_ring = &results;
+  if (pthread_create(&writer, NULL, pipeline_write, &results)) {
+    printf("%s: Error: Unable to start the writer\n", __FUNCTION__);
+    res_ring = NULL;
   }
 
-  *parent_key = keys[*parent_key_index];
+  for (;;) {
 
-  return;
-}
+    /* the writer may be waiting on results held back here */
+    if (res_ring && !ring_ready(&cmds))
+      ring_publish(res_ring);
 
-static void
-borrow_and_adjust_leaf_nodes (bplus_tree_node_t *root,
-                              bplus_tree_node_t *node,
-                              bplus_tree_node_t *sibling,
-                              int sibling_index,
-                              int parent_key_index,
-                              int parent_key)
-{
-  int i 			= 0;
-  int num1 			= 0;
-  int num2 			= 0;
-  pair_t *pairs1 	= NULL;
-  pair_t *pairs2 	= NULL;
+    cmd = ring_get(&cmds);
+    if (cmd->op == BPLUS_CMD_NUM)
+      break;
 
-  num1 		= node->u.leaf->num;
-  num2 		= sibling->u.leaf->num;
-  pairs1 	= node->u.leaf->pairs;
-  pairs2 	= sibling->u.leaf->pairs;
-  if (sibling_index == -1) {
-  
-    /*
-     * leaf is the left most leaf
-     * we need to borrow leftmost pair from sibling
-     * and place it in the rightmost pair of node.
-     * Also change the parent key at the parent_key_index
-     *
-     * example (for order = 5):
-     *              parent(4)
-     *    node: (2, 3) sibling: (7, 8, 9, 10)
-     *
-     * will become
-     *              parent(8)
-     *    node: (2, 3, 7) sibling: (8, 9, 10)
-     */
-    pairs1[num1] = pairs2[0];
-    for (i = 0; i < num2; i++) {
-      pairs2[i] = pairs2[i + 1];
-    }
-    node->parent->u.index->keys[parent_key_index] = pairs2[0].key;
+    bplus_cmd_execute(cmd);
+    ring_get_done(&cmds);
+  }
+
+  if (res_ring) {
+    parser_result(RES_END, 0);
+    ring_publish(&results);
+    pthread_join(writer, NULL);
+    res_ring = NULL;
   } else {
-    
-    /*
-     * leaf has a neighbor on the left
-     * we need to borrow rightmost pair from sibling
-     * and place it in the leftmost pair of node
-     * Also change the parent key at the parent_key_index
-     *
-     * example(for order = 5):
-     *              parent(4)
-     *    sibling: (2, 3, 4, 5) node: (7, 8)
-     *
-     * will become
-     *              parent(5)
-     *    sibling: (2, 3, 4) node: (5, 7, 8)
-     */
-    for (i = num1; i > 0; i--) {
-      pairs1[i] = pairs1[i - 1];
-    }
-    pairs1[0] = pairs2[num2 - 1];
-    node->parent->u.index->keys[parent_key_index] = pairs1[0].key;
+    bplus_cmd_flush();
   }
 
-  node->u.leaf->num++;
-  sibling->u.leaf->num--;
-  return;
+  /* let the reader see the ring drained */
+  ring_get_done(&cmds);
+  atomic_store_explicit(&cmds.tail, cmds.read, memory_order_release);
+  pthread_join(reader, NULL);
+
+  free(cmds.slots);
+  free(results.slots);
 }
 
-static void
-borrow_and_adjust_index_nodes (bplus_tree_node_t *root,
-                               bplus_tree_node_t *node,
-                               bplus_tree_node_t *sibling,
-                               int sibling_index,
-                               int parent_key_index,
-                               int parent_key)
+/*
+ * Partitioned replay (bplustree -w N). The key space is cut into up to
+ * N ranges at quantiles of a sample of the trace's keys, and each range
+ * has its own tree, owned by a worker thread. This thread parses the
+ * trace and hands every command to the worker of its key, in trace
+ * order, so each worker sees the writes to its keys in order and reads
+ * its own writes. Search(a, b) and Scan(a, n) go to every worker their
+ * range may reach. The writer thread takes an order entry per output
+ * line and puts the line together from the results of those workers,
+ * in key order; the order ring is the sequence of the lines, so the
+ * output is that of parser()
+ */
+typedef struct part_worker_t_ {
+  pthread_t 	thread;
+  spsc_ring_t 	cmds;
+  spsc_ring_t 	results;
+} part_worker_t;
+
+typedef struct part_order_t_ {
+  int 		first;				/* worker with the lowest keys of the line */
+  int 		num;				/* workers with a part of it, 0 ends the replay */
+  long 		limit;				/* values wanted, -1 for all */
+} part_order_t;
+
+typedef struct part_replay_t_ {
+  int 		num_workers;
+  bplus_key_t 	bound[PART_MAX_WORKERS];	/* worker w holds bound[w - 1] <= key < bound[w] */
+  part_worker_t workers[PART_MAX_WORKERS];
+  spsc_ring_t 	order;
+} part_replay_t;
+
+static int
+part_key_cmp (const void *a,
+              const void *b)
 {
-  int i = 0;
-  int *pkeys 	= NULL;					 //keys in parent node
-  int *nkeys 	= NULL;					 //keys in node
-  int *skeys 	= NULL;					 //keys in sibling
-  void **nchild = NULL;					 //child pointers in node
-  void **schild = NULL;					 //child pointers in sibling
-  int nnum 		= 0; 					 //number of keys in node
-  int snum 		= 0;					 //number of keys in sibling
-  bplus_tree_node_t *parent = NULL;
+  const bplus_key_t *x = a;
+  const bplus_key_t *y = b;
 
-  nnum 		= node->u.index->num;
-  snum 		= sibling->u.index->num;
-  nkeys 	= node->u.index->keys;
-  skeys 	= sibling->u.index->keys;
-  nchild 	= node->u.index->child;
-  schild 	= sibling->u.index->child;
-  parent 	= node->parent;
-  pkeys 	= parent->u.index->keys;
+  if (BPLUS_KEY_LT(*x, *y))
+    return (-1);
 
-  if (sibling_index == -1) {
+  return (BPLUS_KEY_LT(*y, *x) ? 1 : 0);
+}
 
-    /*
-     * the node is the leftmost node in the tree.
-     * borrow a key from sibling through the neighbor
-     */
-    bplus_tree_node_t *borrowed_child = NULL;
+/*
+ * set the range bounds from the keys of the first
+ * PART_SAMPLE commands of the trace
+ * @return number of ranges, at most num_workers
+ */
+static int
+part_set_bounds (part_replay_t *part,
+                 const bplus_trace_t *trace,
+                 int num_workers)
+{
+  int w 		= 0;
+  int num_bounds 	= 0;
+  long num 		= 0;
+  bplus_key_t key 	= {0};
+  bplus_key_t *keys 	= NULL;
+  bplus_trace_t sample 	= *trace;
+  bplus_cmd_t cmd;
+
+  keys = malloc(PART_SAMPLE * sizeof(bplus_key_t));
+  if (!keys)
+    return (1);
+
+  while (num < PART_SAMPLE && bplus_trace_next(&sample, &cmd)) {
+    if (cmd.op >= BPLUS_CMD_INSERT && cmd.op <= BPLUS_CMD_RMW)
+      keys[num++] = cmd.key;
+  }
+  qsort(keys, num, sizeof(bplus_key_t), part_key_cmp);
 
-    /*
-     * borrow the parent key in the node
-     * also adjust child pointers accordingly
-     */
-    nkeys[nnum] 		= parent_key;
-    nchild[nnum + 1] 	= schild[0];
+  for (w = 1; w < num_workers && num; w++) {
+    key = keys[num * w / num_workers];
+    if (!num_bounds || BPLUS_KEY_LT(part->bound[num_bounds - 1], key))
+      part->bound[num_bounds++] = key;
+  }
 
-    /*
-     * the child which was just borrowed now has a new parent
-     */
-    borrowed_child 			= (bplus_tree_node_t *)nchild[nnum + 1];
-    borrowed_child->parent 	= node;
+  free(keys);
+  return (num_bounds + 1);
+}
 
-    /*
-     * parent key at the parent_key_index will change to the leftmost key
-     * in sibling
-     */
-    pkeys[parent_key_index] = skeys[0];
-    
-    /*
-     * shift all the keys in sibling
-     */
-    for (i = 0; i < snum - 1; i++ )
-      skeys[i] = skeys[i + 1];
+/*
+ * worker owning key
+ */
+static inline int
+part_of (const part_replay_t *part,
+         bplus_key_t key)
+{
+  int lo = 0;
+  int hi = part->num_workers - 1;
+  int mid = 0;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (BPLUS_KEY_LT(key, part->bound[mid]))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
 
-    /*
-     * shift all the children in sibling
-     */
-    for (i = 0; i < snum; i++)
-      schild[i] = schild[i + 1];
-  } else {
-    
-    /*
-     * node has a sibling to its left.
-     * borrow the rightmost key fromm sibling
-     * and place it in leftmost key of node
-     * do the borrow through the parent
-     */
-    bplus_tree_node_t *borrowed_child = NULL;
+  return (lo);
+}
 
-    /*
-     * shift all keys in node
-     */
-    for (i = nnum; i > 0; i--)
-      nkeys[i] = nkeys[i - 1];
+/*
+ * next slot of one of the rings this thread fills. Before it may
+ * wait, everything handed out so far is published, or a worker could
+ * wait on a command held back here while the writer waits on it
+ */
+static void *
+part_put (part_replay_t *part,
+          spsc_ring_t *ring)
+{
+  int w = 0;
 
-    /*
-     * shift all the child pointers
-     */
-    for (i = nnum + 1; i > 0; i--)
-      nchild[i] = nchild[i - 1];
+  if (ring->write == ring->limit) {
+    for (w = 0; w < part->num_workers; w++)
+      ring_publish(&part->workers[w].cmds);
+    ring_publish(&part->order);
+  }
 
-    /*
-     * borrow a key from sibling in node
-     * through parent
-     */
-    nkeys[0] = parent_key;
-    pkeys[parent_key_index] = skeys[snum - 1];
+  return (ring_put(ring));
+}
 
-    /*
-     * borrow the child pointer
-     */
-    nchild[0] = schild[snum];
+static void
+part_send (part_replay_t *part,
+           int w,
+           const bplus_cmd_t *cmd)
+{
+  spsc_ring_t *ring = &part->workers[w].cmds;
 
-    /*
-     * parent of the borrowed child has now changed
-     */
-    borrowed_child = (bplus_tree_node_t *)nchild[0];
-    borrowed_child->parent = node;
-  }
-  
-  /*
-   * After adjusting:
-   * node has one mmore key;
-   * sibling has one less key
-   */
-  node->u.index->num++;
-  sibling->u.index->num--;
+  *(bplus_cmd_t *)part_put(part, ring) = *cmd;
+  ring_put_done(ring);
 }
 
-
 static void
-borrow_from_sibling (bplus_tree_node_t *root,
-                     bplus_tree_node_t *node,
-                     bplus_tree_node_t *sibling,
-                     int sibling_index,
-                     int parent_key_index,
-                     int parent_key)
+part_send_order (part_replay_t *part,
+                 int first,
+                 int num,
+                 long limit)
 {
-  if (node->is_leaf)
-    return borrow_and_adjust_leaf_nodes(root, node, sibling, sibling_index,
-                                        parent_key_index, parent_key);
+  part_order_t *order = part_put(part, &part->order);
 
-  return (borrow_and_adjust_index_nodes(root, node, sibling, sibling_index,
-                                        parent_key_index, parent_key));
+  order->first 	= first;
+  order->num 	= num;
+  order->limit 	= limit;
+  ring_put_done(&part->order);
 }
 
-static bplus_tree_node_t *
-merge_parent_and_sibling_for_leaf_nodes (bplus_tree_node_t *root,
-                                         bplus_tree_node_t *node,
-                                         bplus_tree_node_t *sibling,
-                                         int sibling_index,
-                                         int parent_key_index,
-                                         int parent_key)
+/*
+ * hand one command of the trace to the workers
+ */
+static void
+part_dispatch (part_replay_t *part,
+               const bplus_cmd_t *cmd)
 {
-  int i = 0, j = 0;
-  int nnum 					= 0;
-  int snum 					= 0;
-  pair_t *npairs 			= NULL;
-  pair_t *spairs 			= NULL;
-  bplus_tree_node_t *parent = NULL;
+  int w 	= 0;
+  int first 	= 0;
+  int last 	= 0;
+
+  switch (cmd->op) {
+  case BPLUS_CMD_NONE:
+  case BPLUS_CMD_RUN:
+    break;
+
+  case BPLUS_CMD_INVALID:
+    bplus_cmd_execute(cmd);
+    break;
+
+  /* every worker has its own tree to set up */
+  case BPLUS_CMD_INIT:
+  case BPLUS_CMD_BUFFER:
+  case BPLUS_CMD_LAZY:
+  case BPLUS_CMD_COMPACT:
+  case BPLUS_CMD_FILL:
+    for (w = 0; w < part->num_workers; w++)
+      part_send(part, w, cmd);
+    break;
+
+  case BPLUS_CMD_SEARCH:
+  case BPLUS_CMD_RMW:
+    w = part_of(part, cmd->key);
+    part_send(part, w, cmd);
+    part_send_order(part, w, 1, -1);
+    break;
+
+  case BPLUS_CMD_RANGE:
+    if (BPLUS_KEY_LT(cmd->high_key, cmd->key)) {
+      printf("Please enter a valid range\n");
+      break;
+    }
 
-  nnum 		= node->u.leaf->num;
-  snum 		= sibling->u.leaf->num;
-  npairs 	= node->u.leaf->pairs;
-  spairs 	= sibling->u.leaf->pairs;
-  parent 	= node->parent;
+    first 	= part_of(part, cmd->key);
+    last 	= part_of(part, cmd->high_key);
+    for (w = first; w <= last; w++)
+      part_send(part, w, cmd);
+    part_send_order(part, first, last - first + 1, -1);
+    break;
 
   /*
-   * we will add all the pairs from node to neigh
-   * case1:
-   *  node is the leftmost node
-   *
-   *  example:
-   *          parent (<a> 16 <b>)
-   *
-   *    node (2)        sibling(17, 18)
-   *
-   *    node and neighbors have been swapped
-   *
-   *              ||
-   *              \/
-   *
-   *              parent(<a> 16 <b>)
-   *
-   *    node (17, 18)   sibling (2)
-   *
-   *  final state:
-   *
-   *                  parent(<a> 16(to be deleted) <b>)
-   *
-   *                  sibling(2, 17, 18)
-   *
-   *  case2:
-   *    node has a left neighbor
-   *
-   *  example:
-   *            parent (16)
-   *
-   *    node (2, 3, 5)        sibling(17, 18)
-   *
-   *    final-state:
-   *
-   *                parent (16 (to be deleted))
-   *
-   *                sibling(2, 3, 5, 17)
+   * every worker from that of the key on may hold
+   * some of the first n keys; the writer keeps n
    */
-  i = snum;
-  j = 0;
-  while (j < nnum) {
-    spairs[i++] = npairs[j++];
-    sibling->u.leaf->num++;
+  case BPLUS_CMD_SCAN:
+    first 	= part_of(part, cmd->key);
+    last 	= (cmd->arg > 0) ? part->num_workers - 1 : first;
+    for (w = first; w <= last; w++)
+      part_send(part, w, cmd);
+    part_send_order(part, first, last - first + 1, cmd->arg);
+    break;
+
+  default:
+    part_send(part, part_of(part, cmd->key), cmd);
+    break;
+  }
+}
+
+/*
+ * worker of the partitioned replay; its tree and result ring
+ * are those of this thread
+ */
+static void *
+part_work (void *arg)
+{
+  bplus_cmd_t *cmd 		= NULL;
+  part_worker_t *worker 	= arg;
+
+  tree 		= NULL;
+  res_ring 	= &worker->results;
+
+  for (;;) {
+
+    /* the writer may be waiting on results held back here */
+    if (!ring_ready(&worker->cmds))
+      ring_publish(&worker->results);
+
+    cmd = ring_get(&worker->cmds);
+    if (cmd->op == BPLUS_CMD_NUM)
+      break;
+
+    bplus_cmd_execute(cmd);
+    ring_get_done(&worker->cmds);
   }
 
-  root = delete_key_from_node(root, parent, node, parent_key); 
+  ring_publish(&worker->results);
+  bplus_tree_reader_unregister();
+  return (NULL);
+}
+
+/*
+ * writer of the partitioned replay: puts each output line
+ * together from the results of its workers
+ */
+static void *
+part_write (void *arg)
+{
+  int w 		= 0;
+  int kind 		= 0;
+  long num 		= 0;
+  double value 		= 0;
+  spsc_ring_t *ring 	= NULL;
+  part_replay_t *part 	= arg;
+  parser_result_t *res 	= NULL;
+  part_order_t order;
+
+  for (;;) {
+
+    order = *(part_order_t *)ring_get(&part->order);
+    ring_get_done(&part->order);
+    if (!order.num)
+      break;
+
+    num = 0;
+    for (w = order.first; w < order.first + order.num; w++) {
+
+      ring = &part->workers[w].results;
+      for (;;) {
+
+        res 	= ring_get(ring);
+        kind 	= res->kind;
+        value 	= res->value;
+        ring_get_done(ring);
+
+        if (kind == RES_EOL)
+          break;
+        if (kind == RES_NULL || (order.limit >= 0 && num >= order.limit))
+          continue;
+
+        out_result(num++ ? RES_NEXT_VALUE : RES_VALUE, value);
+      }
+    }
+
+    if (!num)
+      out_result(RES_NULL, 0);
+    out_result(RES_EOL, 0);
+  }
 
-  /* node can now be deleted */
-  bplus_tree_delete_node(node);
-  
-  return (root);
+  bplus_cmd_flush();
+  return (NULL);
 }
 
-static bplus_tree_node_t *
-merge_parent_and_sibling_for_index_nodes (bplus_tree_node_t *root,
-                                          bplus_tree_node_t *node,
-                                          bplus_tree_node_t *sibling,
-                                          int sibling_index,
-                                          int parent_key_index,
-                                          int parent_key)
+/*
+ * replay the input file like parser(), with the key
+ * space split between up to num_workers trees
+ */
+void
+parser_partitioned (int num_workers)
 {
-  int i = 0, j = 0;
-  int nnum 							= 0 ;
-  int snum 							= 0;
-  int *nkeys 						= NULL;
-  int *skeys 						= NULL;
-  void **nchild 					= NULL;
-  void **schild 					= NULL;
-  bplus_tree_node_t *parent 		= NULL;
-  bplus_tree_node_t *merged_child 	= NULL;
+  int w 		= 0;
+  int started 		= 0;
+  bool writer_started 	= false;
+  part_replay_t *part 	= NULL;
+  pthread_t writer;
+  bplus_trace_t trace;
+  bplus_cmd_t cmd;
+
+  if (num_workers < 1 || num_workers > PART_MAX_WORKERS) {
+    printf("%s: Error: 1 - %d workers\n", __FUNCTION__, PART_MAX_WORKERS);
+    return;
+  }
 
-  nnum 		= node->u.index->num;
-  snum 		= sibling->u.index->num;
-  nkeys 	= node->u.index->keys;
-  skeys 	= sibling->u.index->keys;
-  nchild 	= node->u.index->child;
-  schild 	= sibling->u.index->child;
-  parent 	= node->parent;
+  if (!bplus_trace_open(&trace, ip))
+    return;
 
-  skeys[snum] = parent_key;
-  snum = ++sibling->u.index->num;
-  
+  part = calloc(1, sizeof(*part));
+  if (!part) {
+    printf("%s: Error: Unable to allocate memory\n", __FUNCTION__);
+    bplus_trace_close(&trace);
+    return;
+  }
 
-  i = snum;
-  j = 0;
-  while (j < nnum) {
-    skeys[i] 	= nkeys[j];
-    schild[i] 	= nchild[j];
-    sibling->u.index->num++;
-    node->u.index->num--;
+  part->num_workers = part_set_bounds(part, &trace, num_workers);
+  if (!ring_init(&part->order, RES_RING_SLOTS, sizeof(part_order_t)))
+    goto out;
 
-    /* change parent for the merged child */
-    merged_child = (bplus_tree_node_t *)nchild[j];
-    merged_child->parent = sibling;
-    i++;
-    j++;
+  for (w = 0; w < part->num_workers; w++) {
+    if (!ring_init(&part->workers[w].cmds, CMD_RING_SLOTS, sizeof(bplus_cmd_t)) ||
+        !ring_init(&part->workers[w].results, RES_RING_SLOTS, sizeof(parser_result_t)))
+      goto out;
   }
 
-  /* onde more child */
-  schild[i] 	= nchild[j];
-  merged_child 	= (bplus_tree_node_t *)nchild[j];
-  merged_child->parent = sibling;
+  for (started = 0; started < part->num_workers; started++) {
+    if (pthread_create(&part->workers[started].thread, NULL, part_work, &part->workers[started])) {
+      printf("%s: Error: Unable to start a worker\n", __FUNCTION__);
+      goto stop;
+    }
+  }
+  if (pthread_create(&writer, NULL, part_write, part)) {
+    printf("%s: Error: Unable to start the writer\n", __FUNCTION__);
+    goto stop;
+  }
+  writer_started = true;
 
-  root = delete_key_from_node(root, parent, node, parent_key); 
+  while (bplus_trace_next(&trace, &cmd))
+    part_dispatch(part, &cmd);
 
-  /* node can now be deleted */
-  bplus_tree_delete_node(node);
- 
-  return (root);
+stop:
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.op = BPLUS_CMD_NUM;
+  for (w = 0; w < started; w++) {
+    part_send(part, w, &cmd);
+    ring_publish(&part->workers[w].cmds);
+  }
+  part_send_order(part, 0, 0, 0);
+  ring_publish(&part->order);
+
+  for (w = 0; w < started; w++)
+    pthread_join(part->workers[w].thread, NULL);
+  if (writer_started)
+    pthread_join(writer, NULL);
+
+out:
+  for (w = 0; w < part->num_workers; w++) {
+    free(part->workers[w].cmds.slots);
+    free(part->workers[w].results.slots);
+  }
+  free(part->order.slots);
+  free(part);
+  bplus_trace_close(&trace);
 }
 
-static bplus_tree_node_t *
-merge_parent_and_sibling (bplus_tree_node_t *root,
-                          bplus_tree_node_t *node,
-                          bplus_tree_node_t *sibling,
-                          int sibling_index,
-                          int parent_key_index,
-                          int parent_key)
+/*
+ * Server (bplustree -s path). Clients connect to a unix socket and send
+ * commands as in the input file, one per line; the answers are the lines
+ * parser() would write for them, so a trace sent down a connection gets
+ * back its output file. Updates are not answered. One thread serves all
+ * connections on the one tree from epoll: what a read brings in is run
+ * as a batch, every complete line of it, and the answers go back in one
+ * write. A client may send as far ahead as it likes; reading from it
+ * stops while SERVER_OUT_LIMIT bytes of answers wait for it
+ */
+typedef struct server_conn_t_ {
+  int 		fd;
+  uint32_t 	events;				/* epoll events asked for */
+  bool 		eof;				/* the client is done sending */
+  char 		*in;				/* a partial line, then what was read */
+  size_t 	in_len;
+  size_t 	in_cap;
+  char 		*out;				/* answers not sent yet */
+  size_t 	out_off;
+  size_t 	out_len;
+  size_t 	out_cap;
+} server_conn_t;
+
+/*
+ * append len bytes of answers to the output of conn
+ */
+static void
+server_queue (server_conn_t *conn,
+              const char *data,
+              size_t len)
 {
-  bplus_tree_node_t *tmp = NULL;
+  char *out 	= NULL;
+  size_t cap 	= conn->out_cap ? conn->out_cap : SERVER_READ_SIZE;
 
-  if (sibling_index == -1) {
-    tmp 	= node;
-    node 	= sibling;
-    sibling = tmp;
+  if (conn->out_off == conn->out_len)
+    conn->out_off = conn->out_len = 0;
+
+  if (conn->out_len + len > conn->out_cap) {
+
+    while (cap < conn->out_len + len)
+      cap *= 2;
+
+    out = realloc(conn->out, cap);
+    if (!out) {
+      printf("%s: Error: Unable to allocate memory\n", __FUNCTION__);
+      return;
+    }
+    conn->out 		= out;
+    conn->out_cap 	= cap;
   }
-  
-  if (node->is_leaf)
-    return (merge_parent_and_sibling_for_leaf_nodes(root, node,
-                                                    sibling, sibling_index,
-                                                    parent_key_index,
-                                                    parent_key));
 
-  return (merge_parent_and_sibling_for_index_nodes(root, node,
-                                                   sibling, sibling_index,
-                                                   parent_key_index,
-                                                   parent_key));
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
 }
 
-static bplus_tree_node_t *
-delete_key_from_node (bplus_tree_node_t *root,
-                      bplus_tree_node_t *node,
-                      bplus_tree_node_t *child,
-                      int key)
+/*
+ * run the complete lines read from conn,
+ * all of them once the client is done
+ */
+static void
+server_run (server_conn_t *conn)
 {
-  int parent_key 				= 0;
-  int parent_key_index 			= 0;
-  int sibling_index 			= 0;
-  bplus_tree_node_t *sibling 	= NULL;
+  const char *p 	= conn->in;
+  const char *end 	= conn->in + conn->in_len;
+  bplus_cmd_t cmd;
 
-  if (!root)
-    return (root);
+  if (!conn->eof) {
+    while (end > p && end[-1] != '\n')
+      end--;
+  }
 
-  if (!node)
-    return (root);
+  out_conn = conn;
+  while (p < end) {
+    p = bplus_cmd_parse(p, end, &cmd);
+    bplus_cmd_execute(&cmd);
+  }
+  bplus_cmd_flush();
+  out_conn = NULL;
 
-  if (!node->is_leaf && !child)
-    return (root);
+  conn->in_len -= p - conn->in;
+  memmove(conn->in, p, conn->in_len);
+}
 
-  /*
-   * delete the key and the child pointer fromm the node
-   * This will simply delete the key/pointer without adjusting the tree
-   */
-  adjust_node(node, child, key);
+/*
+ * send what conn has waiting
+ * @return false if the connection is broken
+ */
+static bool
+server_send (server_conn_t *conn)
+{
+  ssize_t ret = 0;
 
-  /*
-   * if deletion of key didn't violate b+ tree property
-   * nothing more to be done as tree remains unchanged
-   */
-  if (node_is_valid(root, node))
-    return (root);
-  
-  /*
-   * special case of root
-   */
-  if (node == root)
-    return (modify_root(root));
+  while (conn->out_off < conn->out_len) {
 
-  /*
-   * b+ tree properties are violated;
-   * adjust the tree accordingly
-   */
+    ret = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+    if (ret > 0) {
+      conn->out_off += ret;
+      continue;
+    }
 
-  get_sibling_and_parent_key(node, &sibling, &sibling_index,
-                             &parent_key, &parent_key_index);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    return (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+  }
 
-  /*
-   * see if we can borrow from sibling without
-   * violating the B+ tree properties.
-   * There is no change in the tree in this case;
-   * return root as is
-   */
-  if (is_sibling_generous(sibling)) {
+  conn->out_off = conn->out_len = 0;
+  return (true);
+}
 
-    borrow_from_sibling(root, node, sibling, sibling_index,
-                        parent_key_index, parent_key);
-    return (root);
+/*
+ * read and run what conn has sent
+ * @return false if the connection is broken
+ */
+static bool
+server_read (server_conn_t *conn)
+{
+  char *in 	= NULL;
+  ssize_t ret 	= 0;
+
+  while (!conn->eof && conn->out_len - conn->out_off <= SERVER_OUT_LIMIT) {
+
+    if (conn->in_cap - conn->in_len < SERVER_READ_SIZE) {
+      in = realloc(conn->in, conn->in_len + 2 * SERVER_READ_SIZE);
+      if (!in) {
+        printf("%s: Error: Unable to allocate memory\n", __FUNCTION__);
+        return (false);
+      }
+      conn->in 		= in;
+      conn->in_cap 	= conn->in_len + 2 * SERVER_READ_SIZE;
+    }
+
+    ret = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK);
+
+    conn->in_len 	+= ret;
+    conn->eof 		= (ret == 0);
+    server_run(conn);
   }
 
-  return (merge_parent_and_sibling(root, node, sibling, sibling_index,
-                                   parent_key_index, parent_key));
-  
+  return (true);
 }
 
-bplus_tree_node_t *
-bplus_tree_delete_key_util (bplus_tree_node_t *root,
-                            int key)
+static void
+server_close (int epfd,
+              server_conn_t *conn)
 {
-  bplus_tree_node_t *leaf;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
 
-  if (!root)
-    return (NULL);
+/*
+ * ask epoll for what conn is waiting on: more commands unless the
+ * client is done or has too many answers queued, and room to send
+ * @return false once there is nothing left to do for conn
+ */
+static bool
+server_watch (int epfd,
+              server_conn_t *conn)
+{
+  uint32_t events 		= 0;
+  struct epoll_event ev;
 
-  leaf = find_leaf_for_key(root, key);
-  if (!leaf)
-    return (NULL);
+  if (!conn->eof && conn->out_len - conn->out_off <= SERVER_OUT_LIMIT)
+    events |= EPOLLIN;
+  if (conn->out_off < conn->out_len)
+    events |= EPOLLOUT;
+
+  if (!events)
+    return (false);
+
+  if (events != conn->events) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events 		= events;
+    ev.data.ptr 	= conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events 	= events;
+  }
 
-  return (delete_key_from_node(root, leaf, NULL, key));
+  return (true);
 }
 
 static void
-bplus_tree_delete_key (bplus_tree_t *tree,
-                   int key)
+server_accept (int epfd,
+               int listen_fd)
 {
-  if (!tree)
-    return;
+  int fd 			= 0;
+  server_conn_t *conn 		= NULL;
+  struct epoll_event ev;
 
-  tree->root = bplus_tree_delete_key_util(tree->root, key);
+  while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
 
-  return;
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+      printf("%s: Error: Unable to allocate memory\n", __FUNCTION__);
+      close(fd);
+      continue;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    conn->fd 		= fd;
+    conn->events 	= EPOLLIN;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events 		= EPOLLIN;
+    ev.data.ptr 	= conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      printf("%s: Error: Unable to watch a connection\n", __FUNCTION__);
+      close(fd);
+      free(conn);
+    }
+  }
 }
 
-/*******************
- * Parser function *
- *******************/
 /*
- * This function is used as a parser
- * for the input file
- * This function will call the following
- * functions for each of the following inputs
- ************************************************************
- * 1. Initialie(m)	- bplus_tree_create(order)
- *    Here, order 	= m
- ************************************************************
- * 2. Insert(a, b)	- bplus_tree_insert(tree, key, value)
- *    Here, key		= a
- *          value	= b
- ************************************************************
- * 3. Delete(a)		- bplus_tree_delete(tree, key)
- *    Here, key		= a
- ************************************************************
- * 4. Search(a)		- bplus_tree_search_key(tree, key, 
- * 						&data)
- *    Here, key		= a
- *    	    data	= The value associated with that key
- ************************************************************
- * 5. Search(a,b)	- bplus_tree_range_search(tree, 
- * 					low_key, high_key)
- *    Here, low_key	= a
- *          high_key	= b
- ************************************************************
+ * serve the tree on the unix socket at path
+ * @return false if the socket could not be set up
  */
-
-void
-parser ()
+bool
+bplus_server (const char *path)
 {
-  
-  char str[100];
-  char *pch;
-  int key 	= 0;
-  float data 	= 0;
-  double value 	= 0;
-  int ret 	= 0;
-  int low_key 	= 0;
-  int high_key 	= 0;
-
-  while (ret = (fgets(str, MAX, ip))) {
-
- 	/*
-	 * check if reached the end of file
-	 */	  
-	if (ret == EOF)
-            break;
-
-	/*
-	 * Tokenize the input string 
-	 * from the input file
-	 */
-	pch = strtok(str, "()\n\r");
-	
-	if (pch == NULL)
-	    break;
-	/* If the token string is equal 
-	 * to Initialize then it calls
-	 * the bplus_tree_create(order) function
-	 */
-	if ((!(strncmp(pch, "Initialize", 10))) || (!strncmp(pch, "initialize", 10))) {
-		pch = strtok(NULL, "()\n");
-		/*
-		 * This tokenizing is done to get
-		 * the order of the tree
-		 */
-		if (pch != NULL) {
-			
-			/*
-			 * After we get the order of the tree
-			 * to be created, we call the below function
-			 */
-			tree = bplus_tree_create(atoi(pch));
-		}
-		continue;
+  int i 			= 0;
+  int num 			= 0;
+  int epfd 			= -1;
+  int listen_fd 		= -1;
+  server_conn_t *conn 		= NULL;
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  struct stat st;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("%s: Error: Socket path too long\n", __FUNCTION__);
+    return (false);
+  }
+  strcpy(addr.sun_path, path);
 
-	}
-	
-	/*
-	 * If the token string is equal 
-	 * to Insert then it calls the
-	 * bplus_tree_insert(tree, key, &data) function
-	 */
-	if ((!(strncmp(pch, "Insert", 6))) || (!strncmp(pch, "insert", 6))) {
-	
-		pch = strtok (NULL, " ,()\n\r");
-		/*
-		 * This tokenizing is done to 
-		 * get the key to be inserted
-		 */
-		if (pch != NULL) {
-			key = atoi(pch);
-		}
-
-		pch = strtok(NULL, ", )\n\r");
-		/*
-		 * This tokenizing is done to 
-		 * get the value associated with
-		 *  the key
-		 */
-		if (pch != NULL) {
-			value = atof(pch);
-		}
-
-		/* 
-		 * After getting the key and the value
-		 * it calls the insert function to 
-		 * insert the key and its value to the tree
-		 */
-		bplus_tree_insert(tree, key, value);
-		
-		/*
-		 * print_tree(tree) is function
-		 * which prints the created tree
-		 */
-		/*
-		 * printf("\n***********************\n");
-		 * print_tree(tree);
-		 * printf("\n***********************\n");
-		 */
-		continue;
+  /* a socket left behind by an earlier server */
+  if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+    unlink(path);
 
-	}
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(listen_fd, SOMAXCONN)) {
+    printf("%s: Error: Unable to listen on %s\n", __FUNCTION__, path);
+    goto fail;
+  }
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+  epfd = epoll_create1(0);
+  memset(&ev, 0, sizeof(ev));
+  ev.events 	= EPOLLIN;
+  ev.data.ptr 	= NULL;
+  if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+    printf("%s: Error: Unable to set up epoll\n", __FUNCTION__);
+    goto fail;
+  }
 
-	/*
-	 * If the token string is equal 
-	 * to Delete then it calls the
-	 * bplus_tree_delete_key(tree, key) function
-	 */
-	if ((!(strncmp(pch, "Delete", 6))) || (!strncmp(pch, "delete", 6))) {
-
-		pch = strtok (NULL, "( )\n\r");
-		/*
-		 * This tokenizing is done to 
-		 * get the key to be deleted
-		 * from the tree
-		 */
-		if (pch != NULL) {
-				key = atoi(pch);
-		}
-
-		/* 
-		 * After getting the key to be deleted
-		 * it calls the delete function to 
-		 * delete the key and its value from the tree
-		 */
-		bplus_tree_delete_key(tree, key);
-		
-		/*
-		 * print_tree(tree) is function
-		 * which prints the created tree
-		 */
-		/*
-		 * printf("\n***********************\n");
-		 * print_tree(tree);
-		 * printf("\n***********************\n");
-		 */
-		continue;
+  for (;;) {
 
-	}
-	
-	/*
-	 * If the token string is equal 
-	 * to Search then it calls either the
-	 * bplus_tree_search_key(tree, key, &data) function
-	 * 					OR
-	 * bplus_tree_range_search(tree, low_key, high_key)
-	 *function according to the input
-	 */
-	if ((!(strncmp(pch, "Search", 6))) || (!(strncmp(pch, "search", 6)))) {
-
-		pch = strtok (NULL, " ,()\n\r");
-		/*
-		 * This tokenizing is done to 
-		 * get the key to be searched
-		 */
-		if(pch != NULL) {
-				low_key = atoi(pch);
-				key = atoi(pch);
-		}
-		pch = strtok (NULL, ", )\n\r");
-		/*
-		 * This tokenizing is done to 
-		 * get either the high_key for the range search or to 
-		 * check whether a normal search key operation is required
-		 */
-		/*
-		 * If the pch is null then the search key function is call
-		 * else the range search function is called 
-		 */
-		if (pch == NULL) {
-				bplus_tree_search_key(tree, key, &data);
-				/*
-			     * If the key is found then we write 
-				 * the value associated with the key 
-				 * to the output file else we write 
-				 * Null to the file
-				 */
-				if (bplus_tree_search_key(tree, key, &data)) {
-				    fprintf(op, "%0.2f\n", data);
-				} else {
-				    fprintf(op, "Null\n");
-				}
-		} else if (pch != NULL) {
-			high_key = atoi(pch);
-			bplus_tree_range_search (tree, low_key, high_key);
-			
-			/*
-			 * This is done to remove the last comma at the
-			 * end of the range search output written to 
-			 * the file
-			 */
-			int char_to_delete = 1;
-			fseeko(op, -char_to_delete, SEEK_END);
-			int position = ftello(op);
-			ftruncate(fileno(op), position);
-			fprintf(op, "\n");
-			
-		}
-		continue;
-	}
+    num = epoll_wait(epfd, events, SERVER_MAX_EVENTS, -1);
+    if (num < 0 && errno == EINTR)
+      continue;
+    if (num < 0) {
+      printf("%s: Error: epoll_wait failed\n", __FUNCTION__);
+      goto fail;
+    }
+
+    for (i = 0; i < num; i++) {
+
+      conn = events[i].data.ptr;
+      if (!conn) {
+        server_accept(epfd, listen_fd);
+        continue;
+      }
 
-	printf("Invalid input. The allowed inputs are- Initialize(), Insert(), Delete(), Search()\n");
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !server_read(conn)) {
+        server_close(epfd, conn);
+        continue;
+      }
 
+      /* answers go out as soon as they are ready */
+      if (!server_send(conn) || !server_watch(epfd, conn))
+        server_close(epfd, conn);
+    }
   }
 
+fail:
+  if (epfd >= 0)
+    close(epfd);
+  if (listen_fd >= 0)
+    close(listen_fd);
+  return (false);
 }
 
 /********************
  * Driver function  *
  ********************/
+#ifndef BPLUS_TREE_NO_MAIN
+/*
+ * write the commands of the input file
+ * to out as a binary trace
+ */
+static bool
+parser_convert (FILE *out)
+{
+  bplus_trace_t trace;
+  bplus_cmd_t cmd;
+  bplus_cmd_file_t hdr;
+
+#ifdef BPLUS_KEY_STRING
+  printf("%s: Error: Binary traces need fixed size keys\n", __FUNCTION__);
+  return (false);
+#endif
+  if (!bplus_trace_open(&trace, ip))
+    return (false);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BPLUS_CMD_MAGIC, sizeof(hdr.magic));
+  hdr.version 	= BPLUS_CMD_VERSION;
+  hdr.cmd_size 	= sizeof(bplus_cmd_t);
+  fwrite(&hdr, sizeof(hdr), 1, out);
+
+  while (bplus_trace_next(&trace, &cmd)) {
+    if (cmd.op != BPLUS_CMD_NONE)
+      fwrite(&cmd, sizeof(cmd), 1, out);
+  }
+
+  bplus_trace_close(&trace);
+  return (!ferror(out));
+}
+
 int
 main (int argc, char* argv[])
 {
 
   char input_file_name[MAX_FILE_NAME];
+  char *output_file_name 	= "output_file.txt";
+  bool convert 			= false;
+  bool pipeline 		= false;
+  int workers 			= 0;
+  char *shm_name 		= NULL;
 
   if (argc == 1) {
 	  printf("Please enter the input file name");
 	  return 0;
   }
 
+  /*
+   * bplustree -s path serves the tree on the
+   * unix socket path instead of reading a file
+   */
+  if (argc == 3 && !strcmp(argv[1], "-s"))
+	  return (bplus_server(argv[2]) ? 0 : 1);
+
+  /*
+   * bplustree -m name input replays it and
+   * publishes the tree to shared memory name
+   */
+  if (argc >= 4 && !strcmp(argv[1], "-m")) {
+#ifdef BPLUS_KEY_STRING
+	  printf("Error: -m needs fixed size keys\n");
+	  return 1;
+#endif
+	  shm_name = argv[2];
+	  argv += 2;
+	  argc -= 2;
+  }
+
+  /*
+   * bplustree -b input output converts
+   * the input file to a binary trace
+   */
+  if (argc == 4 && !strcmp(argv[1], "-b")) {
+	  convert 		= true;
+	  output_file_name 	= argv[3];
+	  argv++;
+	  argc -= 2;
+  }
+
+  /*
+   * bplustree -p input replays it
+   * in a pipeline of three threads
+   */
+  if (argc == 3 && !strcmp(argv[1], "-p")) {
+	  pipeline = true;
+	  argv++;
+	  argc--;
+  }
+
+  /*
+   * bplustree -w n input replays it with
+   * the keys split between n trees
+   */
+  if (argc == 4 && !strcmp(argv[1], "-w")) {
+	  workers = atoi(argv[2]);
+	  argv += 2;
+	  argc -= 2;
+  }
+
   if (argc > 2) {
   		printf("Error: Unexpected command line argument passed\n");
 		return 0;
   }
 
+  /* only the serial replay leaves its tree with this thread */
+  if (shm_name && (convert || pipeline || workers)) {
+	  printf("Error: -m cannot be combined with -b, -p or -w\n");
+	  return 1;
+  }
+
   strcpy(input_file_name, argv[1]);
 
   /*
@@ -2456,7 +8140,7 @@ main (int argc, char* argv[])
    * opening the output file 
    * to which output is to be stored
    */
-  op = fopen("output_file.txt", "w");
+  op = fopen(output_file_name, "w");
   /*
    * Error checking
    * for opening the output file
@@ -2472,7 +8156,24 @@ main (int argc, char* argv[])
    * to evaluate the input file and
    * call the appropriate functions
    */
-  parser();
+  if (convert)
+	  parser_convert(op);
+  else if (pipeline)
+	  parser_pipeline();
+  else if (workers)
+	  parser_partitioned(workers);
+  else
+	  parser();
+
+#ifndef BPLUS_KEY_STRING
+  if (shm_name) {
+	  bplus_shm_t *shm = bplus_shm_create(shm_name);
+
+	  if (!bplus_shm_publish(shm, tree))
+		  printf("Could not publish the tree to %s\n", shm_name);
+	  bplus_shm_close(shm);
+  }
+#endif
 
   /*
    * Closing the input file
@@ -2485,3 +8186,4 @@ main (int argc, char* argv[])
   fclose(op);
 
 }
+#endif /* BPLUS_TREE_NO_MAIN */
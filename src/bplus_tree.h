@@ -1,6 +1,12 @@
 #ifndef BPLUS_TREE_H_
 #define BPLUS_TREE_H_
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
 /*****************************
  * Auxillary data structures *
  *****************************/
@@ -19,20 +25,273 @@ typedef struct queue_t_ {
   qnode_t 	*tail;
 } queue_t;
 
+/*
+ * Epoch based reclamation.
+ *
+ * Nodes unlinked from the tree are not freed right away; they are
+ * retired into the limbo list of the current global epoch and freed
+ * once every active reader has moved at least two epochs past it.
+ */
+#define EPOCH_MAX_READERS	64
+#define EPOCH_NUM_LISTS		3
+
+typedef struct epoch_entry_t_ {
+
+  void 			*ptr;			/* retired object */
+  void 			(*free_fn)(void *);	/* destructor for ptr */
+  struct epoch_entry_t_ *next;
+} epoch_entry_t;
+
+typedef struct epoch_reader_t_ {
+
+  atomic_ulong 	state;			/* (epoch << 1) | 1 while active, 0 otherwise */
+  atomic_bool 	in_use;			/* slot is owned by a thread */
+  char 		pad[64 - sizeof(atomic_ulong) - sizeof(atomic_bool)];
+} epoch_reader_t;
+
+typedef struct epoch_t_ {
+
+  atomic_ulong 		global_epoch;
+  atomic_flag 		lock;				/* serializes retire/reclaim */
+  int 			num_retired;			/* objects waiting in limbo */
+  epoch_entry_t 	*limbo[EPOCH_NUM_LISTS];	/* retired per epoch (mod 3) */
+  epoch_reader_t 	readers[EPOCH_MAX_READERS];
+} epoch_t;
+
+/*
+ * Node arenas.
+ *
+ * With the arena enabled tree nodes are carved out of 2 MiB regions
+ * (hugetlbfs pages if reserved, else transparent huge pages) instead of
+ * malloc, so a lookup walks few TLB entries. Index and leaf nodes come
+ * from separate arenas which keeps the index levels packed together.
+ * Every object has a small header naming its size class; freed objects
+ * go on the free list of their class for reuse.
+ */
+#define ARENA_REGION_SIZE	(2UL << 20)
+#define ARENA_GRAIN		16			/* size classes step */
+#define ARENA_NUM_CLASSES	4096			/* up to 64 KiB, larger ones use malloc */
+
+/*
+ * NUMA placement of the arena regions (bplus_arena_bind()):
+ * a node number, or one of these
+ */
+#define BPLUS_MAX_NUMA		8
+#define BPLUS_NUMA_ANY		-1			/* first touch */
+#define BPLUS_NUMA_INTERLEAVE	-2			/* pages spread over all nodes */
+
+enum {
+  ARENA_INDEX = 0,
+  ARENA_LEAF,
+  ARENA_REPLICA,				/* + NUMA node, replicated index levels */
+  ARENA_NUM = ARENA_REPLICA + BPLUS_MAX_NUMA
+};
+
+typedef struct arena_t_ {
+
+  atomic_flag 	lock;				/* alloc vs EBR reclaim */
+  int 		numa;				/* node regions are bound to, BPLUS_NUMA_* */
+  uint8_t 	*cur;				/* free space in the current region */
+  uint8_t 	*end;
+  size_t 	mapped;				/* bytes of regions mapped */
+  int 		num_huge;			/* regions backed by hugetlbfs */
+  void 		*free[ARENA_NUM_CLASSES];	/* free list per size class */
+} arena_t;
+
 /*******************************
  * B+ tree related definitions *
  *******************************/
 
+/*
+ * Key type of the tree, picked at compile time:
+ *   default               int
+ *   -DBPLUS_KEY_INT64     int64_t
+ *   -DBPLUS_KEY_UINT128   unsigned __int128
+ *   -DBPLUS_KEY_STRING    variable length byte strings (see below)
+ *   -DBPLUS_KEY_TYPE=T    any other type (e.g. a composite struct);
+ *                         BPLUS_KEY_LT(a, b), BPLUS_KEY_EQ(a, b),
+ *                         BPLUS_KEY_PARSE(str) and
+ *                         BPLUS_KEY_FORMAT(key, buf, len) must be
+ *                         defined along with it, and BPLUS_KEY_HASH(key)
+ *                         (64 bits) may be for bplus_tree_set_filter()
+ *
+ * Keys are only compared through the macros below, so every
+ * specialization compiles to plain compares with no comparator callback.
+ * Integral keys (BPLUS_KEY_INTEGRAL) can be delta packed in leaves;
+ * bplus_ukey_t is their unsigned counterpart used for the deltas.
+ */
+#if defined(BPLUS_KEY_TYPE)
+typedef BPLUS_KEY_TYPE 		bplus_key_t;
+#elif defined(BPLUS_KEY_INT64)
+typedef int64_t 		bplus_key_t;
+typedef uint64_t 		bplus_ukey_t;
+#define BPLUS_KEY_INTEGRAL
+#elif defined(BPLUS_KEY_UINT128)
+typedef unsigned __int128 	bplus_key_t;
+typedef unsigned __int128 	bplus_ukey_t;
+#define BPLUS_KEY_INTEGRAL
+#elif defined(BPLUS_KEY_STRING)
+
+/*
+ * Variable length string keys.
+ *
+ * The first 8 bytes are kept inline as a big endian integer, so most
+ * comparisons are decided by one integer compare. Longer keys stored
+ * in a tree keep the full byte string in a slot of one of the tree's
+ * key pages (see key_page_t); lookup keys which are not stored in the
+ * tree point at the caller's bytes instead.
+ * Keys compare as unsigned bytes (memcmp order), shorter key first.
+ */
+typedef struct bplus_str_key_t_ {
+    uint64_t 		prefix;			/* first 8 bytes, big endian, zero padded */
+    uint32_t 		len;			/* length of the key in bytes */
+    uint32_t 		ref;			/* key page slot holding the full key, 0 if none */
+    const uint8_t 	*ext;			/* full key, in its slot or the caller's bytes */
+} bplus_str_key_t;
+
+typedef bplus_str_key_t 	bplus_key_t;
+#define BPLUS_KEY_LT(a, b)	(bplus_str_key_cmp((a), (b)) < 0)
+#define BPLUS_KEY_EQ(a, b)	(bplus_str_key_cmp((a), (b)) == 0)
+
+/*
+ * Slotted key page:
+ * an offset array grows from the front of the page and
+ * the key bytes are carved from the end of the page.
+ * ref = (page number << KEY_PAGE_SLOT_BITS) | slot
+ *
+ * Index separators are copies of leaf keys and share their slot, which
+ * counts its users. The last one to go hands the slot to EBR, which puts
+ * it on the free list of its size class once no reader can be on it
+ */
+#define KEY_PAGE_SIZE		16384
+#define KEY_PAGE_SLOT_BITS	12
+#define KEY_MAX_PAGES		(1 << 19)
+#define BPLUS_STR_KEY_MAX	4096			/* longest key we store */
+#define KEY_SLOT_ALIGN		8			/* slot sizes are multiples of this */
+#define KEY_FREE_CLASSES	(BPLUS_STR_KEY_MAX / KEY_SLOT_ALIGN + 1)
+
+typedef struct key_slot_t_ {
+
+    uint16_t 	off;				/* offset of the bytes in the page */
+    uint16_t 	len;				/* number of bytes the slot holds */
+    uint16_t 	refs;				/* keys in the tree using the slot */
+} key_slot_t;
+
+typedef struct key_page_t_ {
+
+    uint16_t 	nslots;				/* entries in the offset array */
+    uint16_t 	heap;				/* start of the heap area */
+    key_slot_t 	slots[];			/* offset array */
+} key_page_t;
+
+typedef struct key_store_t_ {
+
+    atomic_flag 	lock;				/* serializes the writer and EBR */
+    int 		num_pages;			/* pages[1..num_pages] are in use */
+    int 		max_pages;			/* entries allocated in pages */
+    key_page_t 		**pages;
+    uint32_t 		free_list[KEY_FREE_CLASSES];	/* free slots by size / KEY_SLOT_ALIGN */
+    struct key_retired_t_ *retired;		/* slots released, not yet handed to EBR */
+} key_store_t;
+#else
+typedef int 			bplus_key_t;
+typedef unsigned int 		bplus_ukey_t;
+#define BPLUS_KEY_INTEGRAL
+#endif
+
+#ifndef BPLUS_KEY_LT
+#define BPLUS_KEY_LT(a, b)	((a) < (b))
+#endif
+
+#ifndef BPLUS_KEY_EQ
+#define BPLUS_KEY_EQ(a, b)	((a) == (b))
+#endif
+
+#define BPLUS_KEY_LE(a, b)	(!BPLUS_KEY_LT((b), (a)))
+#define BPLUS_KEY_GT(a, b)	(BPLUS_KEY_LT((b), (a)))
+
+#define BPLUS_KEY_STR_LEN	64	/* enough for any key type formatted in decimal */
+
+/*
+ * Value stored with each key.
+ *
+ * Values are BPLUS_VALUE_SIZE bytes stored inline in the leaf
+ * (-DBPLUS_VALUE_SIZE=N, default 8 which holds the double used by the
+ * trace driver). Larger or variable length values are kept out of line
+ * as blobs: the inline value then holds the blob handle and the pair is
+ * flagged with BPLUS_PAIR_BLOB.
+ */
+#ifndef BPLUS_VALUE_SIZE
+#define BPLUS_VALUE_SIZE	8
+#endif
+
+#if BPLUS_VALUE_SIZE < 8
+#error "BPLUS_VALUE_SIZE must be able to hold a double or a blob handle"
+#endif
+
+typedef union bplus_value_t_ {
+    double 	num;				/* numeric value (trace driver) */
+    uint64_t 	blob;				/* handle of an out of line value */
+    uint8_t 	bytes[BPLUS_VALUE_SIZE];	/* inline payload */
+} bplus_value_t;
+
+/*
+ * out of line value; the handle is the address of this header
+ */
+typedef struct bplus_blob_t_ {
+    size_t 	len;				/* bytes in data */
+    uint8_t 	data[];
+} bplus_blob_t;
+
+#define BPLUS_PAIR_BLOB		0x1		/* data is a blob handle */
+#define BPLUS_PAIR_DEAD		0x2		/* tombstone left by a lazy delete */
+
 typedef struct pair_t_ {
-    int 	key;        			/* key */
-    double	data;    			/* data */
+    bplus_key_t	key;        			/* key */
+    uint8_t 	flags;				/* BPLUS_PAIR_* */
+    bplus_value_t data;    			/* data */
 } pair_t;
 
+/*
+ * callback of bplus_tree_range_scan(); flags are BPLUS_PAIR_*.
+ * Return false to stop the scan
+ */
+typedef bool (*bplus_scan_fn_t)(bplus_key_t key, const bplus_value_t *value,
+                                uint8_t flags, void *arg);
+
+/*
+ * Write optimized (B-epsilon) mode.
+ *
+ * Inserts and deletes into a tree with index nodes are queued as
+ * messages in the root's buffer. A full buffer is flushed one child at a
+ * time: the child with the most pending messages gets them, either into
+ * its own buffer or, for a leaf, applied for real. Messages higher up
+ * are newer; a search returns the first one it meets on the way down,
+ * and a scan merges those of the nodes it passes into the leaf pairs.
+ * A message is a pair; a delete carries BPLUS_PAIR_DEAD.
+ */
+#define BPLUS_BUFFER_SIZE	1024		/* default messages per index node */
+#define BPLUS_MSG_LOG		32		/* appended messages merged in at once */
+
+/*
+ * msgs[0, sorted) are sorted by key with one message per key;
+ * new messages are appended after them and merged in BPLUS_MSG_LOG
+ * at a time, so a put does not shift the whole buffer
+ */
+typedef struct bplus_msg_buffer_t_ {
+
+    int 	num;				/* pending messages */
+    int 	sorted;				/* length of the sorted part */
+    int 	cap;				/* allocated entries in msgs */
+    pair_t 	*msgs;				/* sorted part, then newest last */
+} bplus_msg_buffer_t;
+
 typedef struct index_node_t_ {
 
     int 	num;        			/* number of keys in this node */
-    int 	*keys;      			/* array of keys in this node */
+    bplus_key_t	*keys;      			/* array of keys in this node */
     void 	**child;   			/* array of child pointers */
+    bplus_msg_buffer_t buf;			/* pending messages for the subtree */
 } index_node_t;
 
 typedef struct leaf_node_t_ {
@@ -41,12 +300,21 @@ typedef struct leaf_node_t_ {
     struct 	bplus_tree_node_t_ *next;    	/* next node */
     int 	num;                      	/* num of records in this leaf */
     pair_t      *pairs;          		/* iarray of <key, value> pairs */
+
+    /*
+     * packed (frame-of-reference) leaf:
+     * key[i] = base + deltas[i], deltas are 1 or 2 bytes wide.
+     * pairs is NULL while the leaf is packed
+     */
+    int 	packed;				/* delta width in bytes, 0 if not packed */
+    bplus_key_t	base;				/* smallest key in the leaf */
+    void 	*deltas;			/* array of key deltas */
+    bplus_value_t *values;			/* array of data */
 } leaf_node_t;
 
 typedef struct bplus_tree_node_t_ {
 
     bool 	is_leaf;   			/* set to true if this is a leaf node */
-    struct 	bplus_tree_node_t_ *parent;
 
     /*
      * A node in b-plus tree can be:
@@ -60,14 +328,398 @@ typedef struct bplus_tree_node_t_ {
     } u;
 } bplus_tree_node_t;
 
+/*
+ * Nodes do not point back to their parent.
+ * Insert and delete record the index nodes they pass on the way
+ * from the root to the leaf, along with the child slot taken in each,
+ * and walk back up this path to split, borrow and merge.
+ */
+#define BPLUS_MAX_HEIGHT	64
+
+/*
+ * Splits caused by inserts at the right end of the tree (ascending keys)
+ * keep fill_factor percent of the node on the left instead of half,
+ * since nothing will be inserted into the left node again.
+ * 50 gives the classic even split, 100 starts a fresh right node.
+ */
+#define BPLUS_FILL_FACTOR	90
+
+typedef struct bplus_path_t_ {
+
+    int 		depth;				/* number of index nodes on the path */
+    bplus_tree_node_t 	*node[BPLUS_MAX_HEIGHT];	/* index nodes, root first */
+    int 		slot[BPLUS_MAX_HEIGHT];		/* child slot taken in node[i] */
+} bplus_path_t;
+
+/*
+ * Leaf of the last insert and the fence keys bounding it:
+ * every key in [low, high) is routed to this leaf.
+ * A missing fence is open (leftmost / rightmost leaf), so for ascending
+ * keys the rightmost leaf keeps taking inserts with no descent.
+ * Cleared by any split, borrow or merge.
+ */
+typedef struct bplus_leaf_hint_t_ {
+
+    bplus_tree_node_t 	*leaf;				/* NULL if there is no hint */
+    bool 		has_low;			/* low fence is valid */
+    bool 		has_high;			/* high fence is valid */
+    bplus_key_t 	low;				/* smallest key routed to leaf */
+    bplus_key_t 	high;				/* first key routed past leaf */
+} bplus_leaf_hint_t;
+
+/*
+ * Blocked Bloom filter over the keys of a tree, in front of point lookups
+ * (bplus_tree_set_filter()). A key sets probes bits of one 64 byte block,
+ * so an absent key is usually turned away after one cache line instead
+ * of a descent. Bits are never cleared: deletes, and inserts past the
+ * keys it was sized for, count towards rebuilding it from the tree.
+ */
+#define BPLUS_FILTER_BLOCK_WORDS	8			/* 512 bits, a cache line */
+#define BPLUS_FILTER_MIN_KEYS		1024
+
+typedef struct bplus_filter_t_ {
+
+    int 		bits_per_key;
+    int 		probes;				/* bits set per key */
+    long 		capacity;			/* keys it was sized for */
+    long 		num_added;			/* inserts and updates since it was built */
+    long 		num_deleted;			/* deletes since it was built */
+    uint64_t 		num_blocks;
+    _Atomic uint64_t 	*words;				/* num_blocks * BPLUS_FILTER_BLOCK_WORDS */
+} bplus_filter_t;
+
 typedef struct bplus_tree_t_ {
     
     int 		order;                  /* set to m in an m-way tree */
     int 		num_leafs;              /* total number of leaf nodes currently present in the tree*/
     int 		num_index;              /* total number of index nodes currently in the tree */
+    bool 		pack_on_split;		/* pack the left leaf of an append split */
+    int 		fill_factor;		/* percent of a node kept on the left by an append split */
+    bplus_leaf_hint_t 	hint;			/* append cache for inserts */
+
+    /*
+     * lazy deletes only mark the pair as a tombstone;
+     * bplus_tree_compact_step() removes them later and rebalances
+     */
+    bool 		lazy_delete;		/* deletes leave tombstones */
+    int 		num_dead;		/* tombstones in the tree */
+    bool 		has_compact_cursor;	/* compaction resumes at compact_cursor */
+    bplus_key_t 	compact_cursor;		/* last tombstone compacted */
+
+    /*
+     * bplus_tree_defrag_step() walks the leaves in key order and
+     * lays them out back to back in the arena
+     */
+    bool 		has_defrag_cursor;	/* defragmentation resumes at defrag_cursor */
+    bplus_key_t 	defrag_cursor;		/* first key of the next leaf to visit */
+
+    bplus_filter_t 	*filter;		/* negative lookup filter, NULL if off */
+    int 		buffer_size;		/* messages per index node before a flush, 0 if unbuffered */
+    bplus_msg_buffer_t 	orphans;		/* messages of a root that collapsed onto a leaf */
+
+    /*
+     * per NUMA node copies of the index levels, sharing the leaves.
+     * Searches use the copy of their own node while it is current,
+     * i.e. no split, borrow or merge happened since it was built
+     */
+    unsigned long 	index_gen;		/* bumped by every change to the index levels */
+    unsigned long 	replica_gen;		/* index_gen the replicas were built at */
+    int 		num_replicas;
+    int 		replica_height;		/* index levels in each replica */
+    bplus_tree_node_t 	*replica[BPLUS_MAX_NUMA];
     bplus_tree_node_t 	*root;    		/* root of the tree */
+#ifdef BPLUS_KEY_STRING
+    key_store_t 	key_store;		/* bytes of the keys longer than 8 */
+#endif
 } bplus_tree_t;
 
+/*
+ * Static snapshot of a tree for read only use.
+ *
+ * One contiguous block; every array is found by its offset from the
+ * start of the block, so it can be copied, written out or mapped at any
+ * address. The pairs are kept sorted in leaves of BPLUS_SNAPSHOT_LEAF.
+ * The first key of every leaf is a separator; the separators are laid
+ * out in Eytzinger (BFS) order, sep[1] being the root and sep[2k],
+ * sep[2k + 1] the children of sep[k], so the descent needs no pointers
+ * and touches the levels in order.
+ * Blob values are copied into the block; value.blob holds the offset.
+ * Not available for BPLUS_KEY_STRING (the keys point into key pages).
+ */
+#define BPLUS_SNAPSHOT_MAGIC	0x53504c42	/* "BLPS" */
+#define BPLUS_SNAPSHOT_LEAF	16		/* pairs per snapshot leaf */
+
+typedef struct bplus_snapshot_t_ {
+
+    uint32_t 	magic;				/* BPLUS_SNAPSHOT_MAGIC */
+    uint32_t 	key_size;			/* sizeof(bplus_key_t) it was built with */
+    uint64_t 	size;				/* bytes in the snapshot */
+    uint64_t 	num;				/* pairs */
+    uint64_t 	num_leaves;			/* leaves, also separators */
+    uint64_t 	sep_off;			/* bplus_key_t sep[num_leaves + 1] */
+    uint64_t 	rank_off;			/* uint32_t leaf of sep[k] */
+    uint64_t 	key_off;			/* bplus_key_t keys[num] */
+    uint64_t 	value_off;			/* bplus_value_t values[num] */
+    uint64_t 	flag_off;			/* uint8_t flags[num] */
+    uint64_t 	blob_off;			/* copied blobs */
+} bplus_snapshot_t;
+
+/*
+ * snapshots shared between processes (bplus_shm_publish()): the header
+ * object of a name and the mappings of its two snapshot slots
+ */
+#define BPLUS_SHM_MAGIC		0x4d485342	/* "BSHM" */
+#define BPLUS_SHM_NAME		64		/* longest name, with the leading / */
+
+typedef struct bplus_shm_hdr_t_ {
+
+    uint32_t 		magic;			/* BPLUS_SHM_MAGIC */
+    uint32_t 		key_size;		/* sizeof(bplus_key_t) it was built with */
+    atomic_uint 	active;			/* slot of the latest snapshot */
+    atomic_ulong 	seq[2];			/* odd while the slot is written */
+    atomic_ulong 	size[2];		/* bytes of the snapshot in the slot */
+} bplus_shm_hdr_t;
+
+typedef struct bplus_shm_t_ {
+
+    bool 		writer;
+    int 		fd_hdr;
+    int 		fd[2];
+    bplus_shm_hdr_t 	*hdr;
+    bplus_snapshot_t 	*slot[2];
+    size_t 		slot_len[2];		/* bytes mapped */
+} bplus_shm_t;
+
+/*
+ * footprint and occupancy of a tree, filled by bplus_tree_stats().
+ * Bytes include the arena header and size class rounding of each object;
+ * slack is the part of the order sized arrays holding no entry.
+ * Fill is the percentage of the order - 1 key slots in use
+ */
+typedef struct bplus_tree_stats_t_ {
+
+    int 		height;			/* levels, 1 for a lone leaf */
+    long 		num_leafs;
+    long 		num_index;
+    long 		num_packed;		/* leaves in the packed format */
+    long 		entries;		/* pairs in the leaves, tombstones included */
+    long 		num_dead;		/* tombstones */
+    long 		index_keys;		/* separators in the index nodes */
+    long 		buffered;		/* messages waiting in index buffers */
+
+    size_t 		leaf_bytes;		/* leaf nodes and their pair arrays */
+    size_t 		index_bytes;		/* index nodes, keys and child pointers */
+    size_t 		buffer_bytes;		/* message buffers */
+    size_t 		blob_bytes;		/* out of line values */
+    size_t 		filter_bytes;		/* negative lookup filter */
+    size_t 		total_bytes;
+    size_t 		leaf_slack;
+    size_t 		index_slack;		/* unused key, child and buffer slots */
+    size_t 		arena_mapped;		/* leaf and index arena regions, shared by all trees */
+
+    double 		leaf_fill_avg;
+    int 		leaf_fill_min;
+    double 		index_fill_avg;
+    int 		index_fill_min;
+} bplus_tree_stats_t;
+
+/*
+ * hot path counters and per operation latency histograms, compiled in
+ * with -DBPLUS_INSTRUMENT. Each thread counts into its own copy;
+ * bplus_instrument_snapshot() adds them up. Latencies are in ticks
+ * (TSC cycles on x86, else ns): hist[op][b] counts the operations
+ * which took [2^b, 2^(b + 1)) ticks
+ */
+#define BPLUS_HIST_BUCKETS	40
+
+typedef enum bplus_op_e_ {
+    BPLUS_OP_SEARCH,
+    BPLUS_OP_INSERT,
+    BPLUS_OP_DELETE,
+    BPLUS_OP_RANGE,
+    BPLUS_OP_NUM
+} bplus_op_t;
+
+typedef struct bplus_instrument_t_ {
+
+    uint64_t 		descents;		/* root to leaf walks */
+    uint64_t 		node_visits;		/* index and leaf nodes looked into */
+    uint64_t 		compares;		/* key comparisons inside nodes */
+    uint64_t 		leaf_splits;		/* insert_into_full_leaf() */
+    uint64_t 		index_splits;		/* insert_key_into_full_parent() */
+    uint64_t 		borrows;		/* borrow_from_sibling() */
+    uint64_t 		merges;			/* merge_parent_and_sibling() */
+    uint64_t 		root_changes;		/* root grown by a split or collapsed by modify_root() */
+    uint64_t 		filter_rejects;		/* lookups answered by the filter alone */
+    uint64_t 		ops[BPLUS_OP_NUM];
+    uint64_t 		hist[BPLUS_OP_NUM][BPLUS_HIST_BUCKETS];
+    double 		ticks_per_ns;		/* set by bplus_instrument_snapshot() */
+    struct bplus_instrument_t_ *next; 		/* counters of the next thread */
+} bplus_instrument_t;
+
+/*
+ * one command of a trace. A binary trace is a bplus_cmd_file_t followed
+ * by bplus_cmd_t records as they are in memory, so it can be mapped and
+ * replayed without parsing; bplustree -b converts a text trace. The
+ * records hold the keys themselves, which rules out BPLUS_KEY_STRING.
+ * A command parsed from text with a string key points into the text.
+ * bplus_cmd_execute() buffers its output; bplus_cmd_flush() writes it to op
+ */
+#define BPLUS_CMD_MAGIC		"BPLUSCMD"
+#define BPLUS_CMD_VERSION	1
+
+typedef enum bplus_cmd_op_e_ {
+    BPLUS_CMD_NONE = 0,				/* blank line */
+    BPLUS_CMD_INVALID,
+    BPLUS_CMD_INIT,				/* Initialize(arg) */
+    BPLUS_CMD_INSERT,				/* Insert(key, value) */
+    BPLUS_CMD_UPDATE,				/* Update(key, value) */
+    BPLUS_CMD_DELETE,				/* Delete(key) */
+    BPLUS_CMD_SEARCH,				/* Search(key) */
+    BPLUS_CMD_RANGE,				/* Search(key, high_key) */
+    BPLUS_CMD_SCAN,				/* Scan(key, arg) */
+    BPLUS_CMD_RMW,				/* ReadModifyWrite(key, value) */
+    BPLUS_CMD_RUN,				/* Run() */
+    BPLUS_CMD_BUFFER,				/* Buffer(arg) */
+    BPLUS_CMD_LAZY,				/* LazyDelete(arg) */
+    BPLUS_CMD_COMPACT,				/* Compact(arg) */
+    BPLUS_CMD_FILL,				/* FillFactor(arg) */
+    BPLUS_CMD_NUM
+} bplus_cmd_op_t;
+
+typedef struct bplus_cmd_t_ {
+
+    uint8_t 		op;			/* bplus_cmd_op_t */
+    uint8_t 		pad[7];
+    int64_t 		arg;			/* order of Initialize, length of Scan,
+						   operand of the tree settings */
+    double 		value;
+    bplus_key_t 	key;
+    bplus_key_t 	high_key;
+} bplus_cmd_t;
+
+typedef struct bplus_cmd_file_t_ {
+
+    char 		magic[8];		/* BPLUS_CMD_MAGIC, not terminated */
+    uint32_t 		version;		/* BPLUS_CMD_VERSION */
+    uint32_t 		cmd_size;		/* sizeof(bplus_cmd_t) it was written with */
+} bplus_cmd_file_t;
+
+/*
+ * a trace file mapped for reading, text or binary
+ */
+typedef struct bplus_trace_t_ {
+
+    const char 		*base;
+    size_t 		size;
+    const char 		*cur;			/* next line or record */
+    bool 		binary;
+    bool 		mapped;			/* else base is malloc()ed */
+} bplus_trace_t;
+
+/*
+ * single producer, single consumer ring of fixed size slots between
+ * the stages of the pipelined replay (bplustree -p). Each side works on
+ * a private count and publishes it every RING_BATCH slots, or before
+ * it waits, so the shared cache lines move once per batch
+ */
+#define RING_BATCH	64
+
+typedef struct spsc_ring_t_ {
+
+    atomic_size_t 	head;			/* slots written, as published */
+    size_t 		write;			/* producer: slots written */
+    size_t 		limit;			/* producer: write may go up to this */
+    char 		pad0[64 - 3 * sizeof(size_t)];
+    atomic_size_t 	tail;			/* slots read, as published */
+    size_t 		read;			/* consumer: slots read */
+    size_t 		avail;			/* consumer: read may go up to this */
+    char 		pad1[64 - 3 * sizeof(size_t)];
+    size_t 		mask;			/* slots - 1, a power of two */
+    size_t 		slot_size;
+    char 		*slots;
+} spsc_ring_t;
+
+/**************
+ * Public API *
+ **************/
+
+/*
+ * The tree functions work on the tree they are passed.
+ * bplus_tree_range_search() writes a line of output as Search(a, b)
+ * of a trace does; bplus_cmd_flush() writes the output to op.
+ * Build with -DBPLUS_TREE_NO_MAIN to link the tree into another program
+ */
+extern FILE 		*op;
+
+/*
+ * reclamation domain of all trees. epoch_drain() frees whatever is
+ * retired, once no reader is left
+ */
+extern epoch_t 		bplus_epoch;
+
+int epoch_drain(epoch_t *e);
+
+bplus_key_t bplus_key_parse(const char *str);
+
+bplus_tree_t *bplus_tree_create(int order);
+void bplus_tree_set_fill_factor(bplus_tree_t *tree, int fill_factor);
+void bplus_tree_set_buffer_size(bplus_tree_t *tree, int size);
+void bplus_tree_set_filter(bplus_tree_t *tree, int bits_per_key);
+
+void bplus_tree_insert(bplus_tree_t *tree, bplus_key_t key, double value);
+void bplus_tree_insert_value(bplus_tree_t *tree, bplus_key_t key, const bplus_value_t *value);
+bool bplus_tree_insert_blob(bplus_tree_t *tree, bplus_key_t key, const void *value, size_t len);
+void bplus_tree_delete_key(bplus_tree_t *tree, bplus_key_t key);
+
+bool bplus_tree_search_key(bplus_tree_t *tree, bplus_key_t key, double *data);
+bool bplus_tree_search_value(bplus_tree_t *tree, bplus_key_t key, bplus_value_t *value);
+const void *bplus_tree_search_blob(bplus_tree_t *tree, bplus_key_t key, size_t *len);
+void bplus_tree_range_search(bplus_tree_t *tree, bplus_key_t low_key, bplus_key_t high_key);
+long bplus_tree_range_scan(bplus_tree_t *tree, bplus_key_t low_key, bplus_key_t high_key,
+                           bplus_scan_fn_t fn, void *arg);
+long bplus_tree_scan(bplus_tree_t *tree, bplus_key_t low_key, bplus_scan_fn_t fn, void *arg);
+
+void bplus_tree_flush_all(bplus_tree_t *tree);
+int bplus_tree_pack_leaves(bplus_tree_t *tree);
+int bplus_tree_compact_step(bplus_tree_t *tree, int budget);
+int bplus_tree_defrag_step(bplus_tree_t *tree, int budget);
+int bplus_tree_replicate(bplus_tree_t *tree, int num);
+void bplus_tree_stats(bplus_tree_t *tree, bplus_tree_stats_t *stats);
+void bplus_tree_reader_unregister(void);
+
+bool bplus_arena_enable(void);
+void bplus_arena_bind(int kind, int numa);
+
+bool bplus_instrument_snapshot(bplus_instrument_t *out);
+double bplus_instrument_percentile(const bplus_instrument_t *stats, bplus_op_t op, double pct);
+
+#ifndef BPLUS_KEY_STRING
+bplus_snapshot_t *bplus_tree_snapshot(bplus_tree_t *tree);
+bool bplus_snapshot_search(const bplus_snapshot_t *snap, bplus_key_t key, bplus_value_t *value);
+const void *bplus_snapshot_search_blob(const bplus_snapshot_t *snap, bplus_key_t key, size_t *len);
+
+bplus_shm_t *bplus_shm_create(const char *name);
+bplus_shm_t *bplus_shm_open(const char *name);
+bool bplus_shm_publish(bplus_shm_t *shm, bplus_tree_t *tree);
+bool bplus_shm_search(bplus_shm_t *shm, bplus_key_t key, bplus_value_t *value);
+void bplus_shm_close(bplus_shm_t *shm);
+void bplus_shm_unlink(const char *name);
+#endif
+
+bool bplus_trace_open(bplus_trace_t *trace, FILE *fp);
+bool bplus_trace_next(bplus_trace_t *trace, bplus_cmd_t *cmd);
+void bplus_trace_close(bplus_trace_t *trace);
+const char *bplus_cmd_parse(const char *str, const char *end, bplus_cmd_t *cmd);
+void bplus_cmd_execute(const bplus_cmd_t *cmd);
+void bplus_cmd_flush(void);
+void parser(void);
+void parser_pipeline(void);
+void parser_partitioned(int num_workers);
+bool bplus_server(const char *path);
+
+void print_tree(bplus_tree_t *tree);
+
 /*
  * helper function to check if the tree is empty
  */
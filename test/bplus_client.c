@@ -0,0 +1,142 @@
+/*
+ * Client of the trace server (bplustree -s path).
+ *
+ * Sends a trace down the socket and writes the answers to stdout, so
+ * the result can be diffed against the output file of a replay.
+ * The server may not be up yet; connecting is retried for a while.
+ *
+ * usage: bplus_client path input
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define CLIENT_RETRIES		100		/* connect attempts, 50 ms apart */
+#define CLIENT_BUF_SIZE		65536
+
+/*
+ * connect to the unix socket at path
+ * @return the socket, -1 if the server cannot be reached
+ */
+static int
+client_connect (const char *path)
+{
+  int i 	= 0;
+  int fd 	= -1;
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "bplus_client: socket path too long\n");
+    return (-1);
+  }
+  strcpy(addr.sun_path, path);
+
+  for (i = 0; i < CLIENT_RETRIES; i++) {
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      break;
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+      return (fd);
+
+    close(fd);
+    fd = -1;
+    usleep(50000);
+  }
+
+  fprintf(stderr, "bplus_client: cannot connect to %s\n", path);
+  return (-1);
+}
+
+/*
+ * write all of len bytes to fd
+ */
+static int
+client_write (int fd, const char *buf, size_t len)
+{
+  ssize_t ret = 0;
+
+  while (len) {
+
+    ret = write(fd, buf, len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return (-1);
+
+    buf += ret;
+    len -= ret;
+  }
+
+  return (0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int fd 		= -1;
+  int status 		= 0;
+  size_t len 		= 0;
+  ssize_t ret 		= 0;
+  pid_t pid 		= 0;
+  FILE *in 		= NULL;
+  char buf[CLIENT_BUF_SIZE];
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s path input\n", argv[0]);
+    return (1);
+  }
+
+  in = fopen(argv[2], "r");
+  if (!in) {
+    fprintf(stderr, "bplus_client: cannot open %s\n", argv[2]);
+    return (1);
+  }
+
+  fd = client_connect(argv[1]);
+  if (fd < 0)
+    return (1);
+
+  /*
+   * the server stops reading while answers wait for us,
+   * so a child sends the trace while we read
+   */
+  pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "bplus_client: fork failed\n");
+    return (1);
+  }
+
+  if (!pid) {
+    while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+      if (client_write(fd, buf, len))
+        _exit(1);
+    }
+    shutdown(fd, SHUT_WR);
+    _exit(0);
+  }
+
+  fclose(in);
+  for (;;) {
+
+    ret = read(fd, buf, sizeof(buf));
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    fwrite(buf, 1, ret, stdout);
+  }
+  close(fd);
+
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+    return (1);
+
+  return (ret < 0);
+}
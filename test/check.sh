@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# make check: replays the traces under test/ and diffs the outputs.
+#
+# inputN.txt with N in EXPECTED must give outputN.txt exactly; those
+# outputs are in numeric key order, so a BPLUS_KEY_STRING build runs
+# with EXPECTED= to skip them. Every trace replayed pipelined (-p),
+# partitioned (-w) and through the server (-s) must give what the
+# serial replay, parser(), gives.
+#
+# usage: test/check.sh [bplustree [bplus_client]]
+
+EXPECTED=${EXPECTED-"4 5 6 7 8 9"}
+WORKERS=3
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+bin=$(cd "$(dirname "${1:-$top/bplustree}")" && pwd)/$(basename "${1:-$top/bplustree}")
+client=$(cd "$(dirname "${2:-$top/bplus_client}")" && pwd)/$(basename "${2:-$top/bplus_client}")
+tmp=$(mktemp -d)
+failed=0
+server=
+
+cleanup () {
+  [ -n "$server" ] && kill "$server" 2>/dev/null
+  rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+fail () {
+  echo "FAIL: $1"
+  failed=$((failed + 1))
+}
+
+# replay $2 with the options in $1; the output ends up in $tmp/out
+replay () {
+  rm -f "$tmp/output_file.txt"
+  (cd "$tmp" && "$bin" $1 "$2" > /dev/null) || return 1
+  mv "$tmp/output_file.txt" "$tmp/out"
+}
+
+"$bin" -s "$tmp/sock" > /dev/null &
+server=$!
+
+for input in "$top"/test/input*.txt; do
+
+  name=$(basename "$input" .txt)
+  before=$failed
+  if ! replay "" "$input"; then
+    fail "$name: replay"
+    continue
+  fi
+  mv "$tmp/out" "$tmp/serial"
+
+  n=${name#input}
+  for e in $EXPECTED; do
+    if [ "$n" = "$e" ] && ! diff -u "$top/test/output$n.txt" "$tmp/serial"; then
+      fail "$name: output differs from output$n.txt"
+    fi
+  done
+
+  if ! replay "-p" "$input" || ! cmp -s "$tmp/serial" "$tmp/out"; then
+    fail "$name: pipelined replay (-p) differs"
+  fi
+
+  if ! replay "-w $WORKERS" "$input" || ! cmp -s "$tmp/serial" "$tmp/out"; then
+    fail "$name: partitioned replay (-w $WORKERS) differs"
+  fi
+
+  if ! "$client" "$tmp/sock" "$input" > "$tmp/out" || ! cmp -s "$tmp/serial" "$tmp/out"; then
+    fail "$name: server replay (-s) differs"
+  fi
+
+  [ "$failed" -eq "$before" ] && echo "ok $name"
+done
+
+if [ "$failed" -ne 0 ]; then
+  echo "$failed check(s) failed"
+  exit 1
+fi
+echo "all checks passed"
@@ -0,0 +1,1540 @@
+/*
+ * Checks of the tree calls the traces cannot reach.
+ *
+ * Each check drives a tree through the library calls and compares what
+ * it answers against a plain array of the keys it should hold. Built
+ * with -DBPLUS_INSTRUMENT, so the checks can look at the counters too.
+ * Every check runs in a child process, so it starts without the nodes
+ * and counters of the checks before it. One line per check is printed;
+ * the exit status is the number of failed checks.
+ *
+ * usage: tree_check [name ...]
+ *   runs the named checks, all of them without arguments
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include "bplus_tree.h"
+
+#define CHECK_KEYS	8192		/* keys are 0 .. CHECK_KEYS - 1 */
+#define CHECK_RUN	8		/* DEFRAG_RUN, leaves back to back defrag leaves alone */
+#define CHECK_THREADS	4		/* concurrent readers */
+
+typedef struct check_model_t_ {
+  bool 		present[CHECK_KEYS];
+  double 	value[CHECK_KEYS];
+  long 		num;
+} check_model_t;
+
+typedef struct check_t_ {
+  const char 	*name;
+  int 		(*fn)(void);
+} check_t;
+
+#define CHECK_FAIL(...)							\
+  do {									\
+    printf("  %s: ", __FUNCTION__);					\
+    printf(__VA_ARGS__);						\
+    printf("\n");							\
+  } while (0)
+
+static void
+model_insert (check_model_t *model,
+              bplus_tree_t *tree,
+              int key,
+              double value)
+{
+  bplus_tree_insert(tree, key, value);
+  if (!model->present[key])
+    model->num++;
+  model->present[key] 	= true;
+  model->value[key] 	= value;
+}
+
+static void
+model_delete (check_model_t *model,
+              bplus_tree_t *tree,
+              int key)
+{
+  bplus_tree_delete_key(tree, key);
+  if (model->present[key])
+    model->num--;
+  model->present[key] 	= false;
+}
+
+/*
+ * look every key up in the tree
+ * @return the number of keys it answers differently from the model
+ */
+static int
+model_compare (const check_model_t *model,
+               bplus_tree_t *tree)
+{
+  int key 	= 0;
+  int bad 	= 0;
+  bool found 	= false;
+  double value 	= 0;
+
+  for (key = 0; key < CHECK_KEYS; key++) {
+    value = -1;
+    found = bplus_tree_search_key(tree, key, &value);
+    if (found != model->present[key] ||
+        (found && value != model->value[key])) {
+      if (!bad)
+        CHECK_FAIL("key %d: found %d value %g, expected %d value %g", key,
+                   found, value, model->present[key], model->value[key]);
+      bad++;
+    }
+  }
+
+  return (bad);
+}
+
+typedef struct check_scan_t_ {
+  const check_model_t 	*model;
+  int 			last;		/* key seen last, -1 before the first */
+  long 			bad;
+} check_scan_t;
+
+static bool
+model_scan_pair (bplus_key_t key,
+                 const bplus_value_t *value,
+                 uint8_t flags,
+                 void *arg)
+{
+  check_scan_t *scan = arg;
+
+  (void)flags;
+  if (key <= scan->last || key >= CHECK_KEYS || !scan->model->present[key] ||
+      value->num != scan->model->value[key]) {
+    if (!scan->bad)
+      CHECK_FAIL("key %d after %d, value %g", key, scan->last, value->num);
+    scan->bad++;
+  }
+  scan->last = key;
+
+  return (true);
+}
+
+/*
+ * scan the whole tree
+ * @return the number of pairs out of order or not in the model, plus
+ *         one if the scan saw a different number of pairs
+ */
+static int
+model_compare_scan (const check_model_t *model,
+                    bplus_tree_t *tree)
+{
+  long num 		= 0;
+  check_scan_t scan 	= { model, -1, 0 };
+
+  num = bplus_tree_range_scan(tree, 0, CHECK_KEYS - 1, model_scan_pair, &scan);
+  if (num != model->num) {
+    CHECK_FAIL("scanned %ld pairs, expected %ld", num, model->num);
+    scan.bad++;
+  }
+
+  return (scan.bad);
+}
+
+/*
+ * the filter against the model: every key must still be found after
+ * the filter was rebuilt by inserts and by deletes, and most of the
+ * misses must be answered by the filter alone
+ */
+static int
+check_filter_mode (int buffer_size,
+                   bool lazy)
+{
+  int key 			= 0;
+  int bad 			= 0;
+  int delete_rebuilds 		= 0;
+  uint64_t rejects 		= 0;
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  bplus_filter_t *filter 	= NULL;
+  double value 			= 0;
+  bplus_instrument_t stats;
+
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(8);
+  if (!model || !tree) {
+    CHECK_FAIL("could not create the tree");
+    free(model);
+    return (1);
+  }
+  bplus_tree_set_buffer_size(tree, buffer_size);
+  tree->lazy_delete = lazy;
+  bplus_tree_set_filter(tree, 10);
+
+  /* even keys only, past the capacity of the first filter */
+  for (key = 0; key < CHECK_KEYS; key += 2)
+    model_insert(model, tree, key, key * 0.5);
+  bad += model_compare(model, tree);
+
+  /* the odd keys were never inserted */
+  bplus_instrument_snapshot(&stats);
+  rejects = stats.filter_rejects;
+  for (key = 1; key < CHECK_KEYS; key += 2) {
+    if (bplus_tree_search_key(tree, key, &value)) {
+      CHECK_FAIL("absent key %d found", key);
+      bad++;
+    }
+  }
+  bplus_instrument_snapshot(&stats);
+  if (stats.filter_rejects - rejects < CHECK_KEYS / 2 * 9 / 10) {
+    CHECK_FAIL("%lu of %d misses rejected by the filter",
+               (unsigned long)(stats.filter_rejects - rejects), CHECK_KEYS / 2);
+    bad++;
+  }
+
+  /* delete three quarters of them, past the rebuild threshold */
+  for (key = 0; key < CHECK_KEYS; key += 2) {
+    if (key % 8 == 6)
+      continue;
+    filter = tree->filter;
+    model_delete(model, tree, key);
+    if (tree->filter != filter)
+      delete_rebuilds++;
+    if (key % 1024 == 0)
+      bad += model_compare(model, tree);
+  }
+  bad += model_compare(model, tree);
+  if (!delete_rebuilds) {
+    CHECK_FAIL("no rebuild after %d deletes, %ld deleted since the last one",
+               CHECK_KEYS / 8 * 3, tree->filter->num_deleted);
+    bad++;
+  }
+
+  /* deleted keys come back, their old bits are still set */
+  for (key = 0; key < CHECK_KEYS; key += 16)
+    model_insert(model, tree, key, key * 2.0);
+  if (lazy) {
+    while (bplus_tree_compact_step(tree, 64) > 0)
+      ;
+  }
+  bplus_tree_flush_all(tree);
+  bad += model_compare(model, tree);
+
+  free(model);
+  return (bad);
+}
+
+static int
+check_filter (void)
+{
+  int bad = 0;
+
+  bad += check_filter_mode(0, false);
+  bad += check_filter_mode(4, false);
+  bad += check_filter_mode(0, true);
+  bad += check_filter_mode(4, true);
+
+  return (bad);
+}
+
+/*
+ * packed leaves against the model: the left leaves of an ascending
+ * load are packed by the splits, the leaves modified afterwards are
+ * unpacked and bplus_tree_pack_leaves() packs them again.
+ * stride spreads the keys, so the leaves pack to 1 or 2 byte deltas
+ */
+static int
+check_pack_mode (int order,
+                 int stride)
+{
+  int i 			= 0;
+  int key 			= 0;
+  int bad 			= 0;
+  int packed 			= 0;
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  bplus_tree_stats_t stats;
+
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(order);
+  if (!model || !tree) {
+    CHECK_FAIL("could not create the tree");
+    free(model);
+    return (1);
+  }
+  tree->pack_on_split = true;
+
+  for (key = 0; key < CHECK_KEYS; key += stride)
+    model_insert(model, tree, key, key + 0.25);
+  bplus_tree_stats(tree, &stats);
+  if (stats.num_packed < stats.num_leafs - 1) {
+    CHECK_FAIL("order %d: %ld of %ld leaves packed by the splits", order,
+               stats.num_packed, stats.num_leafs);
+    bad++;
+  }
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+
+  /* updates, deletes and inserts all go through unpacked leaves */
+  for (i = 0, key = 0; key < CHECK_KEYS; i++, key += stride) {
+    if (i % 3 == 0)
+      model_delete(model, tree, key);
+    else if (i % 3 == 1)
+      model_insert(model, tree, key, -key);
+    else if (key + 1 < CHECK_KEYS)
+      model_insert(model, tree, key + 1, key);
+  }
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+
+  packed = bplus_tree_pack_leaves(tree);
+  bplus_tree_stats(tree, &stats);
+  if (!packed || stats.num_packed != stats.num_leafs) {
+    CHECK_FAIL("order %d: pack_leaves packed %d, %ld of %ld leaves packed",
+               order, packed, stats.num_packed, stats.num_leafs);
+    bad++;
+  }
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+
+  free(model);
+  return (bad);
+}
+
+static int
+check_pack (void)
+{
+  int bad = 0;
+
+  bad += check_pack_mode(16, 1);
+  bad += check_pack_mode(128, 8);
+
+  return (bad);
+}
+
+/*
+ * keys 0 .. num - 1 in a random order
+ */
+static void
+check_shuffle (int *keys,
+               int num,
+               uint64_t seed)
+{
+  int i 	= 0;
+  int j 	= 0;
+  int tmp 	= 0;
+
+  for (i = 0; i < num; i++)
+    keys[i] = i;
+  for (i = num - 1; i > 0; i--) {
+    seed 	= seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    j 		= (seed >> 33) % (i + 1);
+    tmp 	= keys[i];
+    keys[i] 	= keys[j];
+    keys[j] 	= tmp;
+  }
+}
+
+/*
+ * leaves of the tree lying below the one before them in memory
+ */
+static int
+leaves_out_of_order (bplus_tree_t *tree)
+{
+  int num 			= 0;
+  bplus_tree_node_t *node 	= tree->root;
+
+  if (!node)
+    return (0);
+  while (!node->is_leaf)
+    node = node->u.index->child[0];
+
+  for (; node->u.leaf->next; node = node->u.leaf->next) {
+    if (node->u.leaf->next < node)
+      num++;
+  }
+
+  return (num);
+}
+
+/*
+ * neighbouring leaves under one parent which would fit in one leaf of
+ * max pairs
+ */
+static int
+leaves_mergeable (bplus_tree_node_t *node,
+                  int max)
+{
+  int i 			= 0;
+  int num 			= 0;
+  index_node_t *index 		= NULL;
+  bplus_tree_node_t *child 	= NULL;
+  bplus_tree_node_t *next 	= NULL;
+
+  if (!node || node->is_leaf)
+    return (0);
+
+  index = node->u.index;
+  for (i = 0; i <= index->num; i++) {
+    child = index->child[i];
+    if (!child->is_leaf) {
+      num += leaves_mergeable(child, max);
+      continue;
+    }
+    next = (i < index->num) ? index->child[i + 1] : NULL;
+    if (next && child->u.leaf->num + next->u.leaf->num <= max)
+      num++;
+  }
+
+  return (num);
+}
+
+/*
+ * defrag against the model: a tree loaded and emptied in random order
+ * is defragmented a few leaves at a time while it keeps changing, then
+ * by whole passes. No two leaves of a parent may fit in one, the leaves laid
+ * out in key order, but for the runs of CHECK_RUN leaves which stay
+ * where they are, and a further pass must find nothing to do
+ */
+static int
+check_defrag (void)
+{
+  int i 			= 0;
+  int bad 			= 0;
+  int done 			= 0;
+  int keys[CHECK_KEYS];
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  bplus_tree_stats_t before;
+  bplus_tree_stats_t after;
+
+  /* leaves only move within the arenas */
+  if (!bplus_arena_enable()) {
+    CHECK_FAIL("could not enable the arenas");
+    return (1);
+  }
+
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(16);
+  if (!model || !tree) {
+    CHECK_FAIL("could not create the tree");
+    free(model);
+    return (1);
+  }
+  /* deletes keep leaves half full; two of them fit in a full one */
+  bplus_tree_set_fill_factor(tree, 100);
+
+  check_shuffle(keys, CHECK_KEYS, 1);
+  for (i = 0; i < CHECK_KEYS; i++)
+    model_insert(model, tree, keys[i], keys[i] * 0.5);
+  check_shuffle(keys, CHECK_KEYS, 2);
+  for (i = 0; i < CHECK_KEYS * 3 / 4; i++)
+    model_delete(model, tree, keys[i]);
+  bplus_tree_stats(tree, &before);
+
+  /* a step at a time, with inserts and deletes around the cursor */
+  for (i = 0; i < 200; i++) {
+    done += bplus_tree_defrag_step(tree, 4);
+    model_insert(model, tree, keys[i], -keys[i]);
+    model_delete(model, tree, keys[CHECK_KEYS - 1 - i]);
+    if (i % 50 == 0)
+      bad += model_compare(model, tree);
+  }
+  bad += model_compare(model, tree);
+
+  /* finish the pass, then make a whole one */
+  done += bplus_tree_defrag_step(tree, CHECK_KEYS);
+  done += bplus_tree_defrag_step(tree, CHECK_KEYS);
+  bplus_tree_stats(tree, &after);
+  if (!done || after.num_leafs >= before.num_leafs ||
+      after.leaf_fill_avg <= before.leaf_fill_avg) {
+    CHECK_FAIL("%d leaves merged or moved, %ld -> %ld leaves, %.1f%% -> %.1f%% full",
+               done, before.num_leafs, after.num_leafs,
+               before.leaf_fill_avg, after.leaf_fill_avg);
+    bad++;
+  }
+  if (leaves_mergeable(tree->root, (tree->order - 1) * tree->fill_factor / 100)) {
+    CHECK_FAIL("%d pairs of leaves left to merge",
+               leaves_mergeable(tree->root, (tree->order - 1) * tree->fill_factor / 100));
+    bad++;
+  }
+  if (leaves_out_of_order(tree) > after.num_leafs / CHECK_RUN) {
+    CHECK_FAIL("%d of %ld leaves out of key order in memory",
+               leaves_out_of_order(tree), after.num_leafs);
+    bad++;
+  }
+  done = bplus_tree_defrag_step(tree, CHECK_KEYS);
+  if (done) {
+    CHECK_FAIL("%d leaves merged or moved by a pass over a laid out tree", done);
+    bad++;
+  }
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+
+  free(model);
+  return (bad);
+}
+
+/*
+ * the snapshot against the tree and the model: every key must be found
+ * in all or in none of them, with the same inline value or blob bytes
+ * @param tree  NULL to compare against the model alone
+ * @param blob  keys whose value is the blob check_blob() writes
+ */
+static int
+snapshot_compare (const bplus_snapshot_t *snap,
+                  bplus_tree_t *tree,
+                  const check_model_t *model,
+                  const bool *blob)
+{
+  int key 		= 0;
+  int bad 		= 0;
+  bool found 		= false;
+  bool in_tree 		= false;
+  bool expected 	= false;
+  size_t len 		= 0;
+  size_t tree_len 	= 0;
+  const void *data 	= NULL;
+  const void *tree_data = NULL;
+  char expect[32];
+  bplus_value_t value;
+  bplus_value_t tree_value;
+
+  if (snap->num != (uint64_t)model->num) {
+    CHECK_FAIL("%lu pairs in the snapshot, expected %ld", (unsigned long)snap->num, model->num);
+    bad++;
+  }
+
+  for (key = -1; key <= CHECK_KEYS; key++) {
+
+    found 	= bplus_snapshot_search(snap, key, &value);
+    in_tree 	= tree ? bplus_tree_search_value(tree, key, &tree_value) : found;
+    if (!tree)
+      tree_value = value;
+    expected 	= (key >= 0 && key < CHECK_KEYS && model->present[key]);
+    if (found != in_tree || found != expected) {
+      if (!bad)
+        CHECK_FAIL("key %d: in the snapshot %d, in the tree %d, expected %d", key,
+                   found, in_tree, expected);
+      bad++;
+      continue;
+    }
+    if (!found)
+      continue;
+
+    if (!blob[key]) {
+      if (value.num != tree_value.num || value.num != model->value[key]) {
+        if (!bad)
+          CHECK_FAIL("key %d: value %g in the snapshot, %g in the tree", key,
+                     value.num, tree_value.num);
+        bad++;
+      }
+      continue;
+    }
+
+    data 	= bplus_snapshot_search_blob(snap, key, &len);
+    tree_data 	= data;
+    tree_len 	= len;
+    if (tree)
+      tree_data = bplus_tree_search_blob(tree, key, &tree_len);
+    snprintf(expect, sizeof(expect), "blob %d", key);
+    if (!data || !tree_data || len != tree_len || len != strlen(expect) ||
+        memcmp(data, tree_data, len) || memcmp(data, expect, len)) {
+      if (!bad)
+        CHECK_FAIL("key %d: blob of %zu bytes in the snapshot, %zu in the tree",
+                   key, len, tree_len);
+      bad++;
+    }
+  }
+
+  return (bad);
+}
+
+/*
+ * insert key with the blob "blob key"
+ */
+static void
+check_blob (check_model_t *model,
+            bool *blob,
+            bplus_tree_t *tree,
+            int key)
+{
+  char data[32];
+
+  snprintf(data, sizeof(data), "blob %d", key);
+  bplus_tree_insert_blob(tree, key, data, strlen(data));
+  if (!model->present[key])
+    model->num++;
+  model->present[key] 	= true;
+  blob[key] 		= true;
+}
+
+/*
+ * snapshots of num keys against the tree they were taken of, in each
+ * of the trees it may be: buffered messages, tombstones, packed leaves
+ * and blobs. A snapshot must not change with the tree afterwards
+ */
+static int
+check_snapshot_size (int num)
+{
+  int i 			= 0;
+  int bad 			= 0;
+  int keys[CHECK_KEYS];
+  bool *blob 			= NULL;
+  bool *blob_then 		= NULL;
+  check_model_t *model 		= NULL;
+  check_model_t *model_then 	= NULL;
+  bplus_tree_t *tree 		= NULL;
+  bplus_snapshot_t *snap 	= NULL;
+
+  model 	= calloc(1, sizeof(check_model_t));
+  model_then 	= calloc(1, sizeof(check_model_t));
+  blob 		= calloc(CHECK_KEYS, sizeof(bool));
+  blob_then 	= calloc(CHECK_KEYS, sizeof(bool));
+  tree 		= bplus_tree_create(8);
+  if (!model || !model_then || !blob || !blob_then || !tree) {
+    CHECK_FAIL("could not create the tree");
+    bad = 1;
+    goto done;
+  }
+  bplus_tree_set_buffer_size(tree, 4);
+  tree->pack_on_split 	= true;
+  tree->lazy_delete 	= true;
+
+  /* num keys are left, every seventh with a blob */
+  check_shuffle(keys, CHECK_KEYS, num);
+  for (i = 0; i < num + num / 2; i++) {
+    if (keys[i] % 7)
+      model_insert(model, tree, keys[i], keys[i] * 0.25);
+    else
+      check_blob(model, blob, tree, keys[i]);
+  }
+  for (i = num; i < num + num / 2; i++)
+    model_delete(model, tree, keys[i]);
+  for (i = 0; i < num; i += 3) {
+    if (!blob[keys[i]])
+      model_insert(model, tree, keys[i], -keys[i]);
+  }
+
+  snap = bplus_tree_snapshot(tree);
+  if (!snap) {
+    CHECK_FAIL("no snapshot of %d keys", num);
+    bad = 1;
+    goto done;
+  }
+  bad += snapshot_compare(snap, tree, model, blob);
+
+  /* the tree moves on, the snapshot stays */
+  memcpy(model_then, model, sizeof(check_model_t));
+  memcpy(blob_then, blob, CHECK_KEYS * sizeof(bool));
+  for (i = 0; i < num; i += 2)
+    model_delete(model, tree, keys[i]);
+  for (i = 0; i < num; i += 5) {
+    model_insert(model, tree, keys[i], 1);
+    blob[keys[i]] = false;
+  }
+  bad += snapshot_compare(snap, NULL, model_then, blob_then);
+  free(snap);
+
+  snap = bplus_tree_snapshot(tree);
+  if (!snap) {
+    CHECK_FAIL("no snapshot of %ld keys", model->num);
+    bad = 1;
+    goto done;
+  }
+  bad += snapshot_compare(snap, tree, model, blob);
+
+done:
+  free(snap);
+  free(model);
+  free(model_then);
+  free(blob);
+  free(blob_then);
+  return (bad);
+}
+
+static int
+check_snapshot (void)
+{
+  int i 		= 0;
+  int bad 		= 0;
+  static const int sizes[] = { 0, 1, BPLUS_SNAPSHOT_LEAF - 1, BPLUS_SNAPSHOT_LEAF,
+                               BPLUS_SNAPSHOT_LEAF + 1, 7 * BPLUS_SNAPSHOT_LEAF + 3,
+                               CHECK_KEYS / 2 };
+
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    bad += check_snapshot_size(sizes[i]);
+
+  return (bad);
+}
+
+/*
+ * totals of a tree counted apart from bplus_tree_stats(): the leaves
+ * along their chain, the index nodes and messages by a walk from the root
+ */
+typedef struct check_totals_t_ {
+  int 		height;
+  long 		num_leafs;
+  long 		num_index;
+  long 		num_packed;
+  long 		entries;
+  long 		num_dead;
+  long 		index_keys;
+  long 		buffered;
+} check_totals_t;
+
+static void
+totals_index (bplus_tree_node_t *node,
+              check_totals_t *totals)
+{
+  int i 		= 0;
+  index_node_t *index 	= NULL;
+
+  if (!node || node->is_leaf)
+    return;
+
+  index = node->u.index;
+  totals->num_index++;
+  totals->index_keys 	+= index->num;
+  totals->buffered 	+= index->buf.num;
+  for (i = 0; i <= index->num; i++)
+    totals_index(index->child[i], totals);
+}
+
+static void
+totals_count (bplus_tree_t *tree,
+              check_totals_t *totals)
+{
+  int i 			= 0;
+  bplus_tree_node_t *node 	= tree->root;
+  leaf_node_t *leaf 		= NULL;
+
+  memset(totals, 0, sizeof(*totals));
+  totals_index(tree->root, totals);
+  totals->buffered += tree->orphans.num;
+  if (!node)
+    return;
+
+  for (totals->height = 1; !node->is_leaf; totals->height++)
+    node = node->u.index->child[0];
+
+  for (; node; node = leaf->next) {
+    leaf = node->u.leaf;
+    totals->num_leafs++;
+    totals->entries += leaf->num;
+    if (leaf->packed) {
+      totals->num_packed++;
+      continue;
+    }
+    for (i = 0; i < leaf->num; i++) {
+      if (leaf->pairs[i].flags & BPLUS_PAIR_DEAD)
+        totals->num_dead++;
+    }
+  }
+}
+
+/*
+ * bplus_tree_stats() against the totals, the counters the tree keeps
+ * and the model
+ * @param live  pairs which must be in the leaves, -1 if messages may be pending
+ */
+static int
+stats_compare (bplus_tree_t *tree,
+               long live,
+               const char *when)
+{
+  int bad 		= 0;
+  check_totals_t totals;
+  bplus_tree_stats_t stats;
+
+  totals_count(tree, &totals);
+  bplus_tree_stats(tree, &stats);
+
+#define STATS_EQ(a, b)							\
+  do {									\
+    if ((long)(a) != (long)(b)) {					\
+      CHECK_FAIL("%s: %s %ld, %s %ld", when, #a, (long)(a), #b, (long)(b)); \
+      bad++;								\
+    }									\
+  } while (0)
+
+  STATS_EQ(stats.height, totals.height);
+  STATS_EQ(stats.num_leafs, totals.num_leafs);
+  STATS_EQ(stats.num_leafs, tree->num_leafs);
+  STATS_EQ(stats.num_index, totals.num_index);
+  STATS_EQ(stats.num_index, tree->num_index);
+  STATS_EQ(stats.num_packed, totals.num_packed);
+  STATS_EQ(stats.entries, totals.entries);
+  STATS_EQ(stats.num_dead, totals.num_dead);
+  STATS_EQ(stats.num_dead, tree->num_dead);
+  STATS_EQ(stats.index_keys, totals.index_keys);
+  STATS_EQ(stats.index_keys, totals.num_index ? totals.num_leafs - 1 : 0);
+  STATS_EQ(stats.buffered, totals.buffered);
+  STATS_EQ(stats.total_bytes, stats.leaf_bytes + stats.index_bytes + stats.buffer_bytes +
+                              stats.blob_bytes + stats.filter_bytes);
+  STATS_EQ(stats.filter_bytes > 0, tree->filter != NULL);
+  if (live >= 0) {
+    STATS_EQ(stats.buffered, 0);
+    STATS_EQ(stats.entries - stats.num_dead, live);
+  }
+
+#undef STATS_EQ
+
+  return (bad);
+}
+
+/*
+ * the stats of a tree along the ways it changes: splits, merges,
+ * tombstones and their compaction, buffered messages, packing, blobs
+ * and the filter
+ */
+static int
+check_stats (void)
+{
+  int i 			= 0;
+  int bad 			= 0;
+  int keys[CHECK_KEYS];
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  bplus_tree_stats_t stats;
+
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(8);
+  if (!model || !tree) {
+    CHECK_FAIL("could not create the tree");
+    free(model);
+    return (1);
+  }
+  bad += stats_compare(tree, 0, "empty");
+
+  check_shuffle(keys, CHECK_KEYS, 3);
+  for (i = 0; i < CHECK_KEYS; i++)
+    model_insert(model, tree, keys[i], i);
+  bad += stats_compare(tree, model->num, "loaded");
+  for (i = 0; i < CHECK_KEYS / 2; i++)
+    model_delete(model, tree, keys[i]);
+  bad += stats_compare(tree, model->num, "half deleted");
+
+  /* tombstones count as entries until they are compacted */
+  tree->lazy_delete = true;
+  for (i = CHECK_KEYS / 2; i < CHECK_KEYS * 3 / 4; i++)
+    model_delete(model, tree, keys[i]);
+  bad += stats_compare(tree, model->num, "lazily deleted");
+  bplus_tree_stats(tree, &stats);
+  if (stats.num_dead != CHECK_KEYS / 4) {
+    CHECK_FAIL("%ld tombstones, expected %d", stats.num_dead, CHECK_KEYS / 4);
+    bad++;
+  }
+  while (bplus_tree_compact_step(tree, 100) > 0)
+    bad += stats_compare(tree, model->num, "compacting");
+  bad += stats_compare(tree, model->num, "compacted");
+  tree->lazy_delete = false;
+
+  /* messages are counted until they reach the leaves */
+  bplus_tree_set_buffer_size(tree, 16);
+  for (i = 0; i < CHECK_KEYS / 2; i++)
+    model_insert(model, tree, keys[i], -i);
+  for (i = CHECK_KEYS / 2; i < CHECK_KEYS / 2 + 500; i++)
+    model_delete(model, tree, keys[CHECK_KEYS - 1 - i]);
+  bad += stats_compare(tree, -1, "buffered");
+  bplus_tree_stats(tree, &stats);
+  if (!stats.buffered) {
+    CHECK_FAIL("no message buffered");
+    bad++;
+  }
+  bplus_tree_flush_all(tree);
+  bad += stats_compare(tree, model->num, "flushed");
+  bplus_tree_set_buffer_size(tree, 0);
+
+  bplus_tree_pack_leaves(tree);
+  bad += stats_compare(tree, model->num, "packed");
+  bplus_tree_set_filter(tree, 10);
+  bplus_tree_insert_blob(tree, keys[0], "blob", 4);
+  bad += stats_compare(tree, model->num, "filter and blob");
+  bplus_tree_stats(tree, &stats);
+  if (!stats.num_packed || !stats.blob_bytes) {
+    CHECK_FAIL("%ld packed leaves, %zu blob bytes", stats.num_packed, stats.blob_bytes);
+    bad++;
+  }
+
+  /* emptied down to the root leaf and then nothing */
+  for (i = 0; i < CHECK_KEYS; i++)
+    model_delete(model, tree, i);
+  bad += stats_compare(tree, 0, "emptied");
+  bad += model_compare(model, tree);
+
+  free(model);
+  return (bad);
+}
+
+typedef struct check_reader_t_ {
+  bplus_tree_t 	*tree;
+  long 		found;
+} check_reader_t;
+
+static void *
+check_reader (void *arg)
+{
+  int key 		= 0;
+  double value 		= 0;
+  check_reader_t *reader = arg;
+
+  for (key = 0; key < CHECK_KEYS; key++)
+    reader->found += bplus_tree_search_key(reader->tree, key, &value);
+  bplus_tree_reader_unregister();
+
+  return (NULL);
+}
+
+static bool
+check_count_pair (bplus_key_t key,
+                  const bplus_value_t *value,
+                  uint8_t flags,
+                  void *arg)
+{
+  (void)key;
+  (void)value;
+  (void)flags;
+  (*(long *)arg)++;
+
+  return (true);
+}
+
+/*
+ * operations counted for op, and in the latency histogram of op
+ */
+static int
+instrument_ops (const bplus_instrument_t *now,
+                const bplus_instrument_t *then,
+                bplus_op_t op,
+                uint64_t expected)
+{
+  int i 		= 0;
+  uint64_t hist 	= 0;
+
+  for (i = 0; i < BPLUS_HIST_BUCKETS; i++)
+    hist += now->hist[op][i] - then->hist[op][i];
+
+  if (now->ops[op] - then->ops[op] != expected || hist != expected) {
+    CHECK_FAIL("op %d: %lu counted, %lu in the histogram, expected %lu", op,
+               (unsigned long)(now->ops[op] - then->ops[op]), (unsigned long)hist,
+               (unsigned long)expected);
+    return (1);
+  }
+
+  return (0);
+}
+
+/*
+ * the counters against the work done: operations, descents and the
+ * nodes visited by searches from several threads, and the splits,
+ * merges and root changes against the nodes the tree ends up with
+ */
+static int
+check_instrument (void)
+{
+  int i 			= 0;
+  int bad 			= 0;
+  int keys[CHECK_KEYS];
+  long found 			= 0;
+  double p50 			= 0;
+  double p99 			= 0;
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  pthread_t threads[CHECK_THREADS];
+  check_reader_t readers[CHECK_THREADS];
+  bplus_instrument_t then;
+  bplus_instrument_t now;
+  bplus_tree_stats_t stats;
+
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(8);
+  if (!model || !tree) {
+    CHECK_FAIL("could not create the tree");
+    free(model);
+    return (1);
+  }
+  if (!bplus_instrument_snapshot(&then)) {
+    CHECK_FAIL("built without BPLUS_INSTRUMENT");
+    free(model);
+    return (1);
+  }
+
+  /* every node but the first leaf comes from a split or a new root */
+  check_shuffle(keys, CHECK_KEYS, 4);
+  for (i = 0; i < CHECK_KEYS; i += 2)
+    model_insert(model, tree, keys[i], i);
+  bplus_instrument_snapshot(&now);
+  bplus_tree_stats(tree, &stats);
+  bad += instrument_ops(&now, &then, BPLUS_OP_INSERT, CHECK_KEYS / 2);
+  if (1 + now.leaf_splits + now.index_splits + now.root_changes !=
+      (uint64_t)(stats.num_leafs + stats.num_index) ||
+      now.leaf_splits != (uint64_t)stats.num_leafs - 1) {
+    CHECK_FAIL("%lu leaf and %lu index splits, %lu root changes for %ld leaves "
+               "and %ld index nodes", (unsigned long)now.leaf_splits,
+               (unsigned long)now.index_splits, (unsigned long)now.root_changes,
+               stats.num_leafs, stats.num_index);
+    bad++;
+  }
+
+  /* each thread counts into its own copy, the snapshot adds them up */
+  then = now;
+  for (i = 0; i < CHECK_THREADS; i++) {
+    readers[i].tree 	= tree;
+    readers[i].found 	= 0;
+    pthread_create(&threads[i], NULL, check_reader, &readers[i]);
+  }
+  for (i = 0; i < CHECK_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    found += readers[i].found;
+  }
+  bplus_instrument_snapshot(&now);
+  bad += instrument_ops(&now, &then, BPLUS_OP_SEARCH, CHECK_THREADS * CHECK_KEYS);
+  if (found != CHECK_THREADS * model->num ||
+      now.descents - then.descents != CHECK_THREADS * CHECK_KEYS ||
+      now.node_visits - then.node_visits !=
+      (uint64_t)CHECK_THREADS * CHECK_KEYS * stats.height ||
+      now.compares == then.compares) {
+    CHECK_FAIL("%ld found, %lu descents, %lu nodes visited and %lu compares "
+               "by %d searches of a tree of height %d", found,
+               (unsigned long)(now.descents - then.descents),
+               (unsigned long)(now.node_visits - then.node_visits),
+               (unsigned long)(now.compares - then.compares),
+               CHECK_THREADS * CHECK_KEYS, stats.height);
+    bad++;
+  }
+  p50 = bplus_instrument_percentile(&now, BPLUS_OP_SEARCH, 50);
+  p99 = bplus_instrument_percentile(&now, BPLUS_OP_SEARCH, 99);
+  if (p50 <= 0 || p99 < p50 ||
+      bplus_instrument_percentile(&now, BPLUS_OP_SEARCH, 100) < p99) {
+    CHECK_FAIL("search latency p50 %.0f ns, p99 %.0f ns", p50, p99);
+    bad++;
+  }
+
+  /* the filter answers misses without a descent */
+  bplus_tree_set_filter(tree, 10);
+  then = now;
+  for (i = 1; i < CHECK_KEYS; i += 2)
+    bplus_tree_search_key(tree, keys[i], &p50);
+  bplus_instrument_snapshot(&now);
+  if (now.filter_rejects - then.filter_rejects + now.descents - then.descents !=
+      CHECK_KEYS / 2 || now.filter_rejects == then.filter_rejects) {
+    CHECK_FAIL("%lu misses rejected by the filter, %lu descents",
+               (unsigned long)(now.filter_rejects - then.filter_rejects),
+               (unsigned long)(now.descents - then.descents));
+    bad++;
+  }
+
+  /* a scan is one descent */
+  then 	= now;
+  found = 0;
+  bplus_tree_range_scan(tree, 0, CHECK_KEYS - 1, check_count_pair, &found);
+  bplus_instrument_snapshot(&now);
+  bad += instrument_ops(&now, &then, BPLUS_OP_RANGE, 1);
+  if (found != model->num || now.descents - then.descents != 1) {
+    CHECK_FAIL("%ld pairs scanned in %lu descents", found,
+               (unsigned long)(now.descents - then.descents));
+    bad++;
+  }
+
+  /* deletes shrink the tree by merges */
+  then = now;
+  for (i = 0; i < CHECK_KEYS; i += 2)
+    model_delete(model, tree, keys[i]);
+  bplus_instrument_snapshot(&now);
+  bad += instrument_ops(&now, &then, BPLUS_OP_DELETE, CHECK_KEYS / 2);
+  if (now.merges == then.merges || now.borrows == then.borrows ||
+      now.root_changes == then.root_changes) {
+    CHECK_FAIL("%lu merges, %lu borrows and %lu root changes emptying the tree",
+               (unsigned long)(now.merges - then.merges),
+               (unsigned long)(now.borrows - then.borrows),
+               (unsigned long)(now.root_changes - then.root_changes));
+    bad++;
+  }
+
+  free(model);
+  return (bad);
+}
+
+/*
+ * a reader process of the snapshots published to name: it searches
+ * while generations up to last are published and must see the value
+ * gen * CHECK_KEYS + key of a single generation, never an older one
+ * than it saw before. Once last is out, every key must have it
+ * @param arg   last, an int
+ * @return the number of wrong answers
+ */
+static int
+shm_reader (const char *name,
+            const void *arg)
+{
+  int last 		= *(const int *)arg;
+  int i 		= 0;
+  int key 		= 0;
+  int bad 		= 0;
+  int gen 		= 0;
+  int seen 		= 0;
+  bool found 		= false;
+  bplus_shm_t *shm 	= NULL;
+  bplus_value_t value;
+
+  shm = bplus_shm_open(name);
+  if (!shm) {
+    CHECK_FAIL("could not open %s", name);
+    return (1);
+  }
+
+  for (i = 0; seen < last; i++) {
+    if (i > 10000000) {
+      CHECK_FAIL("generation %d of %d after %d searches", seen, last, i);
+      bad++;
+      break;
+    }
+    key 	= (int)((i * 7919L) % CHECK_KEYS);
+    found 	= bplus_shm_search(shm, key, &value);
+    gen 	= (int)value.num / CHECK_KEYS;
+    if (found != !(key & 1) ||
+        (found && ((int)value.num % CHECK_KEYS != key || gen < seen))) {
+      if (!bad)
+        CHECK_FAIL("key %d: found %d value %g after generation %d", key, found,
+                   found ? value.num : 0, seen);
+      bad++;
+    }
+    if (found && gen > seen)
+      seen = gen;
+  }
+
+  for (key = 0; key < CHECK_KEYS; key++) {
+    found = bplus_shm_search(shm, key, &value);
+    if (found != !(key & 1) || (found && value.num != last * CHECK_KEYS + key)) {
+      if (!bad)
+        CHECK_FAIL("key %d: found %d value %g in generation %d", key, found,
+                   found ? value.num : 0, last);
+      bad++;
+    }
+  }
+
+  bplus_shm_close(shm);
+  return (bad);
+}
+
+/*
+ * a reader process compares the latest snapshot with the model
+ * @param arg   the check_model_t
+ */
+static int
+shm_reader_model (const char *name,
+                  const void *arg)
+{
+  const check_model_t *model = arg;
+  int key 		= 0;
+  int bad 		= 0;
+  bool found 		= false;
+  bplus_shm_t *shm 	= NULL;
+  bplus_value_t value;
+
+  shm = bplus_shm_open(name);
+  if (!shm) {
+    CHECK_FAIL("could not open %s", name);
+    return (1);
+  }
+
+  for (key = -1; key <= CHECK_KEYS; key++) {
+    found = bplus_shm_search(shm, key, &value);
+    if (found != (key >= 0 && key < CHECK_KEYS && model->present[key]) ||
+        (found && value.num != model->value[key])) {
+      if (!bad)
+        CHECK_FAIL("key %d: found %d value %g", key, found, found ? value.num : 0);
+      bad++;
+    }
+  }
+
+  bplus_shm_close(shm);
+  return (bad);
+}
+
+/*
+ * run fn in a child process
+ * @return the child, -1 on failure
+ */
+static pid_t
+check_spawn (int (*fn)(const char *, const void *),
+             const char *name,
+             const void *arg)
+{
+  pid_t pid = 0;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0)
+    _exit(fn(name, arg) ? 1 : 0);
+
+  return (pid);
+}
+
+/*
+ * the exit status of a child from check_spawn()
+ */
+static int
+check_reap (pid_t pid)
+{
+  int status = 0;
+
+  if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+    perror("tree_check");
+    return (1);
+  }
+
+  return (!WIFEXITED(status) || WEXITSTATUS(status));
+}
+
+/*
+ * snapshots published by this process and searched by others: a reader
+ * running while generations are published, then one checking the
+ * last snapshot, taken after deletes, against the model
+ */
+static int
+check_shm (void)
+{
+  int key 			= 0;
+  int gen 			= 0;
+  int bad 			= 0;
+  int last 			= 50;
+  pid_t reader 			= 0;
+  char name[BPLUS_SHM_NAME];
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  bplus_shm_t *shm 		= NULL;
+
+  snprintf(name, sizeof(name), "/tree_check.%d", (int)getpid());
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(8);
+  shm 	= bplus_shm_create(name);
+  if (!model || !tree || !shm) {
+    CHECK_FAIL("could not create the tree or %s", name);
+    bad = 1;
+    goto done;
+  }
+
+  /* the even keys, with the generation in their values */
+  for (gen = 1; gen <= last; gen++) {
+    for (key = 0; key < CHECK_KEYS; key += 2)
+      model_insert(model, tree, key, gen * CHECK_KEYS + key);
+    if (!bplus_shm_publish(shm, tree)) {
+      CHECK_FAIL("could not publish generation %d", gen);
+      bad++;
+      break;
+    }
+    if (gen == 1)
+      reader = check_spawn(shm_reader, name, &last);
+  }
+  bad += check_reap(reader);
+
+  for (key = 0; key < CHECK_KEYS; key += 6)
+    model_delete(model, tree, key);
+  for (key = 1; key < CHECK_KEYS; key += 10)
+    model_insert(model, tree, key, -key);
+  if (!bplus_shm_publish(shm, tree)) {
+    CHECK_FAIL("could not publish");
+    bad++;
+  }
+  bad += check_reap(check_spawn(shm_reader_model, name, model));
+
+done:
+  if (shm) {
+    bplus_shm_close(shm);
+    bplus_shm_unlink(name);
+  }
+  free(model);
+  return (bad);
+}
+
+typedef struct check_stress_t_ {
+  bplus_tree_t 	*tree;
+  atomic_bool 	stop;
+  long 		searches;
+  long 		bad;
+} check_stress_t;
+
+/*
+ * a value the stress writers store, key * 0.5 of some key
+ */
+static bool
+stress_value (double value)
+{
+  return (value >= 0 && value * 2 < CHECK_KEYS && value * 2 == (int)(value * 2));
+}
+
+static bool
+stress_scan_pair (bplus_key_t key,
+                  const bplus_value_t *value,
+                  uint8_t flags,
+                  void *arg)
+{
+  long *bad = arg;
+
+  (void)flags;
+  if (!stress_value(value->num)) {
+    if (!*bad)
+      CHECK_FAIL("key %d: value %g", key, value->num);
+    (*bad)++;
+  }
+
+  return (true);
+}
+
+/*
+ * searches and scans without locks while the writer runs. Nothing orders them
+ * against the writer, so a search may miss a key being moved; but
+ * no node may be freed under it, so whatever it finds must be a
+ * value the writer stored
+ */
+static void *
+stress_reader (void *arg)
+{
+  int key 			= 0;
+  long i 			= 0;
+  long bad 			= 0;
+  bool found 			= false;
+  double value 			= 0;
+  check_stress_t *stress 	= arg;
+
+  for (i = 0; !atomic_load(&stress->stop); i++) {
+    key = (int)((i * 7919) % CHECK_KEYS);
+
+    /* now and then a scan of the leaves around the key */
+    if (i % 64 == 0) {
+      bplus_tree_range_scan(stress->tree, key, key + 100, stress_scan_pair, &bad);
+      continue;
+    }
+
+    found = bplus_tree_search_key(stress->tree, key, &value);
+    if (found && !stress_value(value)) {
+      if (!bad)
+        CHECK_FAIL("key %d: found %d value %g", key, found, value);
+      bad++;
+    }
+  }
+  bplus_tree_reader_unregister();
+
+  /* the check reads these once the threads are joined */
+  stress->searches 	= i;
+  stress->bad 		= bad;
+
+  return (NULL);
+}
+
+/*
+ * the per NUMA node copies of the index levels: searches and scans
+ * through the copies must answer like the tree, before and after the
+ * index changes under them; then lock-free readers search while a
+ * writer splits and merges and rebuilds the copies
+ */
+static int
+check_replicate (void)
+{
+  int i 			= 0;
+  int key 			= 0;
+  int bad 			= 0;
+  int round 			= 0;
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  pthread_t threads[CHECK_THREADS];
+  check_stress_t stress[CHECK_THREADS];
+
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(8);
+  if (!model || !tree) {
+    CHECK_FAIL("could not create the tree");
+    free(model);
+    return (1);
+  }
+
+  for (key = 0; key < CHECK_KEYS; key += 2)
+    model_insert(model, tree, key, key * 0.5);
+  if (bplus_tree_replicate(tree, 2) != 2 || tree->replica_gen != tree->index_gen) {
+    CHECK_FAIL("%d copies built", tree->num_replicas);
+    bad++;
+  }
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+
+  /* the copies are stale once the index changes, until rebuilt */
+  for (key = 1; key < CHECK_KEYS; key += 4)
+    model_insert(model, tree, key, key * 0.5);
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+  bplus_tree_replicate(tree, 2);
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+
+  for (i = 0; i < CHECK_THREADS; i++) {
+    memset(&stress[i], 0, sizeof(stress[i]));
+    stress[i].tree = tree;
+    pthread_create(&threads[i], NULL, stress_reader, &stress[i]);
+  }
+
+  /* the odd keys come and go; the copies are rebuilt every round */
+  for (round = 0; round < 40; round++) {
+    for (key = 1; key < CHECK_KEYS; key += 2) {
+      if ((key >> 1) % 3 == round % 3)
+        model_delete(model, tree, key);
+      else
+        model_insert(model, tree, key, key * 0.5);
+    }
+    bplus_tree_replicate(tree, round % 3);
+  }
+
+  for (i = 0; i < CHECK_THREADS; i++) {
+    atomic_store(&stress[i].stop, true);
+    pthread_join(threads[i], NULL);
+    bad += stress[i].bad;
+    if (!stress[i].searches) {
+      CHECK_FAIL("reader %d made no search", i);
+      bad++;
+    }
+  }
+
+  bplus_tree_replicate(tree, 2);
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+  bplus_tree_replicate(tree, 0);
+  bad += model_compare(model, tree);
+
+  free(model);
+  return (bad);
+}
+
+/*
+ * lock-free readers against a writer which empties the tree and fills
+ * it again, round after round: every merge and root collapse retires
+ * nodes under the readers. Run it under ASan (make check-asan) to catch
+ * a node freed too early; here the retired nodes must not pile up and
+ * all of them must be freed once the readers are gone
+ */
+static int
+check_ebr (void)
+{
+  int i 			= 0;
+  int bad 			= 0;
+  int round 			= 0;
+  int most_retired 		= 0;
+  int keys[CHECK_KEYS];
+  check_model_t *model 		= NULL;
+  bplus_tree_t *tree 		= NULL;
+  pthread_t threads[CHECK_THREADS];
+  check_stress_t stress[CHECK_THREADS];
+
+  model = calloc(1, sizeof(check_model_t));
+  tree 	= bplus_tree_create(4);
+  if (!model || !tree) {
+    CHECK_FAIL("could not create the tree");
+    free(model);
+    return (1);
+  }
+  for (i = 0; i < CHECK_KEYS; i++)
+    model_insert(model, tree, i, i * 0.5);
+
+  for (i = 0; i < CHECK_THREADS; i++) {
+    memset(&stress[i], 0, sizeof(stress[i]));
+    stress[i].tree = tree;
+    pthread_create(&threads[i], NULL, stress_reader, &stress[i]);
+  }
+
+  for (round = 0; round < 10; round++) {
+    check_shuffle(keys, CHECK_KEYS, round);
+    for (i = 0; i < CHECK_KEYS; i++) {
+      model_delete(model, tree, keys[i]);
+      if (bplus_epoch.num_retired > most_retired)
+        most_retired = bplus_epoch.num_retired;
+    }
+    if (tree->root) {
+      CHECK_FAIL("round %d: the tree is not empty", round);
+      bad++;
+    }
+    for (i = 0; i < CHECK_KEYS; i++)
+      model_insert(model, tree, keys[i], keys[i] * 0.5);
+  }
+
+  for (i = 0; i < CHECK_THREADS; i++) {
+    atomic_store(&stress[i].stop, true);
+    pthread_join(threads[i], NULL);
+    bad += stress[i].bad;
+    if (!stress[i].searches) {
+      CHECK_FAIL("reader %d made no search", i);
+      bad++;
+    }
+  }
+
+  /*
+   * a reader preempted inside its critical section holds the epoch back
+   * for a whole time slice, so the backlog is bounded in rounds, not in
+   * nodes: a round retires about one tree, and never freeing anything
+   * would pile up all ten of them
+   */
+  if (most_retired > 2 * CHECK_KEYS) {
+    CHECK_FAIL("up to %d nodes retired", most_retired);
+    bad++;
+  }
+  if (epoch_drain(&bplus_epoch)) {
+    CHECK_FAIL("%d nodes left retired without readers", bplus_epoch.num_retired);
+    bad++;
+  }
+  bad += model_compare(model, tree);
+  bad += model_compare_scan(model, tree);
+
+  free(model);
+  return (bad);
+}
+
+static const check_t checks[] = {
+  { "filter", 		check_filter },
+  { "pack", 		check_pack },
+  { "defrag", 		check_defrag },
+  { "snapshot", 	check_snapshot },
+  { "stats", 		check_stats },
+  { "instrument", 	check_instrument },
+  { "shm", 		check_shm },
+  { "replicate", 	check_replicate },
+  { "ebr", 		check_ebr },
+};
+
+#define NUM_CHECKS	(int)(sizeof(checks) / sizeof(checks[0]))
+
+int
+main (int argc,
+      char *argv[])
+{
+  int i 	= 0;
+  int j 	= 0;
+  int failed 	= 0;
+  int status 	= 0;
+  bool run 	= false;
+  pid_t pid 	= 0;
+
+  for (i = 0; i < NUM_CHECKS; i++) {
+    run = (argc < 2);
+    for (j = 1; j < argc; j++)
+      run |= !strcmp(argv[j], checks[i].name);
+    if (!run)
+      continue;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+      exit(checks[i].fn() ? 1 : 0);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+      perror("tree_check");
+      return (1);
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      printf("%s: FAILED\n", checks[i].name);
+      failed++;
+    } else {
+      printf("%s: ok\n", checks[i].name);
+    }
+  }
+
+  return (failed);
+}